@@ -31,7 +31,14 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/timer.h>
 #include <platform.h>
+#if WITH_LIB_ZALLOC
+#include <sys/zalloc.h>
+#endif
+#if WITH_LIB_BIO
+#include <lib/bio.h>
+#endif
 
 const size_t BUFSIZE = (1024*1024);
 const uint ITER = 1024;
@@ -206,6 +213,349 @@ __NO_INLINE static void arm_bench_multi_issue(void)
 #endif // __CORTEX_M
 #endif // ARCH_ARM
 
+#define TIMER_BENCH_COUNT 100000
+
+static enum handler_return bench_timer_callback(timer_t *timer, lk_time_t now, void *arg)
+{
+    return INT_NO_RESCHEDULE;
+}
+
+__NO_INLINE static void bench_timers(void)
+{
+    timer_t *timers = malloc(sizeof(timer_t) * TIMER_BENCH_COUNT);
+    if (!timers) {
+        printf("failed to allocate timers\n");
+        return;
+    }
+
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++)
+        timer_initialize(&timers[i]);
+
+    /* spread the deadlines from a minute out to several hours so every level of
+     * the timer queue gets exercised and nothing fires during the run */
+    uint count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++) {
+        timer_set_oneshot(&timers[i], 60000 + (rand() % (8 * 3600 * 1000)), bench_timer_callback, NULL);
+    }
+    count = arch_cycle_count() - count;
+
+    printf("took %u cycles to arm %u timers, %u cycles per timer\n",
+           count, TIMER_BENCH_COUNT, count / TIMER_BENCH_COUNT);
+
+    count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++) {
+        timer_cancel(&timers[i]);
+    }
+    count = arch_cycle_count() - count;
+
+    printf("took %u cycles to cancel %u timers, %u cycles per timer\n",
+           count, TIMER_BENCH_COUNT, count / TIMER_BENCH_COUNT);
+
+    free(timers);
+}
+
+#define MALLOC_BENCH_ITER 100000
+#define MALLOC_BENCH_SLOTS 16
+
+static event_t malloc_bench_start = EVENT_INITIAL_VALUE(malloc_bench_start, false, 0);
+
+static int malloc_bench_thread(void *arg)
+{
+    void *slots[MALLOC_BENCH_SLOTS] = { 0 };
+    uint seed = (uintptr_t)arg;
+
+    event_wait(&malloc_bench_start);
+
+    /* churn a small working set of small objects, the pattern pktbufs and vnodes see */
+    for (uint i = 0; i < MALLOC_BENCH_ITER; i++) {
+        seed = seed * 1664525 + 1013904223;
+        uint slot = (seed >> 8) % MALLOC_BENCH_SLOTS;
+
+        free(slots[slot]);
+        slots[slot] = malloc(16 + ((seed >> 16) % 240));
+    }
+
+    for (uint i = 0; i < MALLOC_BENCH_SLOTS; i++)
+        free(slots[i]);
+
+    return 0;
+}
+
+__NO_INLINE static void bench_malloc(void)
+{
+    for (uint nthreads = 1; nthreads <= SMP_MAX_CPUS; nthreads *= 2) {
+        thread_t *threads[SMP_MAX_CPUS];
+
+        event_unsignal(&malloc_bench_start);
+        for (uint i = 0; i < nthreads; i++) {
+            threads[i] = thread_create("malloc bench", &malloc_bench_thread, (void *)(uintptr_t)(i + 1),
+                                       DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            thread_resume(threads[i]);
+        }
+
+        lk_bigtime_t t = current_time_hires();
+        event_signal(&malloc_bench_start, true);
+        for (uint i = 0; i < nthreads; i++)
+            thread_join(threads[i], NULL, INFINITE_TIME);
+        t = current_time_hires() - t;
+
+        /* one malloc and one free per iteration */
+        unsigned long long ops = (unsigned long long)nthreads * MALLOC_BENCH_ITER * 2;
+        printf("took %llu usecs for %llu malloc/free calls on %u threads, %llu calls/sec\n",
+               (unsigned long long)t, ops, nthreads, t ? ops * 1000000 / t : 0);
+    }
+}
+
+#if WITH_LIB_ZALLOC
+#define ZALLOC_BENCH_OBJSIZE 64
+#define ZALLOC_BENCH_BLOCKSIZE 4096
+#define ZALLOC_BENCH_ITER 10000
+
+/* alloc/free cost in a nearly full zone, which a linear slot scan pays for in proportion to the zone size */
+__NO_INLINE static void bench_zalloc(void)
+{
+    for (uint blocks = 1; blocks <= 256; blocks *= 16) {
+        zone_t zone = zinit(ZALLOC_BENCH_OBJSIZE, NULL, NULL, NULL);
+        uint8_t *mem = memalign(16, blocks * ZALLOC_BENCH_BLOCKSIZE);
+        size_t max_objs = blocks * ZALLOC_BENCH_BLOCKSIZE / ZALLOC_BENCH_OBJSIZE;
+        vaddr_t *objs = malloc(max_objs * sizeof(vaddr_t));
+        if (!zone || !mem || !objs) {
+            printf("failed to allocate zone\n");
+            free(objs);
+            free(mem);
+            free(zone);
+            return;
+        }
+
+        for (uint i = 0; i < blocks; i++)
+            zcram(zone, (vaddr_t)mem + i * ZALLOC_BENCH_BLOCKSIZE, ZALLOC_BENCH_BLOCKSIZE);
+
+        /* fill the zone, then open up one slot in a random spot */
+        size_t count = 0;
+        while (count < max_objs && (objs[count] = zget(zone)))
+            count++;
+        size_t victim = rand() % count;
+        zput(zone, objs[victim]);
+
+        uint cycles = arch_cycle_count();
+        for (uint i = 0; i < ZALLOC_BENCH_ITER; i++) {
+            objs[victim] = zget(zone);
+            zput(zone, objs[victim]);
+        }
+        cycles = arch_cycle_count() - cycles;
+
+        printf("took %u cycles for %u zget/zput pairs in a zone of %zu objects, %u cycles per pair\n",
+               cycles, ZALLOC_BENCH_ITER, count, cycles / ZALLOC_BENCH_ITER);
+
+        /* there is no zone destructor, but zinit() just callocs it */
+        free(objs);
+        free(mem);
+        free(zone);
+    }
+}
+#endif // WITH_LIB_ZALLOC
+
+#if WITH_LIB_BIO
+#define BIO_BENCH_DEVICE "virtio0"
+#define BIO_BENCH_XFER 4096
+#define BIO_BENCH_COUNT 4096
+#define BIO_BENCH_MAX_QD 32
+
+struct bench_bio_slot {
+    struct list_node node;
+    bio_request_t req;
+    iovec_t iov;
+};
+
+static spin_lock_t bench_bio_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct list_node bench_bio_free = LIST_INITIAL_VALUE(bench_bio_free);
+static semaphore_t bench_bio_slots;
+
+static void bench_bio_callback(bio_request_t *req, ssize_t status)
+{
+    struct bench_bio_slot *slot = req->cookie;
+
+    /* runs from the driver's irq handler */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bench_bio_lock, state);
+    list_add_tail(&bench_bio_free, &slot->node);
+    spin_unlock_irqrestore(&bench_bio_lock, state);
+
+    sem_post(&bench_bio_slots, false);
+}
+
+/* random 4K reads against a block device, with queue_depth requests kept in flight */
+__NO_INLINE static void bench_bio_qd(void)
+{
+    bdev_t *dev = bio_open(BIO_BENCH_DEVICE);
+    if (!dev) {
+        printf("no %s device, skipping block io benchmark\n", BIO_BENCH_DEVICE);
+        return;
+    }
+
+    uint8_t *buf = memalign(PAGE_SIZE, BIO_BENCH_MAX_QD * BIO_BENCH_XFER);
+    struct bench_bio_slot *slots = calloc(BIO_BENCH_MAX_QD, sizeof(struct bench_bio_slot));
+    uint blocks_per_xfer = BIO_BENCH_XFER / dev->block_size;
+    if (!buf || !slots || blocks_per_xfer == 0 || dev->block_count < blocks_per_xfer) {
+        printf("can't run block io benchmark on %s\n", BIO_BENCH_DEVICE);
+        free(slots);
+        free(buf);
+        bio_close(dev);
+        return;
+    }
+
+    static const uint depths[] = { 1, 4, 32 };
+    for (uint d = 0; d < countof(depths); d++) {
+        uint qd = depths[d];
+        sem_init(&bench_bio_slots, qd);
+        for (uint i = 0; i < qd; i++) {
+            slots[i].iov.iov_base = buf + i * BIO_BENCH_XFER;
+            slots[i].iov.iov_len = BIO_BENCH_XFER;
+            list_add_tail(&bench_bio_free, &slots[i].node);
+        }
+
+        lk_bigtime_t t = current_time_hires();
+        for (uint i = 0; i < BIO_BENCH_COUNT; i++) {
+            sem_wait(&bench_bio_slots);
+
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&bench_bio_lock, state);
+            struct bench_bio_slot *slot = list_remove_head_type(&bench_bio_free, struct bench_bio_slot, node);
+            spin_unlock_irqrestore(&bench_bio_lock, state);
+
+            slot->req = (bio_request_t) {
+                .op = BIO_OP_READ,
+                .block = (rand() % (dev->block_count / blocks_per_xfer)) * blocks_per_xfer,
+                .count = blocks_per_xfer,
+                .iov = &slot->iov,
+                .iov_cnt = 1,
+                .callback = &bench_bio_callback,
+                .cookie = slot,
+            };
+            status_t err = bio_submit_request(dev, &slot->req);
+            if (err < 0) {
+                printf("error %d queueing read\n", err);
+                bench_bio_callback(&slot->req, err);
+                break;
+            }
+        }
+
+        /* wait for everything to drain */
+        for (uint i = 0; i < qd; i++)
+            sem_wait(&bench_bio_slots);
+        t = current_time_hires() - t;
+
+        sem_destroy(&bench_bio_slots);
+        list_initialize(&bench_bio_free);
+
+        unsigned long long bytes = (unsigned long long)BIO_BENCH_COUNT * BIO_BENCH_XFER;
+        printf("QD%u: %u reads of %u bytes took %llu usecs, %llu IOPS, %llu KB/sec\n", qd,
+               BIO_BENCH_COUNT, BIO_BENCH_XFER, (unsigned long long)t,
+               t ? (unsigned long long)BIO_BENCH_COUNT * 1000000 / t : 0,
+               t ? bytes * 1000000 / t / 1024 : 0);
+    }
+
+    free(slots);
+    free(buf);
+    bio_close(dev);
+}
+#endif // WITH_LIB_BIO
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#include <kernel/vmi.h>
+#include <kernel/evm.h>
+
+#define FAULT_BENCH_SIZE (1024UL * 1024 * 1024)
+#define FAULT_BENCH_PAGES (FAULT_BENCH_SIZE / PAGE_SIZE)
+#define FAULT_BENCH_COUNT 10000
+
+/* a pager whose pages are all resident up front, aliasing one physical page */
+static void bench_pager_page_req(evmm_object_t *object, vaddr_t offset, evm_prot_t prot, evm_page_t **pagep)
+{
+    *pagep = NULL;
+}
+
+static void bench_pager_pgunlock(evmm_object_t *object, evm_prot_t prot, evm_page_t *page)
+{
+}
+
+static void bench_pager_free(evmm_object_t *object)
+{
+    evm_page_t *pages = object->pager;
+
+    mutex_acquire(&object->lock);
+    for (size_t i = 0; i < FAULT_BENCH_PAGES; i++)
+        evmm_page_remove(&pages[i]);
+    mutex_release(&object->lock);
+
+    evmm_pre_destroy(object);
+    free(pages);
+    free(object);
+}
+
+static struct evmm_object_ops bench_pager_ops = {
+    .evm_page_req = bench_pager_page_req,
+    .evm_pgunlock = bench_pager_pgunlock,
+    .evm_free = bench_pager_free,
+};
+
+__NO_INLINE static void bench_page_faults(void)
+{
+    struct list_node page_list = LIST_INITIAL_VALUE(page_list);
+    if (pmm_alloc_pages(1, &page_list) != 1) {
+        printf("failed to allocate page\n");
+        return;
+    }
+    vm_page_t *phys_page = list_peek_head_type(&page_list, vm_page_t, node);
+
+    evmm_object_t *object = malloc(sizeof(evmm_object_t));
+    evm_page_t *pages = calloc(FAULT_BENCH_PAGES, sizeof(evm_page_t));
+    if (!object || !pages) {
+        printf("failed to allocate %lu resident pages\n", FAULT_BENCH_PAGES);
+        free(object);
+        free(pages);
+        pmm_free(&page_list);
+        return;
+    }
+
+    evmm_init(object, &bench_pager_ops, pages);
+
+    mutex_acquire(&object->lock);
+    for (size_t i = 0; i < FAULT_BENCH_PAGES; i++) {
+        pages[i].phys_page = phys_page;
+        evmm_page_insert(&pages[i], object, i * PAGE_SIZE);
+    }
+    mutex_release(&object->lock);
+
+    void *ptr;
+    status_t err = vmm_alloc_object(vmm_get_kernel_aspace(), "fault bench", FAULT_BENCH_SIZE, &ptr, 0, 0, object);
+    if (err < 0) {
+        printf("failed to map object, err %d\n", err);
+        goto out;
+    }
+
+    uint faulted = 0;
+    uint count = arch_cycle_count();
+    for (uint i = 0; i < FAULT_BENCH_COUNT; i++) {
+        vaddr_t va = (vaddr_t)ptr + (rand() % FAULT_BENCH_PAGES) * PAGE_SIZE;
+        faulted += vmi_page_fault(va, VMI_FLAGS_READ | VMI_FLAGS_KERNEL);
+    }
+    count = arch_cycle_count() - count;
+
+    printf("took %u cycles for %u faults (%u handled) on a %lu MB object, %u cycles per fault\n",
+           count, FAULT_BENCH_COUNT, faulted, FAULT_BENCH_SIZE / (1024 * 1024), count / FAULT_BENCH_COUNT);
+
+    vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+
+out:
+    /* drop the initial reference, freeing the object */
+    evmm_release(object);
+    pmm_free(&page_list);
+}
+
+#endif // WITH_KERNEL_VM
+
 #if WITH_LIB_LIBM
 #include <math.h>
 
@@ -247,8 +597,16 @@ __NO_INLINE static void bench_sincos(void)
 
 #endif // WITH_LIB_LIBM
 
-void benchmarks(void)
+int benchmarks(int argc, const cmd_args *argv)
 {
+#if WITH_KERNEL_VM
+    /* maps a 1GB object with all of its pages resident, so it only runs when asked for */
+    if (argc >= 2 && !strcmp(argv[1].str, "faults")) {
+        bench_page_faults();
+        return 0;
+    }
+#endif
+
     bench_set_overhead();
     bench_memset();
     bench_memcpy();
@@ -259,6 +617,15 @@ void benchmarks(void)
     bench_cset_uint64_t();
     bench_cset_wide();
 
+    bench_timers();
+    bench_malloc();
+#if WITH_LIB_ZALLOC
+    bench_zalloc();
+#endif
+#if WITH_LIB_BIO
+    bench_bio_qd();
+#endif
+
 #if ARCH_ARM
     arm_bench_cset_stm();
 
@@ -269,5 +636,7 @@ void benchmarks(void)
 #if WITH_LIB_LIBM
     bench_sincos();
 #endif
+
+    return 0;
 }
 
@@ -28,8 +28,62 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/timer.h>
 #include <platform.h>
 
+/* a timer armed from a callback that runs late, on a tick past its due time,
+ * still has to wait its full delay */
+#define LATE_TICK_DELAY 60
+
+static timer_t late_tick_timer;
+static volatile lk_time_t late_tick_armed;
+static volatile lk_time_t late_tick_fired;
+
+static enum handler_return late_tick_fire(timer_t *t, lk_time_t now, void *arg)
+{
+    late_tick_fired = current_time();
+    event_signal((event_t *)arg, false);
+
+    return INT_RESCHEDULE;
+}
+
+static enum handler_return late_tick_rearm(timer_t *t, lk_time_t now, void *arg)
+{
+    late_tick_armed = current_time();
+    timer_set_oneshot(&late_tick_timer, LATE_TICK_DELAY, late_tick_fire, arg);
+
+    return INT_NO_RESCHEDULE;
+}
+
+static void timer_late_tick_test(void)
+{
+    timer_t first;
+    event_t done;
+
+    timer_initialize(&first);
+    timer_initialize(&late_tick_timer);
+    event_init(&done, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    /* with a periodic tick most of these run late, and the rest cover a one shot */
+    for (int i = 0; i < 20; i++) {
+        timer_set_oneshot(&first, 1 + (i % 10), late_tick_rearm, &done);
+
+        if (event_wait_timeout(&done, 1000) < 0) {
+            printf("WARNING: re-armed timer never fired\n");
+            timer_cancel(&first);
+            timer_cancel(&late_tick_timer);
+            break;
+        }
+
+        if (late_tick_fired - late_tick_armed < LATE_TICK_DELAY) {
+            printf("WARNING: re-armed timer fired after %u ms, expected at least %u\n",
+                   late_tick_fired - late_tick_armed, LATE_TICK_DELAY);
+        }
+    }
+
+    event_destroy(&done);
+}
+
 void clock_tests(void)
 {
     uint32_t c;
@@ -98,6 +152,9 @@ void clock_tests(void)
         }
     }
 
+    printf("making sure timers re-armed from a late tick don't fire early\n");
+    timer_late_tick_test();
+
     printf("counting to 5, in one second intervals\n");
     for (int i = 0; i < 5; i++) {
         thread_sleep(1000);
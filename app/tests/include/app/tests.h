@@ -30,7 +30,7 @@ int fibo(int argc, const cmd_args *argv);
 int port_tests(void);
 int spinner(int argc, const cmd_args *argv);
 int thread_tests(void);
-void benchmarks(void);
+int benchmarks(int argc, const cmd_args *argv);
 void clock_tests(void);
 void printf_tests(void);
 void printf_tests_float(void);
@@ -32,6 +32,8 @@
 
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
 #endif
 
 static void mem_test_fail(void *ptr, uint32_t should, uint32_t is)
@@ -237,6 +239,97 @@ usage:
     return 0;
 }
 
+#if WITH_KERNEL_VM
+#define PMM_TEST_MAX_THREADS 32
+#define PMM_TEST_ITERATIONS 100000
+
+static event_t pmm_test_start = EVENT_INITIAL_VALUE(pmm_test_start, false, 0);
+
+static int pmm_test_thread(void *arg)
+{
+    uint iterations = (uintptr_t)arg;
+    struct list_node list = LIST_INITIAL_VALUE(list);
+
+    event_wait(&pmm_test_start);
+
+    for (uint i = 0; i < iterations; i++) {
+        /* mostly small runs, with the occasional one too big for the per cpu cache */
+        uint count = (i % 64 == 63) ? 64 : 1 + (i % 8);
+
+        size_t got = pmm_alloc_pages(count, &list);
+        if (got != count) {
+            printf("pmm_alloc_pages returned %zu of %u pages\n", got, count);
+            pmm_free(&list);
+            return ERR_NO_MEMORY;
+        }
+
+        vm_page_t *p;
+        list_for_every_entry(&list, p, vm_page_t, node) {
+            if (!(p->flags & VM_PAGE_FLAG_NONFREE)) {
+                printf("allocated page %p is marked free\n", p);
+                pmm_free(&list);
+                return ERR_GENERIC;
+            }
+        }
+
+        pmm_free(&list);
+    }
+
+    return NO_ERROR;
+}
+
+/* hammer the page allocator from several threads at once and report throughput */
+static int pmm_test(int argc, const cmd_args *argv)
+{
+    uint nthreads = (argc >= 2) ? argv[1].u : SMP_MAX_CPUS;
+    uint iterations = (argc >= 3) ? argv[2].u : PMM_TEST_ITERATIONS;
+
+    if (nthreads == 0 || nthreads > PMM_TEST_MAX_THREADS) {
+        printf("usage: %s [threads (1-%u)] [iterations]\n", argv[0].str, PMM_TEST_MAX_THREADS);
+        return ERR_INVALID_ARGS;
+    }
+
+    thread_t *threads[PMM_TEST_MAX_THREADS];
+    size_t free_before = pmm_count_free_pages();
+
+    event_unsignal(&pmm_test_start);
+    for (uint i = 0; i < nthreads; i++) {
+        threads[i] = thread_create("pmm tester", &pmm_test_thread, (void *)(uintptr_t)iterations,
+                                   DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+
+    lk_bigtime_t t = current_time_hires();
+    event_signal(&pmm_test_start, true);
+
+    int failures = 0;
+    for (uint i = 0; i < nthreads; i++) {
+        int ret;
+        thread_join(threads[i], &ret, INFINITE_TIME);
+        if (ret < 0)
+            failures++;
+    }
+    t = current_time_hires() - t;
+
+    /* one alloc and one free call per iteration */
+    unsigned long long ops = (unsigned long long)nthreads * iterations * 2;
+    printf("%u threads, %u iterations each: %llu usecs, %llu ops/sec\n", nthreads, iterations,
+           (unsigned long long)t, t ? ops * 1000000 / t : 0);
+
+    size_t free_after = pmm_count_free_pages();
+    if (free_after != free_before) {
+        printf("free page count changed from %zu to %zu\n", free_before, free_after);
+        failures++;
+    }
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? ERR_GENERIC : NO_ERROR;
+}
+#endif
+
 STATIC_COMMAND_START
 STATIC_COMMAND("mem_test", "test memory", &mem_test)
+#if WITH_KERNEL_VM
+STATIC_COMMAND("pmm_test", "multi-threaded page alloc/free throughput test", &pmm_test)
+#endif
 STATIC_COMMAND_END(mem_tests);
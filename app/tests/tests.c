@@ -34,7 +34,7 @@ STATIC_COMMAND("printf_tests_float", "test printf with floating point", (console
 STATIC_COMMAND("thread_tests", "test the scheduler", (console_cmd)&thread_tests)
 STATIC_COMMAND("port_tests", "test the ports", (console_cmd)&port_tests)
 STATIC_COMMAND("clock_tests", "test clocks", (console_cmd)&clock_tests)
-STATIC_COMMAND("bench", "miscellaneous benchmarks", (console_cmd)&benchmarks)
+STATIC_COMMAND("bench", "miscellaneous benchmarks, 'bench faults' for the page fault one", &benchmarks)
 STATIC_COMMAND("fibo", "threaded fibonacci", (console_cmd)&fibo)
 STATIC_COMMAND("spinner", "create a spinning thread", (console_cmd)&spinner)
 STATIC_COMMAND("cbuf_tests", "test lib/cbuf", &cbuf_tests)
@@ -31,6 +31,7 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
 #include <platform.h>
 
 static int sleep_thread(void *arg)
@@ -399,6 +400,93 @@ void context_switch_test(void)
     thread_sleep(100);
 }
 
+/* wakeup benchmark: one pair of threads per cpu bouncing a pair of events back
+ * and forth, run on 1 through N cpus to see how the scheduler scales. */
+#define WAKEUP_BENCH_ITERATIONS 10000
+
+struct wakeup_bench_pair {
+    event_t ping;
+    event_t pong;
+    thread_t *threads[2];
+};
+
+static int wakeup_bench_pinger(void *arg)
+{
+    struct wakeup_bench_pair *pair = (struct wakeup_bench_pair *)arg;
+
+    for (int i = 0; i < WAKEUP_BENCH_ITERATIONS; i++) {
+        event_signal(&pair->ping, true);
+        event_wait(&pair->pong);
+    }
+
+    return 0;
+}
+
+static int wakeup_bench_ponger(void *arg)
+{
+    struct wakeup_bench_pair *pair = (struct wakeup_bench_pair *)arg;
+
+    for (int i = 0; i < WAKEUP_BENCH_ITERATIONS; i++) {
+        event_wait(&pair->ping);
+        event_signal(&pair->pong, true);
+    }
+
+    return 0;
+}
+
+static void wakeup_bench(void)
+{
+    struct wakeup_bench_pair pairs[SMP_MAX_CPUS];
+    uint cpus[SMP_MAX_CPUS];
+    uint cpu_count = 0;
+    lk_bigtime_t base_rate = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (mp_is_cpu_active(i))
+            cpus[cpu_count++] = i;
+    }
+
+    printf("wakeup benchmark, %d round trips per thread pair\n", WAKEUP_BENCH_ITERATIONS);
+
+    for (uint n = 1; n <= cpu_count; n++) {
+        for (uint i = 0; i < n; i++) {
+            event_init(&pairs[i].ping, false, EVENT_FLAG_AUTOUNSIGNAL);
+            event_init(&pairs[i].pong, false, EVENT_FLAG_AUTOUNSIGNAL);
+            pairs[i].threads[0] = thread_create("wakeup ping", &wakeup_bench_pinger, &pairs[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            pairs[i].threads[1] = thread_create("wakeup pong", &wakeup_bench_ponger, &pairs[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            thread_set_pinned_cpu(pairs[i].threads[0], cpus[i]);
+            thread_set_pinned_cpu(pairs[i].threads[1], cpus[i]);
+        }
+
+        lk_bigtime_t t = current_time_hires();
+        for (uint i = 0; i < n; i++) {
+            thread_resume(pairs[i].threads[1]);
+            thread_resume(pairs[i].threads[0]);
+        }
+        for (uint i = 0; i < n; i++) {
+            thread_join(pairs[i].threads[0], NULL, INFINITE_TIME);
+            thread_join(pairs[i].threads[1], NULL, INFINITE_TIME);
+        }
+        t = current_time_hires() - t;
+
+        for (uint i = 0; i < n; i++) {
+            event_destroy(&pairs[i].ping);
+            event_destroy(&pairs[i].pong);
+        }
+
+        /* each round trip is two wakeups and two context switches */
+        lk_bigtime_t wakeups = 2ULL * WAKEUP_BENCH_ITERATIONS * n;
+        lk_bigtime_t rate = t ? (wakeups * 1000000ULL) / t : 0;
+        if (n == 1)
+            base_rate = rate;
+
+        printf("%u cpu%s: %llu wakeups in %llu usecs, %llu wakeups/sec, scaling %llu.%02llux\n",
+               n, n == 1 ? " " : "s", wakeups, t, rate,
+               base_rate ? rate / base_rate : 0ULL,
+               base_rate ? (rate * 100 / base_rate) % 100 : 0ULL);
+    }
+}
+
 static volatile int atomic;
 static volatile int atomic_count;
 
@@ -627,6 +715,7 @@ int thread_tests(void)
 
     thread_sleep(200);
     context_switch_test();
+    wakeup_bench();
 
     preempt_test();
 
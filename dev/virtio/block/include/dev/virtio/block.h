@@ -25,8 +25,18 @@
 #include <compiler.h>
 #include <sys/types.h>
 #include <dev/virtio.h>
+#include <lib/bio.h>
 
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) __NONNULL();
 
 ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write) __NONNULL();
 
+/* queue a request and return, with up to a ring's worth in flight at once.
+ * the callback runs from the irq handler when the request completes. */
+status_t virtio_block_submit(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write,
+                             bio_async_callback_t callback, void *cookie) __NONNULL((1, 2));
+
+/* hold back doorbell writes while queueing a batch of requests */
+void virtio_block_plug(struct virtio_device *dev) __NONNULL();
+void virtio_block_unplug(struct virtio_device *dev) __NONNULL();
+
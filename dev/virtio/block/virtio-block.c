@@ -28,11 +28,17 @@
 #include <compiler.h>
 #include <list.h>
 #include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <arch/ops.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <lib/bio.h>
+#include <lib/console.h>
 
 #define LOCAL_TRACE 0
 
@@ -73,26 +79,72 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
+#define VIRTIO_BLK_RING_LEN 256
+
+/* data descriptors per request, bounding the transfer size of a single request */
+#define VIRTIO_BLK_MAX_SEGS 32
+#if WITH_KERNEL_VM
+#define VIRTIO_BLK_MAX_XFER ((VIRTIO_BLK_MAX_SEGS - 1) * PAGE_SIZE)
+#else
+#define VIRTIO_BLK_MAX_XFER (1024*1024)
+#endif
+
+/* bio requests handed to the driver at once, the rest wait in bio's queue to be sorted and merged */
+#define VIRTIO_BLK_QUEUE_DEPTH 32
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
-static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
-static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static status_t virtio_bdev_submit_request(struct bdev *bdev, bio_request_t *req);
+struct virtio_block_dev;
+static bool virtio_block_start_requests(struct virtio_block_dev *bdev);
+static void virtio_block_kick_locked(struct virtio_block_dev *bdev);
+
+/* the part of a request the device reads and writes, never crossing a page boundary */
+struct virtio_blk_txn_hw {
+    struct virtio_blk_req req;
+    uint8_t status;
+} __ALIGNED(32);
+
+/* the driver's side of a request in flight, completing either a bio request or a callback */
+struct virtio_blk_txn {
+    bio_request_t *req;
+    bio_async_callback_t callback;
+    void *cookie;
+    size_t len;
+};
+
+/* how far the first waiting bio request has been put on the ring */
+struct virtio_blk_cursor {
+    bio_request_t *r;               // the request within a merged one
+    uint iov;
+    size_t offset;
+    bnum_t block;                   // where the next chain starts
+};
 
 struct virtio_block_dev {
     struct virtio_device *dev;
 
-    mutex_t lock;
-    event_t io_event;
+    /* protects the ring and the transaction tables, taken from the irq handler */
+    spin_lock_t lock;
+
+    /* signaled whenever descriptors are returned to the ring */
+    event_t desc_event;
+
+    /* requests in flight and kicks held back while plugged */
+    uint in_flight;
+    uint plugged;
+    bool kick_pending;
+
+    /* bio requests not all on the ring yet. a request larger than a chain is split
+     * into several, and completes when they all have */
+    struct list_node requests;
+    struct virtio_blk_cursor cursor;
 
     /* bio block device */
     bdev_t bdev;
 
-    /* one blk_req structure for io, not crossing a page boundary */
-    struct virtio_blk_req *blk_req;
-    paddr_t blk_req_phys;
-
-    /* one uint8_t response word */
-    uint8_t blk_response;
-    paddr_t blk_response_phys;
+    /* per request state, indexed by the head descriptor of the request's chain */
+    struct virtio_blk_txn_hw *txn_hw;
+    struct virtio_blk_txn txn[VIRTIO_BLK_RING_LEN];
 };
 
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
@@ -100,29 +152,23 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
 
     /* allocate a new block device */
-    struct virtio_block_dev *bdev = malloc(sizeof(struct virtio_block_dev));
+    struct virtio_block_dev *bdev = calloc(1, sizeof(struct virtio_block_dev));
     if (!bdev)
         return ERR_NO_MEMORY;
 
-    mutex_init(&bdev->lock);
-    event_init(&bdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    spin_lock_init(&bdev->lock);
+    event_init(&bdev->desc_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    list_initialize(&bdev->requests);
 
     bdev->dev = dev;
     dev->priv = bdev;
 
-    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req));
-#if WITH_KERNEL_VM
-    bdev->blk_req_phys = vaddr_to_paddr(bdev->blk_req);
-#else
-    bdev->blk_freq_phys = (uint64_t)(uintptr_t)bdev->blk_req;
-#endif
-    LTRACEF("blk_req structure at %p (0x%lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
-
-#if WITH_KERNEL_VM
-    bdev->blk_response_phys = vaddr_to_paddr(&bdev->blk_response);
-#else
-    bdev->blk_response_phys = (uint64_t)(uintptr_t)&bdev->blk_response;
-#endif
+    bdev->txn_hw = memalign(sizeof(struct virtio_blk_txn_hw), VIRTIO_BLK_RING_LEN * sizeof(struct virtio_blk_txn_hw));
+    if (!bdev->txn_hw) {
+        free(bdev);
+        return ERR_NO_MEMORY;
+    }
+    LTRACEF("request headers at %p\n", bdev->txn_hw);
 
     /* make sure the device is reset */
     virtio_reset_device(dev);
@@ -140,7 +186,7 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     // XXX check features bits and ack/nak them
 
     /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 256);
+    virtio_alloc_ring(dev, 0, VIRTIO_BLK_RING_LEN);
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
@@ -157,8 +203,9 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
                         0, NULL, BIO_FLAGS_NONE);
 
     /* override our block device hooks */
-    bdev->bdev.read_block = &virtio_bdev_read_block;
-    bdev->bdev.write_block = &virtio_bdev_write_block;
+    bdev->bdev.submit_request = &virtio_bdev_submit_request;
+    bdev->bdev.queue_depth = VIRTIO_BLK_QUEUE_DEPTH;
+    bdev->bdev.max_xfer = VIRTIO_BLK_MAX_XFER;
 
     bio_register_device(&bdev->bdev);
 
@@ -173,8 +220,15 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
+    spin_lock(&bdev->lock);
+
+    /* pick up the request before its head descriptor goes back on the free list */
+    uint16_t head = e->id;
+    struct virtio_blk_txn txn = bdev->txn[head];
+    uint8_t status = bdev->txn_hw[head].status;
+
     /* parse our descriptor chain, add back to the free queue */
-    uint16_t i = e->id;
+    uint16_t i = head;
     for (;;) {
         int next;
         struct vring_desc *desc = virtio_desc_index_to_desc(dev, ring, i);
@@ -195,146 +249,467 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
         i = next;
     }
 
-    /* signal our event */
-    event_signal(&bdev->io_event, false);
+    bdev->in_flight--;
+
+    /* a bio request is done once all of its chains are on the ring and back */
+    bio_request_t *done = NULL;
+    if (txn.req) {
+        if (txn.req->result >= 0)
+            txn.req->result = (status == VIRTIO_BLK_S_OK) ? txn.req->result + (ssize_t)txn.len : ERR_IO;
+        if (--txn.req->pending == 0 && !list_in_list(&txn.req->node))
+            done = txn.req;
+    }
+
+    /* there's room on the ring again */
+    if (virtio_block_start_requests(bdev))
+        virtio_block_kick_locked(bdev);
+
+    spin_unlock(&bdev->lock);
+
+    LTRACEF("request %u status 0x%hhx\n", head, status);
+
+    /* complete the request */
+    if (done)
+        bio_request_complete(done, done->result);
+    else if (txn.callback)
+        txn.callback(txn.cookie, &bdev->bdev, (status == VIRTIO_BLK_S_OK) ? (ssize_t)txn.len : ERR_IO);
+
+    /* let anyone waiting for ring space try again */
+    event_signal(&bdev->desc_event, false);
 
     return INT_RESCHEDULE;
 }
 
-ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+/* split a buffer into physically contiguous runs, returns the number of runs or an error */
+static int virtio_block_build_segs(void *buf, size_t len, paddr_t *seg_pa, uint32_t *seg_len)
 {
-    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
-
-    uint16_t i;
-    struct vring_desc *desc;
-    paddr_t pa;
+#if WITH_KERNEL_VM
     vaddr_t va = (vaddr_t)buf;
+    int count = 0;
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+    while (len > 0) {
+        paddr_t pa = vaddr_to_paddr((void *)va);
+        size_t len_tohandle = MIN(PAGE_ALIGN(va + 1) - va, len);
+
+        /* is the new translated physical address contiguous to the last one? */
+        if (count > 0 && seg_pa[count - 1] + seg_len[count - 1] == pa) {
+            seg_len[count - 1] += len_tohandle;
+        } else {
+            if (count == VIRTIO_BLK_MAX_SEGS)
+                return ERR_TOO_BIG;
+            seg_pa[count] = pa;
+            seg_len[count] = len_tohandle;
+            count++;
+        }
 
-    mutex_acquire(&bdev->lock);
+        va += len_tohandle;
+        len -= len_tohandle;
+    }
+
+    return count;
+#else
+    seg_pa[0] = (paddr_t)(uintptr_t)buf;
+    seg_len[0] = len;
+    return 1;
+#endif
+}
+
+static void virtio_block_kick_locked(struct virtio_block_dev *bdev)
+{
+    /* kick it off, unless someone is batching up requests */
+    if (bdev->plugged)
+        bdev->kick_pending = true;
+    else
+        virtio_kick_if_needed(bdev->dev, 0);
+}
+
+/* fill in a chain for the header, the data and the status byte and put it on the ring */
+static void virtio_block_queue_chain(struct virtio_block_dev *bdev, struct vring_desc *desc, uint16_t head,
+                                     off_t offset, bool write, const paddr_t *seg_pa, const uint32_t *seg_len, int nsegs)
+{
+    struct virtio_device *dev = bdev->dev;
 
     /* set up the request */
-    bdev->blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    bdev->blk_req->ioprio = 0;
-    bdev->blk_req->sector = offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
-            bdev->blk_req->type, bdev->blk_req->ioprio, bdev->blk_req->sector);
+    struct virtio_blk_txn_hw *hw = &bdev->txn_hw[head];
+    hw->req.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    hw->req.ioprio = 0;
+    hw->req.sector = offset / 512;
+    hw->status = 0xff;
 
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
+#if WITH_KERNEL_VM
+    paddr_t hw_phys = vaddr_to_paddr(hw);
+#else
+    paddr_t hw_phys = (paddr_t)(uintptr_t)hw;
+#endif
 
     // XXX not cache safe.
     // At the moment only tested on arm qemu, which doesn't emulate cache.
 
     /* set up the descriptor pointing to the head */
-    desc->addr = bdev->blk_req_phys;
+    desc->addr = hw_phys + offsetof(struct virtio_blk_txn_hw, req);
     desc->len = sizeof(struct virtio_blk_req);
     desc->flags |= VRING_DESC_F_NEXT;
 
-    /* set up the descriptor pointing to the buffer */
+    /* set up the descriptors pointing to the buffer */
+    for (int s = 0; s < nsegs; s++) {
+        desc = virtio_desc_index_to_desc(dev, 0, desc->next);
+        desc->addr = seg_pa[s];
+        desc->len = seg_len[s];
+        desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
+        desc->flags |= VRING_DESC_F_NEXT;
+    }
+
+    /* set up the descriptor pointing to the response */
     desc = virtio_desc_index_to_desc(dev, 0, desc->next);
+    desc->addr = hw_phys + offsetof(struct virtio_blk_txn_hw, status);
+    desc->len = 1;
+    desc->flags = VRING_DESC_F_WRITE;
+
+    /* submit the transfer */
+    virtio_submit_chain(dev, 0, head);
+    bdev->in_flight++;
+}
+
+status_t virtio_block_submit(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write,
+                             bio_async_callback_t callback, void *cookie)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu, write %u\n", dev, buf, offset, len, write);
+
+    if (len == 0 || len > VIRTIO_BLK_MAX_XFER)
+        return ERR_INVALID_ARGS;
+
+    paddr_t seg_pa[VIRTIO_BLK_MAX_SEGS];
+    uint32_t seg_len[VIRTIO_BLK_MAX_SEGS];
+    int nsegs = virtio_block_build_segs(buf, len, seg_pa, seg_len);
+    if (nsegs < 0)
+        return nsegs;
+
+    /* grab a chain for the header, the data and the status byte, waiting for room if needed */
+    spin_lock_saved_state_t state;
+    struct vring_desc *desc;
+    uint16_t head;
+    for (;;) {
+        spin_lock_irqsave(&bdev->lock, state);
+        desc = virtio_alloc_desc_chain(dev, 0, nsegs + 2, &head);
+        if (desc)
+            break;
+
+        /* while plugged the device may not have heard of what's filling the ring yet */
+        if (bdev->kick_pending) {
+            bdev->kick_pending = false;
+            virtio_kick_if_needed(dev, 0);
+        }
+        spin_unlock_irqrestore(&bdev->lock, state);
+
+        LTRACEF("ring full, waiting\n");
+        event_wait(&bdev->desc_event);
+    }
+
+    bdev->txn[head].req = NULL;
+    bdev->txn[head].callback = callback;
+    bdev->txn[head].cookie = cookie;
+    bdev->txn[head].len = len;
+
+    virtio_block_queue_chain(bdev, desc, head, offset, write, seg_pa, seg_len, nsegs);
+    virtio_block_kick_locked(bdev);
+
+    spin_unlock_irqrestore(&bdev->lock, state);
+
+    return NO_ERROR;
+}
+
+void virtio_block_plug(struct virtio_device *dev)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bdev->lock, state);
+    bdev->plugged++;
+    spin_unlock_irqrestore(&bdev->lock, state);
+}
+
+void virtio_block_unplug(struct virtio_device *dev)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bdev->lock, state);
+    DEBUG_ASSERT(bdev->plugged > 0);
+    if (--bdev->plugged == 0 && bdev->kick_pending) {
+        bdev->kick_pending = false;
+        virtio_kick_if_needed(dev, 0);
+    }
+    spin_unlock_irqrestore(&bdev->lock, state);
+}
+
+/* completion state for synchronous requests, possibly split into several chunks */
+struct virtio_block_waiter {
+    event_t event;
+    volatile int pending;
+    ssize_t err;
+};
+
+static void virtio_block_sync_callback(void *cookie, struct bdev *dev, ssize_t status)
+{
+    struct virtio_block_waiter *w = cookie;
+
+    if (status < 0)
+        w->err = status;
+    if (atomic_add(&w->pending, -1) == 1)
+        event_signal(&w->event, false);
+}
+
+ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+{
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+
+    struct virtio_block_waiter w;
+    event_init(&w.event, false, 0);
+    w.pending = 1;
+    w.err = NO_ERROR;
+
+    /* queue the whole transfer in chunks and ring the doorbell once */
+    virtio_block_plug(dev);
+    while (len > 0) {
+        size_t chunk = MIN(len, VIRTIO_BLK_MAX_XFER);
+
+        atomic_add(&w.pending, 1);
+        status_t err = virtio_block_submit(dev, buf, offset, chunk, write, &virtio_block_sync_callback, &w);
+        if (err < 0) {
+            atomic_add(&w.pending, -1);
+            w.err = err;
+            break;
+        }
+
+        buf = (uint8_t *)buf + chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    virtio_block_unplug(dev);
+
+    /* drop our own reference and wait for the rest */
+    if (atomic_add(&w.pending, -1) != 1)
+        event_wait(&w.event);
+    event_destroy(&w.event);
+
+    LTRACEF("status %ld\n", w.err);
+
+    return w.err;
+}
+
+/* gather the segments for the next chain of a bio request, at most VIRTIO_BLK_MAX_SEGS
+ * of them and ending on a block boundary, and move the cursor past them */
+static int virtio_block_next_segs(struct virtio_block_dev *bdev, struct virtio_blk_cursor *c,
+                                  paddr_t *seg_pa, uint32_t *seg_len, size_t *lenp)
+{
+    size_t len = 0;
+    int nsegs = 0;
+
+    while (c->r && len < VIRTIO_BLK_MAX_XFER) {
+        const iovec_t *iov = &c->r->iov[c->iov];
+        uint8_t *ptr = (uint8_t *)iov->iov_base + c->offset;
+        size_t run = MIN(iov->iov_len - c->offset, VIRTIO_BLK_MAX_XFER - len);
 #if WITH_KERNEL_VM
-    /* translate the first buffer */
-    pa = vaddr_to_paddr((void *)va);
-    desc->addr = (uint64_t)pa;
-    /* desc->len is filled in below */
+        run = MIN(run, PAGE_ALIGN((vaddr_t)ptr + 1) - (vaddr_t)ptr);
+        paddr_t pa = vaddr_to_paddr(ptr);
 #else
-    desc->addr = (uint64_t)(uintptr_t)buf;
-    desc->len = len;
+        paddr_t pa = (paddr_t)(uintptr_t)ptr;
 #endif
-    desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-    desc->flags |= VRING_DESC_F_NEXT;
 
-#if WITH_KERNEL_VM
-    /* see if we need to add more descriptors due to scatter gather */
-    paddr_t next_pa = PAGE_ALIGN(pa + 1);
-    desc->len = MIN(next_pa - pa, len);
-    LTRACEF("first descriptor va 0x%lx desc->addr 0x%llx desc->len %u\n", va, desc->addr, desc->len);
-    len -= desc->len;
-    while (len > 0) {
-        /* amount of source buffer handled by this iteration of the loop */
-        size_t len_tohandle = MIN(len, PAGE_SIZE);
+        if (nsegs > 0 && seg_pa[nsegs - 1] + seg_len[nsegs - 1] == pa) {
+            seg_len[nsegs - 1] += run;
+        } else {
+            if (nsegs == VIRTIO_BLK_MAX_SEGS)
+                break;
+            seg_pa[nsegs] = pa;
+            seg_len[nsegs] = run;
+            nsegs++;
+        }
 
-        /* translate the next page in the buffer */
-        va = PAGE_ALIGN(va + 1);
-        pa = vaddr_to_paddr((void *)va);
-        LTRACEF("va now 0x%lx, pa 0x%lx, next_pa 0x%lx, remaining len %zu\n", va, pa, next_pa, len);
+        len += run;
+        c->offset += run;
+        if (c->offset == iov->iov_len) {
+            c->offset = 0;
+            if (++c->iov == c->r->iov_cnt) {
+                c->iov = 0;
+                c->r = c->r->merge_next;
+            }
+        }
+    }
 
-        /* is the new translated physical address contiguous to the last one? */
-        if (next_pa == pa) {
-            LTRACEF("extending last one by %zu bytes\n", len_tohandle);
-            desc->len += len_tohandle;
+    /* vectors are whole blocks, so a partial block is always at the end of the current one */
+    size_t trim = len & (bdev->bdev.block_size - 1);
+    DEBUG_ASSERT(c->offset >= trim);
+    c->offset -= trim;
+    len -= trim;
+    while (trim > 0) {
+        if (seg_len[nsegs - 1] <= trim) {
+            trim -= seg_len[--nsegs];
         } else {
-            uint16_t next_i = virtio_alloc_desc(dev, 0);
-            struct vring_desc *next_desc = virtio_desc_index_to_desc(dev, 0, next_i);
-            DEBUG_ASSERT(next_desc);
+            seg_len[nsegs - 1] -= trim;
+            trim = 0;
+        }
+    }
+
+    DEBUG_ASSERT(nsegs > 0);
+    *lenp = len;
+    return nsegs;
+}
+
+/* put as much of the waiting bio requests on the ring as there's room for, with the
+ * lock held. returns whether anything was queued */
+static bool virtio_block_start_requests(struct virtio_block_dev *bdev)
+{
+    bool started = false;
+    bio_request_t *req;
+
+    while ((req = list_peek_head_type(&bdev->requests, bio_request_t, node))) {
+        if (!bdev->cursor.r)
+            bdev->cursor = (struct virtio_blk_cursor){ req, 0, 0, req->block };
+
+        paddr_t seg_pa[VIRTIO_BLK_MAX_SEGS];
+        uint32_t seg_len[VIRTIO_BLK_MAX_SEGS];
+        struct virtio_blk_cursor c = bdev->cursor;
+        size_t len;
+        int nsegs = virtio_block_next_segs(bdev, &c, seg_pa, seg_len, &len);
+
+        /* the ring is full, carry on when something completes */
+        uint16_t head;
+        struct vring_desc *desc = virtio_alloc_desc_chain(bdev->dev, 0, nsegs + 2, &head);
+        if (!desc)
+            break;
 
-            LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
+        bdev->txn[head].req = req;
+        bdev->txn[head].callback = NULL;
+        bdev->txn[head].len = len;
+        req->pending++;
 
-            /* fill this descriptor in and put it after the last one but before the response descriptor */
-            next_desc->addr = (uint64_t)pa;
-            next_desc->len = len_tohandle;
-            next_desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-            next_desc->flags |= VRING_DESC_F_NEXT;
-            next_desc->next = desc->next;
-            desc->next = next_i;
+        virtio_block_queue_chain(bdev, desc, head, (off_t)bdev->cursor.block * bdev->bdev.block_size,
+                                 req->op == BIO_OP_WRITE, seg_pa, seg_len, nsegs);
+        started = true;
 
-            desc = next_desc;
+        c.block = bdev->cursor.block + len / bdev->bdev.block_size;
+        bdev->cursor = c;
+        if (!c.r) {
+            /* all of it is on the ring */
+            list_delete(&req->node);
         }
-        len -= len_tohandle;
-        next_pa += PAGE_SIZE;
     }
-#endif
 
-    /* set up the descriptor pointing to the response */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-    desc->addr = bdev->blk_response_phys;
-    desc->len = 1;
-    desc->flags = VRING_DESC_F_WRITE;
+    return started;
+}
 
-    /* submit the transfer */
-    virtio_submit_chain(dev, 0, i);
+static status_t virtio_bdev_submit_request(struct bdev *bdev, bio_request_t *req)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    LTRACEF("dev %p, req %p, op %u, block 0x%x, count %u\n", bdev, req, req->op, req->block, req->count);
 
-    /* kick it off */
-    virtio_kick(dev, 0);
+    req->pending = 0;
+    req->result = 0;
 
-    /* wait for the transfer to complete */
-    event_wait(&bdev->io_event);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->lock, state);
 
-    LTRACEF("status 0x%hhx\n", bdev->blk_response);
+    list_add_tail(&dev->requests, &req->node);
+    if (virtio_block_start_requests(dev))
+        virtio_block_kick_locked(dev);
 
-    mutex_release(&bdev->lock);
+    spin_unlock_irqrestore(&dev->lock, state);
 
-    return len;
+    return NO_ERROR;
 }
 
-static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
+#if LK_DEBUGLEVEL > 0
+/* queue more single block reads than the ring has room for while plugged, then
+ * check them against one plain read of the same blocks */
+static status_t virtio_block_test_plugged(struct virtio_block_dev *bdev)
 {
-    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
-
-    LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
+    struct virtio_device *dev = bdev->dev;
+    size_t block_size = bdev->bdev.block_size;
+    uint count = MIN((bnum_t)VIRTIO_BLK_RING_LEN, bdev->bdev.block_count);
+
+    uint8_t *buf = memalign(PAGE_SIZE, count * block_size);
+    uint8_t *check = memalign(PAGE_SIZE, count * block_size);
+    if (!buf || !check) {
+        free(buf);
+        free(check);
+        return ERR_NO_MEMORY;
+    }
 
-    if (virtio_block_read_write(dev->dev, buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, false) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
+    struct virtio_block_waiter w;
+    event_init(&w.event, false, 0);
+    w.pending = 1;
+    w.err = NO_ERROR;
+
+    printf("queueing %u plugged reads on a ring of %u descriptors\n", count, VIRTIO_BLK_RING_LEN);
+
+    virtio_block_plug(dev);
+    for (uint i = 0; i < count; i++) {
+        atomic_add(&w.pending, 1);
+        status_t err = virtio_block_submit(dev, buf + i * block_size, (off_t)i * block_size, block_size,
+                                           false, &virtio_block_sync_callback, &w);
+        if (err < 0) {
+            atomic_add(&w.pending, -1);
+            w.err = err;
+            break;
+        }
     }
+    virtio_block_unplug(dev);
+
+    if (atomic_add(&w.pending, -1) != 1)
+        event_wait(&w.event);
+    event_destroy(&w.event);
+
+    status_t err = w.err;
+    if (err >= 0)
+        err = virtio_block_read_write(dev, check, 0, count * block_size, false);
+    if (err >= 0 && memcmp(buf, check, count * block_size) != 0) {
+        printf("plugged reads don't match\n");
+        err = ERR_IO;
+    }
+
+    free(buf);
+    free(check);
+
+    return err < 0 ? err : NO_ERROR;
 }
 
-static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+static int cmd_virtio_blk(int argc, const cmd_args *argv)
 {
-    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+    if (argc < 3) {
+        printf("not enough arguments\n");
+usage:
+        printf("usage:\n");
+        printf("%s test <device>\n", argv[0].str);
+        return ERR_GENERIC;
+    }
 
-    LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
+    if (strcmp(argv[1].str, "test"))
+        goto usage;
 
-    if (virtio_block_read_write(dev->dev, (void *)buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, true) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
+    bdev_t *bdev = bio_open(argv[2].str);
+    if (!bdev) {
+        printf("no device %s\n", argv[2].str);
+        return ERR_NOT_FOUND;
     }
+
+    status_t err = ERR_NOT_SUPPORTED;
+    if (bdev->submit_request == &virtio_bdev_submit_request)
+        err = virtio_block_test_plugged(containerof(bdev, struct virtio_block_dev, bdev));
+    else
+        printf("%s is not a virtio block device\n", argv[2].str);
+
+    bio_close(bdev);
+
+    printf("%s\n", err < 0 ? "FAILED" : "PASSED");
+
+    return err;
 }
 
+STATIC_COMMAND_START
+STATIC_COMMAND("virtio_blk", "virtio block tests", &cmd_virtio_blk)
+STATIC_COMMAND_END(virtio_blk);
+#endif
@@ -32,7 +32,7 @@
  * returns number of devices found */
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[]);
 
-#define MAX_VIRTIO_RINGS 4
+#define MAX_VIRTIO_RINGS 24
 
 struct virtio_mmio_config;
 
@@ -50,14 +50,21 @@ struct virtio_device {
     enum handler_return (*irq_driver_callback)(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
     enum handler_return (*config_change_callback)(struct virtio_device *dev);
 
+    /* called once per interrupt for rings in polled_rings_bitmap, instead of
+     * irq_driver_callback per used element. the driver drains those rings itself
+     * with virtio_next_used() */
+    enum handler_return (*irq_poll_callback)(struct virtio_device *dev, uint ring);
+
     /* virtio rings */
     uint32_t active_rings_bitmap;
+    uint32_t polled_rings_bitmap;
     struct vring ring[MAX_VIRTIO_RINGS];
 };
 
 void virtio_reset_device(struct virtio_device *dev);
 void virtio_status_acknowledge_driver(struct virtio_device *dev);
 void virtio_status_driver_ok(struct virtio_device *dev);
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features);
 
 /* api used by devices to interact with the virtio bus */
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len) __NONNULL();
@@ -84,4 +91,16 @@ void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t de
 
 void virtio_kick(struct virtio_device *dev, uint ring_idnex);
 
+/* kick, unless the device has set VRING_USED_F_NO_NOTIFY on the ring */
+void virtio_kick_if_needed(struct virtio_device *dev, uint ring_index);
+
+/* pop the next element off a polled ring's used list, NULL if there is none */
+const struct vring_used_elem *virtio_next_used(struct virtio_device *dev, uint ring_index);
+
+/* ask the device not to interrupt when it returns buffers on a ring, or to start again.
+ * enabling returns true if buffers were returned in the meantime, which won't raise
+ * an interrupt of their own */
+void virtio_ring_disable_interrupt(struct virtio_device *dev, uint ring_index);
+bool virtio_ring_enable_interrupt(struct virtio_device *dev, uint ring_index);
+
 
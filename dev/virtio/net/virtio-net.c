@@ -31,10 +31,15 @@
 #include <err.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
 #include <kernel/spinlock.h>
 #include <kernel/vm.h>
+#include <lib/console.h>
+#include <lk/init.h>
 #include <lib/pktbuf.h>
 #include <lib/minip.h>
+#include <platform.h>
 
 #define LOCAL_TRACE 0
 
@@ -54,6 +59,12 @@ struct virtio_net_hdr {
     uint16_t num_buffers; // unused in tx
 } __PACKED;
 
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM         (1<<0)
+#define VIRTIO_NET_HDR_F_DATA_VALID         (1<<1)
+
+#define VIRTIO_NET_HDR_GSO_NONE             0
+#define VIRTIO_NET_HDR_GSO_TCPV4            1
+
 #define VIRTIO_NET_F_CSUM                   (1<<0)
 #define VIRTIO_NET_F_GUEST_CSUM             (1<<1)
 #define VIRTIO_NET_F_CTRL_GUEST_OFFLOADS    (1<<2)
@@ -79,38 +90,122 @@ struct virtio_net_hdr {
 #define VIRTIO_NET_S_LINK_UP                (1<<0)
 #define VIRTIO_NET_S_ANNOUNCE               (1<<1)
 
-#define TX_RING_SIZE 16
-#define RX_RING_SIZE 16
+#define VIRTIO_NET_CTRL_MQ                  4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET     0
+
+#define VIRTIO_NET_OK                       0
+
+/* big enough for a few 64k tso segments at a fragment per pktbuf */
+#define TX_RING_SIZE 256
+#define RX_RING_SIZE 32
+#define CTRL_RING_SIZE 8
+
+/* most packets the rx worker handles before refilling the ring and letting others run */
+#define RX_POLL_BUDGET 16
+
+/* fewest rx buffers posted to a queue, the rest of the ring's worth is shared between queues */
+#define RX_MIN_BUFFERS 8
+
+/* queue pair n uses rings 2n (rx) and 2n+1 (tx), the control ring follows the last pair */
+#define RING_RX(q) ((q) * 2)
+#define RING_TX(q) ((q) * 2 + 1)
 
-#define RING_RX 0
-#define RING_TX 1
+/* one queue pair per cpu, up to a limit */
+#if SMP_MAX_CPUS > 8
+#define VIRTIO_NET_MAX_QUEUE_PAIRS 8
+#else
+#define VIRTIO_NET_MAX_QUEUE_PAIRS SMP_MAX_CPUS
+#endif
 
 #define VIRTIO_NET_MSS 1514
 
-struct virtio_net_dev {
-    struct virtio_device *dev;
-    bool started;
+/* features we know how to use */
+#define VIRTIO_NET_SUPPORTED_FEATURES \
+    (VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_MAC | VIRTIO_NET_F_HOST_TSO4)
 
-    struct virtio_net_config *config;
+struct virtio_net_dev;
+
+/* a rx/tx queue pair, each served by one cpu */
+struct virtio_net_queue {
+    struct virtio_net_dev *ndev;
+    uint index;
 
-    spin_lock_t lock;
+    /* protects the tx ring. the rx ring is polled and belongs to the rx worker */
+    spin_lock_t tx_lock;
     event_t rx_event;
+    thread_t *rx_thread;
 
-    /* list of active tx/rx packets to be freed at irq time */
+    /* list of active tx packets to be freed at irq time */
     pktbuf_t *pending_tx_packet[TX_RING_SIZE];
+
+    /* buffers posted to the rx ring */
     pktbuf_t *pending_rx_packet[RX_RING_SIZE];
 
     uint tx_pending_count;
-    struct list_node completed_rx_queue;
+
+    struct {
+        uint64_t rx_packets;
+        uint64_t rx_polls;      // passes over the rx ring
+        uint64_t rx_irqs;       // interrupts that started a round of polling
+        uint64_t rx_kicks;      // refill notifications
+        uint64_t tx_packets;
+        uint64_t tx_tso_packets;  // of which were segmented by the device
+        uint64_t tx_kicks;
+    } stats;
+};
+
+/* a control queue command, laid out so each part gets its own descriptor */
+struct virtio_net_ctrl {
+    uint8_t class;
+    uint8_t cmd;
+    uint8_t data[6];
+    uint8_t ack;
+};
+
+struct virtio_net_dev {
+    struct virtio_device *dev;
+    bool started;
+    uint32_t features;
+
+    struct virtio_net_config *config;
+
+    uint queue_count;
+    struct virtio_net_queue queues[VIRTIO_NET_MAX_QUEUE_PAIRS];
+
+    /* pairs are switched on one at a time as cpus come up to serve them. tx only
+     * spreads over the first queues_on, which only ever grows */
+    mutex_t queue_lock;
+    volatile uint queues_on;
+    mp_cpu_mask_t queue_cpus;
+    uint queue_cpu[VIRTIO_NET_MAX_QUEUE_PAIRS];
+
+    /* control queue, only set up when multiqueue is negotiated. one command at a
+     * time, whose chain may still be with the device if it timed out */
+    uint ctrl_ring;
+    mutex_t ctrl_lock;
+    event_t ctrl_event;
+    struct virtio_net_ctrl *ctrl;
+    bool ctrl_pending;
+    uint16_t ctrl_head;
 };
 
 static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
+static enum handler_return virtio_net_irq_poll_callback(struct virtio_device *dev, uint ring);
 static int virtio_net_rx_worker(void *arg);
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p);
+static status_t virtio_net_queue_rx(struct virtio_net_queue *q, pktbuf_t *p);
 
 // XXX remove need for this
 static struct virtio_net_dev *the_ndev;
 
+static paddr_t virtio_net_va_to_pa(void *va)
+{
+#if WITH_KERNEL_VM
+    return vaddr_to_paddr(va);
+#else
+    return (paddr_t)va;
+#endif
+}
+
 static void dump_feature_bits(uint32_t feature)
 {
     printf("virtio-net host features (0x%x):", feature);
@@ -138,6 +233,7 @@ static void dump_feature_bits(uint32_t feature)
     printf("\n");
 }
 
+
 status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
 {
     LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
@@ -150,55 +246,319 @@ status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
     ndev->dev = dev;
     dev->priv = ndev;
     ndev->started = false;
-
-    ndev->lock = SPIN_LOCK_INITIAL_VALUE;
-    event_init(&ndev->rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-    list_initialize(&ndev->completed_rx_queue);
+    mutex_init(&ndev->queue_lock);
 
     ndev->config = (struct virtio_net_config *)dev->config_ptr;
 
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
+    /* ack the features we can make use of */
     dump_feature_bits(host_features);
+    ndev->features = host_features & VIRTIO_NET_SUPPORTED_FEATURES;
+
+    /* segmentation offload depends on the device finishing the checksums */
+    if ((ndev->features & VIRTIO_NET_F_CSUM) == 0)
+        ndev->features &= ~VIRTIO_NET_F_HOST_TSO4;
+
+    /* multiqueue needs the control queue to switch the extra pairs on, and the
+     * control queue sits after the last pair the device has */
+    ndev->queue_count = 1;
+    uint32_t mq = VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ;
+    if (VIRTIO_NET_MAX_QUEUE_PAIRS > 1 && (host_features & mq) == mq) {
+        uint max_pairs = ndev->config->max_virtqueue_pairs;
+        if (max_pairs > 1 && max_pairs * 2 + 1 <= MAX_VIRTIO_RINGS) {
+            ndev->features |= mq;
+            ndev->queue_count = MIN(max_pairs, (uint)VIRTIO_NET_MAX_QUEUE_PAIRS);
+            ndev->ctrl_ring = max_pairs * 2;
+        }
+    }
+    virtio_set_guest_features(dev, ndev->features);
 
-    /* set our irq handler */
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        struct virtio_net_queue *q = &ndev->queues[i];
+
+        q->ndev = ndev;
+        q->index = i;
+        q->tx_lock = SPIN_LOCK_INITIAL_VALUE;
+        event_init(&q->rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    }
+
+    /* set our irq handlers. tx completions are reaped at irq time, the rx rings
+     * are drained by their rx workers with interrupts held off while they run */
     dev->irq_driver_callback = &virtio_net_irq_driver_callback;
+    dev->irq_poll_callback = &virtio_net_irq_poll_callback;
+    for (uint i = 0; i < ndev->queue_count; i++)
+        dev->polled_rings_bitmap |= (1 << RING_RX(i));
 
     /* set DRIVER_OK */
     virtio_status_driver_ok(dev);
 
-    /* allocate a pair of virtio rings */
-    virtio_alloc_ring(dev, RING_RX, RX_RING_SIZE); // rx
-    virtio_alloc_ring(dev, RING_TX, TX_RING_SIZE); // tx
+    /* allocate a pair of virtio rings per queue */
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        virtio_alloc_ring(dev, RING_RX(i), RX_RING_SIZE); // rx
+        virtio_alloc_ring(dev, RING_TX(i), TX_RING_SIZE); // tx
+    }
+
+    if (ndev->features & VIRTIO_NET_F_CTRL_VQ) {
+        mutex_init(&ndev->ctrl_lock);
+        event_init(&ndev->ctrl_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+        /* small and aligned enough that it never straddles a page */
+        STATIC_ASSERT(sizeof(struct virtio_net_ctrl) <= 16);
+        ndev->ctrl = memalign(16, sizeof(struct virtio_net_ctrl));
+        if (!ndev->ctrl)
+            return ERR_NO_MEMORY;
+        dev->polled_rings_bitmap |= (1 << ndev->ctrl_ring);
+        virtio_alloc_ring(dev, ndev->ctrl_ring, CTRL_RING_SIZE);
+    }
 
     the_ndev = ndev;
 
     return NO_ERROR;
 }
 
+/* wait for the device to hand back the outstanding control command, and free its chain */
+static status_t virtio_net_ctrl_wait(struct virtio_net_dev *ndev)
+{
+    struct virtio_device *vdev = ndev->dev;
+
+    DEBUG_ASSERT(is_mutex_held(&ndev->ctrl_lock));
+    DEBUG_ASSERT(ndev->ctrl_pending);
+
+    /* the irq wakes us up, but keep looking in case it isn't unmasked yet */
+    const struct vring_used_elem *e;
+    lk_time_t start = current_time();
+    while (!(e = virtio_next_used(vdev, ndev->ctrl_ring))) {
+        if (current_time() - start > 1000)
+            return ERR_TIMED_OUT;
+        event_wait_timeout(&ndev->ctrl_event, 10);
+    }
+
+    DEBUG_ASSERT(e->id == ndev->ctrl_head);
+
+    /* give the chain back */
+    for (uint16_t i = e->id;;) {
+        struct vring_desc *desc = virtio_desc_index_to_desc(vdev, ndev->ctrl_ring, i);
+        uint16_t next = desc->next;
+        bool more = desc->flags & VRING_DESC_F_NEXT;
+        virtio_free_desc(vdev, ndev->ctrl_ring, i);
+        if (!more)
+            break;
+        i = next;
+    }
+    ndev->ctrl_pending = false;
+
+    return NO_ERROR;
+}
+
+/* run a command on the control queue and wait for the device to answer it */
+static status_t virtio_net_ctrl_cmd(struct virtio_net_dev *ndev, uint8_t class, uint8_t cmd,
+                                    const void *data, size_t len)
+{
+    struct virtio_device *vdev = ndev->dev;
+    struct virtio_net_ctrl *c = ndev->ctrl;
+    status_t err = NO_ERROR;
+
+    DEBUG_ASSERT(c);
+    DEBUG_ASSERT(len <= sizeof(c->data));
+
+    mutex_acquire(&ndev->ctrl_lock);
+
+    /* a command that timed out earlier has to be answered before the next one can go */
+    if (ndev->ctrl_pending) {
+        err = virtio_net_ctrl_wait(ndev);
+        if (err < 0)
+            goto out;
+    }
+
+    c->class = class;
+    c->cmd = cmd;
+    memcpy(c->data, data, len);
+    c->ack = 0xff;
+
+    uint16_t i;
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, ndev->ctrl_ring, 3, &i);
+    DEBUG_ASSERT(desc);
+
+    desc->addr = virtio_net_va_to_pa(&c->class);
+    desc->len = 2;
+
+    desc = virtio_desc_index_to_desc(vdev, ndev->ctrl_ring, desc->next);
+    desc->addr = virtio_net_va_to_pa(c->data);
+    desc->len = len;
+
+    desc = virtio_desc_index_to_desc(vdev, ndev->ctrl_ring, desc->next);
+    desc->addr = virtio_net_va_to_pa(&c->ack);
+    desc->len = 1;
+    desc->flags = VRING_DESC_F_WRITE;
+
+    ndev->ctrl_pending = true;
+    ndev->ctrl_head = i;
+    virtio_submit_chain(vdev, ndev->ctrl_ring, i);
+    virtio_kick(vdev, ndev->ctrl_ring);
+
+    /* if it times out the chain stays with the device, the next command collects it */
+    err = virtio_net_ctrl_wait(ndev);
+    if (err < 0)
+        goto out;
+
+    if (c->ack != VIRTIO_NET_OK)
+        err = ERR_IO;
+
+out:
+    mutex_release(&ndev->ctrl_lock);
+
+    return err;
+}
+
+/* switch on another queue pair for a cpu that has come up, and move its rx worker there */
+static void virtio_net_add_queue_cpu(struct virtio_net_dev *ndev, uint cpu)
+{
+    DEBUG_ASSERT(is_mutex_held(&ndev->queue_lock));
+
+    uint i = ndev->queues_on;
+    if (i == ndev->queue_count || (ndev->queue_cpus & (1U << cpu)))
+        return;
+
+    uint16_t pairs = i + 1;
+    status_t err = virtio_net_ctrl_cmd(ndev, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                                       &pairs, sizeof(pairs));
+    if (err < 0) {
+        TRACEF("failed to enable %u queue pairs, err %d\n", pairs, err);
+        return;
+    }
+
+    ndev->queue_cpu[i] = cpu;
+    ndev->queue_cpus |= 1U << cpu;
+
+    /* the first worker runs anywhere until there's a second */
+    if (i == 1)
+        thread_set_pinned_cpu(ndev->queues[0].rx_thread, ndev->queue_cpu[0]);
+    thread_set_pinned_cpu(ndev->queues[i].rx_thread, cpu);
+
+    ndev->queues_on = pairs;
+}
+
 status_t virtio_net_start(void)
 {
-    if (the_ndev->started)
+    struct virtio_net_dev *ndev = the_ndev;
+
+    mutex_acquire(&ndev->queue_lock);
+
+    if (ndev->started) {
+        mutex_release(&ndev->queue_lock);
         return ERR_ALREADY_STARTED;
+    }
 
-    the_ndev->started = true;
+    ndev->started = true;
 
-    /* start the rx worker thread */
-    thread_resume(thread_create("virtio_net_rx", &virtio_net_rx_worker, (void *)the_ndev, HIGH_PRIORITY, DEFAULT_STACK_SIZE));
+    uint rx_buffers = MAX((RX_RING_SIZE - 1) / ndev->queue_count, (uint)RX_MIN_BUFFERS);
 
-    /* queue up a bunch of rxes */
-    for (uint i = 0; i < RX_RING_SIZE - 1; i++) {
-        pktbuf_t *p = pktbuf_alloc();
-        if (p) {
-            virtio_net_queue_rx(the_ndev, p);
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        struct virtio_net_queue *q = &ndev->queues[i];
+
+        /* queue up a bunch of rxes before the rx worker takes over the ring */
+        pktbuf_t *pkts[RX_RING_SIZE];
+        size_t count = pktbuf_alloc_n(pkts, rx_buffers);
+        for (size_t j = 0; j < count; j++) {
+            virtio_net_queue_rx(q, pkts[j]);
+        }
+        virtio_kick(ndev->dev, RING_RX(i));
+
+        /* start the rx worker thread. it moves to the cpu that owns its queue once
+         * the queue is switched on */
+        char name[32];
+        snprintf(name, sizeof(name), "virtio_net_rx%u", i);
+        q->rx_thread = thread_create(name, &virtio_net_rx_worker, (void *)q, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(q->rx_thread);
+    }
+
+    /* the device starts out on the first pair, which goes to this cpu. the cpus that
+     * are up already get theirs now, the rest as they come up */
+    uint cpu = arch_curr_cpu_num();
+    ndev->queue_cpu[0] = cpu;
+    ndev->queue_cpus = 1U << cpu;
+    ndev->queues_on = 1;
+    if (ndev->queue_count > 1) {
+        for (cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+            if (mp_is_cpu_active(cpu))
+                virtio_net_add_queue_cpu(ndev, cpu);
         }
     }
 
+    mutex_release(&ndev->queue_lock);
+
     return NO_ERROR;
 }
 
+#if WITH_SMP
+/* runs on each secondary cpu once it is scheduling */
+static void virtio_net_cpu_up(uint level)
+{
+    struct virtio_net_dev *ndev = the_ndev;
+
+    if (!ndev || ndev->queue_count == 1)
+        return;
+
+    /* before the start the cpu is picked up there */
+    mutex_acquire(&ndev->queue_lock);
+    if (ndev->started)
+        virtio_net_add_queue_cpu(ndev, arch_curr_cpu_num());
+    mutex_release(&ndev->queue_lock);
+}
+
+LK_INIT_HOOK_FLAGS(virtio_net_cpu_up, virtio_net_cpu_up, LK_INIT_LEVEL_APPS, LK_INIT_FLAG_SECONDARY_CPUS);
+#endif
+
+/* hash the addresses and ports of an outgoing ipv4 packet, so every packet of a flow
+ * leaves through the same queue and, with the device steering its replies after it,
+ * comes back on the same one */
+static bool virtio_net_flow_hash(const pktbuf_t *p, uint32_t *hash)
+{
+    const uint8_t *eth = p->data;
+
+    if (p->dlen < 14 + 20 || eth[12] != 0x08 || eth[13] != 0x00)
+        return false;
+
+    const uint8_t *ip = eth + 14;
+    uint ihl = (ip[0] & 0xf) * 4;
+    uint8_t proto = ip[9];
+
+    uint32_t addrs[2];
+    memcpy(addrs, ip + 12, sizeof(addrs));
+    uint32_t h = addrs[0] ^ (addrs[1] * 0x9e3779b1) ^ proto;
+
+    /* tcp and udp */
+    if ((proto == 6 || proto == 17) && p->dlen >= 14 + ihl + 4) {
+        uint32_t ports;
+        memcpy(&ports, ip + ihl, sizeof(ports));
+        h ^= ports * 0x85ebca6b;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    *hash = h;
+    return true;
+}
+
+static struct virtio_net_queue *virtio_net_select_tx_queue(struct virtio_net_dev *ndev, const pktbuf_t *p)
+{
+    uint queues = ndev->queues_on;
+    if (queues <= 1)
+        return &ndev->queues[0];
+
+    /* anything that isn't part of a flow goes out on the sending cpu's queue */
+    uint32_t hash;
+    if (!virtio_net_flow_hash(p, &hash))
+        hash = arch_curr_cpu_num();
+
+    return &ndev->queues[hash % queues];
+}
+
 static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t *p2)
 {
     struct virtio_device *vdev = ndev->dev;
@@ -208,6 +568,14 @@ static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t
 
     DEBUG_ASSERT(ndev);
 
+    struct virtio_net_queue *q = virtio_net_select_tx_queue(ndev, p2);
+    uint ring = RING_TX(q->index);
+
+    /* one descriptor for the virtio header plus one per fragment of the packet */
+    uint desc_count = 2;
+    for (pktbuf_t *f = p2; (f->flags & PKTBUF_FLAG_EOF) == 0; f = f->next)
+        desc_count++;
+
     p = pktbuf_alloc();
     if (!p)
         return ERR_NO_MEMORY;
@@ -216,52 +584,81 @@ static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t
     struct virtio_net_hdr *hdr = pktbuf_append(p, sizeof(struct virtio_net_hdr) - 2);
     memset(hdr, 0, p->dlen);
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&ndev->lock, state);
+    /* have the device fill in the checksum the stack left for it */
+    if (p2->flags & PKTBUF_FLAG_CKSUM_PARTIAL) {
+        DEBUG_ASSERT(ndev->features & VIRTIO_NET_F_CSUM);
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = p2->csum_start - (p2->data - p2->buffer);
+        hdr->csum_offset = p2->csum_offset;
+    }
+
+    /* and cut an oversized tcp segment into gso_size pieces, copying the headers up to
+     * the end of the tcp header onto each */
+    bool tso = p2->flags & PKTBUF_FLAG_GSO_TCPV4;
+    if (tso) {
+        DEBUG_ASSERT(ndev->features & VIRTIO_NET_F_HOST_TSO4);
+        DEBUG_ASSERT(p2->flags & PKTBUF_FLAG_CKSUM_PARTIAL);
+        const uint8_t *tcp = p2->data + hdr->csum_start;
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->gso_size = p2->gso_size;
+        hdr->hdr_len = hdr->csum_start + (tcp[12] >> 4) * 4;
+    }
 
-    /* only queue if we have enough tx descriptors */
-    if (ndev->tx_pending_count + 2 > TX_RING_SIZE)
-        goto nodesc;
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->tx_lock, state);
 
-    /* allocate a chain of descriptors for our transfer */
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX, 2, &i);
+    /* allocate a chain of descriptors for our transfer, if we have enough tx descriptors */
+    struct vring_desc *desc = NULL;
+    if (q->tx_pending_count + desc_count <= TX_RING_SIZE)
+        desc = virtio_alloc_desc_chain(vdev, ring, desc_count, &i);
     if (!desc) {
-        spin_unlock_irqrestore(&ndev->lock, state);
+        spin_unlock_irqrestore(&q->tx_lock, state);
 
-nodesc:
-        TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", ndev->tx_pending_count);
+        TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", q->tx_pending_count);
         pktbuf_free(p, true);
 
         return ERR_NO_MEMORY;
     }
 
-    ndev->tx_pending_count += 2;
+    q->tx_pending_count += desc_count;
 
-    /* save a pointer to our pktbufs for the irq handler to free */
+    /* save a pointer to our pktbufs for the irq handler to free. freeing p2
+     * releases any fragments chained to it, so their slots stay empty */
     LTRACEF("saving pointer to pkt in index %u and %u\n", i, desc->next);
-    DEBUG_ASSERT(ndev->pending_tx_packet[i] == NULL);
-    DEBUG_ASSERT(ndev->pending_tx_packet[desc->next] == NULL);
-    ndev->pending_tx_packet[i] = p;
-    ndev->pending_tx_packet[desc->next] = p2;
+    DEBUG_ASSERT(q->pending_tx_packet[i] == NULL);
+    DEBUG_ASSERT(q->pending_tx_packet[desc->next] == NULL);
+    q->pending_tx_packet[i] = p;
+    q->pending_tx_packet[desc->next] = p2;
 
     /* set up the descriptor pointing to the header */
     desc->addr = pktbuf_data_phys(p);
     desc->len = p->dlen;
     desc->flags |= VRING_DESC_F_NEXT;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(vdev, RING_TX, desc->next);
-    desc->addr = pktbuf_data_phys(p2);
-    desc->len = p2->dlen;
-    desc->flags = 0;
+    /* set up a descriptor for each fragment of the packet */
+    for (pktbuf_t *f = p2; f; f = (f->flags & PKTBUF_FLAG_EOF) ? NULL : f->next) {
+        desc = virtio_desc_index_to_desc(vdev, ring, desc->next);
+        desc->addr = pktbuf_data_phys(f);
+        desc->len = f->dlen;
+        if (f->flags & PKTBUF_FLAG_EOF) {
+            desc->flags = 0;
+        } else {
+            desc->flags |= VRING_DESC_F_NEXT;
+        }
+    }
 
     /* submit the transfer */
-    virtio_submit_chain(vdev, RING_TX, i);
+    virtio_submit_chain(vdev, ring, i);
+    q->stats.tx_packets++;
+    if (tso)
+        q->stats.tx_tso_packets++;
 
-    /* kick it off */
-    virtio_kick(vdev, RING_TX);
+    /* kick it off, if the device isn't already working through the ring */
+    if ((vdev->ring[ring].used->flags & VRING_USED_F_NO_NOTIFY) == 0)
+        q->stats.tx_kicks++;
+    virtio_kick_if_needed(vdev, ring);
 
-    spin_unlock_irqrestore(&ndev->lock, state);
+    spin_unlock_irqrestore(&q->tx_lock, state);
 
     return NO_ERROR;
 }
@@ -290,31 +687,31 @@ static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, const void *buf
     return err;
 }
 
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
+/* post a buffer to the rx ring. the caller notifies the device once it has posted
+ * everything it has */
+static status_t virtio_net_queue_rx(struct virtio_net_queue *q, pktbuf_t *p)
 {
-    struct virtio_device *vdev = ndev->dev;
+    struct virtio_device *vdev = q->ndev->dev;
 
-    DEBUG_ASSERT(ndev);
+    DEBUG_ASSERT(q);
     DEBUG_ASSERT(p);
 
     /* point our header to the base of the pktbuf */
     p->data = p->buffer;
+    p->flags &= ~(PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD);
     struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)p->data;
     memset(hdr, 0, sizeof(struct virtio_net_hdr) - 2);
 
     p->dlen = sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS;
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&ndev->lock, state);
-
     /* allocate a chain of descriptors for our transfer */
     uint16_t i;
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_RX, 1, &i);
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_RX(q->index), 1, &i);
     DEBUG_ASSERT(desc); /* shouldn't be possible not to have a descriptor ready */
 
     /* save a pointer to our pktbufs for the irq handler to use */
-    DEBUG_ASSERT(ndev->pending_rx_packet[i] == NULL);
-    ndev->pending_rx_packet[i] = p;
+    DEBUG_ASSERT(q->pending_rx_packet[i] == NULL);
+    q->pending_rx_packet[i] = p;
 
     /* set up the descriptor pointing to the header */
     desc->addr = pktbuf_data_phys(p);
@@ -322,12 +719,7 @@ static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
     desc->flags = VRING_DESC_F_WRITE;
 
     /* submit the transfer */
-    virtio_submit_chain(vdev, RING_RX, i);
-
-    /* kick it off */
-    virtio_kick(vdev, RING_RX);
-
-    spin_unlock_irqrestore(&ndev->lock, state);
+    virtio_submit_chain(vdev, RING_RX(q->index), i);
 
     return NO_ERROR;
 }
@@ -338,7 +730,11 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
-    spin_lock(&ndev->lock);
+    /* only the tx rings complete here, rx is polled */
+    DEBUG_ASSERT(ring % 2 == 1 && ring / 2 < ndev->queue_count);
+    struct virtio_net_queue *q = &ndev->queues[ring / 2];
+
+    spin_lock(&q->tx_lock);
 
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
@@ -355,32 +751,14 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
 
         virtio_free_desc(dev, ring, i);
 
-        if (ring == RING_RX) {
-            /* put the freed rx buffer in a queue */
-            pktbuf_t *p = ndev->pending_rx_packet[i];
-            ndev->pending_rx_packet[i] = NULL;
-
-            DEBUG_ASSERT(p);
-            LTRACEF("rx pktbuf %p filled\n", p);
-
-            /* trim the pktbuf according to the written length in the used element descriptor */
-            if (e->len > (sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS)) {
-                TRACEF("bad used len on RX %u\n", e->len);
-                p->dlen = 0;
-            } else {
-                p->dlen = e->len;
-            }
-
-            list_add_tail(&ndev->completed_rx_queue, &p->list);
-        } else { // ring == RING_TX
-            /* free the pktbuf associated with the tx packet we just consumed */
-            pktbuf_t *p = ndev->pending_tx_packet[i];
-            ndev->pending_tx_packet[i] = NULL;
-            ndev->tx_pending_count--;
+        /* free the pktbuf associated with the tx packet we just consumed,
+         * descriptors for chained fragments have none of their own */
+        pktbuf_t *p = q->pending_tx_packet[i];
+        q->pending_tx_packet[i] = NULL;
+        q->tx_pending_count--;
 
-            DEBUG_ASSERT(p);
+        if (p) {
             LTRACEF("freeing pktbuf %p\n", p);
-
             pktbuf_free(p, false);
         }
 
@@ -389,51 +767,130 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
         i = next;
     }
 
-    spin_unlock(&ndev->lock);
+    spin_unlock(&q->tx_lock);
+
+    return INT_RESCHEDULE;
+}
+
+static enum handler_return virtio_net_irq_poll_callback(struct virtio_device *dev, uint ring)
+{
+    struct virtio_net_dev *ndev = (struct virtio_net_dev *)dev->priv;
 
-    /* if rx ring, signal our event */
-    if (ring == 0) {
-        event_signal(&ndev->rx_event, false);
+    if (ndev->ctrl && ring == ndev->ctrl_ring) {
+        event_signal(&ndev->ctrl_event, false);
+        return INT_RESCHEDULE;
     }
 
+    DEBUG_ASSERT(ring % 2 == 0 && ring / 2 < ndev->queue_count);
+    struct virtio_net_queue *q = &ndev->queues[ring / 2];
+
+    /* hold off further rx interrupts until the worker has caught up with the ring */
+    virtio_ring_disable_interrupt(dev, ring);
+    q->stats.rx_irqs++;
+
+    event_signal(&q->rx_event, false);
+
     return INT_RESCHEDULE;
 }
 
-static int virtio_net_rx_worker(void *arg)
+/* receive up to budget packets off the rx ring, then hand all their buffers back
+ * to the device behind a single notification. returns the number received */
+static uint virtio_net_rx_poll(struct virtio_net_queue *q, uint budget)
 {
-    struct virtio_net_dev *ndev = (struct virtio_net_dev *)arg;
+    struct virtio_net_dev *ndev = q->ndev;
+    struct virtio_device *vdev = ndev->dev;
+    uint ring = RING_RX(q->index);
+    const struct vring_used_elem *e;
+    uint count = 0;
+
+    while (count < budget && (e = virtio_next_used(vdev, ring))) {
+        /* rx chains are a single descriptor */
+        uint16_t i = e->id;
+        pktbuf_t *p = q->pending_rx_packet[i];
+        q->pending_rx_packet[i] = NULL;
+        virtio_free_desc(vdev, ring, i);
+
+        DEBUG_ASSERT(p);
+        LTRACEF("rx pktbuf %p filled, len %u\n", p, e->len);
+
+        /* trim the pktbuf according to the written length in the used element descriptor */
+        if (e->len > (sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS)) {
+            TRACEF("bad used len on RX %u\n", e->len);
+            p->dlen = 0;
+        } else {
+            p->dlen = e->len;
+        }
 
-    for (;;) {
-        event_wait(&ndev->rx_event);
+        /* process our packet */
+        struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
+        if (hdr) {
+            /* the device either checked the checksum or the packet never left the
+             * host and the checksum was never filled in. either way, don't check it */
+            if ((ndev->features & VIRTIO_NET_F_GUEST_CSUM) &&
+                    (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID))) {
+                p->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
+            }
 
-        /* pull some packets from the received queue */
-        for (;;) {
-            spin_lock_saved_state_t state;
-            spin_lock_irqsave(&ndev->lock, state);
+            /* call up into the stack */
+            minip_rx_driver_callback(p);
+        }
 
-            pktbuf_t *p = list_remove_head_type(&ndev->completed_rx_queue, pktbuf_t, list);
+        /* put the buffer straight back on the ring */
+        virtio_net_queue_rx(q, p);
+        count++;
+    }
 
-            spin_unlock_irqrestore(&ndev->lock, state);
+    q->stats.rx_polls++;
+    if (count > 0) {
+        q->stats.rx_packets += count;
+        if ((vdev->ring[ring].used->flags & VRING_USED_F_NO_NOTIFY) == 0)
+            q->stats.rx_kicks++;
+        virtio_kick_if_needed(vdev, ring);
+    }
+
+    return count;
+}
 
-            if (!p)
-                break; /* nothing left in the queue, go back to waiting */
+static int virtio_net_rx_worker(void *arg)
+{
+    struct virtio_net_queue *q = (struct virtio_net_queue *)arg;
+    struct virtio_device *vdev = q->ndev->dev;
+    uint ring = RING_RX(q->index);
 
-            LTRACEF("got packet len %u\n", p->dlen);
+    for (;;) {
+        event_wait(&q->rx_event);
 
-            /* process our packet */
-            struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
-            if (hdr) {
-                /* call up into the stack */
-                minip_rx_driver_callback(p);
+        /* rx interrupts are off, poll the ring until it runs dry */
+        for (;;) {
+            if (virtio_net_rx_poll(q, RX_POLL_BUDGET) == RX_POLL_BUDGET) {
+                /* there's likely more waiting, let anyone else at this priority run first */
+                thread_yield();
+                continue;
             }
 
-            /* requeue the pktbuf in the rx queue */
-            virtio_net_queue_rx(ndev, p);
+            /* caught up, turn interrupts back on. anything that slipped in before
+             * they were back on won't raise one, so go around again for it */
+            if (!virtio_ring_enable_interrupt(vdev, ring))
+                break;
+            virtio_ring_disable_interrupt(vdev, ring);
         }
     }
     return 0;
 }
 
+uint32_t virtio_net_minip_tx_features(void)
+{
+    /* multi part packets map directly onto descriptor chains */
+    uint32_t features = MINIP_TX_FEATURE_SG;
+
+    if (the_ndev && (the_ndev->features & VIRTIO_NET_F_CSUM))
+        features |= MINIP_TX_FEATURE_CSUM;
+    if (the_ndev && (the_ndev->features & VIRTIO_NET_F_HOST_TSO4))
+        features |= MINIP_TX_FEATURE_TSO;
+
+    return features;
+}
+
 int virtio_net_found(void)
 {
     return the_ndev ? 1 : 0;
@@ -455,13 +912,6 @@ status_t virtio_net_send_minip_pkt(pktbuf_t *p)
 
     DEBUG_ASSERT(p && p->dlen);
 
-    if ((p->flags & PKTBUF_FLAG_EOF) == 0) {
-        /* can't handle multi part packets yet */
-        PANIC_UNIMPLEMENTED;
-
-        return ERR_NOT_IMPLEMENTED;
-    }
-
     /* hand the pktbuf off to the nic, it owns the pktbuf from now on out unless it fails */
     status_t err = virtio_net_queue_tx_pktbuf(the_ndev, p);
     if (err < 0) {
@@ -471,3 +921,80 @@ status_t virtio_net_send_minip_pkt(pktbuf_t *p)
     return err;
 }
 
+
+#if WITH_LIB_CONSOLE
+
+static void virtio_net_dump_stats(struct virtio_net_dev *ndev)
+{
+    printf("%u queue pair%s, %u in use\n", ndev->queue_count, ndev->queue_count > 1 ? "s" : "",
+           ndev->queues_on);
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        struct virtio_net_queue *q = &ndev->queues[i];
+
+        printf("queue %u rx: %llu packets, %llu polls, %llu irqs, %llu kicks\n", i,
+               q->stats.rx_packets, q->stats.rx_polls, q->stats.rx_irqs, q->stats.rx_kicks);
+        printf("queue %u tx: %llu packets (%llu tso), %llu kicks, %u descriptors pending\n", i,
+               q->stats.tx_packets, q->stats.tx_tso_packets, q->stats.tx_kicks, q->tx_pending_count);
+    }
+}
+
+static void virtio_net_sum_stats(struct virtio_net_dev *ndev, uint64_t *rx, uint64_t *rx_irqs, uint64_t *tx)
+{
+    *rx = *rx_irqs = *tx = 0;
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        *rx += ndev->queues[i].stats.rx_packets;
+        *rx_irqs += ndev->queues[i].stats.rx_irqs;
+        *tx += ndev->queues[i].stats.tx_packets;
+    }
+}
+
+static int cmd_vnet(int argc, const cmd_args *argv)
+{
+    if (!the_ndev) {
+        printf("no virtio net device\n");
+        return ERR_NOT_FOUND;
+    }
+
+    if (argc < 2) {
+usage:
+        printf("usage: %s stats\n", argv[0].str);
+        printf("usage: %s pps [seconds]     sample packet rates, eg. while flooding the guest from the host\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    struct virtio_net_dev *ndev = the_ndev;
+
+    if (!strcmp(argv[1].str, "stats")) {
+        virtio_net_dump_stats(ndev);
+    } else if (!strcmp(argv[1].str, "pps")) {
+        uint seconds = (argc >= 3) ? argv[2].u : 5;
+        if (seconds == 0)
+            seconds = 1;
+
+        uint64_t rx, irqs, tx;
+        virtio_net_sum_stats(ndev, &rx, &irqs, &tx);
+        lk_bigtime_t t = current_time_hires();
+
+        thread_sleep(seconds * 1000);
+
+        uint64_t rx2, irqs2, tx2;
+        virtio_net_sum_stats(ndev, &rx2, &irqs2, &tx2);
+        t = current_time_hires() - t;
+        rx = rx2 - rx;
+        irqs = irqs2 - irqs;
+        tx = tx2 - tx;
+
+        printf("rx %llu pps, tx %llu pps, %llu rx packets per interrupt\n",
+               rx * 1000000 / t, tx * 1000000 / t, irqs ? rx / irqs : rx);
+    } else {
+        goto usage;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("vnet", "virtio net commands", &cmd_vnet)
+STATIC_COMMAND_END(virtio_net);
+
+#endif
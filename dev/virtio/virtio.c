@@ -97,6 +97,15 @@ static enum handler_return virtio_mmio_irq(void *arg)
                 continue;
 
             struct vring *ring = &dev->ring[r];
+
+            /* the driver drains these itself, just let it know there is something there */
+            if (dev->polled_rings_bitmap & (1<<r)) {
+                DEBUG_ASSERT(dev->irq_poll_callback);
+                if (ring->last_used != (ring->used->idx & ring->num_mask))
+                    ret |= dev->irq_poll_callback(dev, r);
+                continue;
+            }
+
             LTRACEF("ring %u: used flags 0x%hhx idx 0x%hhx last_used %u\n", r, ring->used->flags, ring->used->idx, ring->last_used);
 
             uint cur_idx = ring->used->idx;
@@ -322,6 +331,52 @@ void virtio_kick(struct virtio_device *dev, uint ring_index)
     DSB;
 }
 
+void virtio_kick_if_needed(struct virtio_device *dev, uint ring_index)
+{
+    /* make sure the avail index update is visible before sampling the device's flags */
+    DSB;
+    if (dev->ring[ring_index].used->flags & VRING_USED_F_NO_NOTIFY) {
+        LTRACEF("dev %p, ring %u, notify suppressed\n", dev, ring_index);
+        return;
+    }
+
+    virtio_kick(dev, ring_index);
+}
+
+const struct vring_used_elem *virtio_next_used(struct virtio_device *dev, uint ring_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+
+    DEBUG_ASSERT(dev->polled_rings_bitmap & (1<<ring_index));
+
+    if (ring->last_used == (ring->used->idx & ring->num_mask))
+        return NULL;
+
+    /* read the element only after seeing the index that covers it */
+    DSB;
+
+    const struct vring_used_elem *e = &ring->used->ring[ring->last_used];
+    ring->last_used = (ring->last_used + 1) & ring->num_mask;
+
+    return e;
+}
+
+void virtio_ring_disable_interrupt(struct virtio_device *dev, uint ring_index)
+{
+    dev->ring[ring_index].avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+bool virtio_ring_enable_interrupt(struct virtio_device *dev, uint ring_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+
+    ring->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+
+    /* anything used before the device could see the flag cleared has to be picked up by hand */
+    DSB;
+    return ring->last_used != (ring->used->idx & ring->num_mask);
+}
+
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
 {
     LTRACEF("dev %p, index %u, len %u\n", dev, index, len);
@@ -406,6 +461,12 @@ void virtio_status_driver_ok(struct virtio_device *dev)
     dev->mmio_config->status |= VIRTIO_STATUS_DRIVER_OK;
 }
 
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features)
+{
+    dev->mmio_config->guest_features_sel = 0;
+    dev->mmio_config->guest_features = features;
+}
+
 void virtio_init(uint level)
 {
 }
@@ -55,7 +55,6 @@ struct evmm_object_ops;
  *     is an element of several lists, for example:
  *
  *     - A hashtable bucket for quick object/offset lookup.
- *       (not yet implemented!)
  *
  *     - A list of all pages for a given object.
  *
@@ -125,6 +124,22 @@ struct evmm_object_ops {
 	void (*evm_page_req)(evmm_object_t* object,vaddr_t offset, evm_prot_t prot, evm_page_t** pagep);
 	void (*evm_pgunlock)(evmm_object_t* object,evm_prot_t prot, evm_page_t* page);
 	void (*evm_free)(evmm_object_t* object);
+	
+	/*
+	 * Optional. Called by the page-out daemon without the object lock,
+	 * to write back a dirty or precious page before it is reclaimed. The
+	 * page is busy meanwhile. Clear 'dirty' (under the object lock) once
+	 * the data is safe. Pagers without it only get clean pages reclaimed.
+	 */
+	void (*evm_page_out)(evmm_object_t* object, evm_page_t* page);
+	
+	/*
+	 * Optional. Like evm_page_req for the page at 'offset', but the
+	 * pager should also start bringing in the pages of the following
+	 * 'size' bytes (read-ahead) that aren't resident yet. Used once the
+	 * fault path detects sequential access.
+	 */
+	void (*evm_page_req_cluster)(evmm_object_t* object, vaddr_t offset, size_t size, evm_prot_t prot, evm_page_t** pagep);
 };
 
 void evmm_init(evmm_object_t* obj,struct evmm_object_ops* ops,void* pager);
@@ -134,3 +149,41 @@ void evmm_release(evmm_object_t* obj);
 void evmm_destroy(evmm_object_t* obj);
 
 void evmm_signal(evmm_object_t* obj);
+
+/*
+ * Wait for evmm_signal() on the object, e.g. for a busy page to settle.
+ * Set 'wanted' on the page and drop the object lock first.
+ */
+void evmm_wait(evmm_object_t* obj);
+
+/*
+ * Resident page table.
+ *
+ * Pagers must enter every resident page with evmm_page_insert() and take it
+ * out again with evmm_page_remove() before freeing it, so that the fault
+ * path can find it with evmm_page_lookup(). The offset is page aligned.
+ * The object lock must be held for all three.
+ */
+void evmm_page_insert(evm_page_t* page, evmm_object_t* object, vaddr_t offset);
+void evmm_page_remove(evm_page_t* page);
+evm_page_t* evmm_page_lookup(evmm_object_t* object, vaddr_t offset);
+
+/*
+ * Pageable pages.
+ *
+ * evmm_page_alloc() returns a busy page backed by a fresh physical page,
+ * already entered at object/offset and queued for the page-out daemon, or
+ * NULL if memory is short. Pagers may then evmm_page_wait() for the daemon
+ * to free some memory and retry. A pager must not free busy pages, and frees
+ * pageable pages with evmm_page_free(). The object lock must be held for
+ * evmm_page_alloc() and evmm_page_free(), but not for evmm_page_wait().
+ */
+evm_page_t* evmm_page_alloc(evmm_object_t* object, vaddr_t offset);
+void evmm_page_free(evm_page_t* page);
+void evmm_page_wait(void);
+
+/*
+ * Tear down all mappings of a page, so that the next access to it faults
+ * again. The object lock must be held.
+ */
+void evmm_page_unmap(evm_page_t* page);
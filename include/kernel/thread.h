@@ -94,6 +94,7 @@ typedef struct thread {
 #if WITH_SMP
     int curr_cpu;
     int pinned_cpu; /* only run on pinned_cpu if >= 0 */
+    int last_cpu; /* cpu it last ran on, used for run queue affinity */
 #endif
 #if WITH_KERNEL_VM
     vmm_aspace_t *aspace;
@@ -133,7 +134,7 @@ typedef struct thread {
 #define thread_curr_cpu(t) (0)
 #define thread_pinned_cpu(t) (-1)
 #define thread_set_curr_cpu(t,c) do {} while(0)
-#define thread_set_pinned_cpu(t, c) do {} while(0)
+#define thread_set_pinned_cpu(t, c) do { (void)(t); (void)(c); } while(0)
 #endif
 
 /* thread priority */
@@ -237,6 +238,7 @@ struct thread_stats {
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong steals; /* threads pulled from another cpu's run queue */
 #endif
 };
 
@@ -88,9 +88,11 @@ typedef struct vm_page {
 
     uint flags : 8;
     uint ref : 24;
+    uint order : 8; /* block order, valid on VM_PAGE_FLAG_FREE_HEAD pages */
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_FREE_HEAD (0x2) /* first page of a free buddy block */
 
 /* kernel address space */
 #ifndef KERNEL_ASPACE_BASE
@@ -123,6 +125,12 @@ static inline bool is_user_address(vaddr_t va)
 }
 
 /* physical allocator */
+
+/* largest buddy block is (1 << PMM_MAX_ORDER) pages */
+#ifndef PMM_MAX_ORDER
+#define PMM_MAX_ORDER 20
+#endif
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -136,7 +144,7 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_lists[PMM_MAX_ORDER + 1];
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
@@ -180,6 +188,12 @@ static inline void *pmm_alloc_kpage(void) { return pmm_alloc_kpages(1, NULL); }
 
 size_t pmm_free_kpages(void *ptr, uint count);
 
+/* Number of pages managed by all arenas, free or not. */
+size_t pmm_count_total_pages(void);
+
+/* Number of free pages in all arenas. */
+size_t pmm_count_free_pages(void);
+
 /* physical to virtual */
 void *paddr_to_kvaddr(paddr_t pa);
 
@@ -205,7 +219,9 @@ typedef struct vmm_aspace {
     vaddr_t base;
     size_t  size;
 
+    /* regions sorted by base, and the same regions indexed by base */
     struct list_node region_list;
+    struct vmm_region *region_tree;
 
     arch_aspace_t arch_aspace;
 } vmm_aspace_t;
@@ -229,8 +245,17 @@ typedef struct vmm_region {
 
     vmm_aspace_t *parent;
 
+    /* aspace region tree linkage */
+    struct vmm_region *tree_left;
+    struct vmm_region *tree_right;
+    int tree_height;
+    size_t gap;         /* free space between the previous region and this one */
+    size_t max_gap;     /* largest gap in this subtree */
+
     struct list_node    e_node;
     struct evmm_object *e_object;
+    vaddr_t             e_last_fault;   /* object offset of the last fault */
+    uint                e_readahead;    /* read-ahead window in pages */
 } vmm_region_t;
 
 #define VMM_REGION_FLAG_RESERVED 0x1
@@ -264,6 +289,11 @@ __NONNULL((1));
 status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_log2, uint vmm_flags, uint arch_mmu_flags)
 __NONNULL((1));
 
+/* map an evmm object, whose pages are faulted in from its pager on demand.
+ * The region holds a reference to the object until it is freed. */
+status_t vmm_alloc_object(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_log2, uint vmm_flags, struct evmm_object *object)
+__NONNULL((1, 7));
+
 /* Unmap previously allocated region and free physical memory pages backing it (if any) */
 status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t va);
 
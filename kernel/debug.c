@@ -84,6 +84,7 @@ static int cmd_threadstats(int argc, const cmd_args *argv)
         printf("\treschedules: %lu\n", thread_stats[i].reschedules);
 #if WITH_SMP
         printf("\treschedule_ipis: %lu\n", thread_stats[i].reschedule_ipis);
+        printf("\tsteals: %lu\n", thread_stats[i].steals);
 #endif
         printf("\tcontext_switches: %lu\n", thread_stats[i].context_switches);
         printf("\tpreempts: %lu\n", thread_stats[i].preempts);
@@ -124,6 +125,7 @@ static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
                "pmpts %lu, "
 #if WITH_SMP
                "rs_ipis %lu, "
+               "steals %lu, "
 #endif
                "ints %lu, "
                "tmr ints %lu, "
@@ -134,6 +136,7 @@ static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
                thread_stats[i].preempts - old_stats[i].preempts,
 #if WITH_SMP
                thread_stats[i].reschedule_ipis - old_stats[i].reschedule_ipis,
+               thread_stats[i].steals - old_stats[i].steals,
 #endif
                thread_stats[i].interrupts - old_stats[i].interrupts,
                thread_stats[i].timer_ints - old_stats[i].timer_ints,
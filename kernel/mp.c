@@ -57,6 +57,10 @@ void mp_reschedule(mp_cpu_mask_t target, uint flags)
 
     LTRACEF("local %d, post mask target now 0x%x\n", local_cpu, target);
 
+    /* the scheduler usually targets a single cpu, or none at all */
+    if (target == 0)
+        return;
+
     arch_mp_send_ipi(target, MP_IPI_RESCHEDULE);
 }
 
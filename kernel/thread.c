@@ -64,12 +64,23 @@ static struct list_node thread_list;
 /* master thread spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/* the run queues. each cpu owns a set of priority queues and a bitmap of which
+ * ones are non empty. threads are queued on the cpu they are expected to run on,
+ * and cpus look at each other's queues only to steal work they would otherwise
+ * not have. on UP builds this collapses to a single queue.
+ */
+struct run_queue {
+    struct list_node queue[NUM_PRIORITIES];
+    uint32_t bitmap;
+#if WITH_SMP
+    int curr_priority; /* priority of the thread currently running on this cpu */
+#endif
+} __CPU_ALIGN;
+
+static struct run_queue run_queues[SMP_MAX_CPUS];
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queues[0].bitmap) * 8);
 
 /* the idle thread(s) (statically allocated) */
 #if WITH_SMP
@@ -89,8 +100,131 @@ static void idle_thread_routine(void) __NO_RETURN;
 static timer_t preempt_timer[SMP_MAX_CPUS];
 #endif
 
-/* run queue manipulation */
-static void insert_in_run_queue_head(thread_t *t)
+static bool thread_is_idle(thread_t *t);
+
+static inline uint run_queue_highest_priority(uint32_t bitmap)
+{
+    return sizeof(bitmap) * 8 - 1 - __builtin_clz(bitmap);
+}
+
+static void run_queue_remove(struct run_queue *rq, thread_t *t)
+{
+    list_delete(&t->queue_node);
+    if (list_is_empty(&rq->queue[t->priority]))
+        rq->bitmap &= ~(1U << t->priority);
+}
+
+#if WITH_SMP
+/* pick the cpu whose run queue a thread that just became ready should go on */
+static uint run_queue_select_cpu(thread_t *t)
+{
+    uint local_cpu = arch_curr_cpu_num();
+    thread_t *current_thread = get_current_thread();
+
+    /* pinned threads only ever sit in their own cpu's queue */
+    if (t->pinned_cpu >= 0)
+        return t->pinned_cpu;
+
+    /* the current thread going back in the queue stays put, and anything made
+     * ready while this cpu is idle (a timer or irq) is picked up locally. */
+    if (t == current_thread || thread_is_idle(current_thread))
+        return local_cpu;
+
+    /* otherwise prefer an idle cpu, starting with the one it last ran on */
+    mp_cpu_mask_t idle = mp_get_idle_mask() & mp.active_cpus;
+    if (t->last_cpu >= 0 && (idle & (1U << t->last_cpu)))
+        return t->last_cpu;
+    if (idle)
+        return __builtin_ctz(idle);
+
+    /* everyone is busy, go where it would preempt the lowest priority thread.
+     * cpus running real time threads are skipped since they will not take
+     * a reschedule ipi. */
+    mp_cpu_mask_t candidates = mp.active_cpus & ~mp_get_realtime_mask();
+    uint target = local_cpu;
+    int lowest = run_queues[local_cpu].curr_priority;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if ((candidates & (1U << i)) && run_queues[i].curr_priority < lowest) {
+            lowest = run_queues[i].curr_priority;
+            target = i;
+        }
+    }
+    if (lowest < t->priority)
+        return target;
+
+    /* nobody would be preempted, so keep whatever cache affinity it had */
+    if (t->last_cpu >= 0 && (candidates & (1U << t->last_cpu)))
+        return t->last_cpu;
+
+    return local_cpu;
+}
+
+/* return the mask of cpus that need a reschedule ipi to notice t on cpu's queue */
+static mp_cpu_mask_t run_queue_kick_mask(thread_t *t, uint cpu)
+{
+    if (cpu == arch_curr_cpu_num())
+        return 0;
+
+    if (mp_is_cpu_idle(cpu) || run_queues[cpu].curr_priority < t->priority)
+        return 1U << cpu;
+
+    return 0;
+}
+
+/* find the highest priority unpinned thread in rq above min_priority, if any */
+static thread_t *run_queue_peek_unpinned(struct run_queue *rq, int min_priority)
+{
+    thread_t *t;
+    uint32_t bitmap = rq->bitmap;
+
+    if (min_priority >= 0)
+        bitmap &= ~((2U << min_priority) - 1);
+
+    while (bitmap) {
+        uint pri = run_queue_highest_priority(bitmap);
+
+        list_for_every_entry(&rq->queue[pri], t, thread_t, queue_node) {
+            if (t->pinned_cpu < 0)
+                return t;
+        }
+
+        bitmap &= ~(1U << pri);
+    }
+
+    return NULL;
+}
+
+/* pull the best thread queued on another cpu, if it beats min_priority */
+static thread_t *run_queue_steal(uint cpu, int min_priority)
+{
+    thread_t *best = NULL;
+    uint best_cpu = cpu;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i == cpu || run_queues[i].bitmap == 0)
+            continue;
+
+        thread_t *t = run_queue_peek_unpinned(&run_queues[i], best ? best->priority : min_priority);
+        if (t) {
+            best = t;
+            best_cpu = i;
+        }
+    }
+
+    if (best) {
+        run_queue_remove(&run_queues[best_cpu], best);
+        THREAD_STATS_INC(steals);
+    }
+
+    return best;
+}
+#else
+static inline uint run_queue_select_cpu(thread_t *t) { return 0; }
+static inline mp_cpu_mask_t run_queue_kick_mask(thread_t *t, uint cpu) { return 0; }
+#endif
+
+/* run queue manipulation. returns the set of remote cpus to poke with mp_reschedule() */
+static mp_cpu_mask_t insert_in_run_queue_head(thread_t *t)
 {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
@@ -98,11 +232,16 @@ static void insert_in_run_queue_head(thread_t *t)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    uint cpu = run_queue_select_cpu(t);
+    struct run_queue *rq = &run_queues[cpu];
+
+    list_add_head(&rq->queue[t->priority], &t->queue_node);
+    rq->bitmap |= (1U << t->priority);
+
+    return run_queue_kick_mask(t, cpu);
 }
 
-static void insert_in_run_queue_tail(thread_t *t)
+static mp_cpu_mask_t insert_in_run_queue_tail(thread_t *t)
 {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
@@ -110,8 +249,13 @@ static void insert_in_run_queue_tail(thread_t *t)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    uint cpu = run_queue_select_cpu(t);
+    struct run_queue *rq = &run_queues[cpu];
+
+    list_add_tail(&rq->queue[t->priority], &t->queue_node);
+    rq->bitmap |= (1U << t->priority);
+
+    return run_queue_kick_mask(t, cpu);
 }
 
 static void init_thread_struct(thread_t *t, const char *name)
@@ -119,6 +263,9 @@ static void init_thread_struct(thread_t *t, const char *name)
     memset(t, 0, sizeof(thread_t));
     t->magic = THREAD_MAGIC;
     thread_set_pinned_cpu(t, -1);
+#if WITH_SMP
+    t->last_cpu = -1;
+#endif
     strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -291,15 +438,16 @@ status_t thread_resume(thread_t *t)
 
     bool resched = false;
     bool ints_disabled = arch_ints_disabled();
+    mp_cpu_mask_t kick = 0;
     THREAD_LOCK(state);
     if (t->state == THREAD_SUSPENDED) {
         t->state = THREAD_READY;
-        insert_in_run_queue_head(t);
+        kick = insert_in_run_queue_head(t);
         if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
             resched = true;
     }
 
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    mp_reschedule(kick, 0);
 
     THREAD_UNLOCK(state);
 
@@ -448,29 +596,23 @@ static void idle_thread_routine(void)
 
 static thread_t *get_top_thread(int cpu)
 {
-    thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
-
-    while (local_run_queue_bitmap) {
-        /* find the first (remaining) queue with a thread in it */
-        uint next_queue = sizeof(run_queue_bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
+    struct run_queue *rq = &run_queues[cpu];
+    int local_priority = rq->bitmap ? (int)run_queue_highest_priority(rq->bitmap) : -1;
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
 #if WITH_SMP
-            if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
+    /* take a higher priority thread than anything we have queued from another cpu */
+    thread_t *stolen = run_queue_steal(cpu, local_priority);
+    if (stolen)
+        return stolen;
 #endif
-            {
-                list_delete(&newthread->queue_node);
 
-                if (list_is_empty(&run_queue[next_queue]))
-                    run_queue_bitmap &= ~(1<<next_queue);
+    if (local_priority >= 0) {
+        thread_t *newthread = list_peek_head_type(&rq->queue[local_priority], thread_t, queue_node);
 
-                return newthread;
-            }
-        }
-
-        local_run_queue_bitmap &= ~(1<<next_queue);
+        run_queue_remove(rq, newthread);
+        return newthread;
     }
+
     /* no threads to run, select the idle thread for this cpu */
     return idle_thread(cpu);
 }
@@ -505,6 +647,11 @@ void thread_resched(void)
 
     newthread->state = THREAD_RUNNING;
 
+#if WITH_SMP
+    run_queues[cpu].curr_priority = newthread->priority;
+    newthread->last_cpu = cpu;
+#endif
+
     oldthread = current_thread;
 
     if (newthread == oldthread)
@@ -638,7 +785,7 @@ void thread_yield(void)
     current_thread->state = THREAD_READY;
     current_thread->remaining_quantum = 0;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
-        insert_in_run_queue_tail(current_thread);
+        mp_reschedule(insert_in_run_queue_tail(current_thread), 0);
     }
     thread_resched();
 
@@ -679,10 +826,12 @@ void thread_preempt(void)
     /* we are being preempted, so we get to go back into the front of the run queue if we have quantum left */
     current_thread->state = THREAD_READY;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
+        mp_cpu_mask_t kick;
         if (current_thread->remaining_quantum > 0)
-            insert_in_run_queue_head(current_thread);
+            kick = insert_in_run_queue_head(current_thread);
         else
-            insert_in_run_queue_tail(current_thread); /* if we're out of quantum, go to the tail of the queue */
+            kick = insert_in_run_queue_tail(current_thread); /* if we're out of quantum, go to the tail of the queue */
+        mp_reschedule(kick, 0);
     }
     thread_resched();
 
@@ -720,8 +869,7 @@ void thread_unblock(thread_t *t, bool resched)
     DEBUG_ASSERT(!thread_is_idle(t));
 
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    mp_reschedule(insert_in_run_queue_head(t), 0);
     if (resched)
         thread_resched();
 }
@@ -752,7 +900,7 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
     THREAD_LOCK(state);
 
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
+    mp_reschedule(insert_in_run_queue_head(t), 0);
 
     THREAD_UNLOCK(state);
 
@@ -800,8 +948,10 @@ void thread_init_early(void)
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
     /* initialize the run queues */
-    for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (i=0; i < NUM_PRIORITIES; i++)
+            list_initialize(&run_queues[cpu].queue[i]);
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
@@ -862,7 +1012,7 @@ void thread_set_priority(int priority)
     current_thread->priority = priority;
 
     current_thread->state = THREAD_READY;
-    insert_in_run_queue_head(current_thread);
+    mp_reschedule(insert_in_run_queue_head(current_thread), 0);
     thread_resched();
 
     THREAD_UNLOCK(state);
@@ -1164,12 +1314,12 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
          * of the run queue first, so that the newly awakened thread gets a chance to run
          * before the current one, but the current one doesn't get unnecessarilly punished.
          */
+        mp_cpu_mask_t kick = 0;
         if (reschedule) {
             current_thread->state = THREAD_READY;
-            insert_in_run_queue_head(current_thread);
+            kick = insert_in_run_queue_head(current_thread);
         }
-        insert_in_run_queue_head(t);
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+        mp_reschedule(kick | insert_in_run_queue_head(t), 0);
         if (reschedule) {
             thread_resched();
         }
@@ -1199,6 +1349,7 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
 {
     thread_t *t;
     int ret = 0;
+    mp_cpu_mask_t kick = 0;
 
     thread_t *current_thread = get_current_thread();
 
@@ -1212,7 +1363,7 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
          * before the current one, but the current one doesn't get unnecessarilly punished.
          */
         current_thread->state = THREAD_READY;
-        insert_in_run_queue_head(current_thread);
+        kick |= insert_in_run_queue_head(current_thread);
     }
 
     /* pop all the threads off the wait queue into the run queue */
@@ -1223,14 +1374,14 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
         t->wait_queue_block_ret = wait_queue_error;
         t->blocking_wait_queue = NULL;
 
-        insert_in_run_queue_head(t);
+        kick |= insert_in_run_queue_head(t);
         ret++;
     }
 
     DEBUG_ASSERT(wait->count == 0);
 
     if (ret > 0) {
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+        mp_reschedule(kick, 0);
         if (reschedule) {
             thread_resched();
         }
@@ -1284,8 +1435,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
     t->blocking_wait_queue = NULL;
     t->state = THREAD_READY;
     t->wait_queue_block_ret = wait_queue_error;
-    insert_in_run_queue_head(t);
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    mp_reschedule(insert_in_run_queue_head(t), 0);
 
     return NO_ERROR;
 }
@@ -49,8 +49,39 @@
 
 spin_lock_t timer_lock;
 
+/* Timers are kept in a per cpu hierarchical timing wheel. Level 0 has a slot per
+ * millisecond and each level above it covers TIMER_WHEEL_SLOTS times the span of
+ * the one below. A timer is hashed into the lowest level whose span covers its
+ * expiration and is cascaded down when the wheel reaches the start of its slot,
+ * so arming and canceling are O(1) while expiration stays exact to the ms.
+ * Timers further out than the top level are parked on an overflow list that is
+ * rechecked each time the top level wraps.
+ */
+#ifndef TIMER_WHEEL_BITS
+#define TIMER_WHEEL_BITS 6
+#endif
+#ifndef TIMER_WHEEL_LEVELS
+#define TIMER_WHEEL_LEVELS 4
+#endif
+
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_SPAN (1U << TIMER_WHEEL_SHIFT(TIMER_WHEEL_LEVELS))
+
+STATIC_ASSERT(TIMER_WHEEL_SLOTS <= 64);
+STATIC_ASSERT(TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS < 32);
+
 struct timer_state {
-    struct list_node timer_queue;
+    lk_time_t base; /* the next millisecond the wheel has not processed, only moves forward */
+    bool ticking; /* timer_tick() is walking the wheel */
+    uint64_t pending[TIMER_WHEEL_LEVELS]; /* bitmap of non empty slots per level */
+    struct list_node wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    struct list_node overflow;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    bool armed;
+    lk_time_t deadline; /* when the one shot timer is due, if armed */
+#endif
 } __CPU_ALIGN;
 
 static struct timer_state timers[SMP_MAX_CPUS];
@@ -65,25 +96,166 @@ void timer_initialize(timer_t *timer)
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
+static bool timer_wheel_empty(struct timer_state *ts)
+{
+    for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (ts->pending[level])
+            return false;
+    }
+
+    return list_is_empty(&ts->overflow);
+}
+
 static void insert_timer_in_queue(uint cpu, timer_t *timer)
 {
-    timer_t *entry;
+    struct timer_state *ts = &timers[cpu];
 
     DEBUG_ASSERT(arch_ints_disabled());
 
     LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
 
-    list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-        if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-            list_add_before(&entry->node, &timer->node);
+    /* anything already due goes in the next slot to be processed */
+    lk_time_t expires = timer->scheduled_time;
+    if (TIME_LT(expires, ts->base))
+        expires = ts->base;
+
+    lk_time_t delta = expires - ts->base;
+    for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (delta < (1U << TIMER_WHEEL_SHIFT(level + 1))) {
+            uint slot = (expires >> TIMER_WHEEL_SHIFT(level)) & TIMER_WHEEL_MASK;
+
+            list_add_tail(&ts->wheel[level][slot], &timer->node);
+            ts->pending[level] |= 1ULL << slot;
             return;
         }
     }
 
-    /* walked off the end of the list */
-    list_add_tail(&timers[cpu].timer_queue, &timer->node);
+    /* too far out for the wheel, wait for the top level to come around */
+    list_add_tail(&ts->overflow, &timer->node);
 }
 
+static void remove_timer_from_queue(timer_t *timer)
+{
+    struct list_node *head = timer->node.prev;
+    bool last = (timer->node.prev == timer->node.next);
+
+    list_delete(&timer->node);
+
+    if (!last)
+        return;
+
+    /* it was the only timer in its list, so the neighbour was the list head.
+     * figure out which wheel slot that is and mark it empty. */
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct list_node *first = &timers[cpu].wheel[0][0];
+
+        if (head >= first && head < first + TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS) {
+            uint index = head - first;
+
+            timers[cpu].pending[index / TIMER_WHEEL_SLOTS] &= ~(1ULL << (index % TIMER_WHEEL_SLOTS));
+            return;
+        }
+    }
+}
+
+/* the next time the wheel has work to do: a level 0 slot coming due, the start
+ * of a higher level slot that has to be cascaded down, or the overflow recheck.
+ * only meaningful if the wheel is not empty. */
+static lk_time_t timer_wheel_next_event(struct timer_state *ts)
+{
+    lk_time_t base = ts->base;
+    lk_time_t best = UINT32_MAX;
+
+    for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t pending = ts->pending[level];
+        if (!pending)
+            continue;
+
+        uint shift = TIMER_WHEEL_SHIFT(level);
+        uint index = (base >> shift) & TIMER_WHEEL_MASK;
+        lk_time_t lap = base & ~((TIMER_WHEEL_SLOTS << shift) - 1);
+
+        /* slots past the current index belong to this lap of the level, the rest
+         * to the next one. the current slot is only still due if the wheel has
+         * not yet processed its first millisecond, which is always true at level 0. */
+        uint first = (base & ((1U << shift) - 1)) ? index + 1 : index;
+        uint64_t ahead = (first < TIMER_WHEEL_SLOTS) ? (pending & (~0ULL << first)) : 0;
+
+        lk_time_t t;
+        if (ahead)
+            t = lap + ((lk_time_t)__builtin_ctzll(ahead) << shift);
+        else
+            t = lap + (TIMER_WHEEL_SLOTS << shift) + ((lk_time_t)__builtin_ctzll(pending) << shift);
+
+        if (t - base < best)
+            best = t - base;
+    }
+
+    if (!list_is_empty(&ts->overflow)) {
+        lk_time_t t = ((base - 1) & ~(TIMER_WHEEL_SPAN - 1)) + TIMER_WHEEL_SPAN;
+
+        if (t - base < best)
+            best = t - base;
+    }
+
+    return base + best;
+}
+
+static void timer_wheel_requeue(uint cpu, struct list_node *list)
+{
+    struct list_node temp;
+    timer_t *timer;
+
+    list_initialize(&temp);
+    while ((timer = list_remove_head_type(list, timer_t, node)))
+        list_add_tail(&temp, &timer->node);
+
+    while ((timer = list_remove_head_type(&temp, timer_t, node)))
+        insert_timer_in_queue(cpu, timer);
+}
+
+/* the wheel just reached ts->base, move any higher level slots that start here down */
+static void timer_wheel_cascade(uint cpu)
+{
+    struct timer_state *ts = &timers[cpu];
+
+    for (uint level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (ts->base & ((1U << TIMER_WHEEL_SHIFT(level)) - 1))
+            return;
+
+        uint slot = (ts->base >> TIMER_WHEEL_SHIFT(level)) & TIMER_WHEEL_MASK;
+        if (ts->pending[level] & (1ULL << slot)) {
+            ts->pending[level] &= ~(1ULL << slot);
+            timer_wheel_requeue(cpu, &ts->wheel[level][slot]);
+        }
+    }
+
+    if ((ts->base & (TIMER_WHEEL_SPAN - 1)) == 0)
+        timer_wheel_requeue(cpu, &ts->overflow);
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* make sure the one shot timer fires no later than the wheel's next event */
+static void timer_wheel_program(uint cpu, lk_time_t now)
+{
+    struct timer_state *ts = &timers[cpu];
+
+    if (timer_wheel_empty(ts))
+        return;
+
+    lk_time_t next = timer_wheel_next_event(ts);
+    if (ts->armed && TIME_LTE(ts->deadline, next))
+        return;
+
+    lk_time_t delay = TIME_LT(next, now) ? 0 : next - now;
+
+    LTRACEF("setting new timer for %u msecs\n", delay);
+    platform_set_oneshot_timer(timer_tick, NULL, delay);
+    ts->armed = true;
+    ts->deadline = next;
+}
+#endif
+
 static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg)
 {
     lk_time_t now;
@@ -108,14 +280,17 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
     spin_lock_irqsave(&timer_lock, state);
 
     uint cpu = arch_curr_cpu_num();
+
+    /* an empty wheel may have been left behind while the cpu was tickless. not while
+     * timer_tick() is walking it though, it still has to catch up to now itself. */
+    struct timer_state *ts = &timers[cpu];
+    if (!ts->ticking && timer_wheel_empty(ts) && TIME_LT(ts->base, now))
+        ts->base = now;
+
     insert_timer_in_queue(cpu, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
-        /* we just modified the head of the timer queue */
-        LTRACEF("setting new timer for %u msecs\n", delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    timer_wheel_program(cpu, now);
 #endif
 
     spin_unlock_irqrestore(&timer_lock, state);
@@ -173,14 +348,8 @@ void timer_cancel(timer_t *timer)
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&timer_lock, state);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    uint cpu = arch_curr_cpu_num();
-
-    timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-#endif
-
     if (list_in_list(&timer->node))
-        list_delete(&timer->node);
+        remove_timer_from_queue(timer);
 
     /* to keep it from being reinserted into the queue if called from
      * periodic timer callback.
@@ -190,22 +359,13 @@ void timer_cancel(timer_t *timer)
     timer->arg = NULL;
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    /* see if we've just modified the head of the timer queue */
-    timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (newhead == NULL) {
+    /* if that emptied our wheel there is no reason to take the interrupt. otherwise
+     * leave the one shot alone, if it fires early it'll just reprogram itself. */
+    uint cpu = arch_curr_cpu_num();
+    if (timers[cpu].armed && timer_wheel_empty(&timers[cpu])) {
         LTRACEF("clearing old hw timer, nothing in the queue\n");
         platform_stop_timer();
-    } else if (newhead != oldhead) {
-        lk_time_t delay;
-        lk_time_t now = current_time();
-
-        if (TIME_LT(newhead->scheduled_time, now))
-            delay = 0;
-        else
-            delay = newhead->scheduled_time - now;
-
-        LTRACEF("setting new timer to %u\n", (uint) delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
+        timers[cpu].armed = false;
     }
 #endif
 
@@ -224,64 +384,81 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 //  KEVLOG_TIMER_TICK(); // enable only if necessary
 
     uint cpu = arch_curr_cpu_num();
+    struct timer_state *ts = &timers[cpu];
 
     LTRACEF("cpu %u now %u, sp %p\n", cpu, now, __GET_FRAME());
 
     spin_lock(&timer_lock);
 
-    for (;;) {
-        /* see if there's an event to process */
-        timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-        if (likely(timer == 0))
-            break;
-        LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-        if (likely(TIME_LT(now, timer->scheduled_time)))
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the one shot that got us here has fired */
+    ts->armed = false;
+#endif
+
+    /* walk the wheel forward to now, one event at a time */
+    ts->ticking = true;
+    while (!timer_wheel_empty(ts)) {
+        lk_time_t next = timer_wheel_next_event(ts);
+        if (TIME_GT(next, now))
             break;
 
-        /* process it */
-        LTRACEF("timer %p\n", timer);
-        DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-        list_delete(&timer->node);
+        ts->base = next;
+        timer_wheel_cascade(cpu);
+
+        struct list_node *slot = &ts->wheel[0][next & TIMER_WHEEL_MASK];
+        while ((timer = list_peek_head_type(slot, timer_t, node))) {
+            LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
+
+            /* process it */
+            DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
+            remove_timer_from_queue(timer);
 
-        /* we pulled it off the list, release the list lock to handle it */
-        spin_unlock(&timer_lock);
+            /* level 0 slots don't know which lap they are on, so anything that isn't
+             * due yet got here a lap early. put it back where it belongs. */
+            if (TIME_GT(timer->scheduled_time, next)) {
+                insert_timer_in_queue(cpu, timer);
+                continue;
+            }
 
-        LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
+            /* we pulled it off the list, release the list lock to handle it */
+            spin_unlock(&timer_lock);
 
-        THREAD_STATS_INC(timers);
+            LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
 
-        bool periodic = timer->periodic_time > 0;
+            THREAD_STATS_INC(timers);
 
-        LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
-        KEVLOG_TIMER_CALL(timer->callback, timer->arg);
-        if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
-            ret = INT_RESCHEDULE;
+            bool periodic = timer->periodic_time > 0;
 
-        /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
-        spin_lock(&timer_lock);
+            LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
+            KEVLOG_TIMER_CALL(timer->callback, timer->arg);
+            if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
+                ret = INT_RESCHEDULE;
 
-        /* if it was a periodic timer and it hasn't been requeued
-         * by the callback put it back in the list
-         */
-        if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
-            LTRACEF("periodic timer, period %u\n", timer->periodic_time);
-            timer->scheduled_time = now + timer->periodic_time;
-            insert_timer_in_queue(cpu, timer);
+            /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
+            spin_lock(&timer_lock);
+
+            /* if it was a periodic timer and it hasn't been requeued
+             * by the callback put it back in the list
+             */
+            if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
+                LTRACEF("periodic timer, period %u\n", timer->periodic_time);
+                timer->scheduled_time = now + timer->periodic_time;
+                insert_timer_in_queue(cpu, timer);
+            }
         }
+
+        if (TIME_LT(ts->base, next + 1))
+            ts->base = next + 1;
     }
+    ts->ticking = false;
+
+    /* nothing is left at or before now */
+    if (TIME_LTE(ts->base, now))
+        ts->base = now + 1;
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     /* reset the timer to the next event */
-    timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (timer) {
-        /* has to be the case or it would have fired already */
-        DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
-
-        lk_time_t delay = timer->scheduled_time - now;
-
-        LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    timer_wheel_program(cpu, now);
 
     /* we're done manipulating the timer queue */
     spin_unlock(&timer_lock);
@@ -302,7 +479,11 @@ void timer_init(void)
 {
     timer_lock = SPIN_LOCK_INITIAL_VALUE;
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        list_initialize(&timers[i].timer_queue);
+        for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            for (uint slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+                list_initialize(&timers[i].wheel[level][slot]);
+        }
+        list_initialize(&timers[i].overflow);
     }
 #if !PLATFORM_HAS_DYNAMIC_TIMER
     /* register for a periodic timer tick */
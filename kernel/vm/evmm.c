@@ -22,8 +22,118 @@
  */
 //#include <trace.h>
 #include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <arch/ops.h>
 #include <kernel/vmi.h>
 #include <kernel/evm.h>
+#include <kernel/spinlock.h>
+#include <lk/init.h>
+#include "vm_priv.h"
+
+/*
+ * The resident page table: a hash table over object/offset pairs, like the
+ * vm_page_buckets of Mach. It is sized after the number of physical pages,
+ * so chains stay short no matter how large a single object grows.
+ *
+ * Chains are linked through evm_page_t::next. As a chain can hold pages of
+ * several objects, the buckets are guarded by a set of striped spin locks in
+ * addition to the object lock.
+ */
+#define EVM_PAGE_HASH_LOCKS 64
+
+static evm_page_t**  evm_page_buckets;
+static uint          evm_page_hash_mask;
+static spin_lock_t   evm_page_hash_locks[EVM_PAGE_HASH_LOCKS];
+
+static inline uint evm_page_hash(evmm_object_t* object, vaddr_t offset) {
+	return (uint)(((uintptr_t)object >> 6) + (offset >> PAGE_SIZE_SHIFT)) & evm_page_hash_mask;
+}
+
+static inline spin_lock_t* evm_page_hash_lock(uint bucket) {
+	return &evm_page_hash_locks[bucket % EVM_PAGE_HASH_LOCKS];
+}
+
+static void evmm_init_page_hash(uint level)
+{
+	size_t pages = pmm_count_total_pages();
+	
+	uint count = 1;
+	while(count < pages && count < (1U<<31)) count <<= 1;
+	
+	evm_page_buckets = calloc(count, sizeof(evm_page_t*));
+	if(!evm_page_buckets) panic("evmm: unable to allocate %u page hash buckets\n", count);
+	evm_page_hash_mask = count-1;
+	
+	for(uint i=0; i<EVM_PAGE_HASH_LOCKS; i++) spin_lock_init(&evm_page_hash_locks[i]);
+}
+
+LK_INIT_HOOK(evmm, &evmm_init_page_hash, LK_INIT_LEVEL_VM + 1);
+
+void evmm_page_insert(evm_page_t* page, evmm_object_t* object, vaddr_t offset)
+{
+	DEBUG_ASSERT(!page->tabled);
+	DEBUG_ASSERT(IS_PAGE_ALIGNED(offset));
+	DEBUG_ASSERT(is_mutex_held(&object->lock));
+	
+	page->object = object;
+	page->offset = offset;
+	
+	uint bucket = evm_page_hash(object, offset);
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(evm_page_hash_lock(bucket), state);
+	{
+		page->next = evm_page_buckets[bucket];
+		evm_page_buckets[bucket] = page;
+	}
+	spin_unlock_irqrestore(evm_page_hash_lock(bucket), state);
+	page->tabled = 1;
+	
+	list_add_tail(&object->memq, &page->listq);
+}
+
+void evmm_page_remove(evm_page_t* page)
+{
+	DEBUG_ASSERT(page->tabled);
+	DEBUG_ASSERT(is_mutex_held(&page->object->lock));
+	
+	uint bucket = evm_page_hash(page->object, page->offset);
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(evm_page_hash_lock(bucket), state);
+	{
+		evm_page_t** pp = &evm_page_buckets[bucket];
+		while(*pp != page) {
+			DEBUG_ASSERT(*pp);
+			pp = &(*pp)->next;
+		}
+		*pp = page->next;
+	}
+	spin_unlock_irqrestore(evm_page_hash_lock(bucket), state);
+	page->next = 0;
+	page->tabled = 0;
+	
+	list_delete(&page->listq);
+}
+
+evm_page_t* evmm_page_lookup(evmm_object_t* object, vaddr_t offset)
+{
+	evm_page_t* page;
+	
+	DEBUG_ASSERT(IS_PAGE_ALIGNED(offset));
+	DEBUG_ASSERT(is_mutex_held(&object->lock));
+	
+	uint bucket = evm_page_hash(object, offset);
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(evm_page_hash_lock(bucket), state);
+	{
+		for(page = evm_page_buckets[bucket]; page; page = page->next)
+			if(page->object == object && page->offset == offset) break;
+	}
+	spin_unlock_irqrestore(evm_page_hash_lock(bucket), state);
+	
+	return page;
+}
 
 static inline bool evmm_should_wait(evm_page_t *page,evm_prot_t prot) {
 	if(
@@ -57,7 +167,148 @@ static inline uint evmm_prot_to_mmuflags(evm_prot_t prot, bool kernel_aspace) {
 	return ret;
 }
 
-static void evmm_wait(evmm_object_t* obj);
+/*
+ * Fault clustering.
+ *
+ * Every fault also maps the resident neighbours of the page (fault-around)
+ * within an aligned block of EVMM_FAULT_AROUND pages, so that access to
+ * pages that are already in memory doesn't trap once per page.
+ *
+ * Each region also tracks where the last fault hit. A fault that picks up
+ * where the previous one left off is taken as sequential access and
+ * doubles the region's read-ahead window, from EVMM_READAHEAD_MIN up to
+ * EVMM_READAHEAD_MAX pages; anything else closes it. While it is open,
+ * missing pages are requested from the pager together with the pages
+ * ahead of them, and fault-around covers the window instead.
+ */
+#ifndef EVMM_FAULT_AROUND
+#define EVMM_FAULT_AROUND 8
+#endif
+#ifndef EVMM_READAHEAD_MIN
+#define EVMM_READAHEAD_MIN 4
+#endif
+#ifndef EVMM_READAHEAD_MAX
+#define EVMM_READAHEAD_MAX 32
+#endif
+
+#define EVMM_CLUSTER_MAX MAX(EVMM_FAULT_AROUND, EVMM_READAHEAD_MAX)
+
+static struct {
+	volatile int faults;     /* faults on evmm regions */
+	volatile int major;      /* ... that had to ask the pager */
+	volatile int readahead;  /* pages covered by read-ahead requests */
+	volatile int around;     /* neighbours mapped by fault-around */
+} evmm_fault_stats;
+
+/*
+ * Update the region's read-ahead window for a fault at offset. Called with
+ * the VMM lock held.
+ */
+static uint evmm_fault_window(vmm_region_t* region, vaddr_t offset)
+{
+	vaddr_t last = region->e_last_fault;
+	
+	if(offset > last && offset-last <= MAX(region->e_readahead,1U)*PAGE_SIZE)
+		region->e_readahead = MIN(MAX(region->e_readahead*2, EVMM_READAHEAD_MIN), EVMM_READAHEAD_MAX);
+	else
+		region->e_readahead = 0;
+	region->e_last_fault = offset;
+	
+	return region->e_readahead;
+}
+
+/*
+ * Collect the resident neighbours of the page at offset that can be mapped
+ * read-only right away, in offset order. Pages on the inactive queue are
+ * left alone, they have to fault to prove they are still in use. Called with
+ * the object lock held.
+ */
+static uint evmm_fault_around(evmm_object_t* object, vaddr_t offset, size_t size, uint readahead, evm_page_t** pages)
+{
+	vaddr_t start, end;
+	uint    count = 0;
+	
+	if(readahead) {
+		start = offset;
+		end = offset + readahead*PAGE_SIZE;
+	} else {
+		start = ROUNDDOWN(offset, EVMM_FAULT_AROUND*PAGE_SIZE);
+		end = start + EVMM_FAULT_AROUND*PAGE_SIZE;
+	}
+	if(end > size || end < start) end = size;
+	
+	for(vaddr_t off = start; off < end; off += PAGE_SIZE) {
+		if(off == offset) continue;
+		
+		evm_page_t* p = evmm_page_lookup(object,off);
+		if(!p || p->inactive || !p->phys_page) continue;
+		if(evmm_should_wait(p,EVM_PROT_READ) || !evmm_can_map(p,EVM_PROT_READ)) continue;
+		if(p->not_allowed & EVM_PROT_READ) continue;
+		
+		p->prev_uses |= EVM_PROT_READ;
+		pages[count++] = p;
+	}
+	
+	return count;
+}
+
+/*
+ * Map the pages collected by evmm_fault_around() that aren't mapped yet,
+ * one arch_mmu_map() per physically contiguous run. Called with the object
+ * lock and the VMM lock held.
+ */
+static void evmm_map_around(vmm_aspace_t* aspace, vaddr_t base, evm_page_t** pages, uint count, uint mmuflags)
+{
+	uint i = 0;
+	
+	while(i < count) {
+		vaddr_t va = base + pages[i]->offset;
+		if(arch_mmu_query(&aspace->arch_aspace,va,0,0) == NO_ERROR) {
+			i++;
+			continue;
+		}
+		
+		paddr_t pa = vm_page_to_paddr(pages[i]->phys_page);
+		uint run = 1;
+		while(i+run < count &&
+		      pages[i+run]->offset == pages[i]->offset + run*PAGE_SIZE &&
+		      vm_page_to_paddr(pages[i+run]->phys_page) == pa + run*PAGE_SIZE &&
+		      arch_mmu_query(&aspace->arch_aspace,va + run*PAGE_SIZE,0,0) != NO_ERROR)
+			run++;
+		
+		/*
+		 * These are extras, if they can't be mapped they fault on their own.
+		 */
+		if(arch_mmu_map(&aspace->arch_aspace,va,pa,run,mmuflags) >= 0)
+			atomic_add(&evmm_fault_stats.around, run);
+		i += run;
+	}
+}
+
+/*
+ * Map the faulting page. It may still be mapped with fewer rights, by an
+ * earlier fault or by fault-around, and not every architecture maps over a
+ * live entry, so that one is removed first. Called with the object lock and
+ * the VMM lock held.
+ */
+static bool evmm_map_page(vmm_aspace_t* aspace, vaddr_t va, paddr_t pa, uint mmuflags)
+{
+	if(arch_mmu_query(&aspace->arch_aspace,va,0,0) == NO_ERROR)
+		arch_mmu_unmap(&aspace->arch_aspace,va,1);
+	
+	return arch_mmu_map(&aspace->arch_aspace,va,pa,1,mmuflags) >= 0;
+}
+
+void evmm_dump_fault_stats(void)
+{
+	int faults = evmm_fault_stats.faults;
+	int major = evmm_fault_stats.major;
+	
+	printf("evmm faults %d, resident %d (%d%%), pager %d\n",
+	       faults, faults-major, faults ? (faults-major)*100/faults : 0, major);
+	printf("read-ahead pages %d, fault-around pages %d\n",
+	       evmm_fault_stats.readahead, evmm_fault_stats.around);
+}
 
 uint vmi_page_fault(vaddr_t addr, uint flags)
 {
@@ -67,7 +318,10 @@ uint vmi_page_fault(vaddr_t addr, uint flags)
 	vmm_region_t  *region;
 	evmm_object_t *object = 0;
 	vaddr_t        offset;
-	evm_page_t    *page, *p;
+	vaddr_t        region_base;
+	size_t         region_size;
+	uint           readahead = 0;
+	evm_page_t    *page;
 	evm_prot_t     evm_prot = (flags & EVM_PROT_MASK) | EVM_PROT_READ;
 	bool           request_fulfilled = false;
 	
@@ -93,13 +347,16 @@ uint vmi_page_fault(vaddr_t addr, uint flags)
 			 */
 			region = vmi_find_region(aspace,addr);
 			if(region) {
+				offset = ROUNDDOWN(addr-region->base, PAGE_SIZE);
+				region_base = region->base;
+				region_size = region->size;
 				if(region->flags&VMM_REGION_FLAG_EXTENDED) {
 					object = region->e_object;
 					object->refcount++; /* XXX undo this! */
+					readahead = evmm_fault_window(region,offset);
 				} else {
 					object = 0;
 				}
-				offset = addr-region->base;
 			}
 		} else {
 			kernelrange = false;
@@ -139,18 +396,14 @@ uint vmi_page_fault(vaddr_t addr, uint flags)
 	 */
 	
 	
+	atomic_add(&evmm_fault_stats.faults, 1);
+	
 	mutex_acquire(&object->lock);
 	{
-		page = 0;
 		/*
 		 * Step 1, find the Page if it exists.
 		 */
-		list_for_every_entry(&object->memq, p, evm_page_t, listq)
-		{
-			if(offset<p->offset) continue;
-			if(offset>p->offset) break;
-			page = p;
-		}
+		page = evmm_page_lookup(object,offset);
 		
 		/*
 		 * Step 2, if not found, obtain the page.
@@ -161,7 +414,17 @@ uint vmi_page_fault(vaddr_t addr, uint flags)
 		 */
 		if(!page){
 			mutex_release(&object->lock);
-			object->pagerops->evm_page_req(object,offset,evm_prot,&page);
+			atomic_add(&evmm_fault_stats.major, 1);
+			if(readahead && object->pagerops->evm_page_req_cluster) {
+				/*
+				 * Sequential access, bring in what lies ahead as well.
+				 */
+				size_t size = MIN(readahead*PAGE_SIZE, region_size-offset);
+				atomic_add(&evmm_fault_stats.readahead, size/PAGE_SIZE);
+				object->pagerops->evm_page_req_cluster(object,offset,size,evm_prot,&page);
+			} else {
+				object->pagerops->evm_page_req(object,offset,evm_prot,&page);
+			}
 			mutex_acquire(&object->lock);
 			
 			if(!page) goto vmodone;
@@ -209,7 +472,7 @@ uint vmi_page_fault(vaddr_t addr, uint flags)
 		/*
 		 * Step 5, Check, if we can map this page.
 		 */
-		if(evmm_can_map(page,evm_prot)) goto vmodone;
+		if(!evmm_can_map(page,evm_prot)) goto vmodone;
 		
 		/*
 		 * At this point we MUST have a physical page.
@@ -224,25 +487,35 @@ uint vmi_page_fault(vaddr_t addr, uint flags)
 		page->prev_uses = evmprot2;
 		
 		/*
-		 * Release the object-lock.
+		 * Tell the page-out daemon the page is in use, and dirty if
+		 * it becomes writable.
 		 */
-		mutex_release(&object->lock);
+		evmm_page_referenced(page,evmprot2);
 		
 		/*
 		 * Obtain the physical address.
 		 */
 		paddr_t paddr = vm_page_to_paddr(page->phys_page);
 		
+		/*
+		 * Step 6, pick the neighbours to map along.
+		 */
+		evm_page_t* around[EVMM_CLUSTER_MAX];
+		uint naround = evmm_fault_around(object,offset,region_size,readahead,around);
+		
 		bool freeme;
 		
 		/*
 		 * Final step. Acquire the VMM lock. and map the page.
+		 *
+		 * The object-lock is held until the page is mapped, so the
+		 * page-out daemon can't reclaim it in between.
 		 */
 		mutex_acquire(vmi_vmm_lock());
 		{
-			request_fulfilled = true;
-			
-			arch_mmu_map(&aspace->arch_aspace,ROUNDDOWN(addr, PAGE_SIZE),paddr,1,evmm_prot_to_mmuflags(evmprot2,kernelrange));
+			request_fulfilled = evmm_map_page(aspace,ROUNDDOWN(addr, PAGE_SIZE),paddr,evmm_prot_to_mmuflags(evmprot2,kernelrange));
+			if(request_fulfilled)
+				evmm_map_around(aspace,region_base,around,naround,evmm_prot_to_mmuflags(EVM_PROT_READ,kernelrange));
 			
 			/*
 			 * Efficiency: decrement the refcount, as we are already holding the mandatory lock.
@@ -252,6 +525,11 @@ uint vmi_page_fault(vaddr_t addr, uint flags)
 		}
 		mutex_release(vmi_vmm_lock());
 		
+		/*
+		 * Release the object-lock.
+		 */
+		mutex_release(&object->lock);
+		
 		/*
 		 * Free the object if the refcount dropped to ZERO. (UNLIKELY)
 		 */
@@ -329,7 +607,7 @@ void evmm_destroy(evmm_object_t* obj)
 	obj->pagerops->evm_free(obj);
 }
 
-static void evmm_wait(evmm_object_t* obj)
+void evmm_wait(evmm_object_t* obj)
 {
 	THREAD_LOCK(state);
 	wait_queue_block(&obj->waitq, INFINITE_TIME);
@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2018 Simon Schmidt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <string.h>
+#include <kernel/vmi.h>
+#include <kernel/evm.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
+#include <lib/console.h>
+#include <lk/init.h>
+#include "vm_priv.h"
+
+/*
+ * The page-out daemon.
+ *
+ * Pages allocated by evmm_page_alloc() are kept on one of two page
+ * queues, as in Mach:
+ *
+ *     - The active queue holds pages that are mapped and in use.
+ *
+ *     - The inactive queue holds pages whose mappings were torn down,
+ *       so the next access to them has to fault.
+ *
+ * The MMU layer doesn't give us referenced or modified bits, so they are
+ * kept in software instead: the fault path sets 'reference' on every
+ * fault, and 'dirty' for writable mappings. An inactive page that is
+ * faulted in again, or that arch_mmu_query() still finds mapped, is
+ * referenced and goes back to the active queue.
+ *
+ * Once the free page count drops below the low watermark, the daemon
+ * keeps about a third of the pageable pages inactive, deactivating from
+ * the head of the active queue (referenced pages get a second chance at
+ * its tail). It reclaims from the head of the inactive queue until the
+ * high watermark is reached. Clean pages are returned to the PMM, dirty
+ * and precious ones are laundered through the pager first.
+ *
+ * Lock order is object lock, page queue lock, VMM lock. The daemon finds
+ * pages through the queues, so it only ever tries the object lock.
+ */
+#ifndef EVMM_PAGEOUT_LOW_PERCENT
+#define EVMM_PAGEOUT_LOW_PERCENT 2
+#endif
+#ifndef EVMM_PAGEOUT_HIGH_PERCENT
+#define EVMM_PAGEOUT_HIGH_PERCENT 4
+#endif
+
+/* How long evmm_page_wait() waits for a pass, in ms. */
+#define EVMM_PAGEOUT_WAIT 100
+
+static mutex_t          evm_page_queue_lock = MUTEX_INITIAL_VALUE(evm_page_queue_lock);
+static struct list_node evm_page_queue_active = LIST_INITIAL_VALUE(evm_page_queue_active);
+static struct list_node evm_page_queue_inactive = LIST_INITIAL_VALUE(evm_page_queue_inactive);
+static uint             evm_page_active_count;   /* (P) */
+static uint             evm_page_inactive_count; /* (P) */
+
+static event_t evmm_pageout_event = EVENT_INITIAL_VALUE(evmm_pageout_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+static event_t evmm_pageout_done = EVENT_INITIAL_VALUE(evmm_pageout_done, false, 0);
+static bool    evmm_pageout_running;
+
+/* The daemon is woken below 'low' free pages and reclaims up to 'high'. */
+static size_t evmm_pageout_low;
+static size_t evmm_pageout_high;
+
+static struct {
+	ulong wakeups;
+	ulong scanned;
+	ulong deactivated;
+	ulong reactivated;
+	ulong laundered;
+	ulong freed;
+} evmm_pageout_stats;
+
+/*
+ * Page queue helpers. The page queue lock must be held.
+ */
+static void evm_page_dequeue(evm_page_t* page)
+{
+	if(page->active) {
+		list_delete(&page->pageq);
+		page->active = 0;
+		evm_page_active_count--;
+	} else if(page->inactive) {
+		list_delete(&page->pageq);
+		page->inactive = 0;
+		evm_page_inactive_count--;
+	}
+}
+
+static void evm_page_activate(evm_page_t* page)
+{
+	evm_page_dequeue(page);
+	list_add_tail(&evm_page_queue_active, &page->pageq);
+	page->active = 1;
+	evm_page_active_count++;
+}
+
+static void evm_page_deactivate(evm_page_t* page)
+{
+	evm_page_dequeue(page);
+	list_add_tail(&evm_page_queue_inactive, &page->pageq);
+	page->inactive = 1;
+	evm_page_inactive_count++;
+}
+
+/*
+ * Mapping helpers. The object lock and the VMM lock must be held.
+ */
+static bool evm_page_mapped(evm_page_t* page)
+{
+	vmm_region_t* region;
+	list_for_every_entry(&page->object->e_list, region, vmm_region_t, e_node) {
+		if(page->offset >= region->size) continue;
+		if(arch_mmu_query(&region->parent->arch_aspace,region->base+page->offset,0,0) == NO_ERROR)
+			return true;
+	}
+	return false;
+}
+
+static void evm_page_unmap(evm_page_t* page)
+{
+	vmm_region_t* region;
+	list_for_every_entry(&page->object->e_list, region, vmm_region_t, e_node) {
+		if(page->offset >= region->size) continue;
+		arch_mmu_unmap(&region->parent->arch_aspace,region->base+page->offset,1);
+	}
+}
+
+/*
+ * Take the page out of its object and give its memory back.
+ * The object lock and the page queue lock must be held.
+ */
+static void evm_page_reclaim(evm_page_t* page)
+{
+	evm_page_dequeue(page);
+	if(page->tabled) evmm_page_remove(page);
+	pmm_free_page(page->phys_page);
+	free(page);
+}
+
+evm_page_t* evmm_page_alloc(evmm_object_t* object, vaddr_t offset)
+{
+	DEBUG_ASSERT(is_mutex_held(&object->lock));
+	
+	struct list_node list = LIST_INITIAL_VALUE(list);
+	if(pmm_alloc_pages(1,&list) != 1) return 0;
+	
+	evm_page_t* page = calloc(1,sizeof(evm_page_t));
+	if(!page) {
+		pmm_free(&list);
+		return 0;
+	}
+	
+	page->phys_page = list_remove_head_type(&list, vm_page_t, node);
+	page->busy = 1;
+	evmm_page_insert(page,object,offset);
+	
+	mutex_acquire(&evm_page_queue_lock);
+	evm_page_activate(page);
+	mutex_release(&evm_page_queue_lock);
+	
+	return page;
+}
+
+void evmm_page_free(evm_page_t* page)
+{
+	DEBUG_ASSERT(is_mutex_held(&page->object->lock));
+	DEBUG_ASSERT(page->active || page->inactive);
+	
+	mutex_acquire(&evm_page_queue_lock);
+	evm_page_reclaim(page);
+	mutex_release(&evm_page_queue_lock);
+}
+
+void evmm_page_wait(void)
+{
+	if(!evmm_pageout_running) return;
+	
+	event_signal(&evmm_pageout_event, true);
+	event_wait_timeout(&evmm_pageout_done, EVMM_PAGEOUT_WAIT);
+}
+
+void evmm_page_unmap(evm_page_t* page)
+{
+	DEBUG_ASSERT(is_mutex_held(&page->object->lock));
+	
+	mutex_acquire(vmi_vmm_lock());
+	evm_page_unmap(page);
+	mutex_release(vmi_vmm_lock());
+}
+
+void evmm_page_referenced(evm_page_t* page, evm_prot_t prot)
+{
+	DEBUG_ASSERT(is_mutex_held(&page->object->lock));
+	
+	if(prot & EVM_PROT_WRITE) page->dirty = 1;
+	
+	/*
+	 * Queue transitions are only made with the object-lock held,
+	 * so this is stable.
+	 */
+	if(!page->active && !page->inactive) return;
+	
+	mutex_acquire(&evm_page_queue_lock);
+	page->reference = 1;
+	if(page->inactive) {
+		evm_page_activate(page);
+		evmm_pageout_stats.reactivated++;
+	}
+	mutex_release(&evm_page_queue_lock);
+}
+
+void evmm_pageout_check(size_t free_pages)
+{
+	if(evmm_pageout_running && free_pages < evmm_pageout_low)
+		event_signal(&evmm_pageout_event, false);
+}
+
+/*
+ * Hand a dirty or precious page to the pager. Called with the object-lock
+ * and the page queue lock held, which are dropped around the call. Returns
+ * with both held again, and with a reference on the object that the caller
+ * drops once it has let go of both locks.
+ */
+static void evmm_pageout_launder(evmm_object_t* object, evm_page_t* page)
+{
+	/*
+	 * Keep the object alive while it is unlocked.
+	 */
+	mutex_acquire(vmi_vmm_lock());
+	object->refcount++;
+	mutex_release(vmi_vmm_lock());
+	
+	page->busy = 1;
+	page->laundry = 1;
+	mutex_release(&evm_page_queue_lock);
+	mutex_release(&object->lock);
+	
+	object->pagerops->evm_page_out(object,page);
+	
+	mutex_acquire(&object->lock);
+	mutex_acquire(&evm_page_queue_lock);
+	page->laundry = 0;
+	page->busy = 0;
+	evmm_pageout_stats.laundered++;
+	
+	/*
+	 * Wake up anybody who faulted on it meanwhile.
+	 */
+	if(page->wanted) {
+		page->wanted = 0;
+		evmm_signal(object);
+	}
+	
+	/*
+	 * Written back, so the data isn't precious anymore.
+	 */
+	if(!page->dirty) page->precious = 0;
+}
+
+static void evmm_pageout_scan(void)
+{
+	evm_page_t*    page;
+	evmm_object_t* object;
+	
+	mutex_acquire(&evm_page_queue_lock);
+	
+	/*
+	 * Step 1, refill the inactive queue from the active queue,
+	 * taking the mappings of unreferenced pages down.
+	 */
+	uint target = (evm_page_active_count + evm_page_inactive_count) / 3;
+	uint budget = evm_page_active_count;
+	while(evm_page_inactive_count < target && budget--) {
+		page = list_peek_head_type(&evm_page_queue_active, evm_page_t, pageq);
+		if(!page) break;
+		evmm_pageout_stats.scanned++;
+		
+		object = page->object;
+		if(page->reference || mutex_acquire_timeout(&object->lock, 0) != NO_ERROR) {
+			page->reference = 0;
+			evm_page_activate(page);
+			continue;
+		}
+		
+		if(page->busy || page->wanted || page->wirecnt) {
+			evm_page_activate(page);
+		} else {
+			mutex_acquire(vmi_vmm_lock());
+			evm_page_unmap(page);
+			mutex_release(vmi_vmm_lock());
+			
+			evm_page_deactivate(page);
+			evmm_pageout_stats.deactivated++;
+		}
+		mutex_release(&object->lock);
+	}
+	
+	/*
+	 * Step 2, reclaim inactive pages.
+	 */
+	budget = evm_page_inactive_count;
+	while(pmm_count_free_pages() < evmm_pageout_high && budget--) {
+		page = list_peek_head_type(&evm_page_queue_inactive, evm_page_t, pageq);
+		if(!page) break;
+		evmm_pageout_stats.scanned++;
+		
+		object = page->object;
+		if(mutex_acquire_timeout(&object->lock, 0) != NO_ERROR) {
+			evm_page_deactivate(page);
+			continue;
+		}
+		
+		if(page->busy || page->wanted || page->wirecnt) {
+			evm_page_deactivate(page);
+			mutex_release(&object->lock);
+			continue;
+		}
+		
+		/*
+		 * Sample the reference bit.
+		 */
+		mutex_acquire(vmi_vmm_lock());
+		bool mapped = evm_page_mapped(page);
+		mutex_release(vmi_vmm_lock());
+		
+		if(page->reference || mapped) {
+			page->reference = 0;
+			evm_page_activate(page);
+			evmm_pageout_stats.reactivated++;
+			mutex_release(&object->lock);
+			continue;
+		}
+		
+		if(page->dirty || page->precious) {
+			/*
+			 * Without a way to write it back, the page has to stay.
+			 */
+			if(!object->pagerops->evm_page_out) {
+				evm_page_activate(page);
+				mutex_release(&object->lock);
+				continue;
+			}
+			
+			evmm_pageout_launder(object,page);
+			
+			/*
+			 * It may have been faulted in again, or failed to write.
+			 */
+			if(page->reference || page->dirty || page->precious || page->wanted) {
+				evm_page_deactivate(page);
+			} else {
+				evm_page_reclaim(page);
+				evmm_pageout_stats.freed++;
+			}
+			
+			/*
+			 * Dropping the last reference frees the object through
+			 * its pager, which needs both locks.
+			 */
+			mutex_release(&object->lock);
+			mutex_release(&evm_page_queue_lock);
+			evmm_release(object);
+			mutex_acquire(&evm_page_queue_lock);
+			continue;
+		}
+		
+		evm_page_reclaim(page);
+		evmm_pageout_stats.freed++;
+		
+		mutex_release(&object->lock);
+	}
+	
+	mutex_release(&evm_page_queue_lock);
+}
+
+static int evmm_pageout_thread(void* arg)
+{
+	for(;;) {
+		event_wait(&evmm_pageout_event);
+		evmm_pageout_stats.wakeups++;
+		
+		while(pmm_count_free_pages() < evmm_pageout_high) {
+			ulong progress = evmm_pageout_stats.freed + evmm_pageout_stats.laundered;
+			
+			evmm_pageout_scan();
+			
+			/*
+			 * Nothing left to reclaim.
+			 */
+			if(progress == evmm_pageout_stats.freed + evmm_pageout_stats.laundered) break;
+		}
+		
+		/*
+		 * Let everybody in evmm_page_wait() retry.
+		 */
+		event_signal(&evmm_pageout_done, true);
+		event_unsignal(&evmm_pageout_done);
+	}
+	return 0;
+}
+
+static void evmm_pageout_init(uint level)
+{
+	size_t pages = pmm_count_total_pages();
+	
+	evmm_pageout_low  = pages * EVMM_PAGEOUT_LOW_PERCENT / 100;
+	evmm_pageout_high = pages * EVMM_PAGEOUT_HIGH_PERCENT / 100;
+	
+	thread_detach_and_resume(thread_create("evmm pageout", &evmm_pageout_thread, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE));
+	evmm_pageout_running = true;
+}
+
+LK_INIT_HOOK(evmm_pageout, &evmm_pageout_init, LK_INIT_LEVEL_THREADING);
+
+static int cmd_evmm(int argc, const cmd_args *argv)
+{
+	if(argc < 2) {
+notenoughargs:
+		printf("not enough arguments\n");
+usage:
+		printf("usage:\n");
+		printf("%s pageout\n", argv[0].str);
+		printf("%s watermarks <low pages> <high pages>\n", argv[0].str);
+		return ERR_GENERIC;
+	}
+	
+	if(!strcmp(argv[1].str, "pageout")) {
+		printf("free pages %zu, watermarks low %zu high %zu\n",
+		       pmm_count_free_pages(), evmm_pageout_low, evmm_pageout_high);
+		printf("active %u inactive %u\n", evm_page_active_count, evm_page_inactive_count);
+		printf("wakeups %lu scanned %lu deactivated %lu reactivated %lu laundered %lu freed %lu\n",
+		       evmm_pageout_stats.wakeups, evmm_pageout_stats.scanned,
+		       evmm_pageout_stats.deactivated, evmm_pageout_stats.reactivated,
+		       evmm_pageout_stats.laundered, evmm_pageout_stats.freed);
+	} else if(!strcmp(argv[1].str, "watermarks")) {
+		if(argc < 4) goto notenoughargs;
+		if(argv[2].u > argv[3].u) {
+			printf("low watermark must not be above the high one\n");
+			return ERR_INVALID_ARGS;
+		}
+		
+		evmm_pageout_low  = argv[2].u;
+		evmm_pageout_high = argv[3].u;
+		
+		/*
+		 * Start right away if we are below the new mark.
+		 */
+		evmm_pageout_check(pmm_count_free_pages());
+	} else {
+		printf("unknown command\n");
+		goto usage;
+	}
+	
+	return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+#if LK_DEBUGLEVEL > 0
+STATIC_COMMAND("evmm", "evmm page-out daemon", &cmd_evmm)
+#endif
+STATIC_COMMAND_END(evmm);
@@ -33,11 +33,36 @@
 #include <pow2.h>
 #include <lib/console.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <arch/ops.h>
 
 #define LOCAL_TRACE 0
 
+/*
+ * Free pages live in per arena buddy free lists, one list per block order.
+ * The first page of every free block carries VM_PAGE_FLAG_FREE_HEAD and the
+ * block's order, so the buddy of a block being freed can be found and merged
+ * in constant time.
+ *
+ * In front of the arenas each cpu keeps a small magazine of single pages.
+ * Single page allocations and frees are served out of it under a per cpu
+ * spinlock and only move to and from the arenas in batches, under the global
+ * lock. Pages sitting in a magazine stay marked VM_PAGE_FLAG_NONFREE.
+ */
+#ifndef PMM_MAGAZINE_SIZE
+#define PMM_MAGAZINE_SIZE 64
+#endif
+#define PMM_MAGAZINE_BATCH (PMM_MAGAZINE_SIZE / 2)
+
+struct pmm_magazine {
+    spin_lock_t lock;
+    uint count;
+    vm_page_t *pages[PMM_MAGAZINE_SIZE];
+} __CPU_ALIGN;
+
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
 static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
+static struct pmm_magazine magazines[SMP_MAX_CPUS];
 
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
@@ -49,11 +74,255 @@ static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 #define ADDRESS_IN_ARENA(address, arena) \
     ((address) >= (arena)->base && (address) <= (arena)->base + (arena)->size - 1)
 
+static size_t count_free_pages_locked(void)
+{
+    DEBUG_ASSERT(is_mutex_held(&lock));
+
+    size_t count = 0;
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        count += a->free_count;
+    }
+
+    /* cached pages are as good as free, the count is only a hint anyway */
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        count += magazines[i].count;
+    }
+
+    return count;
+}
+
 static inline bool page_is_free(const vm_page_t *page)
 {
     return !(page->flags & VM_PAGE_FLAG_NONFREE);
 }
 
+/* insert the free block at index, merging it with its free buddies */
+static void buddy_free_block(pmm_arena_t *a, size_t index, uint order)
+{
+    size_t page_count = a->size / PAGE_SIZE;
+
+    while (order < PMM_MAX_ORDER) {
+        size_t buddy = index ^ (1UL << order);
+        if (buddy + (1UL << order) > page_count)
+            break;
+
+        vm_page_t *b = &a->page_array[buddy];
+        if (!(b->flags & VM_PAGE_FLAG_FREE_HEAD) || b->order != order)
+            break;
+
+        list_delete(&b->node);
+        b->flags &= ~VM_PAGE_FLAG_FREE_HEAD;
+
+        index &= ~(1UL << order);
+        order++;
+    }
+
+    vm_page_t *p = &a->page_array[index];
+    p->flags |= VM_PAGE_FLAG_FREE_HEAD;
+    p->order = order;
+    list_add_head(&a->free_lists[order], &p->node);
+}
+
+/* insert a run of free pages as maximal naturally aligned blocks */
+static void buddy_free_range(pmm_arena_t *a, size_t index, size_t count)
+{
+    while (count > 0) {
+        uint order = 0;
+        while (order < PMM_MAX_ORDER && !(index & (1UL << order)) && (2UL << order) <= count)
+            order++;
+
+        buddy_free_block(a, index, order);
+
+        index += 1UL << order;
+        count -= 1UL << order;
+    }
+}
+
+/* return the index of the free block holding page index, or -1 */
+static ssize_t buddy_find_block(const pmm_arena_t *a, size_t index)
+{
+    for (uint order = 0; order <= PMM_MAX_ORDER; order++) {
+        size_t head = index & ~((1UL << order) - 1);
+        const vm_page_t *p = &a->page_array[head];
+
+        if ((p->flags & VM_PAGE_FLAG_FREE_HEAD) && p->order == order)
+            return head;
+    }
+
+    return -1;
+}
+
+/* carve pages [start, start + count) out of the free block at index */
+static void buddy_take(pmm_arena_t *a, size_t index, size_t start, size_t count, struct list_node *list)
+{
+    vm_page_t *head = &a->page_array[index];
+    size_t block = 1UL << head->order;
+
+    DEBUG_ASSERT(head->flags & VM_PAGE_FLAG_FREE_HEAD);
+    DEBUG_ASSERT(start >= index && start + count <= index + block);
+
+    list_delete(&head->node);
+    head->flags &= ~VM_PAGE_FLAG_FREE_HEAD;
+
+    for (size_t i = start; i < start + count; i++) {
+        vm_page_t *p = &a->page_array[i];
+        DEBUG_ASSERT(page_is_free(p));
+
+        p->flags |= VM_PAGE_FLAG_NONFREE;
+        if (list)
+            list_add_tail(list, &p->node);
+    }
+    a->free_count -= count;
+
+    /* give back what's left on either side */
+    buddy_free_range(a, index, start - index);
+    buddy_free_range(a, start + count, index + block - start - count);
+}
+
+/* take an arbitrary run of free pages, which may span several blocks */
+static void take_run_locked(pmm_arena_t *a, size_t start, size_t count, struct list_node *list)
+{
+    size_t end = start + count;
+
+    while (start < end) {
+        ssize_t head = buddy_find_block(a, start);
+        DEBUG_ASSERT(head >= 0);
+
+        size_t block_end = head + (1UL << a->page_array[head].order);
+        size_t n = MIN(end, block_end) - start;
+
+        buddy_take(a, head, start, n, list);
+        start += n;
+    }
+}
+
+static uint alloc_pages_locked(uint count, struct list_node *list)
+{
+    DEBUG_ASSERT(is_mutex_held(&lock));
+
+    uint allocated = 0;
+
+    /* walk the arenas in order, allocating as many pages as we can from each */
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        while (allocated < count) {
+            vm_page_t *page = NULL;
+            for (uint order = 0; order <= PMM_MAX_ORDER && !page; order++) {
+                page = list_peek_head_type(&a->free_lists[order], vm_page_t, node);
+            }
+            if (!page)
+                break;
+
+            /* smallest block first, taking as much of it as needed */
+            size_t index = page - a->page_array;
+            size_t n = MIN(1UL << page->order, (size_t)(count - allocated));
+
+            buddy_take(a, index, index, n, list);
+            allocated += n;
+        }
+
+        if (allocated == count)
+            break;
+    }
+
+    return allocated;
+}
+
+static void free_page_locked(vm_page_t *page)
+{
+    DEBUG_ASSERT(is_mutex_held(&lock));
+
+    pmm_arena_t *a = page->arena;
+    DEBUG_ASSERT(PAGE_BELONGS_TO_ARENA(page, a));
+
+    page->flags &= ~VM_PAGE_FLAG_NONFREE;
+    buddy_free_block(a, page - a->page_array, 0);
+    a->free_count++;
+}
+
+static void free_list_locked(struct list_node *list)
+{
+    vm_page_t *page;
+    while ((page = list_remove_head_type(list, vm_page_t, node))) {
+        free_page_locked(page);
+    }
+}
+
+/* lock the current cpu's magazine, pinning us to the cpu while held */
+static struct pmm_magazine *magazine_lock(spin_lock_saved_state_t *state)
+{
+    arch_interrupt_save(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_magazine *m = &magazines[arch_curr_cpu_num()];
+    spin_lock(&m->lock);
+
+    return m;
+}
+
+static void magazine_unlock(struct pmm_magazine *m, spin_lock_saved_state_t state)
+{
+    spin_unlock(&m->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+static uint magazine_alloc(uint count, struct list_node *list)
+{
+    spin_lock_saved_state_t state;
+    struct pmm_magazine *m = magazine_lock(&state);
+
+    uint n = MIN(count, m->count);
+    for (uint i = 0; i < n; i++) {
+        list_add_tail(list, &m->pages[--m->count]->node);
+    }
+
+    magazine_unlock(m, state);
+
+    return n;
+}
+
+/* stash as many pages from list as fit, spilling a batch to overflow if full */
+static void magazine_free(struct list_node *list, struct list_node *overflow)
+{
+    spin_lock_saved_state_t state;
+    struct pmm_magazine *m = magazine_lock(&state);
+
+    vm_page_t *page;
+    while (m->count < PMM_MAGAZINE_SIZE &&
+            (page = list_remove_head_type(list, vm_page_t, node))) {
+        m->pages[m->count++] = page;
+    }
+
+    if (m->count == PMM_MAGAZINE_SIZE && !list_is_empty(list)) {
+        for (uint i = 0; i < PMM_MAGAZINE_BATCH; i++) {
+            list_add_tail(overflow, &m->pages[--m->count]->node);
+        }
+    }
+
+    magazine_unlock(m, state);
+}
+
+/* pull every cached page back into the arenas, for when the arenas run dry */
+static void magazine_drain_all(void)
+{
+    struct list_node drained = LIST_INITIAL_VALUE(drained);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct pmm_magazine *m = &magazines[i];
+        spin_lock_saved_state_t state;
+
+        spin_lock_irqsave(&m->lock, state);
+        while (m->count > 0) {
+            list_add_tail(&drained, &m->pages[--m->count]->node);
+        }
+        spin_unlock_irqrestore(&m->lock, state);
+    }
+
+    mutex_acquire(&lock);
+    free_list_locked(&drained);
+    mutex_release(&lock);
+}
+
 paddr_t vm_page_to_paddr(const vm_page_t *page)
 {
     pmm_arena_t *a;
@@ -102,7 +371,9 @@ done_add:
 
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++) {
+        list_initialize(&arena->free_lists[i]);
+    }
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
@@ -111,16 +382,14 @@ done_add:
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
 
-    /* add them to the free list */
     for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
-        p->arena = arena;
-
-        list_add_tail(&arena->free_list, &p->node);
-
-        arena->free_count++;
+        arena->page_array[i].arena = arena;
     }
 
+    /* add them to the free lists */
+    buddy_free_range(arena, 0, page_count);
+    arena->free_count = page_count;
+
     return NO_ERROR;
 }
 
@@ -132,31 +401,58 @@ size_t pmm_alloc_pages(uint count, struct list_node *list)
     DEBUG_ASSERT(list);
 
     uint allocated = 0;
+    size_t free_count;
     if (count == 0)
         return 0;
 
+    /* small requests are served from this cpu's magazine */
+    if (count <= PMM_MAGAZINE_BATCH) {
+        allocated = magazine_alloc(count, list);
+        if (allocated == count)
+            return allocated;
+    }
+
+    struct list_node batch = LIST_INITIAL_VALUE(batch);
+    bool refill = count <= PMM_MAGAZINE_BATCH;
+    bool drained = false;
+
+retry:
     mutex_acquire(&lock);
 
-    /* walk the arenas in order, allocating as many pages as we can from each */
-    pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                /* goto done; */
-                break;
+    allocated += alloc_pages_locked(count - allocated, list);
 
-            a->free_count--;
+    /* top the magazine back up while we have the lock */
+    if (refill)
+        alloc_pages_locked(PMM_MAGAZINE_BATCH, &batch);
 
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+    free_count = count_free_pages_locked();
+    mutex_release(&lock);
 
-            allocated++;
+    if (allocated < count && !drained) {
+        /* the arenas ran dry, the rest may be cached on other cpus */
+        magazine_drain_all();
+        drained = true;
+        goto retry;
+    }
+
+    if (refill && !list_is_empty(&batch)) {
+        struct list_node overflow = LIST_INITIAL_VALUE(overflow);
+
+        magazine_free(&batch, &overflow);
+
+        /* another thread filled the magazine in the meantime */
+        if (!list_is_empty(&batch) || !list_is_empty(&overflow)) {
+            mutex_acquire(&lock);
+            free_list_locked(&batch);
+            free_list_locked(&overflow);
+            free_count = count_free_pages_locked();
+            mutex_release(&lock);
         }
     }
 
-done:
-    mutex_release(&lock);
+    /* kick the page-out daemon if this ran us low */
+    evmm_pageout_check(free_count);
+
     return allocated;
 }
 
@@ -172,6 +468,9 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
 
     address = ROUNDDOWN(address, PAGE_SIZE);
 
+    /* pages we want may be sitting in a magazine */
+    magazine_drain_all();
+
     mutex_acquire(&lock);
 
     /* walk through the arenas, looking to see if the physical page belongs to it */
@@ -188,13 +487,8 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
-
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            take_run_locked(a, index, 1, list);
 
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -213,31 +507,27 @@ size_t pmm_free(struct list_node *list)
 
     DEBUG_ASSERT(list);
 
-    mutex_acquire(&lock);
-
     uint count = 0;
+    vm_page_t *page;
+    list_for_every_entry(list, page, vm_page_t, node) {
+        DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+        DEBUG_ASSERT(PAGE_BELONGS_TO_ARENA(page, page->arena));
+        count++;
+    }
+
+    /* feed the magazine, handing a batch back to the arenas each time it fills */
     while (!list_is_empty(list)) {
-        vm_page_t *page = list_remove_head_type(list, vm_page_t, node);
+        struct list_node overflow = LIST_INITIAL_VALUE(overflow);
 
-        DEBUG_ASSERT(!list_in_list(&page->node));
-        DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+        magazine_free(list, &overflow);
 
-        /* see which arena this page belongs to and add it */
-        pmm_arena_t *a;
-	a = page->arena;
-        /* list_for_every_entry(&arena_list, a, pmm_arena_t, node) { */
-            if (PAGE_BELONGS_TO_ARENA(page, a)) {
-                page->flags &= ~VM_PAGE_FLAG_NONFREE;
-
-                list_add_head(&a->free_list, &page->node);
-                a->free_count++;
-                count++;
-                break;
-            }
-        /*}*/
+        if (!list_is_empty(&overflow)) {
+            mutex_acquire(&lock);
+            free_list_locked(&overflow);
+            mutex_release(&lock);
+        }
     }
 
-    mutex_release(&lock);
     return count;
 }
 
@@ -289,6 +579,74 @@ size_t pmm_free_kpages(void *_ptr, uint count)
     return pmm_free(&list);
 }
 
+/* find an aligned run inside a single free block, smallest fitting order first */
+static bool find_run_buddy(const pmm_arena_t *a, uint count, uint8_t alignment_log2, size_t *start)
+{
+    uint order = 0;
+    while ((1UL << order) < count)
+        order++;
+
+    for (; order <= PMM_MAX_ORDER; order++) {
+        const vm_page_t *p;
+        list_for_every_entry(&a->free_lists[order], p, vm_page_t, node) {
+            size_t index = p - a->page_array;
+            paddr_t base = a->base + index * PAGE_SIZE;
+            paddr_t aligned = ROUNDUP(base, (paddr_t)1 << alignment_log2);
+            if (aligned < base)
+                continue;
+
+            size_t first = index + (aligned - base) / PAGE_SIZE;
+            if (first + count <= index + (1UL << order)) {
+                *start = first;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/* slow path: a linear scan finds runs that straddle blocks which could not be merged */
+static bool find_run_scan(const pmm_arena_t *a, uint count, uint8_t alignment_log2, size_t *start_out)
+{
+    /* walk the list starting at alignment boundaries.
+     * calculate the starting offset into this arena, based on the
+     * base address of the arena to handle the case where the arena
+     * is not aligned on the same boundary requested.
+     */
+    paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
+    if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        return false;
+
+    uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
+    uint start = aligned_offset;
+    LTRACEF("starting search at aligned offset %u\n", start);
+    LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+
+retry:
+    /* search while we're still within the arena and have a chance of finding a slot
+       (start + count < end of arena) */
+    while ((start < a->size / PAGE_SIZE) &&
+            ((start + count) <= a->size / PAGE_SIZE)) {
+        const vm_page_t *p = &a->page_array[start];
+        for (uint i = 0; i < count; i++) {
+            if (p->flags & VM_PAGE_FLAG_NONFREE) {
+                /* this run is broken, break out of the inner loop.
+                 * start over at the next alignment boundary
+                 */
+                start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
+                goto retry;
+            }
+            p++;
+        }
+
+        *start_out = start;
+        return true;
+    }
+
+    return false;
+}
+
 size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list)
 {
     LTRACEF("count %u, align %u\n", count, alignment_log2);
@@ -298,88 +656,105 @@ size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, str
     if (alignment_log2 < PAGE_SIZE_SHIFT)
         alignment_log2 = PAGE_SIZE_SHIFT;
 
+    bool drained = false;
+    size_t free_count;
+
+retry:
     mutex_acquire(&lock);
 
-    pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        // XXX make this a flag to only search kmap?
-        if (a->flags & PMM_ARENA_FLAG_KMAP) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+    /* try the buddy lists of every arena before falling back to scanning */
+    for (uint pass = 0; pass < 2; pass++) {
+        pmm_arena_t *a;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            // XXX make this a flag to only search kmap?
+            if (!(a->flags & PMM_ARENA_FLAG_KMAP))
                 continue;
 
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-            LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+            size_t start;
+            bool found = (pass == 0) ? find_run_buddy(a, count, alignment_log2, &start)
+                         : find_run_scan(a, count, alignment_log2, &start);
+            if (!found)
+                continue;
 
-retry:
-            /* search while we're still within the arena and have a chance of finding a slot
-               (start + count < end of arena) */
-            while ((start < a->size / PAGE_SIZE) &&
-                    ((start + count) <= a->size / PAGE_SIZE)) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
-                }
-
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
-
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
-
-                    if (list)
-                        list_add_tail(list, &p->node);
-                }
-
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
-
-                mutex_release(&lock);
-
-                return count;
-            }
+            /* we found a run */
+            LTRACEF("found run from pn %zu to %zu\n", start, start + count);
+
+            take_run_locked(a, start, count, list);
+
+            if (pa)
+                *pa = a->base + start * PAGE_SIZE;
+
+            free_count = count_free_pages_locked();
+            mutex_release(&lock);
+
+            evmm_pageout_check(free_count);
+
+            return count;
         }
     }
 
+    free_count = count_free_pages_locked();
     mutex_release(&lock);
 
+    if (!drained) {
+        /* pages cached in the magazines may be what's breaking up the run */
+        magazine_drain_all();
+        drained = true;
+        goto retry;
+    }
+
+    evmm_pageout_check(free_count);
+
     LTRACEF("couldn't find run\n");
     return 0;
 }
 
+size_t pmm_count_free_pages(void)
+{
+    mutex_acquire(&lock);
+    size_t count = count_free_pages_locked();
+    mutex_release(&lock);
+
+    return count;
+}
+
+size_t pmm_count_total_pages(void)
+{
+    size_t count = 0;
+
+    mutex_acquire(&lock);
+
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        count += a->size / PAGE_SIZE;
+    }
+
+    mutex_release(&lock);
+
+    return count;
+}
+
 static void dump_page(const vm_page_t *page)
 {
     printf("page %p: address 0x%lx flags 0x%x\n", page, vm_page_to_paddr(page), page->flags);
 }
 
-static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
+static void dump_arena(pmm_arena_t *arena, bool dump_pages)
 {
     printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x\n",
            arena, arena->name, arena->base, arena->size, arena->priority, arena->flags);
     printf("\tpage_array %p, free_count %zu\n",
            arena->page_array, arena->free_count);
 
+    /* dump the buddy lists */
+    printf("\tfree blocks by order:");
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++) {
+        size_t blocks = list_length(&arena->free_lists[i]);
+        if (blocks)
+            printf(" %u:%zu", i, blocks);
+    }
+    printf("\n");
+
     /* dump all of the pages */
     if (dump_pages) {
         for (size_t i = 0; i < arena->size / PAGE_SIZE; i++) {
@@ -432,6 +807,11 @@ usage:
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             dump_arena(a, false);
         }
+        printf("magazines:");
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            printf(" %u:%u", i, magazines[i].count);
+        }
+        printf("\n");
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 3) goto notenoughargs;
 
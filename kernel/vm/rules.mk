@@ -8,5 +8,6 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/vm.c \
 	$(LOCAL_DIR)/vmm.c \
 	$(LOCAL_DIR)/evmm.c \
+	$(LOCAL_DIR)/evmm_pageout.c \
 
 include make/module.mk
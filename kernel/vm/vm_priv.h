@@ -34,3 +34,12 @@ extern uintptr_t boot_alloc_end;
 void vmm_init_preheap(void);
 void vmm_init(void);
 
+/* wake the evmm page-out daemon if free memory dropped below its low watermark */
+void evmm_pageout_check(size_t free_pages);
+
+/* note a fault on a pageable evmm page, with the object lock held */
+struct evm_page;
+void evmm_page_referenced(struct evm_page *page, uint prot);
+
+/* print the evmm fault and fault-around counters */
+void evmm_dump_fault_stats(void);
@@ -25,9 +25,12 @@
 #include <assert.h>
 #include <err.h>
 #include <string.h>
+#include <rand.h>
+#include <arch/ops.h>
 #include <lib/console.h>
 #include <kernel/vm.h>
 #include <kernel/vmi.h>
+#include <kernel/evm.h>
 #include <kernel/mutex.h>
 #include "vm_priv.h"
 
@@ -132,7 +135,192 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
     return r;
 }
 
-/* add a region to the appropriate spot in the address space list,
+/*
+ * Besides the sorted region list, every aspace indexes its regions in an AVL
+ * tree keyed by base. Each node caches the size of the hole between the
+ * previous region and itself, plus the largest such hole in its subtree, so
+ * both address lookups and free space searches are O(log n).
+ */
+static inline int region_tree_height(const vmm_region_t *r)
+{
+    return r ? r->tree_height : 0;
+}
+
+static inline size_t region_tree_max_gap(const vmm_region_t *r)
+{
+    return r ? r->max_gap : 0;
+}
+
+/* first address past the previous region, the start of the gap in front of the next one */
+static inline vaddr_t region_gap_base(const vmm_aspace_t *aspace, const vmm_region_t *prev)
+{
+    return prev ? prev->base + prev->size : aspace->base;
+}
+
+static void region_tree_update(vmm_region_t *r)
+{
+    r->tree_height = MAX(region_tree_height(r->tree_left), region_tree_height(r->tree_right)) + 1;
+    r->max_gap = MAX(r->gap, MAX(region_tree_max_gap(r->tree_left), region_tree_max_gap(r->tree_right)));
+}
+
+static vmm_region_t *region_tree_rotate_left(vmm_region_t *r)
+{
+    vmm_region_t *right = r->tree_right;
+
+    r->tree_right = right->tree_left;
+    right->tree_left = r;
+    region_tree_update(r);
+    region_tree_update(right);
+
+    return right;
+}
+
+static vmm_region_t *region_tree_rotate_right(vmm_region_t *r)
+{
+    vmm_region_t *left = r->tree_left;
+
+    r->tree_left = left->tree_right;
+    left->tree_right = r;
+    region_tree_update(r);
+    region_tree_update(left);
+
+    return left;
+}
+
+static vmm_region_t *region_tree_balance(vmm_region_t *r)
+{
+    region_tree_update(r);
+
+    int balance = region_tree_height(r->tree_left) - region_tree_height(r->tree_right);
+    if (balance > 1) {
+        if (region_tree_height(r->tree_left->tree_left) < region_tree_height(r->tree_left->tree_right))
+            r->tree_left = region_tree_rotate_left(r->tree_left);
+        return region_tree_rotate_right(r);
+    } else if (balance < -1) {
+        if (region_tree_height(r->tree_right->tree_right) < region_tree_height(r->tree_right->tree_left))
+            r->tree_right = region_tree_rotate_right(r->tree_right);
+        return region_tree_rotate_left(r);
+    }
+
+    return r;
+}
+
+static vmm_region_t *region_tree_insert(vmm_region_t *root, vmm_region_t *r)
+{
+    if (!root) {
+        r->tree_left = r->tree_right = NULL;
+        region_tree_update(r);
+        return r;
+    }
+
+    if (r->base < root->base)
+        root->tree_left = region_tree_insert(root->tree_left, r);
+    else
+        root->tree_right = region_tree_insert(root->tree_right, r);
+
+    return region_tree_balance(root);
+}
+
+static vmm_region_t *region_tree_remove_min(vmm_region_t *root, vmm_region_t **min)
+{
+    if (!root->tree_left) {
+        *min = root;
+        return root->tree_right;
+    }
+
+    root->tree_left = region_tree_remove_min(root->tree_left, min);
+
+    return region_tree_balance(root);
+}
+
+static vmm_region_t *region_tree_remove(vmm_region_t *root, vmm_region_t *r)
+{
+    DEBUG_ASSERT(root);
+
+    if (r->base < root->base) {
+        root->tree_left = region_tree_remove(root->tree_left, r);
+    } else if (r->base > root->base) {
+        root->tree_right = region_tree_remove(root->tree_right, r);
+    } else {
+        DEBUG_ASSERT(root == r);
+
+        if (!r->tree_right)
+            return r->tree_left;
+
+        /* replace it with its successor */
+        vmm_region_t *min;
+        vmm_region_t *right = region_tree_remove_min(r->tree_right, &min);
+        min->tree_left = r->tree_left;
+        min->tree_right = right;
+        root = min;
+    }
+
+    return region_tree_balance(root);
+}
+
+/* refresh the cached max gaps on the way down to r after its gap changed */
+static void region_tree_update_path(vmm_region_t *root, const vmm_region_t *r)
+{
+    DEBUG_ASSERT(root);
+
+    if (r->base < root->base)
+        region_tree_update_path(root->tree_left, r);
+    else if (r->base > root->base)
+        region_tree_update_path(root->tree_right, r);
+
+    region_tree_update(root);
+}
+
+/* find the region with the highest base at or below vaddr */
+static vmm_region_t *region_tree_floor(const vmm_aspace_t *aspace, vaddr_t vaddr)
+{
+    vmm_region_t *r = aspace->region_tree;
+    vmm_region_t *found = NULL;
+
+    while (r) {
+        if (vaddr < r->base) {
+            r = r->tree_left;
+        } else {
+            found = r;
+            r = r->tree_right;
+        }
+    }
+
+    return found;
+}
+
+/* link a region into the list and tree right after prev (or at the head if NULL) */
+static void insert_region(vmm_aspace_t *aspace, vmm_region_t *prev, vmm_region_t *r)
+{
+    list_add_after(prev ? &prev->node : &aspace->region_list, &r->node);
+
+    r->gap = r->base - region_gap_base(aspace, prev);
+    aspace->region_tree = region_tree_insert(aspace->region_tree, r);
+
+    /* the region carved the front out of its successor's gap */
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    if (next) {
+        next->gap = next->base - region_gap_base(aspace, r);
+        region_tree_update_path(aspace->region_tree, next);
+    }
+}
+
+static void remove_region(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+
+    list_delete(&r->node);
+    aspace->region_tree = region_tree_remove(aspace->region_tree, r);
+
+    /* the successor's gap now reaches back to the previous region */
+    if (next) {
+        next->gap = next->base - region_gap_base(aspace, prev);
+        region_tree_update_path(aspace->region_tree, next);
+    }
+}
+
+/* add a region to the appropriate spot in the address space,
  * testing to see if there's a space */
 static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 {
@@ -150,35 +338,23 @@ static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 
     vaddr_t r_end = r->base + r->size - 1;
 
-    r->parent = aspace;
-
-    /* does it fit in front */
-    vmm_region_t *last;
-    last = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
-    if (!last || r_end < last->base) {
-        /* empty list or not empty and fits before the first element */
-        list_add_head(&aspace->region_list, &r->node);
-        return NO_ERROR;
-    }
+    /* find the neighbors it would go between */
+    vmm_region_t *prev = region_tree_floor(aspace, r->base);
+    vmm_region_t *next;
+    if (prev)
+        next = list_next_type(&aspace->region_list, &prev->node, vmm_region_t, node);
+    else
+        next = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
 
-    /* walk the list, finding the right spot to put it */
-    list_for_every_entry(&aspace->region_list, last, vmm_region_t, node) {
-        /* does it go after last? */
-        if (r->base > last->base + last->size - 1) {
-            /* get the next element in the list */
-            vmm_region_t *next = list_next_type(&aspace->region_list, &last->node, vmm_region_t, node);
-            if (!next || (r_end < next->base)) {
-                /* end of the list or next exists and it goes between them */
-                list_add_after(&last->node, &r->node);
-                return NO_ERROR;
-            }
-        }
+    if ((prev && r->base <= prev->base + prev->size - 1) || (next && r_end >= next->base)) {
+        LTRACEF("couldn't find spot\n");
+        return ERR_NO_MEMORY;
     }
 
-    r->parent = (vmm_aspace_t*)0;
+    r->parent = aspace;
+    insert_region(aspace, prev, r);
 
-    LTRACEF("couldn't find spot\n");
-    return ERR_NO_MEMORY;
+    return NO_ERROR;
 }
 
 /*
@@ -207,10 +383,7 @@ static inline bool check_gap(vmm_aspace_t *aspace,
 
     DEBUG_ASSERT(pva);
 
-    if (prev)
-        gap_beg = prev->base + prev->size;
-    else
-        gap_beg = aspace->base;
+    gap_beg = region_gap_base(aspace, prev);
 
     if (next) {
         if (gap_beg == next->base)
@@ -241,8 +414,31 @@ not_found:
     return true; /* not_found: stop search */
 }
 
+/*
+ *  Walk the gaps in the subtree in address order, skipping any subtree whose
+ *  largest gap can't hold the allocation. Returns true if the search stopped.
+ */
+static bool alloc_spot_in_tree(vmm_aspace_t *aspace, vmm_region_t *root,
+                               vaddr_t *pva, vaddr_t align, size_t size,
+                               uint arch_mmu_flags)
+{
+    if (!root || root->max_gap < size)
+        return false;
+
+    if (alloc_spot_in_tree(aspace, root->tree_left, pva, align, size, arch_mmu_flags))
+        return true;
+
+    if (root->gap >= size) {
+        vmm_region_t *prev = list_prev_type(&aspace->region_list, &root->node, vmm_region_t, node);
+        if (check_gap(aspace, prev, root, pva, align, size, arch_mmu_flags))
+            return true;
+    }
+
+    return alloc_spot_in_tree(aspace, root->tree_right, pva, align, size, arch_mmu_flags);
+}
+
 static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
-                          uint arch_mmu_flags, struct list_node **before)
+                          uint arch_mmu_flags)
 {
     DEBUG_ASSERT(aspace);
     DEBUG_ASSERT(size > 0 && IS_PAGE_ALIGNED(size));
@@ -254,29 +450,18 @@ static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
     vaddr_t align = 1UL << align_pow2;
 
     vaddr_t spot;
-    vmm_region_t *r = NULL;
 
-    /* try to pick spot at the beginning of address space */
-    if (check_gap(aspace, NULL,
-                  list_peek_head_type(&aspace->region_list, vmm_region_t, node),
-                  &spot, align, size, arch_mmu_flags))
-        goto done;
+    /* try the gaps in front of each region, lowest address first */
+    if (alloc_spot_in_tree(aspace, aspace->region_tree, &spot, align, size, arch_mmu_flags))
+        return spot;
 
-    /* search the middle of the list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if (check_gap(aspace, r,
-                      list_next_type(&aspace->region_list, &r->node, vmm_region_t, node),
-                      &spot, align, size, arch_mmu_flags))
-            goto done;
-    }
+    /* then the space past the last region */
+    if (check_gap(aspace, list_peek_tail_type(&aspace->region_list, vmm_region_t, node), NULL,
+                  &spot, align, size, arch_mmu_flags))
+        return spot;
 
     /* couldn't find anything */
     return -1;
-
-done:
-    if (before)
-        *before = r ? &r->node : &aspace->region_list;
-    return spot;
 }
 
 /* allocate a region structure and stick it in the address space */
@@ -299,10 +484,8 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
         }
     } else {
         /* allocate a virtual slot for it */
-        struct list_node *before = NULL;
-
-        vaddr = alloc_spot(aspace, size, align_pow2, arch_mmu_flags, &before);
-        LTRACEF("alloc_spot returns 0x%lx, before %p\n", vaddr, before);
+        vaddr = alloc_spot(aspace, size, align_pow2, arch_mmu_flags);
+        LTRACEF("alloc_spot returns 0x%lx\n", vaddr);
 
         if (vaddr == (vaddr_t)-1) {
             LTRACEF("failed to find spot\n");
@@ -310,12 +493,15 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
             return NULL;
         }
 
-        DEBUG_ASSERT(before != NULL);
-
         r->base = (vaddr_t)vaddr;
 
         /* add it to the region list */
-        list_add_after(before, &r->node);
+        status_t err = add_region_to_aspace(aspace, r);
+        DEBUG_ASSERT(err == NO_ERROR);
+        if (err < 0) {
+            free(r);
+            return NULL;
+        }
     }
 
     return r;
@@ -579,6 +765,66 @@ err:
     return err;
 }
 
+status_t vmm_alloc_object(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr,
+                          uint8_t align_pow2, uint vmm_flags, evmm_object_t *object)
+{
+    LTRACEF("aspace %p name '%s' size 0x%zx ptr %p align %hhu vmm_flags 0x%x object %p\n",
+            aspace, name, size, ptr ? *ptr : 0, align_pow2, vmm_flags, object);
+
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT(object);
+
+    size = ROUNDUP(size, PAGE_SIZE);
+    if (size == 0)
+        return ERR_INVALID_ARGS;
+
+    if (!name)
+        name = "";
+
+    vaddr_t vaddr = 0;
+
+    /* if they're asking for a specific spot, copy the address */
+    if (vmm_flags & VMM_FLAG_VALLOC_SPECIFIC) {
+        /* can't ask for a specific spot and then not provide one */
+        if (!ptr)
+            return ERR_INVALID_ARGS;
+        vaddr = (vaddr_t)*ptr;
+    }
+
+    mutex_acquire(&vmm_lock);
+
+    /* allocate a region and put it in the aspace list, nothing gets mapped until it faults */
+    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
+                                   VMM_REGION_FLAG_EXTENDED, 0);
+    if (!r) {
+        mutex_release(&vmm_lock);
+        return ERR_NO_MEMORY;
+    }
+
+    r->e_object = object;
+    object->refcount++;
+    list_add_tail(&object->e_list, &r->e_node);
+
+    /* return the vaddr if requested */
+    if (ptr)
+        *ptr = (void *)r->base;
+
+    mutex_release(&vmm_lock);
+    return NO_ERROR;
+}
+
+/* drop the region's reference to its evmm object, returns true if it was the last one */
+static bool release_region_object(vmm_region_t *r)
+{
+    DEBUG_ASSERT(is_mutex_held(&vmm_lock));
+
+    if (!(r->flags & VMM_REGION_FLAG_EXTENDED))
+        return false;
+
+    list_delete(&r->e_node);
+    return --r->e_object->refcount == 0;
+}
+
 static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
 {
     vmm_region_t *r;
@@ -588,11 +834,10 @@ static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
     if (!aspace)
         return NULL;
 
-    /* search the region list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if ((vaddr >= r->base) && (vaddr <= r->base + r->size - 1))
-            return r;
-    }
+    /* search the region tree */
+    r = region_tree_floor(aspace, vaddr);
+    if (r && vaddr <= r->base + r->size - 1)
+        return r;
 
     return NULL;
 }
@@ -614,13 +859,18 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
     }
 
     /* remove it from aspace */
-    list_delete(&r->node);
+    remove_region(aspace, r);
 
     /* unmap it */
     arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
 
+    bool free_object = release_region_object(r);
+
     mutex_release(&vmm_lock);
 
+    if (free_object)
+        evmm_destroy(r->e_object);
+
     /* return physical pages if any */
     pmm_free(&r->page_list);
 
@@ -693,11 +943,20 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
 
         /* unmap it */
         arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
+
+        /* the object reference is dropped below */
+        if (r->flags & VMM_REGION_FLAG_EXTENDED)
+            list_delete(&r->e_node);
     }
+    aspace->region_tree = NULL;
     mutex_release(&vmm_lock);
 
     /* without the vmm lock held, free all of the pmm pages and the structure */
     while ((r = list_remove_head_type(&region_list, vmm_region_t, node))) {
+        /* drop the reference to the object backing it, if any */
+        if (r->flags & VMM_REGION_FLAG_EXTENDED)
+            evmm_release(r->e_object);
+
         /* return physical pages if any */
         pmm_free(&r->page_list);
 
@@ -766,6 +1025,84 @@ static void dump_aspace(const vmm_aspace_t *a)
     }
 }
 
+#define BENCH_LOOKUPS 100000
+#define BENCH_ADDRS 1024
+
+/* time the fault path region lookup and first fit allocation in a detached
+ * aspace holding count regions separated by random sized holes */
+static void bench_region_lookup(uint count)
+{
+    vmm_aspace_t *aspace = calloc(1, sizeof(vmm_aspace_t));
+    vaddr_t *addrs = malloc(sizeof(vaddr_t) * BENCH_ADDRS);
+    vmm_region_t **regions = calloc(count, sizeof(vmm_region_t *));
+    if (!aspace || !addrs || !regions) {
+        printf("failed to allocate benchmark state\n");
+        goto out;
+    }
+
+    aspace->base = KERNEL_ASPACE_BASE;
+    aspace->size = KERNEL_ASPACE_SIZE;
+    list_initialize(&aspace->region_list);
+
+    vaddr_t va = aspace->base;
+    uint inserted;
+    uint cycles = arch_cycle_count();
+    for (inserted = 0; inserted < count; inserted++) {
+        va += (1 + rand() % 4) * PAGE_SIZE;
+        vmm_region_t *r = alloc_region_struct("bench", va, (1 + rand() % 2) * PAGE_SIZE, 0, 0);
+        if (!r || add_region_to_aspace(aspace, r) < 0) {
+            free(r);
+            break;
+        }
+        regions[inserted] = r;
+        va += r->size;
+    }
+    cycles = arch_cycle_count() - cycles;
+    if (inserted == 0)
+        goto out;
+
+    printf("%u regions: %u cycles per insert", inserted, cycles / inserted);
+
+    for (uint i = 0; i < BENCH_ADDRS; i++) {
+        vmm_region_t *r = regions[rand() % inserted];
+        addrs[i] = r->base + rand() % r->size;
+    }
+
+    uint hits = 0;
+    cycles = arch_cycle_count();
+    for (uint i = 0; i < BENCH_LOOKUPS; i++) {
+        if (vmm_find_region(aspace, addrs[i % BENCH_ADDRS]))
+            hits++;
+    }
+    cycles = arch_cycle_count() - cycles;
+
+    printf(", %u cycles per lookup (%u/%u hits)", cycles / BENCH_LOOKUPS, hits, BENCH_LOOKUPS);
+
+    /* first fit allocations have to find the holes between the regions */
+    uint allocs = MIN(count, 1000U);
+    cycles = arch_cycle_count();
+    for (uint i = 0; i < allocs; i++) {
+        if (!alloc_region(aspace, "bench", PAGE_SIZE * 2, 0, 0, 0, 0, 0))
+            break;
+    }
+    cycles = arch_cycle_count() - cycles;
+
+    printf(", %u cycles per alloc\n", cycles / allocs);
+
+out:
+    if (aspace && aspace->region_list.next) {
+        vmm_region_t *r;
+        while ((r = list_peek_head_type(&aspace->region_list, vmm_region_t, node))) {
+            remove_region(aspace, r);
+            free(r);
+        }
+        DEBUG_ASSERT(aspace->region_tree == NULL);
+    }
+    free(regions);
+    free(addrs);
+    free(aspace);
+}
+
 static int cmd_vmm(int argc, const cmd_args *argv)
 {
     if (argc < 2) {
@@ -782,6 +1119,8 @@ usage:
         printf("%s create_test_aspace\n", argv[0].str);
         printf("%s free_aspace <address>\n", argv[0].str);
         printf("%s set_test_aspace <address>\n", argv[0].str);
+        printf("%s bench_lookup\n", argv[0].str);
+        printf("%s faults\n", argv[0].str);
         return ERR_GENERIC;
     }
 
@@ -852,6 +1191,12 @@ usage:
         test_aspace = (void *)argv[2].u;
         get_current_thread()->aspace = test_aspace;
         thread_sleep(1); // XXX hack to force it to reschedule and thus load the aspace
+    } else if (!strcmp(argv[1].str, "bench_lookup")) {
+        bench_region_lookup(10);
+        bench_region_lookup(100);
+        bench_region_lookup(10000);
+    } else if (!strcmp(argv[1].str, "faults")) {
+        evmm_dump_fault_stats();
     } else {
         printf("unknown command\n");
         goto usage;
@@ -27,16 +27,51 @@
 #include <sys/types.h>
 #include <debug.h>
 #include <trace.h>
+#include <err.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
 
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
+
 #define LOCAL_TRACE 0
 
+/* Bytes of block buffers shared by every cache. A cache can always hold the number
+ * of blocks it was created with, and takes more from here while there's room. */
+#ifndef BCACHE_POOL_SIZE
+#define BCACHE_POOL_SIZE (1024 * 1024)
+#endif
+
+/* each cache is split into shards with their own lock, index and lists. runs of
+ * BCACHE_SHARD_RUN adjacent blocks land in the same shard */
+#define BCACHE_SHARDS       4
+#define BCACHE_SHARD_RUN    8
+#define BCACHE_HASH_BUCKETS 64
+
+/* most blocks moved in one device request by write-back or read-ahead */
+#define BCACHE_MAX_RUN      32
+#define BCACHE_READAHEAD_MIN 4
+
+/* dirty blocks are written back this often (ms), or sooner once a shard is
+ * BCACHE_WB_DIRTY_PCT percent dirty */
+#define BCACHE_WB_INTERVAL  1000
+#define BCACHE_WB_DIRTY_PCT 25
+
 struct bcache_block {
-    struct list_node node;
+    struct list_node node;          // on the shard's active or inactive list
+    struct list_node hash_node;
+    struct list_node dirty_node;
     bnum_t blocknum;
     int ref_count;
     bool is_dirty;
+    bool is_active;                 // used again since it was brought in
+    bool readahead;                 // brought in by read-ahead and not used yet
+    bool pooled;                    // counted against the shared pool
     void *ptr;
 };
 
@@ -46,169 +81,391 @@ struct bcache_stats {
     uint32_t misses;
     uint32_t reads;
     uint32_t writes;
+    uint32_t evictions;
+    uint32_t dirty_evictions;       // evictions that had to write the block out first
+    uint32_t coalesced;             // blocks written in the same request as the one before them
+    uint32_t readahead;             // blocks brought in ahead of use
+    uint32_t readahead_hits;
+};
+
+/*
+ * Replacement is 2Q style: blocks come in on the inactive list and move to the active
+ * list when they're used again, so one pass over a big file only churns the inactive
+ * list and leaves the metadata that's used over and over alone. Victims come off the
+ * cold end of the inactive list first.
+ */
+struct bcache_shard {
+    mutex_t lock;
+    struct list_node hash[BCACHE_HASH_BUCKETS];
+    struct list_node inactive_list;
+    struct list_node active_list;
+    struct list_node dirty_list;
+    uint count;
+    uint active_count;
+    uint dirty_count;
+    uint reserve;                   // blocks held no matter how full the pool is
+    uint32_t gen;                   // bumped whenever a block joins or leaves the index
+    struct bcache_stats stats;
 };
 
 struct bcache {
+    struct list_node node;
     bdev_t *dev;
     size_t block_size;
     int count;
-    struct bcache_stats stats;
+    uint dev_blocks_per_block;      // 0 if the cache blocks aren't whole device blocks
+
+    struct bcache_shard shards[BCACHE_SHARDS];
 
-    struct list_node free_list;
-    struct list_node lru_list;
+    /* write-back and read-ahead share the bounce buffer */
+    mutex_t io_lock;
+    void *io_buf;
 
-    struct bcache_block *blocks;
+    /* sequential access detection for read-ahead, only a hint so not locked */
+    bnum_t next_seq;
+    bnum_t ra_next;
+    uint ra_window;
 };
 
+static struct list_node bcache_list = LIST_INITIAL_VALUE(bcache_list);
+static mutex_t bcache_list_lock = MUTEX_INITIAL_VALUE(bcache_list_lock);
+
+static spin_lock_t bcache_pool_lock = SPIN_LOCK_INITIAL_VALUE;
+static size_t bcache_pool_used;
+
+static event_t bcache_wb_event = EVENT_INITIAL_VALUE(bcache_wb_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+static thread_t *bcache_wb_thread;
+
+static int bcache_wb_worker(void *arg);
+
+static inline struct bcache_shard *block_shard(struct bcache *cache, bnum_t blocknum)
+{
+    return &cache->shards[(blocknum / BCACHE_SHARD_RUN) % BCACHE_SHARDS];
+}
+
+static inline struct list_node *block_bucket(struct bcache_shard *shard, bnum_t blocknum)
+{
+    /* squeeze out the bits that picked the shard */
+    bnum_t index = blocknum / (BCACHE_SHARD_RUN * BCACHE_SHARDS) * BCACHE_SHARD_RUN +
+                   blocknum % BCACHE_SHARD_RUN;
+    return &shard->hash[index % BCACHE_HASH_BUCKETS];
+}
+
+/* take size bytes from the shared pool, or let force run it over */
+static bool pool_take(size_t size, bool force)
+{
+    bool ret = false;
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&bcache_pool_lock, state);
+    if (force || bcache_pool_used + size <= BCACHE_POOL_SIZE) {
+        bcache_pool_used += size;
+        ret = true;
+    }
+    spin_unlock_irqrestore(&bcache_pool_lock, state);
+
+    return ret;
+}
+
+static void pool_return(size_t size)
+{
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&bcache_pool_lock, state);
+    DEBUG_ASSERT(bcache_pool_used >= size);
+    bcache_pool_used -= size;
+    spin_unlock_irqrestore(&bcache_pool_lock, state);
+}
+
+static ssize_t cache_read(struct bcache *cache, void *buf, bnum_t blocknum, uint count)
+{
+    if (cache->dev_blocks_per_block)
+        return bio_read_block(cache->dev, buf, blocknum * cache->dev_blocks_per_block,
+                              count * cache->dev_blocks_per_block);
+
+    return bio_read(cache->dev, buf, (off_t)blocknum * cache->block_size, count * cache->block_size);
+}
+
+static ssize_t cache_write(struct bcache *cache, const void *buf, bnum_t blocknum, uint count)
+{
+    if (cache->dev_blocks_per_block)
+        return bio_write_block(cache->dev, buf, blocknum * cache->dev_blocks_per_block,
+                               count * cache->dev_blocks_per_block);
+
+    return bio_write(cache->dev, buf, (off_t)blocknum * cache->block_size, count * cache->block_size);
+}
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 {
     struct bcache *cache;
 
-    cache = malloc(sizeof(struct bcache));
+    cache = calloc(1, sizeof(struct bcache));
+    if (!cache)
+        return NULL;
+
+    cache->io_buf = malloc(block_size * BCACHE_MAX_RUN);
+    if (!cache->io_buf) {
+        free(cache);
+        return NULL;
+    }
 
     cache->dev = dev;
     cache->block_size = block_size;
     cache->count = block_count;
-    memset(&cache->stats, 0, sizeof(cache->stats));
-
-    list_initialize(&cache->free_list);
-    list_initialize(&cache->lru_list);
-
-    cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
-    int i;
-    for (i=0; i < block_count; i++) {
-        cache->blocks[i].ref_count = 0;
-        cache->blocks[i].is_dirty = false;
-        cache->blocks[i].ptr = malloc(block_size);
-        // add to the free list
-        list_add_head(&cache->free_list, &cache->blocks[i].node);
+    if (dev->block_size && block_size % dev->block_size == 0)
+        cache->dev_blocks_per_block = block_size / dev->block_size;
+    mutex_init(&cache->io_lock);
+    cache->ra_window = BCACHE_READAHEAD_MIN;
+
+    for (uint i = 0; i < BCACHE_SHARDS; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
+
+        mutex_init(&shard->lock);
+        for (uint b = 0; b < BCACHE_HASH_BUCKETS; b++)
+            list_initialize(&shard->hash[b]);
+        list_initialize(&shard->inactive_list);
+        list_initialize(&shard->active_list);
+        list_initialize(&shard->dirty_list);
+        shard->reserve = (block_count + BCACHE_SHARDS - 1) / BCACHE_SHARDS;
+    }
+
+    mutex_acquire(&bcache_list_lock);
+    list_add_tail(&bcache_list, &cache->node);
+    if (!bcache_wb_thread) {
+        bcache_wb_thread = thread_create("bcache writeback", &bcache_wb_worker, NULL,
+                                         LOW_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_detach_and_resume(bcache_wb_thread);
     }
+    mutex_release(&bcache_list_lock);
 
     return (bcache_t)cache;
 }
 
-static int flush_block(struct bcache *cache, struct bcache_block *block)
+static void free_block(struct bcache *cache, struct bcache_block *block)
+{
+    if (block->pooled)
+        pool_return(cache->block_size);
+    free(block->ptr);
+    free(block);
+}
+
+static void set_dirty(struct bcache_shard *shard, struct bcache_block *block, bool dirty)
+{
+    if (block->is_dirty == dirty)
+        return;
+
+    block->is_dirty = dirty;
+    if (dirty) {
+        list_add_tail(&shard->dirty_list, &block->dirty_node);
+        shard->dirty_count++;
+
+        /* get the write-back thread going early if a lot is piling up */
+        if (shard->dirty_count * 100 > shard->count * BCACHE_WB_DIRTY_PCT)
+            event_signal(&bcache_wb_event, false);
+    } else {
+        list_delete(&block->dirty_node);
+        shard->dirty_count--;
+    }
+}
+
+static int flush_block(struct bcache *cache, struct bcache_shard *shard, struct bcache_block *block)
 {
     int rc;
 
-    rc = bio_write(cache->dev, block->ptr,
-                   (off_t)block->blocknum * cache->block_size,
-                   cache->block_size);
+    DEBUG_ASSERT(is_mutex_held(&shard->lock));
+
+    rc = cache_write(cache, block->ptr, block->blocknum, 1);
     if (rc < 0)
         goto exit;
 
-    block->is_dirty = false;
-    cache->stats.writes++;
+    set_dirty(shard, block, false);
+    shard->stats.writes++;
     rc = 0;
 exit:
     return (rc);
 }
 
-void bcache_destroy(bcache_t _cache)
+static void unlink_block(struct bcache_shard *shard, struct bcache_block *block)
 {
-    struct bcache *cache = _cache;
-    int i;
+    DEBUG_ASSERT(block->ref_count == 0);
+    DEBUG_ASSERT(!block->is_dirty);
+
+    list_delete(&block->node);
+    list_delete(&block->hash_node);
+    if (block->is_active)
+        shard->active_count--;
+    shard->count--;
+    shard->gen++;
+}
 
-    for (i=0; i < cache->count; i++) {
-        DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
+static void insert_block(struct bcache_shard *shard, struct bcache_block *block, bnum_t blocknum)
+{
+    block->blocknum = blocknum;
+    block->ref_count = 0;
+    block->is_active = false;
+    block->readahead = false;
+    list_add_head(block_bucket(shard, blocknum), &block->hash_node);
+    list_add_head(&shard->inactive_list, &block->node);
+    shard->count++;
+    shard->gen++;
+}
 
-        if (cache->blocks[i].is_dirty)
-            printf("warning: freeing dirty block %u\n",
-                   cache->blocks[i].blocknum);
+/* look a block up without counting it as a use */
+static struct bcache_block *lookup_block(struct bcache_shard *shard, bnum_t blocknum, uint32_t *depth)
+{
+    struct bcache_block *block;
 
-        free(cache->blocks[i].ptr);
+    list_for_every_entry(block_bucket(shard, blocknum), block, struct bcache_block, hash_node) {
+        if (depth)
+            (*depth)++;
+        if (block->blocknum == blocknum)
+            return block;
     }
 
-    free(cache);
+    return NULL;
 }
 
 /* find a block if it's already present */
-static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
+static struct bcache_block *find_block(struct bcache_shard *shard, bnum_t blocknum)
 {
     uint32_t depth = 0;
     struct bcache_block *block;
 
     LTRACEF("num %u\n", blocknum);
 
-    block = NULL;
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
-        depth++;
+    DEBUG_ASSERT(is_mutex_held(&shard->lock));
 
-        if (block->blocknum == blocknum) {
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            cache->stats.hits++;
-            cache->stats.depth += depth;
-            return block;
+    block = lookup_block(shard, blocknum, &depth);
+    if (!block) {
+        shard->stats.misses++;
+        return NULL;
+    }
+
+    shard->stats.hits++;
+    shard->stats.depth += depth;
+
+    if (block->readahead) {
+        block->readahead = false;
+        shard->stats.readahead_hits++;
+    }
+
+    /* a second use promotes it to the active list, keep that to half the shard */
+    list_delete(&block->node);
+    list_add_head(&shard->active_list, &block->node);
+    if (!block->is_active) {
+        block->is_active = true;
+        shard->active_count++;
+
+        if (shard->active_count > shard->count / 2) {
+            struct bcache_block *cold = list_peek_tail_type(&shard->active_list, struct bcache_block, node);
+            list_delete(&cold->node);
+            list_add_head(&shard->inactive_list, &cold->node);
+            cold->is_active = false;
+            shard->active_count--;
         }
     }
 
-    cache->stats.misses++;
-    return NULL;
+    return block;
 }
 
-/* allocate a new block */
-static struct bcache_block *alloc_block(struct bcache *cache)
+/* unhook the coldest unreferenced block for reuse, preferring clean ones */
+static struct bcache_block *evict_block(struct bcache *cache, struct bcache_shard *shard)
 {
-    int err;
-    struct bcache_block *block;
+    struct bcache_block *victim = NULL;
+    struct bcache_block *dirty = NULL;
+    struct list_node *lists[] = { &shard->inactive_list, &shard->active_list };
+
+    for (uint i = 0; i < countof(lists) && !victim; i++) {
+        for (struct list_node *n = list_peek_tail(lists[i]); n; n = list_prev(lists[i], n)) {
+            struct bcache_block *block = containerof(n, struct bcache_block, node);
+            if (block->ref_count > 0)
+                continue;
+            if (!block->is_dirty) {
+                victim = block;
+                break;
+            }
+            if (!dirty)
+                dirty = block;
+        }
+    }
+
+    if (!victim)
+        victim = dirty;
+    if (!victim)
+        return NULL;
 
-    /* pop one off the free list if it's present */
-    block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
-    if (block) {
-        block->ref_count = 0;
-        list_add_tail(&cache->lru_list, &block->node);
-        LTRACEF("found block %p on free list\n", block);
-        return block;
+    if (victim->is_dirty) {
+        if (flush_block(cache, shard, victim) < 0)
+            return NULL;
+        shard->stats.dirty_evictions++;
     }
 
-    /* walk the lru, looking for a free block */
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-        if (block->ref_count == 0) {
-            if (block->is_dirty) {
-                err = flush_block(cache, block);
-                if (err)
-                    return NULL;
-            }
+    LTRACEF("evicting block %u\n", victim->blocknum);
+    unlink_block(shard, victim);
+    shard->stats.evictions++;
+
+    return victim;
+}
 
-            // add it to the tail of the lru
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
+/* allocate a new block */
+static struct bcache_block *alloc_block(struct bcache *cache, struct bcache_shard *shard)
+{
+    struct bcache_block *block;
+
+    DEBUG_ASSERT(is_mutex_held(&shard->lock));
+
+    /* grow while under the reserve or while the pool has room, otherwise reuse the
+     * coldest block, and if every block is in use go over the pool rather than fail */
+    bool pooled = shard->count >= shard->reserve;
+    if (pooled && !pool_take(cache->block_size, false)) {
+        block = evict_block(cache, shard);
+        if (block)
             return block;
-        }
+
+        pool_take(cache->block_size, true);
     }
 
-    return NULL;
+    block = calloc(1, sizeof(struct bcache_block));
+    if (block)
+        block->ptr = malloc(cache->block_size);
+    if (!block || !block->ptr) {
+        free(block);
+        if (pooled)
+            pool_return(cache->block_size);
+        return NULL;
+    }
+    block->pooled = pooled;
+
+    return block;
 }
 
-static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum)
+static struct bcache_block *find_or_fill_block(struct bcache *cache, struct bcache_shard *shard, uint blocknum)
 {
     int err;
 
     LTRACEF("block %u\n", blocknum);
 
     /* see if it's already in the cache */
-    struct bcache_block *block = find_block(cache, blocknum);
+    struct bcache_block *block = find_block(shard, blocknum);
     if (block == NULL) {
         LTRACEF("wasn't allocated\n");
 
         /* allocate a new block and fill it */
-        block = alloc_block(cache);
-        DEBUG_ASSERT(block);
+        block = alloc_block(cache, shard);
+        if (!block)
+            return NULL;
 
         LTRACEF("wasn't allocated, new block %p\n", block);
 
-        block->blocknum = blocknum;
-        err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
+        err = cache_read(cache, block->ptr, blocknum, 1);
         if (err < 0) {
             /* free the block, return an error */
-            list_add_tail(&cache->free_list, &block->node);
+            free_block(cache, block);
             return NULL;
         }
 
-        cache->stats.reads++;
+        insert_block(shard, block, blocknum);
+        shard->stats.reads++;
     }
 
     DEBUG_ASSERT(block->blocknum == blocknum);
@@ -216,39 +473,133 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
     return block;
 }
 
+/* Once reads look sequential, read the blocks ahead of them in one request, doubling
+ * the window each time the reader catches up with it. */
+static void bcache_readahead(struct bcache *cache, bnum_t blocknum)
+{
+    bool sequential = (blocknum == cache->next_seq);
+    cache->next_seq = blocknum + 1;
+
+    if (!sequential) {
+        cache->ra_window = BCACHE_READAHEAD_MIN;
+        cache->ra_next = 0;
+        return;
+    }
+
+    if (cache->ra_next <= blocknum)
+        cache->ra_next = blocknum + 1;
+
+    /* still well ahead of the reader */
+    if (cache->ra_next - blocknum > cache->ra_window / 2)
+        return;
+
+    bnum_t cache_blocks = cache->dev->total_size / cache->block_size;
+    bnum_t start = cache->ra_next;
+    uint count = MIN(cache->ra_window, (uint)BCACHE_MAX_RUN);
+    if (start >= cache_blocks)
+        return;
+    count = MIN(count, cache_blocks - start);
+
+    /* stop short of anything already there. the shard generations say whether that
+     * still holds once the read is done, a block may have been read, written back and
+     * evicted in the meantime, and then what was read ahead is stale */
+    uint32_t gen[BCACHE_SHARDS];
+    bool seen[BCACHE_SHARDS] = { false };
+    for (uint i = 0; i < count; i++) {
+        uint s = block_shard(cache, start + i) - cache->shards;
+        struct bcache_shard *shard = &cache->shards[s];
+        mutex_acquire(&shard->lock);
+        bool present = lookup_block(shard, start + i, NULL) != NULL;
+        bool changed = seen[s] && shard->gen != gen[s];
+        gen[s] = shard->gen;
+        seen[s] = true;
+        mutex_release(&shard->lock);
+        if (present || changed) {
+            count = i;
+            break;
+        }
+    }
+
+    cache->ra_next = start + MAX(count, 1U);
+    cache->ra_window = MIN(cache->ra_window * 2, (uint)BCACHE_MAX_RUN);
+    if (count == 0)
+        return;
+
+    LTRACEF("reading ahead %u blocks at %u\n", count, start);
+
+    mutex_acquire(&cache->io_lock);
+
+    if (cache_read(cache, cache->io_buf, start, count) < 0)
+        goto done;
+
+    for (uint i = 0; i < count; i++) {
+        uint s = block_shard(cache, start + i) - cache->shards;
+        struct bcache_shard *shard = &cache->shards[s];
+        mutex_acquire(&shard->lock);
+        if (shard->gen == gen[s]) {
+            struct bcache_block *block = alloc_block(cache, shard);
+            if (block) {
+                memcpy(block->ptr, (uint8_t *)cache->io_buf + i * cache->block_size, cache->block_size);
+                insert_block(shard, block, start + i);
+                block->readahead = true;
+                shard->stats.readahead++;
+            }
+            /* our own changes don't count */
+            gen[s] = shard->gen;
+        }
+        mutex_release(&shard->lock);
+    }
+
+done:
+    mutex_release(&cache->io_lock);
+}
+
 int bcache_read_block(bcache_t _cache, void *buf, uint blocknum)
 {
     struct bcache *cache = _cache;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
 
     LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+    struct bcache_block *block = find_or_fill_block(cache, shard, blocknum);
     if (block == NULL) {
         /* error */
+        mutex_release(&shard->lock);
         return -1;
     }
 
     memcpy(buf, block->ptr, cache->block_size);
+    mutex_release(&shard->lock);
+
+    bcache_readahead(cache, blocknum);
+
     return 0;
 }
 
 int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 {
     struct bcache *cache = _cache;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
 
     LTRACEF("ptr %p, blocknum %u\n", ptr, blocknum);
 
     DEBUG_ASSERT(ptr);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+    struct bcache_block *block = find_or_fill_block(cache, shard, blocknum);
     if (block == NULL) {
         /* error */
+        mutex_release(&shard->lock);
         return -1;
     }
 
     /* increment the ref count to keep it from being freed */
     block->ref_count++;
     *ptr = block->ptr;
+    mutex_release(&shard->lock);
+
+    bcache_readahead(cache, blocknum);
 
     return 0;
 }
@@ -256,16 +607,19 @@ int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 int bcache_put_block(bcache_t _cache, uint blocknum)
 {
     struct bcache *cache = _cache;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
 
     LTRACEF("blocknum %u\n", blocknum);
 
-    struct bcache_block *block = find_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+    struct bcache_block *block = lookup_block(shard, blocknum, NULL);
 
     /* be pretty hard on the caller for now */
     DEBUG_ASSERT(block);
     DEBUG_ASSERT(block->ref_count > 0);
 
     block->ref_count--;
+    mutex_release(&shard->lock);
 
     return 0;
 }
@@ -274,17 +628,20 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
 {
     int err;
     struct bcache *cache = priv;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
     struct bcache_block *block;
 
-    block = find_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+    block = lookup_block(shard, blocknum, NULL);
     if (!block) {
         err = -1;
         goto exit;
     }
 
-    block->is_dirty = true;
+    set_dirty(shard, block, true);
     err = 0;
 exit:
+    mutex_release(&shard->lock);
     return (err);
 }
 
@@ -292,59 +649,268 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
 {
     int err;
     struct bcache *cache = priv;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
     struct bcache_block *block;
 
-    block = find_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+    block = find_block(shard, blocknum);
     if (!block) {
-        block = alloc_block(cache);
+        block = alloc_block(cache, shard);
         if (!block) {
             err = -1;
             goto exit;
         }
 
-        block->blocknum = blocknum;
+        insert_block(shard, block, blocknum);
     }
 
     memset(block->ptr, 0, cache->block_size);
-    block->is_dirty = true;
+    set_dirty(shard, block, true);
     err = 0;
 exit:
+    mutex_release(&shard->lock);
     return (err);
 }
 
+static int compare_blocknum(const void *_a, const void *_b)
+{
+    const struct bcache_block *a = *(struct bcache_block * const *)_a;
+    const struct bcache_block *b = *(struct bcache_block * const *)_b;
+
+    return (a->blocknum > b->blocknum) - (a->blocknum < b->blocknum);
+}
+
+/* Write out every dirty block in the cache, sorted, with each run of adjacent blocks
+ * written in one request. Blocks are marked clean before they're written, so anything
+ * dirtied again meanwhile gets written next time. */
+static int bcache_writeback(struct bcache *cache)
+{
+    int err = 0;
+    uint total = 0;
+
+    mutex_acquire(&cache->io_lock);
+
+    for (uint i = 0; i < BCACHE_SHARDS; i++)
+        total += cache->shards[i].dirty_count;
+    if (total == 0)
+        goto out;
+
+    struct bcache_block **blocks = malloc(total * sizeof(struct bcache_block *));
+    if (!blocks) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    /* pin the dirty blocks and mark them clean */
+    uint count = 0;
+    for (uint i = 0; i < BCACHE_SHARDS; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
+        struct bcache_block *block, *temp;
+
+        mutex_acquire(&shard->lock);
+        list_for_every_entry_safe(&shard->dirty_list, block, temp, struct bcache_block, dirty_node) {
+            if (count == total)
+                break;
+            block->ref_count++;
+            set_dirty(shard, block, false);
+            blocks[count++] = block;
+        }
+        mutex_release(&shard->lock);
+    }
+
+    qsort(blocks, count, sizeof(struct bcache_block *), compare_blocknum);
+
+    for (uint start = 0; start < count; ) {
+        uint run = 1;
+        while (start + run < count && run < BCACHE_MAX_RUN &&
+                blocks[start + run]->blocknum == blocks[start]->blocknum + run)
+            run++;
+
+        ssize_t rc;
+        if (cache->dev_blocks_per_block) {
+            /* gather straight from the blocks */
+            iovec_t iov[BCACHE_MAX_RUN];
+            for (uint i = 0; i < run; i++)
+                iov[i] = (iovec_t){ blocks[start + i]->ptr, cache->block_size };
+
+            rc = bio_write_iovec(cache->dev, iov, run, blocks[start]->blocknum * cache->dev_blocks_per_block);
+        } else {
+            for (uint i = 0; i < run; i++)
+                memcpy((uint8_t *)cache->io_buf + i * cache->block_size, blocks[start + i]->ptr, cache->block_size);
+
+            rc = cache_write(cache, cache->io_buf, blocks[start]->blocknum, run);
+        }
+        LTRACEF("wrote %u blocks at %u, rc %ld\n", run, blocks[start]->blocknum, rc);
+
+        for (uint i = 0; i < run; i++) {
+            struct bcache_block *block = blocks[start + i];
+            struct bcache_shard *shard = block_shard(cache, block->blocknum);
+
+            mutex_acquire(&shard->lock);
+            if (rc < 0) {
+                set_dirty(shard, block, true);
+            } else {
+                shard->stats.writes++;
+                if (i > 0)
+                    shard->stats.coalesced++;
+            }
+            block->ref_count--;
+            mutex_release(&shard->lock);
+        }
+
+        if (rc < 0)
+            err = rc;
+        start += run;
+    }
+
+    free(blocks);
+out:
+    mutex_release(&cache->io_lock);
+    return err;
+}
+
+/* hand pooled blocks back while the pool is over its size, clean and cold ones only */
+static void bcache_trim(struct bcache *cache)
+{
+    for (uint i = 0; i < BCACHE_SHARDS && bcache_pool_used > BCACHE_POOL_SIZE; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
+
+        mutex_acquire(&shard->lock);
+        struct list_node *n = list_peek_tail(&shard->inactive_list);
+        while (n && bcache_pool_used > BCACHE_POOL_SIZE) {
+            struct bcache_block *block = containerof(n, struct bcache_block, node);
+            n = list_prev(&shard->inactive_list, n);
+
+            if (!block->pooled || block->ref_count > 0 || block->is_dirty)
+                continue;
+
+            unlink_block(shard, block);
+            shard->stats.evictions++;
+            free_block(cache, block);
+        }
+        mutex_release(&shard->lock);
+    }
+}
+
+static int bcache_wb_worker(void *arg)
+{
+    for (;;) {
+        event_wait_timeout(&bcache_wb_event, BCACHE_WB_INTERVAL);
+
+        mutex_acquire(&bcache_list_lock);
+        struct bcache *cache;
+        list_for_every_entry(&bcache_list, cache, struct bcache, node) {
+            bcache_writeback(cache);
+            bcache_trim(cache);
+        }
+        mutex_release(&bcache_list_lock);
+    }
+
+    return 0;
+}
+
 int bcache_flush(bcache_t priv)
 {
-    int err;
-    struct bcache *cache = priv;
-    struct bcache_block *block;
+    return bcache_writeback(priv);
+}
+
+void bcache_destroy(bcache_t _cache)
+{
+    struct bcache *cache = _cache;
+
+    mutex_acquire(&bcache_list_lock);
+    list_delete(&cache->node);
+    mutex_release(&bcache_list_lock);
 
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        if (block->is_dirty) {
-            err = flush_block(cache, block);
-            if (err)
-                goto exit;
+    if (bcache_writeback(cache) < 0)
+        printf("warning: failed to write back dirty blocks on destroy\n");
+
+    for (uint i = 0; i < BCACHE_SHARDS; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
+        struct list_node *lists[] = { &shard->inactive_list, &shard->active_list };
+
+        for (uint l = 0; l < countof(lists); l++) {
+            struct bcache_block *block;
+            while ((block = list_remove_head_type(lists[l], struct bcache_block, node))) {
+                DEBUG_ASSERT(block->ref_count == 0);
+
+                if (block->is_dirty)
+                    printf("warning: freeing dirty block %u\n", block->blocknum);
+
+                free_block(cache, block);
+            }
         }
     }
 
-    err = 0;
-exit:
-    return (err);
+    free(cache->io_buf);
+    free(cache);
 }
 
 void bcache_dump(bcache_t priv, const char *name)
 {
     uint32_t finds;
     struct bcache *cache = priv;
+    struct bcache_stats stats;
+    uint count = 0, active = 0, dirty = 0;
+
+    memset(&stats, 0, sizeof(stats));
+    for (uint i = 0; i < BCACHE_SHARDS; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
+
+        mutex_acquire(&shard->lock);
+        stats.hits += shard->stats.hits;
+        stats.depth += shard->stats.depth;
+        stats.misses += shard->stats.misses;
+        stats.reads += shard->stats.reads;
+        stats.writes += shard->stats.writes;
+        stats.evictions += shard->stats.evictions;
+        stats.dirty_evictions += shard->stats.dirty_evictions;
+        stats.coalesced += shard->stats.coalesced;
+        stats.readahead += shard->stats.readahead;
+        stats.readahead_hits += shard->stats.readahead_hits;
+        count += shard->count;
+        active += shard->active_count;
+        dirty += shard->dirty_count;
+        mutex_release(&shard->lock);
+    }
 
-    finds = cache->stats.hits + cache->stats.misses;
+    finds = stats.hits + stats.misses;
 
     printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
            name,
-           cache->stats.hits,
-           finds ? (cache->stats.hits * 100) / finds : 0,
-           cache->stats.hits ? cache->stats.depth / cache->stats.hits : 0,
-           cache->stats.misses,
-           finds ? (cache->stats.misses * 100) / finds : 0,
-           cache->stats.reads,
-           cache->stats.writes);
+           stats.hits,
+           finds ? (stats.hits * 100) / finds : 0,
+           stats.hits ? stats.depth / stats.hits : 0,
+           stats.misses,
+           finds ? (stats.misses * 100) / finds : 0,
+           stats.reads,
+           stats.writes);
+    printf("%s: blocks=%u(active %u dirty %u) evictions=%u(dirty %u) coalesced=%u readahead=%u(used %u)\n",
+           name, count, active, dirty,
+           stats.evictions, stats.dirty_evictions, stats.coalesced,
+           stats.readahead, stats.readahead_hits);
 }
+
+#if WITH_LIB_CONSOLE
+
+static int cmd_bcache(int argc, const cmd_args *argv)
+{
+    struct bcache *cache;
+
+    printf("pool: %zu of %u bytes in use above the caches' reserves\n",
+           bcache_pool_used, BCACHE_POOL_SIZE);
+
+    mutex_acquire(&bcache_list_lock);
+    list_for_every_entry(&bcache_list, cache, struct bcache, node) {
+        bcache_dump(cache, cache->dev->name);
+    }
+    mutex_release(&bcache_list_lock);
+
+    return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("bcache", "block cache statistics", &cmd_bcache)
+STATIC_COMMAND_END(bcache);
+
+#endif
@@ -35,3 +35,12 @@ int bcache_read_block(bcache_t, void *, uint block);
 int bcache_get_block(bcache_t, void **, uint block);
 int bcache_put_block(bcache_t, uint block);
 
+// mark a block dirty (it must be in the cache, held with bcache_get_block)
+// or zero it without reading it in. dirty blocks are written back in the
+// background, or when bcache_flush is called
+int bcache_mark_block_dirty(bcache_t, uint block);
+int bcache_zero_block(bcache_t, uint block);
+int bcache_flush(bcache_t);
+
+void bcache_dump(bcache_t, const char *name);
+
@@ -29,6 +29,7 @@
 #include <list.h>
 #include <pow2.h>
 #include <lib/bio.h>
+#include <kernel/event.h>
 #include <kernel/mutex.h>
 #include <lk/init.h>
 
@@ -42,8 +43,10 @@ static struct {
     .lock = MUTEX_INITIAL_VALUE(bdevs.lock),
 };
 
-/* default implementation is to use the read_block hook to 'deblock' the device */
-static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size_t len)
+static ssize_t bio_sync_request(bdev_t *dev, uint op, const iovec_t *iov, uint iov_cnt, bnum_t block);
+
+/* deblock a read through a bounce buffer, for devices that can't take the caller's buffer */
+static ssize_t bio_default_read_bounce(struct bdev *dev, void *_buf, off_t offset, size_t len)
 {
     uint8_t *buf = (uint8_t *)_buf;
     ssize_t bytes_read = 0;
@@ -140,6 +143,47 @@ err:
     return (err >= 0) ? bytes_read : err;
 }
 
+/* default implementation is to read the partial first and last blocks into bounce
+ * buffers and the rest straight into the caller's buffer, all as one request */
+static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size_t len)
+{
+    uint8_t *buf = (uint8_t *)_buf;
+    STACKBUF_DMA_ALIGN(head, dev->block_size);
+    STACKBUF_DMA_ALIGN(tail, dev->block_size);
+
+    bnum_t block = offset >> dev->block_shift;
+    size_t head_offset = offset & (dev->block_size - 1);
+    size_t head_len = head_offset ? MIN(dev->block_size - head_offset, len) : 0;
+    size_t middle_len = (len - head_len) & ~(dev->block_size - 1);
+    size_t tail_len = len - head_len - middle_len;
+
+    /* only the middle goes straight into the caller's buffer */
+    if ((dev->flags & BIO_FLAG_CACHE_ALIGNED_READS) && middle_len &&
+            !IS_ALIGNED((size_t)(buf + head_len), CACHE_LINE))
+        return bio_default_read_bounce(dev, buf, offset, len);
+
+    LTRACEF("buf %p, offset %lld, block %u, len %zd (%zu/%zu/%zu)\n", buf, offset, block, len,
+            head_len, middle_len, tail_len);
+
+    iovec_t iov[3];
+    uint iov_cnt = 0;
+    if (head_len)
+        iov[iov_cnt++] = (iovec_t){ head, dev->block_size };
+    if (middle_len)
+        iov[iov_cnt++] = (iovec_t){ buf + head_len, middle_len };
+    if (tail_len)
+        iov[iov_cnt++] = (iovec_t){ tail, dev->block_size };
+
+    ssize_t err = bio_sync_request(dev, BIO_OP_READ, iov, iov_cnt, block);
+    if (err < 0)
+        return err;
+
+    memcpy(buf, head + head_offset, head_len);
+    memcpy(buf + head_len + middle_len, tail, tail_len);
+
+    return len;
+}
+
 static ssize_t bio_default_write(struct bdev *dev, const void *_buf, off_t offset, size_t len)
 {
     const uint8_t *buf = (const uint8_t *)_buf;
@@ -297,6 +341,21 @@ static ssize_t bio_default_write_block(struct bdev *dev, const void *buf, bnum_t
     return ERR_NOT_SUPPORTED;
 }
 
+/* for devices with a request queue, the synchronous block calls are requests that are waited on */
+static ssize_t bio_queued_read_block(struct bdev *dev, void *buf, bnum_t block, uint count)
+{
+    iovec_t iov = { buf, (size_t)count << dev->block_shift };
+
+    return bio_sync_request(dev, BIO_OP_READ, &iov, 1, block);
+}
+
+static ssize_t bio_queued_write_block(struct bdev *dev, const void *buf, bnum_t block, uint count)
+{
+    iovec_t iov = { (void *)buf, (size_t)count << dev->block_shift };
+
+    return bio_sync_request(dev, BIO_OP_WRITE, &iov, 1, block);
+}
+
 static void bdev_inc_ref(bdev_t *dev)
 {
     LTRACEF("Add ref \"%s\" %d -> %d\n", dev->name, dev->ref, dev->ref + 1);
@@ -439,6 +498,327 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
     return dev->write_block(dev, buf, block, count);
 }
 
+/* the next request to hand the driver, in one sweep up the device: the first one at or
+ * past where the last one ended, or the lowest if there's none. whatever follows it
+ * directly is merged in behind it. */
+static bio_request_t *bio_queue_next(bdev_t *dev)
+{
+    struct bio_queue *q = &dev->queue;
+    bio_request_t *req = NULL;
+    bio_request_t *r;
+
+    DEBUG_ASSERT(!list_is_empty(&q->pending));
+
+    list_for_every_entry(&q->pending, r, bio_request_t, node) {
+        if (r->block >= q->head_pos) {
+            req = r;
+            break;
+        }
+    }
+    if (!req)
+        req = list_peek_head_type(&q->pending, bio_request_t, node);
+
+    bio_request_t *next = list_next_type(&q->pending, &req->node, bio_request_t, node);
+    list_delete(&req->node);
+    q->pending_count--;
+
+    bio_request_t *last = req;
+    bnum_t end = req->block + req->count;
+    size_t len = (size_t)req->count << dev->block_shift;
+    while (next && next->op == req->op && next->block == end) {
+        size_t next_len = (size_t)next->count << dev->block_shift;
+        if (dev->max_xfer && len + next_len > dev->max_xfer)
+            break;
+
+        r = next;
+        next = list_next_type(&q->pending, &r->node, bio_request_t, node);
+        list_delete(&r->node);
+        q->pending_count--;
+        q->stats.merged++;
+
+        last->merge_next = r;
+        last = r;
+        end += r->count;
+        len += next_len;
+    }
+
+    q->head_pos = end;
+
+    return req;
+}
+
+/* hand the driver as many requests as it'll take. a completion or failure inside the
+ * driver's hook lands back here, in which case the outer call goes around again. */
+static void bio_queue_run(bdev_t *dev)
+{
+    struct bio_queue *q = &dev->queue;
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&q->lock, state);
+    if (q->running) {
+        q->rerun = true;
+        spin_unlock_irqrestore(&q->lock, state);
+        return;
+    }
+    q->running = true;
+
+    do {
+        q->rerun = false;
+        while (!q->plugged && q->in_flight < dev->queue_depth && !list_is_empty(&q->pending)) {
+            bio_request_t *req = bio_queue_next(dev);
+            q->in_flight++;
+            q->stats.dispatched++;
+            spin_unlock_irqrestore(&q->lock, state);
+
+            status_t err = dev->submit_request(dev, req);
+            if (err < 0)
+                bio_request_complete(req, err);
+
+            spin_lock_irqsave(&q->lock, state);
+        }
+    } while (q->rerun);
+
+    q->running = false;
+    spin_unlock_irqrestore(&q->lock, state);
+}
+
+/* devices without a submit hook do the request in place through their block hooks */
+static void bio_request_run_sync(bdev_t *dev, bio_request_t *req)
+{
+    ssize_t status = 0;
+    bnum_t block = req->block;
+
+    for (uint i = 0; i < req->iov_cnt; i++) {
+        uint count = req->iov[i].iov_len >> dev->block_shift;
+        ssize_t err;
+
+        if (req->op == BIO_OP_WRITE)
+            err = dev->write_block(dev, req->iov[i].iov_base, block, count);
+        else
+            err = dev->read_block(dev, req->iov[i].iov_base, block, count);
+
+        if (err < 0) {
+            status = err;
+            break;
+        } else if ((size_t)err != req->iov[i].iov_len) {
+            status = ERR_IO;
+            break;
+        }
+
+        status += err;
+        block += count;
+    }
+
+    bio_request_complete(req, status);
+}
+
+static status_t bio_queue_request(bdev_t *dev, bio_request_t *req)
+{
+    LTRACEF("dev '%s', req %p, op %u, block %u, count %u, iov_cnt %u\n",
+            dev->name, req, req->op, req->block, req->count, req->iov_cnt);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(req && req->callback);
+    DEBUG_ASSERT(req->op == BIO_OP_READ || req->op == BIO_OP_WRITE);
+
+    /* every vector has to be whole blocks, and together make up the request */
+    size_t len = 0;
+    for (uint i = 0; i < req->iov_cnt; i++) {
+        if (req->iov[i].iov_len & (dev->block_size - 1))
+            return ERR_INVALID_ARGS;
+        len += req->iov[i].iov_len;
+    }
+    if (req->count == 0 || len != ((size_t)req->count << dev->block_shift))
+        return ERR_INVALID_ARGS;
+    if (bio_trim_block_range(dev, req->block, req->count) != req->count)
+        return ERR_OUT_OF_RANGE;
+
+    req->dev = dev;
+    req->queue_dev = NULL;
+    req->merge_next = NULL;
+
+    if (!dev->submit_request) {
+        bio_request_run_sync(dev, req);
+        return NO_ERROR;
+    }
+
+    if (dev->queue_depth == 0)
+        return dev->submit_request(dev, req);
+
+    /* keep the queue sorted, most requests go on the end */
+    struct bio_queue *q = &dev->queue;
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
+
+    req->queue_dev = dev;
+
+    struct list_node *n;
+    for (n = list_peek_tail(&q->pending); n; n = list_prev(&q->pending, n)) {
+        if (containerof(n, bio_request_t, node)->block <= req->block)
+            break;
+    }
+    if (n)
+        list_add_after(n, &req->node);
+    else
+        list_add_head(&q->pending, &req->node);
+
+    q->pending_count++;
+    q->stats.submitted++;
+    q->stats.max_pending = MAX(q->stats.max_pending, q->pending_count);
+
+    spin_unlock_irqrestore(&q->lock, state);
+
+    bio_queue_run(dev);
+
+    return NO_ERROR;
+}
+
+status_t bio_submit_request(bdev_t *dev, bio_request_t *req)
+{
+    DEBUG_ASSERT(req);
+
+    req->rebase = 0;
+
+    return bio_queue_request(dev, req);
+}
+
+status_t bio_forward_request(bdev_t *dev, bio_request_t *req, bnum_t offset)
+{
+    req->block += offset;
+    req->rebase += offset;
+
+    status_t err = bio_queue_request(dev, req);
+    if (err < 0) {
+        req->block -= offset;
+        req->rebase -= offset;
+    }
+
+    return err;
+}
+
+void bio_request_complete(bio_request_t *req, ssize_t status)
+{
+    bdev_t *dev = req->queue_dev;
+
+    LTRACEF("req %p, status %ld\n", req, status);
+
+    if (dev) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&dev->queue.lock, state);
+        DEBUG_ASSERT(dev->queue.in_flight > 0);
+        dev->queue.in_flight--;
+        dev->queue.stats.completed++;
+        spin_unlock_irqrestore(&dev->queue.lock, state);
+    }
+
+    /* a short transfer of a merged request can't be pinned on any one of them */
+    size_t total = 0;
+    for (bio_request_t *r = req; r; r = r->merge_next)
+        total += (size_t)r->count << r->dev->block_shift;
+    if (status >= 0 && (size_t)status != total)
+        status = ERR_IO;
+
+    /* each merged request gets its own share */
+    while (req) {
+        bio_request_t *next = req->merge_next;
+        ssize_t len = (ssize_t)req->count << req->dev->block_shift;
+
+        req->merge_next = NULL;
+        req->block -= req->rebase;
+        req->rebase = 0;
+        req->callback(req, (status < 0) ? status : len);
+        req = next;
+    }
+
+    if (dev)
+        bio_queue_run(dev);
+}
+
+void bio_plug(bdev_t *dev)
+{
+    while (dev->lower)
+        dev = dev->lower;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->queue.lock, state);
+    dev->queue.plugged++;
+    spin_unlock_irqrestore(&dev->queue.lock, state);
+}
+
+void bio_unplug(bdev_t *dev)
+{
+    while (dev->lower)
+        dev = dev->lower;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->queue.lock, state);
+    DEBUG_ASSERT(dev->queue.plugged > 0);
+    bool run = (--dev->queue.plugged == 0);
+    spin_unlock_irqrestore(&dev->queue.lock, state);
+
+    if (run && dev->queue_depth > 0)
+        bio_queue_run(dev);
+}
+
+struct bio_sync_waiter {
+    event_t event;
+    ssize_t status;
+};
+
+static void bio_sync_callback(bio_request_t *req, ssize_t status)
+{
+    struct bio_sync_waiter *w = req->cookie;
+
+    w->status = status;
+    event_signal(&w->event, false);
+}
+
+static ssize_t bio_sync_request(bdev_t *dev, uint op, const iovec_t *iov, uint iov_cnt, bnum_t block)
+{
+    struct bio_sync_waiter w;
+    bio_request_t req = {
+        .op = op,
+        .block = block,
+        .count = iovec_size(iov, iov_cnt) >> dev->block_shift,
+        .iov = iov,
+        .iov_cnt = iov_cnt,
+        .callback = &bio_sync_callback,
+        .cookie = &w,
+    };
+
+    event_init(&w.event, false, 0);
+
+    status_t err = bio_submit_request(dev, &req);
+    if (err >= 0) {
+        event_wait(&w.event);
+        err = w.status;
+    }
+
+    event_destroy(&w.event);
+
+    return err;
+}
+
+ssize_t bio_read_iovec(bdev_t *dev, const iovec_t *iov, uint iov_cnt, bnum_t block)
+{
+    LTRACEF("dev '%s', iov %p, iov_cnt %u, block %u\n", dev->name, iov, iov_cnt, block);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(iov);
+
+    return bio_sync_request(dev, BIO_OP_READ, iov, iov_cnt, block);
+}
+
+ssize_t bio_write_iovec(bdev_t *dev, const iovec_t *iov, uint iov_cnt, bnum_t block)
+{
+    LTRACEF("dev '%s', iov %p, iov_cnt %u, block %u\n", dev->name, iov, iov_cnt, block);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(iov);
+
+    return bio_sync_request(dev, BIO_OP_WRITE, iov, iov_cnt, block);
+}
+
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
 {
     LTRACEF("dev '%s', offset %lld, len %zd\n", dev->name, offset, len);
@@ -538,6 +918,15 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->write_block = bio_default_write_block;
     dev->erase = bio_default_erase;
     dev->close = NULL;
+
+    /* no request queue unless the driver sets one up */
+    dev->submit_request = NULL;
+    dev->queue_depth = 0;
+    dev->max_xfer = 0;
+    dev->lower = NULL;
+    memset(&dev->queue, 0, sizeof(dev->queue));
+    spin_lock_init(&dev->queue.lock);
+    list_initialize(&dev->queue.pending);
 }
 
 void bio_register_device(bdev_t *dev)
@@ -546,6 +935,14 @@ void bio_register_device(bdev_t *dev)
 
     LTRACEF(" '%s'\n", dev->name);
 
+    /* the synchronous block calls go through the request queue if there is one */
+    if (dev->submit_request) {
+        if (dev->read_block == bio_default_read_block)
+            dev->read_block = bio_queued_read_block;
+        if (dev->write_block == bio_default_write_block)
+            dev->write_block = bio_queued_write_block;
+    }
+
     bdev_inc_ref(dev);
 
     mutex_acquire(&bdevs.lock);
@@ -589,6 +986,13 @@ void bio_dump_devices(void)
         }
 
         printf("\n");
+
+        if (entry->queue_depth > 0) {
+            const struct bio_queue_stats *stats = &entry->queue.stats;
+            printf("\t\tqueue depth %u: in flight %u pending %u (max %u), submitted %u dispatched %u merged %u completed %u\n",
+                   entry->queue_depth, entry->queue.in_flight, entry->queue.pending_count, stats->max_pending,
+                   stats->submitted, stats->dispatched, stats->merged, stats->completed);
+        }
     }
     mutex_release(&bdevs.lock);
 }
@@ -25,6 +25,8 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <list.h>
+#include <iovec.h>
+#include <kernel/spinlock.h>
 
 __BEGIN_CDECLS;
 
@@ -34,6 +36,68 @@ __BEGIN_CDECLS;
 
 typedef uint32_t bnum_t;
 
+struct bdev;
+typedef struct bio_request bio_request_t;
+
+/* completion of an asynchronous block request. status is the number of bytes
+ * transferred or an error. may be called from interrupt context. */
+typedef void (*bio_async_callback_t)(void *cookie, struct bdev *dev, ssize_t status);
+typedef void (*bio_request_callback_t)(bio_request_t *req, ssize_t status);
+
+#define BIO_OP_READ  0
+#define BIO_OP_WRITE 1
+
+/*
+ * A block request, scattered over or gathered from one or more buffers. Every
+ * vector has to be a whole number of blocks, adding up to count blocks. The
+ * request belongs to bio and the driver from bio_submit_request() until its
+ * callback runs. block is rebased as it passes through a subdevice, and is back
+ * to what the submitter filled in by the time the callback runs. Requests outstanding at the same time aren't ordered against each other.
+ */
+struct bio_request {
+    /* filled in by the submitter */
+    uint op;
+    bnum_t block;
+    uint count;
+    const iovec_t *iov;
+    uint iov_cnt;
+    bio_request_callback_t callback;
+    void *cookie;
+
+    /* private to bio */
+    struct bdev *dev;
+    struct bdev *queue_dev;
+    bio_request_t *merge_next;      // requests merged in behind this one
+    bnum_t rebase;                  // added to block on the way down by subdevices
+
+    /* bio's and then the driver's while the request is outstanding */
+    struct list_node node;
+    uint pending;
+    ssize_t result;
+};
+
+struct bio_queue_stats {
+    uint32_t submitted;
+    uint32_t dispatched;
+    uint32_t merged;
+    uint32_t completed;
+    uint32_t max_pending;
+};
+
+/* requests waiting to go to the driver, kept sorted by block so adjacent ones can
+ * be merged and the device is swept in one direction */
+struct bio_queue {
+    spin_lock_t lock;
+    struct list_node pending;
+    uint pending_count;
+    uint in_flight;
+    uint plugged;
+    bnum_t head_pos;                // block after the last one dispatched
+    bool running;
+    bool rerun;
+    struct bio_queue_stats stats;
+};
+
 typedef struct bio_erase_geometry_info {
     off_t  start;  // start of the region in bytes.
     off_t  size;
@@ -68,6 +132,17 @@ typedef struct bdev {
     ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
     int (*ioctl)(struct bdev *, int request, void *argp);
     void (*close)(struct bdev *);
+
+    /* native request interface. the driver gets requests from the queue, possibly
+     * with others merged in behind them through merge_next, and finishes each with
+     * bio_request_complete(), from any context. devices that set it get read_block
+     * and write_block layered on top for free. */
+    status_t (*submit_request)(struct bdev *, bio_request_t *req);
+    uint queue_depth;               // requests handed to the driver at once, 0 for no queue
+    size_t max_xfer;                // largest merged request in bytes, 0 for no limit
+    struct bdev *lower;             // unqueued stacked device, plugs pass down to it
+
+    struct bio_queue queue;
 } bdev_t;
 
 /* user api */
@@ -80,6 +155,23 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
 
+/* vectored block io, block is where the first vector goes */
+ssize_t bio_read_iovec(bdev_t *dev, const iovec_t *iov, uint iov_cnt, bnum_t block);
+ssize_t bio_write_iovec(bdev_t *dev, const iovec_t *iov, uint iov_cnt, bnum_t block);
+
+/* asynchronous block io. on NO_ERROR the callback is called exactly once,
+ * possibly before this returns; on error it is never called */
+status_t bio_submit_request(bdev_t *dev, bio_request_t *req);
+void bio_request_complete(bio_request_t *req, ssize_t status);
+
+/* pass a request on to the device underneath, offset blocks further in. the
+ * submitter's block is put back before the callback runs */
+status_t bio_forward_request(bdev_t *dev, bio_request_t *req, bnum_t offset);
+
+/* hold requests in the queue while submitting a batch, so they can be merged */
+void bio_plug(bdev_t *dev);
+void bio_unplug(bdev_t *dev);
+
 /* register a block device */
 void bio_register_device(bdev_t *dev);
 void bio_unregister_device(bdev_t *dev);
@@ -21,6 +21,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
 #include <string.h>
 #include <stdlib.h>
@@ -47,17 +48,6 @@ static ssize_t mem_bdev_read(bdev_t *bdev, void *buf, off_t offset, size_t len)
     return len;
 }
 
-static ssize_t mem_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
-{
-    mem_bdev_t *mem = (mem_bdev_t *)bdev;
-
-    LTRACEF("bdev %s, buf %p, block %u, count %u\n", bdev->name, buf, block, count);
-
-    memcpy(buf, (uint8_t *)mem->ptr + block * BLOCKSIZE, count * BLOCKSIZE);
-
-    return count * BLOCKSIZE;
-}
-
 static ssize_t mem_bdev_write(bdev_t *bdev, const void *buf, off_t offset, size_t len)
 {
     mem_bdev_t *mem = (mem_bdev_t *)bdev;
@@ -69,15 +59,25 @@ static ssize_t mem_bdev_write(bdev_t *bdev, const void *buf, off_t offset, size_
     return len;
 }
 
-static ssize_t mem_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+/* requests complete in place, there's nothing to gain from queueing them */
+static status_t mem_bdev_submit_request(struct bdev *bdev, bio_request_t *req)
 {
     mem_bdev_t *mem = (mem_bdev_t *)bdev;
+    uint8_t *ptr = (uint8_t *)mem->ptr + req->block * BLOCKSIZE;
+
+    LTRACEF("bdev %s, op %u, block %u, count %u\n", bdev->name, req->op, req->block, req->count);
 
-    LTRACEF("bdev %s, buf %p, block %u, count %u\n", bdev->name, buf, block, count);
+    for (uint i = 0; i < req->iov_cnt; i++) {
+        if (req->op == BIO_OP_WRITE)
+            memcpy(ptr, req->iov[i].iov_base, req->iov[i].iov_len);
+        else
+            memcpy(req->iov[i].iov_base, ptr, req->iov[i].iov_len);
+        ptr += req->iov[i].iov_len;
+    }
 
-    memcpy((uint8_t *)mem->ptr + block * BLOCKSIZE, buf, count * BLOCKSIZE);
+    bio_request_complete(req, req->count * BLOCKSIZE);
 
-    return count * BLOCKSIZE;
+    return NO_ERROR;
 }
 
 int create_membdev(const char *name, void *ptr, size_t len)
@@ -91,9 +91,8 @@ int create_membdev(const char *name, void *ptr, size_t len)
     /* our bits */
     mem->ptr = ptr;
     mem->dev.read = mem_bdev_read;
-    mem->dev.read_block = mem_bdev_read_block;
     mem->dev.write = mem_bdev_write;
-    mem->dev.write_block = mem_bdev_write_block;
+    mem->dev.submit_request = mem_bdev_submit_request;
 
     /* register it */
     bio_register_device(&mem->dev);
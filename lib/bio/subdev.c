@@ -50,13 +50,6 @@ static ssize_t subdev_read(struct bdev *_dev, void *buf, off_t offset, size_t le
     return bio_read(subdev->parent, buf, offset + subdev->offset * subdev->dev.block_size, len);
 }
 
-static ssize_t subdev_read_block(struct bdev *_dev, void *buf, bnum_t block, uint count)
-{
-    subdev_t *subdev = (subdev_t *)_dev;
-
-    return bio_read_block(subdev->parent, buf, block + subdev->offset, count);
-}
-
 static ssize_t subdev_write(struct bdev *_dev, const void *buf, off_t offset, size_t len)
 {
     subdev_t *subdev = (subdev_t *)_dev;
@@ -64,11 +57,13 @@ static ssize_t subdev_write(struct bdev *_dev, const void *buf, off_t offset, si
     return bio_write(subdev->parent, buf, offset + subdev->offset * subdev->dev.block_size, len);
 }
 
-static ssize_t subdev_write_block(struct bdev *_dev, const void *buf, bnum_t block, uint count)
+/* requests go straight onto the parent's queue, where they can merge with the
+ * requests of other subdevices */
+static status_t subdev_submit_request(struct bdev *_dev, bio_request_t *req)
 {
     subdev_t *subdev = (subdev_t *)_dev;
 
-    return bio_write_block(subdev->parent, buf, block + subdev->offset, count);
+    return bio_forward_request(subdev->parent, req, subdev->offset);
 }
 
 static ssize_t subdev_erase(struct bdev *_dev, off_t offset, size_t len)
@@ -178,11 +173,11 @@ status_t bio_publish_subdevice(const char *parent_dev,
     sub->offset = startblock;
 
     sub->dev.read = &subdev_read;
-    sub->dev.read_block = &subdev_read_block;
     sub->dev.write = &subdev_write;
-    sub->dev.write_block = &subdev_write_block;
     sub->dev.erase = &subdev_erase;
     sub->dev.close = &subdev_close;
+    sub->dev.submit_request = &subdev_submit_request;
+    sub->dev.lower = parent;
 
     bio_register_device(&sub->dev);
 
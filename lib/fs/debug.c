@@ -168,6 +168,7 @@ usage:
         printf("%s format <type> [device]\n", argv[0].str);
         printf("%s stat <path>\n", argv[0].str);
         printf("%s ioctl <request> [args...]\n", argv[0].str);
+        printf("%s readbench <path> [<chunk size>]\n", argv[0].str);
         return -1;
     }
 
@@ -271,6 +272,45 @@ usage:
         }
 
         fs_close_file(handle);
+    } else if (!strcmp(argv[1].str, "readbench")) {
+        int err;
+        filehandle *handle;
+
+        if (argc < 3)
+            goto notenoughargs;
+
+        size_t chunk = (argc >= 4) ? argv[3].u : 1024 * 1024;
+        void *buf = malloc(chunk);
+        if (!buf) {
+            printf("error allocating %zu byte buffer\n", chunk);
+            return ERR_NO_MEMORY;
+        }
+
+        err = fs_open_file(argv[2].str, &handle);
+        if (err < 0) {
+            printf("error %d opening file\n", err);
+            free(buf);
+            return err;
+        }
+
+        /* read the whole file front to back */
+        off_t off = 0;
+        ssize_t ret;
+        lk_bigtime_t t = current_time_hires();
+        while ((ret = fs_read_file(handle, buf, off, chunk)) > 0)
+            off += ret;
+        t = current_time_hires() - t;
+
+        fs_close_file(handle);
+        free(buf);
+
+        if (ret < 0) {
+            printf("error %ld reading file at offset %lld\n", ret, off);
+            return ret;
+        }
+
+        printf("read %lld bytes in %zu byte chunks in %llu usecs, %llu KB/sec\n", off, chunk,
+               (unsigned long long)t, t ? (unsigned long long)off * 1000000 / t / 1024 : 0);
     } else {
         printf("unrecognized subcommand\n");
         goto usage;
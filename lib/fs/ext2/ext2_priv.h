@@ -43,16 +43,28 @@ typedef struct {
     struct ext2_inode root_inode;
 } ext2_t;
 
-struct cache_block {
-    blocknum_t num;
-    void *ptr;
+/* a run of file blocks that are contiguous on disk, or a hole if phys_block is 0 */
+struct ext2_extent {
+    blocknum_t file_block;
+    blocknum_t phys_block;
+    uint32_t count;
+};
+
+/* file block to disk block mappings already dug out of the indirect blocks,
+ * sorted by file block. starts over once it holds EXT2_EXTENT_CACHE_MAX. */
+#define EXT2_EXTENT_CACHE_MAX 256
+
+struct ext2_extent_cache {
+    struct ext2_extent *extents;
+    uint count;
+    uint size;
 };
 
 /* open file handle */
 typedef struct {
     ext2_t *ext2;
 
-    struct cache_block ind_cache[3]; // cache of indirect blocks as they're scanned
+    struct ext2_extent_cache extents;
     struct ext2_inode inode;
 } ext2_file_t;
 
@@ -67,6 +79,8 @@ int ext2_put_block(ext2_t *ext2, blocknum_t bnum);
 
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode);
 ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len);
+ssize_t ext2_read_inode_etc(ext2_t *ext2, struct ext2_inode *inode, struct ext2_extent_cache *cache,
+                            void *buf, off_t offset, size_t len);
 int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len);
 
 /* fs api */
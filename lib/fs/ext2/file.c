@@ -71,7 +71,7 @@ ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
     }
 
     // read from the inode
-    err = ext2_read_inode(file->ext2, &file->inode, buf, offset, len);
+    err = ext2_read_inode_etc(file->ext2, &file->inode, &file->extents, buf, offset, len);
 
     return err;
 }
@@ -80,14 +80,7 @@ int ext2_close_file(filecookie *fcookie)
 {
     ext2_file_t *file = (ext2_file_t *)fcookie;
 
-    // see if we need to free any of the cache blocks
-    int i;
-    for (i=0; i < 3; i++) {
-        if (file->ind_cache[i].num != 0) {
-            free(file->ind_cache[i].ptr);
-        }
-    }
-
+    free(file->extents.extents);
     free(file);
 
     return 0;
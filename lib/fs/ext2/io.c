@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
 #include "ext2_priv.h"
 
@@ -142,49 +143,156 @@ error:
     return err;
 }
 
-/* translate a file block to a physical block */
-static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, uint fileblock)
+/* Map fileblock and the blocks after it that are contiguous on disk, up to max of them.
+ * Only the pointer table fileblock is in gets scanned, so that costs at most one
+ * indirect block walk. */
+static int ext2_map_run(ext2_t *ext2, struct ext2_inode *inode, uint fileblock, uint max,
+                        blocknum_t *phys_block, uint *count)
 {
     int err;
-    blocknum_t block;
-
-    LTRACEF("inode %p, fileblock %u\n", inode, fileblock);
-
     uint32_t pos[4];
     uint32_t level = 0;
-    ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos);
+
+    LTRACEF("inode %p, fileblock %u, max %u\n", inode, fileblock, max);
+
+    err = ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos);
+    if (err < 0)
+        return err;
 
     LTRACEF("level %d, pos 0x%x 0x%x 0x%x 0x%x\n", level, pos[0], pos[1], pos[2], pos[3]);
 
+    const blocknum_t *table;
+    uint index, limit;
+    blocknum_t ind_block = 0;
     if (level == 0) {
-        /* direct block, just return it directly */
-        block = LE32(inode->i_block[fileblock]);
+        /* direct block, the table is in the inode */
+        table = inode->i_block;
+        index = fileblock;
+        limit = EXT2_NDIR_BLOCKS;
     } else {
-        /* at least one level of indirection, get a pointer to the final indirect block table and dereference it */
+        /* at least one level of indirection, get a pointer to the final indirect block table */
         blocknum_t *ind_table;
-        blocknum_t phys_block;
-        err = ext2_get_indirect_block_pointer_cache_block(ext2, inode, &ind_table, level, pos, &phys_block);
-        if (err < 0)
+        err = ext2_get_indirect_block_pointer_cache_block(ext2, inode, &ind_table, level, pos, &ind_block);
+        if (err < 0) {
+            /* missing indirect block, the whole table is a hole */
+            *phys_block = 0;
+            *count = MIN(max, EXT2_ADDR_PER_BLOCK(ext2->sb) - pos[level]);
             return 0;
+        }
+        table = ind_table;
+        index = pos[level];
+        limit = EXT2_ADDR_PER_BLOCK(ext2->sb);
+    }
+
+    blocknum_t block = LE32(table[index]);
+    uint n = 1;
+    while (n < max && index + n < limit) {
+        blocknum_t next = LE32(table[index + n]);
+        if (block ? (next != block + n) : (next != 0))
+            break;
+        n++;
+    }
 
-        /* dereference the final entry in the final table */
-        block = LE32(ind_table[pos[level]]);
-        LTRACEF("block %u, indirect_block %u\n", block, phys_block);
+    if (ind_block)
+        ext2_put_block(ext2, ind_block);
+
+    LTRACEF("block %u, count %u\n", block, n);
+
+    *phys_block = block;
+    *count = n;
+    return 0;
+}
+
+/* Find where fileblock lives on disk and how many blocks after it follow it there, at
+ * most max. Runs are remembered in the cache, if there is one. */
+static int ext2_lookup_extent(ext2_t *ext2, struct ext2_inode *inode, struct ext2_extent_cache *cache,
+                              uint fileblock, uint max, blocknum_t *phys_block, uint *count)
+{
+    int err;
+
+    if (!cache)
+        return ext2_map_run(ext2, inode, fileblock, max, phys_block, count);
+
+    /* find the first extent past fileblock, the one before it may hold it */
+    uint lo = 0, hi = cache->count;
+    while (lo < hi) {
+        uint mid = (lo + hi) / 2;
+        if (cache->extents[mid].file_block <= fileblock)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo > 0) {
+        struct ext2_extent *e = &cache->extents[lo - 1];
+        uint skip = fileblock - e->file_block;
+        if (skip < e->count) {
+            *phys_block = e->phys_block ? e->phys_block + skip : 0;
+            *count = MIN(e->count - skip, max);
+            return 0;
+        }
+    }
+
+    /* map it from the block tree, as far as the next known extent */
+    uint limit = max;
+    if (lo < cache->count)
+        limit = MIN(limit, cache->extents[lo].file_block - fileblock);
+
+    blocknum_t block;
+    uint n;
+    err = ext2_map_run(ext2, inode, fileblock, limit, &block, &n);
+    if (err < 0)
+        return err;
+
+    *phys_block = block;
+    *count = n;
+
+    /* carry on the extent before it if it picks up right where that ends */
+    if (lo > 0) {
+        struct ext2_extent *e = &cache->extents[lo - 1];
+        if (e->file_block + e->count == fileblock &&
+                (e->phys_block ? (block == e->phys_block + e->count) : (block == 0))) {
+            e->count += n;
+            return 0;
+        }
+    }
 
-        /* release the ref on the cache block */
-        ext2_put_block(ext2, phys_block);
+    if (cache->count == cache->size) {
+        if (cache->size == EXT2_EXTENT_CACHE_MAX) {
+            /* full, start over around where we're reading now */
+            cache->count = 0;
+            lo = 0;
+        } else {
+            uint size = cache->size ? cache->size * 2 : 16;
+            struct ext2_extent *extents = realloc(cache->extents, size * sizeof(struct ext2_extent));
+            if (!extents)
+                return 0;
+            cache->extents = extents;
+            cache->size = size;
+        }
     }
 
-    LTRACEF("returning %u\n", block);
+    memmove(&cache->extents[lo + 1], &cache->extents[lo], (cache->count - lo) * sizeof(struct ext2_extent));
+    cache->extents[lo].file_block = fileblock;
+    cache->extents[lo].phys_block = block;
+    cache->extents[lo].count = n;
+    cache->count++;
 
-    return block;
+    return 0;
+}
+
+ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len)
+{
+    return ext2_read_inode_etc(ext2, inode, NULL, buf, offset, len);
 }
 
-ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len)
+ssize_t ext2_read_inode_etc(ext2_t *ext2, struct ext2_inode *inode, struct ext2_extent_cache *cache,
+                            void *_buf, off_t offset, size_t len)
 {
     int err = 0;
     size_t bytes_read = 0;
     uint8_t *buf = _buf;
+    const size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
 
     /* calculate the file size */
     off_t file_size = ext2_file_len(ext2, inode);
@@ -200,70 +308,71 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         return 0;
 
     /* calculate the starting file block */
-    uint file_block = offset / EXT2_BLOCK_SIZE(ext2->sb);
+    uint file_block = offset / block_size;
+    size_t block_offset = offset % block_size;
 
-    /* handle partial first block */
-    if ((offset % EXT2_BLOCK_SIZE(ext2->sb)) != 0) {
-        uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
+    while (len > 0) {
+        blocknum_t phys_block;
+        uint count;
+        err = ext2_lookup_extent(ext2, inode, cache, file_block,
+                                 ROUNDUP(block_offset + len, block_size) / block_size, &phys_block, &count);
+        if (err < 0)
+            break;
+
+        if (block_offset != 0 || len < block_size) {
+            /* partial block, through the block cache */
+            uint8_t temp[block_size];
+
+            if (phys_block == 0) {
+                memset(temp, 0, block_size);
+            } else {
+                err = ext2_read_block(ext2, temp, phys_block);
+                if (err < 0)
+                    break;
+            }
+
+            /* copy out what we need */
+            size_t tocopy = MIN(len, block_size - block_offset);
+            memcpy(buf, temp + block_offset, tocopy);
+
+            /* increment our stuff */
+            file_block++;
+            block_offset = 0;
+            len -= tocopy;
+            bytes_read += tocopy;
+            buf += tocopy;
+            continue;
+        }
 
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+        /* whole blocks, as many in one go as are contiguous on disk */
+        count = MIN(count, len / block_size);
+        size_t tocopy = count * block_size;
         if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
+            memset(buf, 0, tocopy);
+        } else if (count == 1) {
+            err = ext2_read_block(ext2, buf, phys_block);
+            if (err < 0)
+                break;
         } else {
-            ext2_read_block(ext2, temp, phys_block);
+            /* straight from the device into the caller's buffer */
+            ssize_t ret = bio_read(ext2->dev, buf, (off_t)phys_block * block_size, tocopy);
+            if (ret < 0) {
+                err = ret;
+                break;
+            } else if ((size_t)ret != tocopy) {
+                err = ERR_IO;
+                break;
+            }
         }
 
-        /* copy out what we need */
-        size_t block_offset = offset % EXT2_BLOCK_SIZE(ext2->sb);
-        size_t tocopy = MIN(len, EXT2_BLOCK_SIZE(ext2->sb) - block_offset);
-        memcpy(buf, temp + block_offset, tocopy);
-
         /* increment our stuff */
-        file_block++;
+        file_block += count;
         len -= tocopy;
         bytes_read += tocopy;
         buf += tocopy;
     }
 
-    /* handle middle blocks */
-    while (len >= EXT2_BLOCK_SIZE(ext2->sb)) {
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, buf, phys_block);
-        }
-
-        /* increment our stuff */
-        file_block++;
-        len -= EXT2_BLOCK_SIZE(ext2->sb);
-        bytes_read += EXT2_BLOCK_SIZE(ext2->sb);
-        buf += EXT2_BLOCK_SIZE(ext2->sb);
-    }
-
-    /* handle partial last block */
-    if (len > 0) {
-        uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
-
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, temp, phys_block);
-        }
-
-        /* copy out what we need */
-        memcpy(buf, temp, len);
-
-        /* increment our stuff */
-        bytes_read += len;
-    }
-
     LTRACEF("err %d, bytes_read %zu\n", err, bytes_read);
 
     return (err < 0) ? err : (ssize_t)bytes_read;
 }
-
@@ -166,7 +166,7 @@ status_t fat32_mount(bdev_t *dev, fscookie **cookie)
     }
 
     fat->bytes_per_cluster = fat->sectors_per_cluster * fat->bytes_per_sector;
-    fat->cache = bcache_create(fat->dev, fat->bytes_per_sector, 4);
+    fat->cache = bcache_create(fat->dev, fat->bytes_per_sector, 16);
 
     *cookie = (fscookie *)fat;
 end:
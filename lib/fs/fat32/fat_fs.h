@@ -49,11 +49,25 @@ typedef struct {
     uint32_t root_start;
 } fat_fs_t;
 
+/* a run of clusters of a file that are contiguous on disk */
+struct fat_cluster_run {
+    uint32_t file_cluster;          // index of the first one within the file
+    uint32_t cluster;
+    uint32_t count;
+};
+
 typedef struct {
     fat_fs_t *fat_fs;
     uint32_t start_cluster;
     uint32_t length;
     uint8_t attributes;
+
+    /* the cluster chain as far as it has been followed, in file order */
+    struct fat_cluster_run *runs;
+    uint32_t run_count;
+    uint32_t run_size;
+    uint32_t mapped_clusters;
+    uint32_t next_cluster;          // where the chain carries on past the last run
 } fat_file_t;
 
 typedef enum {
@@ -21,6 +21,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <assert.h>
 #include <err.h>
 #include <lib/bio.h>
 #include <lib/fs.h>
@@ -36,34 +37,63 @@
 #define DIR_ENTRY_LENGTH 32
 #define USE_CACHE 1
 
-uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
+/* a FAT sector held from the block cache while walking a chain through it */
+struct fat_walk {
+    uint32_t bnum;
+    void *ptr;
+};
+
+static void fat32_walk_done(fat_fs_t *fat, struct fat_walk *w)
+{
+    if (w->ptr) {
+        bcache_put_block(fat->cache, w->bnum);
+        w->ptr = NULL;
+    }
+}
+
+/* look up the cluster after this one, only going back to the cache when the chain
+ * leaves the FAT sector it was in. the end of the chain reads as 0x0fffffff. */
+static uint32_t fat32_walk_next(fat_fs_t *fat, struct fat_walk *w, uint32_t cluster)
 {
-    uint32_t fat_sector = (cluster) >> 7;
-    uint32_t fat_index = (cluster ) & 127;
+    uint32_t entries_per_sector = fat->bytes_per_sector / (fat->fat_bits / 8);
+    uint32_t fat_sector = cluster / entries_per_sector;
+    uint32_t fat_index = cluster % entries_per_sector;
 
     uint32_t bnum = (fat->lba_start / fat->bytes_per_sector) + (fat->reserved_sectors + fat_sector);
     uint32_t next_cluster = 0x0fffffff;
 
 #if USE_CACHE
-    void *cache_ptr;
-    int err = bcache_get_block(fat->cache, &cache_ptr, bnum);
-    if (err < 0) {
-        printf("bcache_get_block returned: %i\n", err);
-    } else {
-        if (fat->fat_bits == 32) {
-            uint32_t *table = (uint32_t *)cache_ptr;
-            next_cluster = table[fat_index];
-            LE32SWAP(next_cluster);
-        } else if (fat->fat_bits == 16) {
-            uint16_t *table = (uint16_t *)cache_ptr;
-            next_cluster = table[fat_index];
-            LE16SWAP(next_cluster);
-            if (next_cluster > 0xfff0) {
-                next_cluster |= 0x0fff0000;
-            }
+    if (w->ptr && w->bnum != bnum)
+        fat32_walk_done(fat, w);
+
+    if (!w->ptr) {
+        int err = bcache_get_block(fat->cache, &w->ptr, bnum);
+        if (err < 0) {
+            printf("bcache_get_block returned: %i\n", err);
+            w->ptr = NULL;
+            return next_cluster;
         }
+        w->bnum = bnum;
+    }
 
-        bcache_put_block(fat->cache, bnum);
+    if (fat->fat_bits == 32) {
+        uint32_t *table = (uint32_t *)w->ptr;
+        next_cluster = table[fat_index];
+        LE32SWAP(next_cluster);
+        next_cluster &= 0x0fffffff;
+        if (next_cluster >= 0x0ffffff8) {
+            next_cluster = 0x0fffffff;
+        }
+    } else if (fat->fat_bits == 16) {
+        uint16_t *table = (uint16_t *)w->ptr;
+        next_cluster = table[fat_index];
+        LE16SWAP(next_cluster);
+        if (next_cluster > 0xfff0) {
+            next_cluster |= 0x0fff0000;
+        }
+        if (next_cluster >= 0x0ffffff8) {
+            next_cluster = 0x0fffffff;
+        }
     }
 #else
     uint32_t offset = (bnum * fat->bytes_per_sector) + (fat_index * (fat->fat_bits / 8));
@@ -73,6 +103,96 @@ uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
     return next_cluster;
 }
 
+uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
+{
+    struct fat_walk w = { 0, NULL };
+
+    uint32_t next_cluster = fat32_walk_next(fat, &w, cluster);
+    fat32_walk_done(fat, &w);
+
+    return next_cluster;
+}
+
+/* follow the file's chain until file_cluster is mapped, adding a run each time the
+ * chain jumps */
+static status_t fat32_file_extend(fat_file_t *file, uint32_t file_cluster)
+{
+    fat_fs_t *fat = file->fat_fs;
+    uint32_t total = ((uint64_t)file->length + fat->bytes_per_cluster - 1) / fat->bytes_per_cluster;
+    struct fat_walk w = { 0, NULL };
+    status_t err = NO_ERROR;
+
+    if (file_cluster >= total)
+        return ERR_OUT_OF_RANGE;
+
+    while (file->mapped_clusters <= file_cluster) {
+        uint32_t cluster = file->next_cluster;
+        if (cluster < 2 || cluster >= 0x0ffffff7) {
+            /* the chain ends before the file does */
+            err = ERR_IO;
+            break;
+        }
+
+        /* follow it for as long as it's contiguous, but no further than the file goes */
+        uint32_t count = 1;
+        uint32_t next;
+        while ((next = fat32_walk_next(fat, &w, cluster + count - 1)) == cluster + count &&
+                file->mapped_clusters + count < total)
+            count++;
+
+        if (file->run_count == file->run_size) {
+            uint32_t size = file->run_size ? file->run_size * 2 : 8;
+            struct fat_cluster_run *runs = realloc(file->runs, size * sizeof(struct fat_cluster_run));
+            if (!runs) {
+                err = ERR_NO_MEMORY;
+                break;
+            }
+            file->runs = runs;
+            file->run_size = size;
+        }
+
+        struct fat_cluster_run *run = &file->runs[file->run_count++];
+        run->file_cluster = file->mapped_clusters;
+        run->cluster = cluster;
+        run->count = count;
+
+        file->mapped_clusters += count;
+        file->next_cluster = next;
+    }
+
+    fat32_walk_done(fat, &w);
+
+    return err;
+}
+
+/* where file_cluster is on disk, and how many clusters after it follow it there */
+static status_t fat32_file_map(fat_file_t *file, uint32_t file_cluster, uint32_t *cluster, uint32_t *count)
+{
+    if (file_cluster >= file->mapped_clusters) {
+        status_t err = fat32_file_extend(file, file_cluster);
+        if (err < 0)
+            return err;
+    }
+
+    /* find the last run starting at or before it */
+    uint32_t lo = 0, hi = file->run_count;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (file->runs[mid].file_cluster <= file_cluster)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    const struct fat_cluster_run *run = &file->runs[lo];
+    DEBUG_ASSERT(file_cluster - run->file_cluster < run->count);
+
+    *cluster = run->cluster + (file_cluster - run->file_cluster);
+    *count = run->count - (file_cluster - run->file_cluster);
+
+    return NO_ERROR;
+}
+
 static inline off_t fat32_offset_for_cluster(fat_fs_t *fat, uint32_t cluster)
 {
     off_t cluster_begin_lba = fat->reserved_sectors + (fat->fat_count * fat->sectors_per_fat);
@@ -186,11 +306,15 @@ status_t fat32_open_file(fscookie *cookie, const char *path, filecookie **fcooki
             free(filename);
 
             if (matched) {
-                uint16_t target_cluster = fat_read16(dir, offset + 0x1a);
+                uint32_t target_cluster = fat_read16(dir, offset + 0x1a);
+                if (fat->fat_bits == 32) {
+                    target_cluster |= (uint32_t)fat_read16(dir, offset + 0x14) << 16;
+                }
                 if (done == true) {
-                    file = malloc(sizeof(fat_file_t));
+                    file = calloc(1, sizeof(fat_file_t));
                     file->fat_fs = fat;
                     file->start_cluster = target_cluster;
+                    file->next_cluster = target_cluster;
                     file->length = fat_read32(dir, offset + 0x1c);
                     file->attributes = dir[0x0B + offset];
                     result = NO_ERROR;
@@ -231,51 +355,44 @@ out:
     return result;
 }
 
-ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
+ssize_t fat32_read_file(filecookie *fcookie, void *_buf, off_t offset, size_t len)
 {
     fat_file_t *file = (fat_file_t *)fcookie;
     fat_fs_t *fat = file->fat_fs;
     bdev_t *dev = fat->dev;
+    uint8_t *buf = _buf;
 
-    uint32_t cluster = 0;
-    if (offset <= fat->bytes_per_cluster) {
-        cluster = file->start_cluster;
-    } else {
-        // XXX: support non-0 offsets
-        TRACE;
-        return -1;
-    }
+    /* trim the read */
+    if (offset < 0 || offset >= file->length)
+        return 0;
+    len = MIN(len, (size_t)(file->length - offset));
 
-    uint32_t length = file->length;
-    uint32_t amount_read = 0;
+    size_t amount_read = 0;
+    while (len > 0) {
+        uint32_t file_cluster = offset / fat->bytes_per_cluster;
+        uint32_t cluster_offset = offset % fat->bytes_per_cluster;
 
-    do {
-        off_t lba_addr = fat32_offset_for_cluster(fat, cluster);
-
-        uint32_t to_read = fat->bytes_per_cluster;
-        uint32_t next_cluster = 0;
-        while ((next_cluster = fat32_next_cluster_in_chain(fat, cluster)) == cluster + 1) {
-            cluster = next_cluster;
-            to_read += fat->bytes_per_cluster;
+        /* read as much as is contiguous on disk in one go */
+        uint32_t cluster, count;
+        status_t err = fat32_file_map(file, file_cluster, &cluster, &count);
+        if (err < 0) {
+            printf("no more clusters, amount_read=%zu\n", amount_read);
+            return amount_read ? (ssize_t)amount_read : err;
         }
-        cluster = next_cluster;
 
-        to_read = MIN(length - amount_read, to_read);
-        // XXX: support non-0 offsets
-        int err = bio_read(dev, buf+amount_read, lba_addr, to_read);
-        if (err < 0) {
-            return err;
+        size_t to_read = MIN((size_t)count * fat->bytes_per_cluster - cluster_offset, len);
+        ssize_t ret = bio_read(dev, buf, fat32_offset_for_cluster(fat, cluster) + cluster_offset, to_read);
+        if (ret < 0) {
+            return ret;
+        } else if ((size_t)ret != to_read) {
+            return ERR_IO;
         }
 
+        buf += to_read;
+        offset += to_read;
+        len -= to_read;
         amount_read += to_read;
-
-        if (amount_read < length) {
-            if (cluster == 0x0fffffff) {
-                printf("no more clusters, amount_read=%i, to_read=%i\n", amount_read, to_read);
-                break;
-            }
-        }
-    } while (amount_read < length);
+    }
 
     return amount_read;
 }
@@ -283,6 +400,7 @@ ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len
 status_t fat32_close_file(filecookie *fcookie)
 {
     fat_file_t *file = (fat_file_t *)fcookie;
+    free(file->runs);
     free(file);
     return NO_ERROR;
 }
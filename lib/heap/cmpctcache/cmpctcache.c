@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/cmpctcache.h>
+
+#include <trace.h>
+#include <debug.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+#include <lib/cmpctmalloc.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * Small allocations are rounded up to one of CACHE_CLASSES size classes and
+ * kept on per cpu free lists, protected by a per cpu spinlock. A cpu only goes
+ * to the central cmpctmalloc heap, and its mutex, when one of its lists runs
+ * empty or overflows, and then moves CACHE_BATCH objects at a time.
+ */
+#define CACHE_CLASS_SHIFT 4
+#define CACHE_CLASS_SIZE (1u << CACHE_CLASS_SHIFT)
+#define CACHE_CLASSES 16
+#define CACHE_MAX_SIZE (CACHE_CLASSES * CACHE_CLASS_SIZE)
+
+#ifndef CMPCT_CACHE_DEPTH
+#define CMPCT_CACHE_DEPTH 32
+#endif
+#define CACHE_BATCH (CMPCT_CACHE_DEPTH / 2)
+
+struct cache_object {
+    struct cache_object *next;
+};
+
+struct cache_class {
+    struct cache_object *head;
+    uint count;
+};
+
+struct cpu_cache {
+    spin_lock_t lock;
+    struct cache_class classes[CACHE_CLASSES];
+
+    /* stats */
+    ulong hits;
+    ulong misses;
+    ulong spills;
+} __CPU_ALIGN;
+
+static struct cpu_cache caches[SMP_MAX_CPUS];
+
+/* the class an allocation of size bytes comes out of */
+static inline uint alloc_class(size_t size)
+{
+    DEBUG_ASSERT(size > 0 && size <= CACHE_MAX_SIZE);
+
+    return (size - 1) >> CACHE_CLASS_SHIFT;
+}
+
+/* objects in class c have at least this many usable bytes */
+static inline size_t class_size(uint c)
+{
+    return (size_t)(c + 1) << CACHE_CLASS_SHIFT;
+}
+
+/* lock the current cpu's cache, pinning us to the cpu while held */
+static struct cpu_cache *cache_lock(spin_lock_saved_state_t *state)
+{
+    arch_interrupt_save(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct cpu_cache *cache = &caches[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+
+    return cache;
+}
+
+static void cache_unlock(struct cpu_cache *cache, spin_lock_saved_state_t state)
+{
+    spin_unlock(&cache->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+static inline void class_push(struct cache_class *cl, void *ptr)
+{
+    struct cache_object *obj = ptr;
+
+    obj->next = cl->head;
+    cl->head = obj;
+    cl->count++;
+}
+
+static inline void *class_pop(struct cache_class *cl)
+{
+    struct cache_object *obj = cl->head;
+
+    if (obj) {
+        cl->head = obj->next;
+        cl->count--;
+    }
+    return obj;
+}
+
+void *cmpct_cache_alloc(size_t size)
+{
+    if (size == 0 || size > CACHE_MAX_SIZE)
+        return cmpct_alloc(size);
+
+    uint c = alloc_class(size);
+
+    spin_lock_saved_state_t state;
+    struct cpu_cache *cache = cache_lock(&state);
+    void *ptr = class_pop(&cache->classes[c]);
+    if (likely(ptr)) {
+        cache->hits++;
+        cache_unlock(cache, state);
+        return ptr;
+    }
+    cache->misses++;
+    cache_unlock(cache, state);
+
+    /* refill from the central heap, keeping the first object for ourselves */
+    void *batch[CACHE_BATCH];
+    size_t count = cmpct_alloc_batch(class_size(c), batch, CACHE_BATCH);
+    if (count == 0)
+        return NULL;
+
+    LTRACEF("refilled class %u with %zu objects\n", c, count);
+
+    size_t i = 1;
+    if (count > 1) {
+        cache = cache_lock(&state);
+        struct cache_class *cl = &cache->classes[c];
+        for (; i < count && cl->count < CMPCT_CACHE_DEPTH; i++) {
+            class_push(cl, batch[i]);
+        }
+        cache_unlock(cache, state);
+    }
+
+    /* we may have migrated to a cpu whose list is already full */
+    if (i < count)
+        cmpct_free_batch(&batch[i], count - i);
+
+    return batch[0];
+}
+
+void cmpct_cache_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    /* anything that didn't come from a class, or came back oversized, goes straight back */
+    size_t usable = cmpct_usable_size(ptr);
+    if (usable < CACHE_CLASS_SIZE || usable >= CACHE_MAX_SIZE + CACHE_CLASS_SIZE) {
+        cmpct_free(ptr);
+        return;
+    }
+
+    uint c = usable / CACHE_CLASS_SIZE - 1;
+
+    spin_lock_saved_state_t state;
+    struct cpu_cache *cache = cache_lock(&state);
+    struct cache_class *cl = &cache->classes[c];
+    if (likely(cl->count < CMPCT_CACHE_DEPTH)) {
+        class_push(cl, ptr);
+        cache_unlock(cache, state);
+        return;
+    }
+
+    /* the list is full, hand half of it back along with this object */
+    void *batch[CACHE_BATCH + 1];
+    size_t count = 0;
+
+    batch[count++] = ptr;
+    while (count < countof(batch)) {
+        batch[count++] = class_pop(cl);
+    }
+    cache->spills++;
+    cache_unlock(cache, state);
+
+    cmpct_free_batch(batch, count);
+}
+
+void *cmpct_cache_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return cmpct_cache_alloc(size);
+
+    size_t old_size = cmpct_usable_size(ptr);
+
+    void *new_ptr = cmpct_cache_alloc(size);
+    if (new_ptr == NULL)
+        return NULL;
+
+    memcpy(new_ptr, ptr, MIN(size, old_size));
+    cmpct_cache_free(ptr);
+
+    return new_ptr;
+}
+
+void *cmpct_cache_memalign(size_t size, size_t alignment)
+{
+    /* cmpctmalloc hands out 8 byte aligned objects */
+    if (alignment <= 8)
+        return cmpct_cache_alloc(size);
+
+    return cmpct_memalign(size, alignment);
+}
+
+/* return every cached object to the central heap */
+static void cache_drain(struct cpu_cache *cache)
+{
+    void *batch[CACHE_BATCH];
+
+    for (uint c = 0; c < CACHE_CLASSES; c++) {
+        for (;;) {
+            spin_lock_saved_state_t state;
+            size_t count = 0;
+
+            spin_lock_irqsave(&cache->lock, state);
+            while (count < countof(batch) && cache->classes[c].head) {
+                batch[count++] = class_pop(&cache->classes[c]);
+            }
+            spin_unlock_irqrestore(&cache->lock, state);
+
+            if (count == 0)
+                break;
+
+            cmpct_free_batch(batch, count);
+        }
+    }
+}
+
+void cmpct_cache_trim(void)
+{
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        cache_drain(&caches[i]);
+    }
+
+    cmpct_trim();
+}
+
+void cmpct_cache_dump(void)
+{
+    printf("\tper cpu caches:\n");
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct cpu_cache *cache = &caches[i];
+
+        printf("\t\tcpu %u: hits %lu misses %lu spills %lu, cached", i,
+               cache->hits, cache->misses, cache->spills);
+        for (uint c = 0; c < CACHE_CLASSES; c++) {
+            if (cache->classes[c].count)
+                printf(" %zu:%u", class_size(c), cache->classes[c].count);
+        }
+        printf("\n");
+    }
+
+    cmpct_dump();
+}
+
+void cmpct_cache_init(void)
+{
+    LTRACE_ENTRY;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        spin_lock_init(&caches[i].lock);
+    }
+
+    cmpct_init();
+}
@@ -31,6 +31,11 @@ void *cmpct_realloc(void *, size_t);
 void cmpct_free(void *);
 void *cmpct_memalign(size_t size, size_t alignment);
 
+/* batched variants for caching front ends */
+size_t cmpct_alloc_batch(size_t size, void **ptrs, size_t count);
+void cmpct_free_batch(void **ptrs, size_t count);
+size_t cmpct_usable_size(void *payload);
+
 void cmpct_init(void);
 void cmpct_dump(void);
 void cmpct_test(void);
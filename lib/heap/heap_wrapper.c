@@ -74,6 +74,29 @@ static inline void HEAP_INIT(void)
 #define HEAP_TRIM miniheap_trim
 
 /* end miniheap implementation */
+#elif WITH_LIB_HEAP_CMPCTCACHE
+/* cmpctmalloc with a per cpu caching front end */
+#include <lib/cmpctcache.h>
+#include <lib/cmpctmalloc.h>
+
+#define HEAP_MEMALIGN(boundary, s) cmpct_cache_memalign(s, boundary)
+#define HEAP_MALLOC cmpct_cache_alloc
+#define HEAP_REALLOC cmpct_cache_realloc
+#define HEAP_FREE cmpct_cache_free
+#define HEAP_INIT cmpct_cache_init
+#define HEAP_DUMP cmpct_cache_dump
+#define HEAP_TRIM cmpct_cache_trim
+static inline void *HEAP_CALLOC(size_t n, size_t s)
+{
+    size_t realsize = n * s;
+
+    void *ptr = cmpct_cache_alloc(realsize);
+    if (likely(ptr))
+        memset(ptr, 0, realsize);
+    return ptr;
+}
+
+/* end cmpctcache implementation */
 #elif WITH_LIB_HEAP_CMPCTMALLOC
 /* cmpctmalloc implementation */
 #include <lib/cmpctmalloc.h>
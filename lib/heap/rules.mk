@@ -26,6 +26,10 @@ endif
 ifeq ($(LK_HEAP_IMPLEMENTATION),cmpctmalloc)
 MODULE_DEPS := lib/heap/cmpctmalloc
 endif
+# cmpctmalloc behind per cpu size class caches, for SMP builds
+ifeq ($(LK_HEAP_IMPLEMENTATION),cmpctcache)
+MODULE_DEPS := lib/heap/cmpctcache
+endif
 
 GLOBAL_DEFINES += LK_HEAP_IMPLEMENTATION=$(LK_HEAP_IMPLEMENTATION)
 
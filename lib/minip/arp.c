@@ -23,12 +23,16 @@
 
 #include "minip-internal.h"
 
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
 #include <list.h>
 #include <string.h>
 #include <malloc.h>
 #include <stdio.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <platform.h>
 #include <trace.h>
 
 typedef union {
@@ -37,34 +41,222 @@ typedef union {
 } ipv4_t;
 
 #define LOCAL_TRACE 0
-static struct list_node arp_list;
+
+#define ARP_HASH_BUCKETS    32
+#define ARP_MAX_ENTRIES     128
+#define ARP_MAX_PENDING     8                   /* packets held per unresolved neighbour */
+#define ARP_MAX_REQUESTS    4                   /* requests sent before giving up */
+#define ARP_RETRY_INTERVAL  250                 /* ms between requests */
+#define ARP_ENTRY_LIFETIME  (5 * 60 * 1000)     /* ms a resolved entry stays valid */
+#define ARP_SWEEP_INTERVAL  (30 * 1000)         /* ms between aging passes */
+
+enum {
+    ARP_STATE_PENDING,
+    ARP_STATE_RESOLVED,
+};
+
 typedef struct {
     struct list_node node;
     uint32_t addr;
     uint8_t mac[6];
+    uint8_t state;
+    uint8_t requests;
+    lk_time_t time;             /* when resolved, or when the last request went out */
+    struct list_node pending;   /* pktbufs waiting on the reply, linked through ->list */
+    uint pending_count;
 } arp_entry_t;
 
+static struct list_node arp_table[ARP_HASH_BUCKETS];
+static uint arp_entry_count;
+static uint arp_pending_count;
 static mutex_t arp_mutex = MUTEX_INITIAL_VALUE(arp_mutex);
 
+/* a single timer drives retries and aging for the whole table, armed_delay is 0 when idle */
+static net_timer_t arp_timer;
+static lk_time_t arp_timer_armed_delay;
+
+static minip_unreachable_callback_t arp_unreachable_cb;
+static void *arp_unreachable_arg;
+
+static struct {
+    uint hits;
+    uint misses;
+    uint requests;
+    uint queued;
+    uint flushed;
+    uint dropped_full;
+    uint dropped_timeout;
+    uint timeouts;
+    uint expired;
+} arp_stats;
+
+static void arp_timer_tick(void *arg);
+
 void arp_cache_init(void)
 {
-    list_initialize(&arp_list);
+    for (uint i = 0; i < ARP_HASH_BUCKETS; i++) {
+        list_initialize(&arp_table[i]);
+    }
+}
+
+void minip_set_unreachable_callback(minip_unreachable_callback_t cb, void *arg)
+{
+    mutex_acquire(&arp_mutex);
+    arp_unreachable_cb = cb;
+    arp_unreachable_arg = arg;
+    mutex_release(&arp_mutex);
+}
+
+static inline struct list_node *arp_bucket(uint32_t addr)
+{
+    addr ^= addr >> 16;
+    addr ^= addr >> 8;
+    return &arp_table[addr % ARP_HASH_BUCKETS];
+}
+
+static arp_entry_t *arp_find(uint32_t addr)
+{
+    DEBUG_ASSERT(is_mutex_held(&arp_mutex));
+
+    struct list_node *bucket = arp_bucket(addr);
+    arp_entry_t *arp;
+    list_for_every_entry(bucket, arp, arp_entry_t, node) {
+        if (arp->addr == addr) {
+            /* keep the bucket in mru order */
+            if (bucket->next != &arp->node) {
+                list_delete(&arp->node);
+                list_add_head(bucket, &arp->node);
+            }
+            return arp;
+        }
+    }
+
+    return NULL;
+}
+
+static arp_entry_t *arp_entry_alloc(uint32_t addr, uint8_t state)
+{
+    DEBUG_ASSERT(is_mutex_held(&arp_mutex));
+
+    if (arp_entry_count >= ARP_MAX_ENTRIES) {
+        return NULL;
+    }
+
+    arp_entry_t *arp = calloc(1, sizeof(arp_entry_t));
+    if (arp == NULL) {
+        return NULL;
+    }
+
+    arp->addr = addr;
+    arp->state = state;
+    list_initialize(&arp->pending);
+    list_add_head(arp_bucket(addr), &arp->node);
+    arp_entry_count++;
+    if (state == ARP_STATE_PENDING) {
+        arp_pending_count++;
+    }
+
+    return arp;
+}
+
+static bool arp_entry_valid(const arp_entry_t *arp, lk_time_t now)
+{
+    return arp->state == ARP_STATE_RESOLVED && now - arp->time <= ARP_ENTRY_LIFETIME;
 }
 
-static inline void mru_update(struct list_node *entry)
+/* make sure the table timer fires within delay ms */
+static void arp_timer_arm(lk_time_t delay)
 {
-    if (arp_list.next == entry)
+    DEBUG_ASSERT(is_mutex_held(&arp_mutex));
+
+    if (arp_timer_armed_delay == 0 || delay < arp_timer_armed_delay) {
+        arp_timer_armed_delay = delay;
+        net_timer_set(&arp_timer, &arp_timer_tick, NULL, delay);
+    }
+}
+
+static void arp_request(arp_entry_t *arp, lk_time_t now)
+{
+    DEBUG_ASSERT(is_mutex_held(&arp_mutex));
+
+    arp->time = now;
+
+    /* out of pktbufs, the retry timer tries again */
+    if (arp_send_request(arp->addr) < 0)
         return;
 
-    list_delete(entry);
-    list_add_head(&arp_list, entry);
+    arp->requests++;
+    arp_stats.requests++;
+}
+
+static void arp_timer_tick(void *arg)
+{
+    struct list_node failed = LIST_INITIAL_VALUE(failed);
+    arp_entry_t *arp, *temp;
+    minip_unreachable_callback_t cb;
+    void *cb_arg;
+
+    mutex_acquire(&arp_mutex);
+    arp_timer_armed_delay = 0;
+
+    lk_time_t now = current_time();
+    for (uint i = 0; i < ARP_HASH_BUCKETS; i++) {
+        list_for_every_entry_safe(&arp_table[i], arp, temp, arp_entry_t, node) {
+            if (arp->state == ARP_STATE_PENDING) {
+                if (now - arp->time < ARP_RETRY_INTERVAL) {
+                    continue;
+                }
+                if (arp->requests < ARP_MAX_REQUESTS) {
+                    arp_request(arp, now);
+                    continue;
+                }
+
+                /* nobody answered, throw away what was waiting on them */
+                list_delete(&arp->node);
+                list_add_tail(&failed, &arp->node);
+                arp_entry_count--;
+                arp_pending_count--;
+                arp_stats.timeouts++;
+                arp_stats.dropped_timeout += arp->pending_count;
+            } else if (now - arp->time > ARP_ENTRY_LIFETIME) {
+                list_delete(&arp->node);
+                free(arp);
+                arp_entry_count--;
+                arp_stats.expired++;
+            }
+        }
+    }
+
+    if (arp_pending_count > 0) {
+        arp_timer_arm(ARP_RETRY_INTERVAL);
+    } else if (arp_entry_count > 0) {
+        arp_timer_arm(ARP_SWEEP_INTERVAL);
+    }
+
+    cb = arp_unreachable_cb;
+    cb_arg = arp_unreachable_arg;
+    mutex_release(&arp_mutex);
+
+    while ((arp = list_remove_head_type(&failed, arp_entry_t, node))) {
+        LTRACEF("%u.%u.%u.%u unreachable, dropping %u packets\n",
+                IPV4_SPLIT(arp->addr), arp->pending_count);
+
+        pktbuf_t *p;
+        while ((p = list_remove_head_type(&arp->pending, pktbuf_t, list))) {
+            pktbuf_free(p, true);
+        }
+        if (cb) {
+            cb(arp->addr, arp->pending_count, cb_arg);
+        }
+        free(arp);
+    }
 }
 
 void arp_cache_update(uint32_t addr, const uint8_t mac[6])
 {
+    struct list_node flush = LIST_INITIAL_VALUE(flush);
     arp_entry_t *arp;
     ipv4_t ip;
-    bool found = false;
 
     ip.u = addr;
 
@@ -73,56 +265,126 @@ void arp_cache_update(uint32_t addr, const uint8_t mac[6])
         return;
     }
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
     mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            arp->addr = addr;
-            mru_update(&arp->node);
-            found = true;
-            break;
-        }
-    }
-
-    if (!found) {
+    arp = arp_find(addr);
+    if (arp == NULL) {
         LTRACEF("Adding %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x to cache\n",
                 ip.b[0], ip.b[1], ip.b[2], ip.b[3],
                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-        arp = malloc(sizeof(arp_entry_t));
+        arp = arp_entry_alloc(addr, ARP_STATE_RESOLVED);
         if (arp == NULL) {
-            goto err;
+            goto out;
         }
+    } else if (arp->state == ARP_STATE_PENDING) {
+        /* resolved, everything that was waiting can go */
+        pktbuf_t *p;
+        while ((p = list_remove_head_type(&arp->pending, pktbuf_t, list))) {
+            list_add_tail(&flush, &p->list);
+        }
+        arp_stats.flushed += arp->pending_count;
+        arp->pending_count = 0;
+        arp_pending_count--;
+    }
+
+    memcpy(arp->mac, mac, sizeof(arp->mac));
+    arp->state = ARP_STATE_RESOLVED;
+    arp->requests = 0;
+    arp->time = current_time();
+
+    arp_timer_arm(ARP_SWEEP_INTERVAL);
+
+out:
+    mutex_release(&arp_mutex);
 
-        arp->addr = addr;
-        memcpy(arp->mac, mac, sizeof(arp->mac));
-        list_add_head(&arp_list, &arp->node);
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&flush, pktbuf_t, list))) {
+        struct eth_hdr *eth = (struct eth_hdr *)p->data;
+        mac_addr_copy(eth->dst_mac, mac);
+        minip_tx(p);
     }
+}
+
+/* Looks up a MAC address based on the provided ip addr, returns false if it isn't resolved */
+bool arp_cache_lookup(uint32_t addr, uint8_t mac[6])
+{
+    arp_entry_t *arp;
+    bool found = false;
 
-err:
+    mutex_acquire(&arp_mutex);
+    arp = arp_find(addr);
+    if (arp && arp_entry_valid(arp, current_time())) {
+        memcpy(mac, arp->mac, sizeof(arp->mac));
+        found = true;
+    }
     mutex_release(&arp_mutex);
-    return;
+
+    return found;
 }
 
-/* Looks up and returns a MAC address based on the provided ip addr */
-uint8_t *arp_cache_lookup(uint32_t addr)
+/* Fill in the destination MAC of an ethernet frame headed for addr and send it. If addr
+ * isn't resolved yet the frame is held until the reply comes in, or dropped if it never does. */
+status_t arp_send_to(pktbuf_t *p, uint32_t addr)
 {
-    arp_entry_t *arp = NULL;
-    uint8_t *ret = NULL;
+    struct eth_hdr *eth = (struct eth_hdr *)p->data;
+    arp_entry_t *arp;
+    status_t err = NO_ERROR;
+
+    if (minip_is_broadcast(addr)) {
+        mac_addr_copy(eth->dst_mac, bcast_mac);
+        minip_tx(p);
+        return NO_ERROR;
+    }
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
     mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            mru_update(&arp->node);
-            ret = arp->mac;
-            break;
+
+    lk_time_t now = current_time();
+    arp = arp_find(addr);
+    if (arp && arp_entry_valid(arp, now)) {
+        arp_stats.hits++;
+        mac_addr_copy(eth->dst_mac, arp->mac);
+        mutex_release(&arp_mutex);
+
+        minip_tx(p);
+        return NO_ERROR;
+    }
+
+    arp_stats.misses++;
+    if (arp == NULL) {
+        arp = arp_entry_alloc(addr, ARP_STATE_PENDING);
+        if (arp == NULL) {
+            err = -ENOMEM;
+            goto drop;
         }
+    } else if (arp->state == ARP_STATE_RESOLVED) {
+        /* aged out, go find them again */
+        arp->state = ARP_STATE_PENDING;
+        arp->requests = 0;
+        arp_pending_count++;
     }
+
+    if (arp->pending_count >= ARP_MAX_PENDING) {
+        arp_stats.dropped_full++;
+        err = -ENOBUFS;
+        goto drop;
+    }
+
+    list_add_tail(&arp->pending, &p->list);
+    arp->pending_count++;
+    arp_stats.queued++;
+
+    /* only the first packet to an unresolved neighbour sends a request, the timer handles retries */
+    if (arp->requests == 0) {
+        arp_request(arp, now);
+        arp_timer_arm(ARP_RETRY_INTERVAL);
+    }
+
     mutex_release(&arp_mutex);
+    return NO_ERROR;
 
-    return ret;
+drop:
+    mutex_release(&arp_mutex);
+    pktbuf_free(p, true);
+    return err;
 }
 
 void arp_cache_dump(void)
@@ -130,26 +392,47 @@ void arp_cache_dump(void)
     int i = 0;
     arp_entry_t *arp;
 
-    if (!list_is_empty(&arp_list)) {
-        list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
+    mutex_acquire(&arp_mutex);
+    lk_time_t now = current_time();
+    for (uint b = 0; b < ARP_HASH_BUCKETS; b++) {
+        list_for_every_entry(&arp_table[b], arp, arp_entry_t, node) {
             ipv4_t ip;
             ip.u = arp->addr;
-            printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x\n",
-                   i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
-                   arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5]);
+            if (arp->state == ARP_STATE_PENDING) {
+                printf("%2d: %u.%u.%u.%u -> (incomplete) requests %u, %u packets queued\n",
+                       i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3], arp->requests, arp->pending_count);
+            } else {
+                printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x age %u ms\n",
+                       i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
+                       arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5],
+                       now - arp->time);
+            }
         }
-    } else {
+    }
+    mutex_release(&arp_mutex);
+
+    if (i == 0) {
         printf("The arp table is empty\n");
     }
 }
 
+void arp_dump_stats(void)
+{
+    printf("arp: %u entries (%u pending), %u hits %u misses %u requests\n",
+           arp_entry_count, arp_pending_count, arp_stats.hits, arp_stats.misses, arp_stats.requests);
+    printf("     %u queued %u flushed, dropped %u (queue full) %u (timeout), %u timeouts %u expired\n",
+           arp_stats.queued, arp_stats.flushed, arp_stats.dropped_full, arp_stats.dropped_timeout,
+           arp_stats.timeouts, arp_stats.expired);
+}
+
 int arp_send_request(uint32_t addr)
 {
     pktbuf_t *p;
     struct eth_hdr *eth;
     struct arp_pkt *arp;
 
-    if ((p = pktbuf_alloc()) == NULL) {
+    /* callers hold the arp table or a socket lock, so don't wait for the pool */
+    if ((p = pktbuf_alloc_etc(false)) == NULL) {
         return -1;
     }
 
@@ -170,35 +453,3 @@ int arp_send_request(uint32_t addr)
     minip_tx_handler(p);
     return 0;
 }
-
-static void handle_arp_timeout_cb(void *arg)
-{
-    *(bool *)arg = true;
-}
-
-const uint8_t *arp_get_dest_mac(uint32_t host)
-{
-    const uint8_t *dst_mac = NULL;
-    bool arp_timeout = false;
-    net_timer_t arp_timeout_timer;
-
-    if (host == IPV4_BCAST) {
-        return bcast_mac;
-    }
-
-    dst_mac = arp_cache_lookup(host);
-    if (dst_mac == NULL) {
-        arp_send_request(host);
-        memset(&arp_timeout_timer, 0, sizeof(arp_timeout_timer));
-        net_timer_set(&arp_timeout_timer, handle_arp_timeout_cb, &arp_timeout, 100);
-        while (!arp_timeout) {
-            dst_mac = arp_cache_lookup(host);
-            if (dst_mac) {
-                net_timer_cancel(&arp_timeout_timer);
-                break;
-            }
-        }
-    }
-
-    return dst_mac;
-}
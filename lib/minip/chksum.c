@@ -23,8 +23,206 @@
 
 #include "minip-internal.h"
 
-/* XXX alternate implementation, merge */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <platform.h>
+
+#if X86_WITH_FPU && __SSE2__
+#include <emmintrin.h>
+#define CKSUM_SIMD 1
+#elif ARCH_ARM64 && __ARM_NEON
+#include <arm_neon.h>
+#define CKSUM_SIMD 1
+#endif
+
+/*
+ * The one's complement sum doesn't care which 16 bit lane a word is added in,
+ * only that every word lands in some 16 bit aligned position, so the buffer is
+ * summed as native 64 bit words with the carries wrapped back around and only
+ * folded down to 16 bits at the very end. This also makes it byte order
+ * independent; the result is in the same order as the data.
+ */
+static inline uint64_t add64_carry(uint64_t sum, uint64_t v)
+{
+    sum += v;
+    return sum + (sum < v);
+}
+
+static inline uint16_t fold64(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    uint32_t s = sum;
+    s = (s & 0xffff) + (s >> 16);
+    s = (s & 0xffff) + (s >> 16);
+    return s;
+}
+
+#if CKSUM_SIMD
+/* sum whole 64 byte blocks with vector registers, returns the number of bytes consumed */
+static size_t ones_sum_simd(uint64_t *sum, const uint8_t *buf, size_t len)
+{
+    size_t done = len & ~(size_t)63;
+    const uint8_t *end = buf + done;
+    uint64_t lanes[4];
+
+#if X86_WITH_FPU
+    /* zero extend each 32 bit word into a 64 bit lane so nothing carries out */
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero;
+    __m128i acc1 = zero;
+    for (; buf < end; buf += 64) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)buf);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(buf + 32));
+        __m128i v3 = _mm_loadu_si128((const __m128i *)(buf + 48));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v0, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v0, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v1, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v1, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v2, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v2, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v3, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v3, zero));
+    }
+    _mm_storeu_si128((__m128i *)&lanes[0], acc0);
+    _mm_storeu_si128((__m128i *)&lanes[2], acc1);
+#else
+    /* pairwise add adjacent 32 bit words into 64 bit lanes */
+    uint64x2_t acc0 = vdupq_n_u64(0);
+    uint64x2_t acc1 = vdupq_n_u64(0);
+    for (; buf < end; buf += 64) {
+        acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(buf)));
+        acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(buf + 16)));
+        acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(buf + 32)));
+        acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(buf + 48)));
+    }
+    vst1q_u64(&lanes[0], acc0);
+    vst1q_u64(&lanes[2], acc1);
+#endif
+
+    for (uint i = 0; i < countof(lanes); i++)
+        *sum = add64_carry(*sum, lanes[i]);
+
+    return done;
+}
+#endif
+
+/* unfolded one's complement sum of a buffer of any length and alignment */
+static uint64_t ones_sum64(uint64_t sum, const void *_buf, size_t len)
+{
+    const uint8_t *buf = _buf;
+
+#if CKSUM_SIMD
+    if (len >= 256) {
+        size_t done = ones_sum_simd(&sum, buf, len);
+        buf += done;
+        len -= done;
+    }
+#endif
+
+    while (len >= 32) {
+        uint64_t w[4];
+        memcpy(w, buf, sizeof(w));
+        sum = add64_carry(sum, w[0]);
+        sum = add64_carry(sum, w[1]);
+        sum = add64_carry(sum, w[2]);
+        sum = add64_carry(sum, w[3]);
+        buf += 32;
+        len -= 32;
+    }
+
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, buf, sizeof(w));
+        sum = add64_carry(sum, w);
+        buf += 8;
+        len -= 8;
+    }
+
+    /* the tail keeps its position within the word, as if padded with zeros */
+    if (len) {
+        uint64_t w = 0;
+        memcpy(&w, buf, len);
+        sum = add64_carry(sum, w);
+    }
+
+    return sum;
+}
+
 uint16_t ones_sum16(uint32_t sum, const void *_buf, int len)
+{
+    return fold64(ones_sum64(sum, _buf, len));
+}
+
+/* RFC 1624: patch a checksum for a 16 bit field changing from old_val to new_val.
+ * the values are in the same byte order as the packet data */
+uint16_t cksum_update16(uint16_t cksum, uint16_t old_val, uint16_t new_val)
+{
+    uint32_t sum = (uint16_t)~cksum + (uint16_t)~old_val + new_val;
+
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+uint16_t cksum_update32(uint16_t cksum, uint32_t old_val, uint32_t new_val)
+{
+    cksum = cksum_update16(cksum, old_val >> 16, new_val >> 16);
+    return cksum_update16(cksum, old_val & 0xffff, new_val & 0xffff);
+}
+
+/* continue a sum over the data of a pktbuf and any fragments chained to it, starting
+ * offset bytes in. a fragment that starts at an odd position sums byte swapped */
+uint16_t ones_sum16_chain(uint32_t sum, const pktbuf_t *p, size_t offset)
+{
+    uint64_t total = sum;
+    bool odd = false;
+
+    for (; p; p = (p->flags & PKTBUF_FLAG_EOF) ? NULL : p->next) {
+        if (offset >= p->dlen) {
+            offset -= p->dlen;
+            continue;
+        }
+
+        size_t len = p->dlen - offset;
+        uint16_t part = ones_sum16(0, p->data + offset, len);
+        if (odd)
+            part = (part << 8) | (part >> 8);
+        total = add64_carry(total, part);
+        odd ^= len & 1;
+        offset = 0;
+    }
+
+    return fold64(total);
+}
+
+uint16_t rfc1701_chksum(const uint8_t *buf, size_t len)
+{
+    return ~ones_sum16(0, buf, len);
+}
+
+#if MINIP_USE_UDP_CHECKSUM
+uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, udp_hdr_t *udp)
+{
+    /* pseudo header, then the udp header and payload, all in network order */
+    uint16_t len = ntohs(ipv4->len) - sizeof(struct ipv4_hdr);
+    uint64_t sum = ones_sum64(0, &ipv4->src_addr, sizeof(ipv4->src_addr) * 2);
+    sum = add64_carry(sum, htons(IP_PROTO_UDP));
+    sum = add64_carry(sum, htons(len));
+    sum = ones_sum64(sum, udp, len);
+
+    uint16_t chksum = ~fold64(sum);
+
+    /* a computed zero is sent as all ones, zero means no checksum */
+    return chksum ? chksum : 0xffff;
+}
+#endif
+
+#if WITH_LIB_CONSOLE
+/* the straightforward 16 bits at a time sum, as a reference for the benchmark */
+static uint16_t ones_sum16_ref(uint32_t sum, const void *_buf, int len)
 {
     const uint16_t *buf = _buf;
 
@@ -36,7 +234,8 @@ uint16_t ones_sum16(uint32_t sum, const void *_buf, int len)
     }
 
     if (len) {
-        uint16_t temp = htons((*(uint8_t *)buf) << 8);
+        uint16_t temp = 0;
+        memcpy(&temp, buf, 1);
         sum += temp;
     }
 
@@ -46,53 +245,63 @@ uint16_t ones_sum16(uint32_t sum, const void *_buf, int len)
     return sum;
 }
 
-uint16_t rfc1701_chksum(const uint8_t *buf, size_t len)
+void minip_cksum_bench(void)
 {
-    uint32_t total = 0;
-    uint16_t chksum = 0;
-    const uint16_t *p = (const uint16_t *) buf;
-
-    // Length is in bytes
-    for (size_t i = 0; i < len / 2; i++ ) {
-        total += p[i];
+    const size_t max_len = 64 * 1024;
+    uint8_t *buf = malloc(max_len + 1);
+    if (!buf) {
+        printf("failed to allocate buffer\n");
+        return;
     }
 
-    chksum = (total & 0xFFFF) + (total >> 16);
-    chksum = ~chksum;
+    for (size_t i = 0; i < max_len + 1; i++)
+        buf[i] = rand();
 
-    return chksum;
-}
+    /* check the fast path against the reference at every alignment and a spread of lengths */
+    for (size_t len = 0; len < 1024; len += (len < 80) ? 1 : 37) {
+        for (uint align = 0; align < 2; align++) {
+            uint16_t a = ones_sum16(0x1234, buf + align, len);
+            uint16_t b = ones_sum16_ref(0x1234, buf + align, len);
+            if (a != b) {
+                printf("MISMATCH: len %zu align %u: 0x%hx vs 0x%hx\n", len, align, a, b);
+                goto out;
+            }
+        }
+    }
 
-#if MINIP_USE_UDP_CHECKSUM
-uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, struct udp_hdr *udp)
-{
-    uint32_t total = 0;
-    uint16_t chksum = 0;
-    size_t len = ntohs(udp->len);
-    uint16_t *p;
-
-    p = (uint16_t *)ipv4->src_addr;
-    total += htons(p[0]);
-    total += htons(p[1]);
-
-    p = (uint16_t *)ipv4->dst_addr;
-    total += htons(p[0]);
-    total += htons(p[1]);
-
-    p = (const uint16_t *)udp->data;
-    for (size_t i = 0; i < len / 2; i++ ) {
-        total += p[i];
+    /* and the incremental update against a full recompute */
+    uint16_t cksum = ~ones_sum16(0, buf, 64);
+    uint32_t old_val;
+    memcpy(&old_val, buf + 8, sizeof(old_val));
+    uint32_t new_val = old_val ^ 0x5a5aa5a5;
+    memcpy(buf + 8, &new_val, sizeof(new_val));
+    uint16_t full = ~ones_sum16(0, buf, 64);
+    if (cksum_update32(cksum, old_val, new_val) != full) {
+        printf("MISMATCH: incremental update\n");
+        goto out;
     }
 
-    total += IP_PROTO_UDP;
-    total += udp->len;
-    total += udp->src_port;
-    total += udp->dst_port;
-    total += ipv4->len;
+    printf("%8s %12s %12s\n", "len", "ref MB/s", "MB/s");
+    for (size_t len = 64; len <= max_len; len *= 2) {
+        uint iters = (16 * 1024 * 1024) / len;
+        volatile uint16_t result;
+
+        lk_bigtime_t t = current_time_hires();
+        for (uint i = 0; i < iters; i++)
+            result = ones_sum16_ref(0, buf, len);
+        lk_bigtime_t ref = current_time_hires() - t;
 
-    chksum = (total & 0xFFFF) + (total >> 16);
-    chksum = ~chksum;
+        t = current_time_hires();
+        for (uint i = 0; i < iters; i++)
+            result = ones_sum16(0, buf, len);
+        t = current_time_hires() - t;
+        (void)result;
+
+        uint64_t bytes = (uint64_t)iters * len;
+        printf("%8zu %12llu %12llu\n", len, ref ? bytes / ref : 0, t ? bytes / t : 0);
+    }
 
-    return chksum;
+out:
+    free(buf);
 }
 #endif
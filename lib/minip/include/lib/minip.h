@@ -50,6 +50,18 @@ void minip_init_dhcp(tx_func_t tx_func, void *tx_arg);
 /* packet rx hook to hand to ethernet driver */
 void minip_rx_driver_callback(pktbuf_t *p);
 
+/* capabilities of the tx handler, set by whoever hooked up the driver */
+#define MINIP_TX_FEATURE_SG     (1<<0) /* takes multi part pktbufs chained through pktbuf->next */
+#define MINIP_TX_FEATURE_CSUM   (1<<1) /* finishes PKTBUF_FLAG_CKSUM_PARTIAL checksums */
+#define MINIP_TX_FEATURE_TSO    (1<<2) /* splits PKTBUF_FLAG_GSO_TCPV4 packets itself */
+
+void minip_set_tx_features(uint32_t features);
+uint32_t minip_get_tx_features(void);
+
+/* called when a neighbour never answered arp, with the number of packets dropped for it */
+typedef void (*minip_unreachable_callback_t)(uint32_t addr, uint dropped, void *arg);
+void minip_set_unreachable_callback(minip_unreachable_callback_t cb, void *arg);
+
 /* global configuration state */
 void minip_get_macaddr(uint8_t *addr);
 void minip_set_macaddr(const uint8_t *addr);
@@ -79,6 +91,13 @@ status_t tcp_close(tcp_socket_t *socket);
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len);
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
 
+/* Queue buf to be sent without copying it. The buffer must stay untouched until
+ * cb is called, which happens from a tcp worker thread once every byte of it has
+ * been acked and the driver has let go of it, or the socket is torn down. */
+typedef void (*tcp_write_callback_t)(const void *buf, size_t len, void *arg);
+status_t tcp_write_nocopy(tcp_socket_t *socket, const void *buf, size_t len,
+                          tcp_write_callback_t cb, void *arg);
+
 static inline status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
 {
     return tcp_accept_timeout(listen_socket, accept_socket, INFINITE_TIME);
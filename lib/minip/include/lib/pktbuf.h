@@ -32,6 +32,11 @@
 #define PKTBUF_POOL_SIZE 256
 #endif
 
+/* the pool grows on demand past PKTBUF_POOL_SIZE, up to this many objects */
+#ifndef PKTBUF_POOL_MAX
+#define PKTBUF_POOL_MAX (PKTBUF_POOL_SIZE * 4)
+#endif
+
 #ifndef PKTBUF_SIZE
 #define PKTBUF_SIZE     1536
 #endif
@@ -49,6 +54,11 @@ typedef struct pktbuf {
     paddr_t phys_base;
     struct list_node list;
     u32 flags;
+    u32 priv; // scratch space for the layer currently holding the packet
+    u16 csum_start;  // with CKSUM_PARTIAL, where summing starts, as an offset from buffer
+    u16 csum_offset; // and where the result goes, relative to csum_start
+    u16 gso_size;    // with GSO_TCPV4, the payload size of each segment to cut the packet into
+    struct pktbuf *next; // next fragment of a multi part packet, valid only if EOF is clear
     pktbuf_free_callback cb;
     void *cb_args;
     u8 *buffer;
@@ -66,6 +76,8 @@ typedef struct pktbuf_pool_object {
 #define PKTBUF_FLAG_CKSUM_UDP_GOOD (1<<2)
 #define PKTBUF_FLAG_EOF            (1<<3)
 #define PKTBUF_FLAG_CACHED         (1<<4)
+#define PKTBUF_FLAG_CKSUM_PARTIAL  (1<<5) // tx checksum to be finished by the nic
+#define PKTBUF_FLAG_GSO_TCPV4      (1<<6) // tcp segment larger than the mss, to be split on the way out
 
 /* Return the physical address offset of data in the packet */
 static inline u32 pktbuf_data_phys(pktbuf_t *p)
@@ -73,6 +85,17 @@ static inline u32 pktbuf_data_phys(pktbuf_t *p)
     return p->phys_base + (p->data - p->buffer);
 }
 
+// total length of a packet and any fragments chained to it
+static inline u32 pktbuf_chain_len(pktbuf_t *p)
+{
+    u32 len = p->dlen;
+    while ((p->flags & PKTBUF_FLAG_EOF) == 0) {
+        p = p->next;
+        len += p->dlen;
+    }
+    return len;
+}
+
 // number of bytes available for _prepend
 static inline u32 pktbuf_avail_head(pktbuf_t *p)
 {
@@ -89,13 +112,34 @@ static inline u32 pktbuf_avail_tail(pktbuf_t *p)
 pktbuf_t *pktbuf_alloc(void);
 pktbuf_t *pktbuf_alloc_empty(void);
 
+// allocate a packet buffer. unless can_block is set, returns NULL instead of
+// waiting when the pool is exhausted
+pktbuf_t *pktbuf_alloc_etc(bool can_block);
+
+// allocate an empty packet buffer header. unless can_block is set, returns
+// NULL instead of waiting when the pool is exhausted
+pktbuf_t *pktbuf_alloc_empty_etc(bool can_block);
+
+// allocate up to count packet buffers without blocking, returns how many it got
+size_t pktbuf_alloc_n(pktbuf_t **pkts, size_t count);
+
 /* Add a buffer to an existing packet buffer */
 void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
                        uint32_t flags, pktbuf_free_callback cb, void *cb_args);
-// return packet buffer to buffer pool
+// take over the data of a received packet without blocking, leaving
+// p with a fresh empty buffer. returns NULL if the pool is exhausted
+pktbuf_t *pktbuf_steal(pktbuf_t *p);
+
+// chain frag (and anything chained to it) to the end of p
+void pktbuf_append_frag(pktbuf_t *p, pktbuf_t *frag);
+
+// return packet buffer and any chained fragments to buffer pool
 // returns number of threads woken up
 int pktbuf_free(pktbuf_t *p, bool reschedule);
 
+// return count packet buffers, and their fragments, to the pool in one go
+void pktbuf_free_n(pktbuf_t **pkts, size_t count, bool reschedule);
+
 // extend buffer by sz bytes, copied from data
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz);
 
@@ -124,4 +168,5 @@ void pktbuf_create(void *ptr, size_t size);
 void pktbuf_create_bufs(void *ptr, size_t size);
 
 void pktbuf_dump(pktbuf_t *p);
+void pktbuf_dump_stats(void);
 #endif
@@ -57,6 +57,7 @@ void arp_usage(void)
 {
     printf("arp list                        print arp table\n");
     printf("arp query <ipv4 address>        query arp address\n");
+    printf("arp stats                       print arp statistics\n");
 }
 
 static int cmd_arp(int argc, const cmd_args *argv)
@@ -71,6 +72,8 @@ static int cmd_arp(int argc, const cmd_args *argv)
     cmd = argv[1].str;
     if (argc == 2 && strncmp(cmd, "list", sizeof("list")) == 0) {
         arp_cache_dump();
+    } else if (argc == 2 && strncmp(cmd, "stats", sizeof("stats")) == 0) {
+        arp_dump_stats();
     } else if (argc == 3 && strncmp(cmd, "query", sizeof("query")) == 0) {
         const char *addr_s = argv[2].str;
         uint32_t addr = str_ip_to_int(addr_s, strlen(addr_s));
@@ -89,13 +92,27 @@ static int cmd_minip(int argc, const cmd_args *argv)
 minip_usage:
         printf("minip commands\n");
         printf("mi [a]rp                        dump arp table\n");
+        printf("mi [p]ktbuf                     print pktbuf pool usage\n");
         printf("mi [s]tatus                     print ip status\n");
         printf("mi [t]est [dest] [port] [cnt]   send <cnt> test packets to the dest:port\n");
+        printf("mi shim [drop] [reorder]        drop/reorder received packets, rates per 1000\n");
+        printf("mi cksum                        checksum correctness check and benchmark\n");
+    } else if (!strcmp(argv[1].str, "cksum")) {
+        minip_cksum_bench();
+    } else if (!strcmp(argv[1].str, "shim")) {
+        if (argc >= 3)
+            minip_set_rx_shim(argv[2].u, (argc >= 4) ? argv[3].u : 0);
+        minip_dump_rx_shim();
     } else {
         switch (argv[1].str[0]) {
 
             case 'a':
                 arp_cache_dump();
+                arp_dump_stats();
+                break;
+
+            case 'p':
+                pktbuf_dump_stats();
                 break;
 
             case 's': {
@@ -106,14 +106,19 @@ static const uint8_t bcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
 void arp_cache_init(void);
 void arp_cache_update(uint32_t addr, const uint8_t mac[6]);
-uint8_t *arp_cache_lookup(uint32_t addr);
+bool arp_cache_lookup(uint32_t addr, uint8_t mac[6]);
 void arp_cache_dump(void);
+void arp_dump_stats(void);
 int arp_send_request(uint32_t addr);
-const uint8_t *arp_get_dest_mac(uint32_t host);
+status_t arp_send_to(pktbuf_t *p, uint32_t addr);
 
 uint16_t rfc1701_chksum(const uint8_t *buf, size_t len);
 uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, udp_hdr_t *udp);
 uint16_t ones_sum16(uint32_t sum, const void *_buf, int len);
+uint16_t ones_sum16_chain(uint32_t sum, const pktbuf_t *p, size_t offset);
+uint16_t cksum_update16(uint16_t cksum, uint16_t old_val, uint16_t new_val);
+uint16_t cksum_update32(uint16_t cksum, uint32_t old_val, uint32_t new_val);
+void minip_cksum_bench(void);
 
 /* Helper methods for building headers */
 void minip_build_mac_hdr(struct eth_hdr *pkt, const uint8_t *dst, uint16_t type);
@@ -121,10 +126,18 @@ void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, ui
 
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto);
 
+/* hand a finished ethernet frame to the driver, segmenting it first if it needs to be */
+void minip_tx(pktbuf_t *p);
+void minip_dump_tx_stats(void);
+
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip);
+
+/* receive path drop/reorder shim for testing, rates in packets per thousand */
+void minip_set_rx_shim(uint drop_rate, uint reorder_rate);
+void minip_dump_rx_shim(void);
 void udp_input(pktbuf_t *p, uint32_t src_ip);
 
-const uint8_t *get_dest_mac(uint32_t host);
+bool minip_is_broadcast(uint32_t addr);
 
 // timers
 typedef void (*net_timer_callback_t)(void *);
@@ -24,6 +24,7 @@
 
 #include "minip-internal.h"
 
+#include <assert.h>
 #include <err.h>
 #include <stdio.h>
 #include <debug.h>
@@ -36,8 +37,7 @@
 #include <malloc.h>
 #include <list.h>
 #include <kernel/thread.h>
-
-static struct list_node arp_list = LIST_INITIAL_VALUE(arp_list);
+#include <kernel/spinlock.h>
 
 // TODO
 // 1. Tear endian code out into something that flips words before/after tx/rx calls
@@ -105,6 +105,7 @@ void gen_random_mac_address(uint8_t *mac_addr)
 /* This function is called by minip to send packets */
 tx_func_t minip_tx_handler;
 void *minip_tx_arg;
+static uint32_t minip_tx_features;
 
 void minip_init(tx_func_t tx_handler, void *tx_arg,
                 uint32_t ip, uint32_t mask, uint32_t gateway)
@@ -150,96 +151,147 @@ void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, ui
     ipv4->chksum = rfc1701_chksum((uint8_t *) ipv4, sizeof(struct ipv4_hdr));
 }
 
-int send_arp_request(uint32_t addr)
+bool minip_is_broadcast(uint32_t addr)
 {
-    pktbuf_t *p;
-    struct eth_hdr *eth;
-    struct arp_pkt *arp;
-
-    if ((p = pktbuf_alloc()) == NULL) {
-        return -1;
-    }
-
-    eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
-    arp = pktbuf_append(p, sizeof(struct arp_pkt));
-    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_ARP);
-
-    arp->htype = htons(0x0001);
-    arp->ptype = htons(0x0800);
-    arp->hlen = 6;
-    arp->plen = 4;
-    arp->oper = htons(ARP_OPER_REQUEST);
-    arp->spa = minip_ip;
-    arp->tpa = addr;
-    mac_addr_copy(arp->sha, minip_mac);
-    mac_addr_copy(arp->tha, bcast_mac);
+    return addr == IPV4_BCAST || addr == minip_broadcast;
+}
 
-    minip_tx_handler(p);
-    return 0;
+void minip_set_tx_features(uint32_t features)
+{
+    minip_tx_features = features;
 }
 
-static void handle_arp_timeout_cb(void *arg)
+uint32_t minip_get_tx_features(void)
 {
-    *(bool *)arg = true;
+    return minip_tx_features;
 }
 
-const uint8_t *get_dest_mac(uint32_t host)
+static struct {
+    uint gso_packets;       // oversized tcp segments passed down
+    uint gso_segments;      // packets they were split into in software
+    uint gso_drops;         // segments lost to a pktbuf shortage
+} minip_tx_stats;
+
+/* Split an oversized tcp segment into gso_size pieces for a driver that can't do it
+ * itself. This happens as late as possible, so the layers above only ever see the
+ * one large segment. Each piece gets a copy of the headers with the length, id,
+ * sequence number and checksums redone, and only the last keeps FIN and PSH. */
+static void minip_gso_segment(pktbuf_t *p)
 {
-    uint8_t *dst_mac = NULL;
-    bool arp_timeout = false;
-    net_timer_t arp_timeout_timer;
+    const size_t eth_len = sizeof(struct eth_hdr);
+    struct ipv4_hdr *ip = (struct ipv4_hdr *)(p->data + eth_len);
+    size_t ip_len = (ip->ver_ihl & 0xf) * 4;
+    uint8_t *tcp = (uint8_t *)ip + ip_len;
+    size_t tcp_len = (tcp[12] >> 4) * 4;
+    size_t hdr_len = eth_len + ip_len + tcp_len;
+
+    DEBUG_ASSERT(p->gso_size > 0);
+    DEBUG_ASSERT(p->dlen >= hdr_len);
+    DEBUG_ASSERT(hdr_len + p->gso_size <= PKTBUF_SIZE);
+
+    uint32_t payload = pktbuf_chain_len(p) - hdr_len;
+    uint32_t seq;
+    memcpy(&seq, tcp + 4, sizeof(seq));
+    seq = ntohl(seq);
+    uint16_t id = ntohs(ip->id);
+    bool csum_offload = minip_tx_features & MINIP_TX_FEATURE_CSUM;
+
+    /* where the payload left off in the chain */
+    const pktbuf_t *f = p;
+    size_t f_offset = hdr_len;
+
+    for (uint32_t offset = 0; offset < payload; id++) {
+        uint32_t len = MIN(p->gso_size, payload - offset);
+
+        /* the sender may hold its socket lock, so drop the rest rather than wait for the pool */
+        pktbuf_t *sp = pktbuf_alloc_etc(false);
+        if (!sp) {
+            minip_tx_stats.gso_drops++;
+            break;
+        }
+
+        /* headers and payload fill the whole buffer, the driver doesn't need room in front */
+        sp->data = sp->buffer;
+        pktbuf_append_data(sp, p->data, hdr_len);
+        for (uint32_t copied = 0; copied < len; ) {
+            if (f_offset == f->dlen) {
+                f = f->next;
+                f_offset = 0;
+                continue;
+            }
+            size_t n = MIN(len - copied, f->dlen - f_offset);
+            pktbuf_append_data(sp, f->data + f_offset, n);
+            f_offset += n;
+            copied += n;
+        }
 
-    if (host == IPV4_BCAST) {
-        return bcast_mac;
+        struct ipv4_hdr *sip = (struct ipv4_hdr *)(sp->data + eth_len);
+        sip->len = htons(ip_len + tcp_len + len);
+        sip->id = htons(id);
+        sip->chksum = 0;
+        sip->chksum = rfc1701_chksum((uint8_t *)sip, ip_len);
+
+        uint8_t *stcp = (uint8_t *)sip + ip_len;
+        uint32_t sseq = htonl(seq + offset);
+        memcpy(stcp + 4, &sseq, sizeof(sseq));
+        offset += len;
+        if (offset < payload)
+            stcp[13] &= ~0x09; // FIN, PSH
+
+        /* pseudo header, then the tcp header and payload */
+        uint16_t sum = ones_sum16(0, &sip->src_addr, sizeof(sip->src_addr) * 2);
+        uint16_t pseudo[2] = { htons(IP_PROTO_TCP), htons(tcp_len + len) };
+        sum = ones_sum16(sum, pseudo, sizeof(pseudo));
+        uint16_t *csum = (uint16_t *)(stcp + 16);
+        if (csum_offload) {
+            *csum = sum;
+            sp->flags |= PKTBUF_FLAG_CKSUM_PARTIAL;
+            sp->csum_start = stcp - sp->buffer;
+            sp->csum_offset = 16;
+        } else {
+            *csum = 0;
+            *csum = ~ones_sum16(sum, stcp, tcp_len + len);
+        }
+
+        minip_tx_stats.gso_segments++;
+        minip_tx_handler(sp);
     }
 
-    dst_mac = arp_cache_lookup(host);
-    if (dst_mac == NULL) {
-        send_arp_request(host);
-        memset(&arp_timeout_timer, 0, sizeof(arp_timeout_timer));
-        net_timer_set(&arp_timeout_timer, handle_arp_timeout_cb, &arp_timeout, 100);
-        while (!arp_timeout) {
-            dst_mac = arp_cache_lookup(host);
-            if (dst_mac) {
-                net_timer_cancel(&arp_timeout_timer);
-                break;
-            }
+    pktbuf_free(p, true);
+}
+
+void minip_tx(pktbuf_t *p)
+{
+    if (p->flags & PKTBUF_FLAG_GSO_TCPV4) {
+        minip_tx_stats.gso_packets++;
+        if ((minip_tx_features & MINIP_TX_FEATURE_TSO) == 0) {
+            minip_gso_segment(p);
+            return;
         }
     }
 
-    return dst_mac;
+    minip_tx_handler(p);
+}
+
+void minip_dump_tx_stats(void)
+{
+    printf("tx features 0x%x, gso: %u packets, %u software segments, %u dropped\n",
+           minip_tx_features, minip_tx_stats.gso_packets, minip_tx_stats.gso_segments,
+           minip_tx_stats.gso_drops);
 }
 
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
 {
-    status_t ret = 0;
-    size_t data_len = p->dlen;
-    const uint8_t *dst_mac;
+    size_t data_len = pktbuf_chain_len(p);
 
     struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
     struct eth_hdr *eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
 
-
-    if (dest_addr == IPV4_BCAST || dest_addr == minip_broadcast) {
-        dst_mac = bcast_mac;
-        goto ready;
-    }
-
-    dst_mac = get_dest_mac(dest_addr);
-    if (!dst_mac) {
-        pktbuf_free(p, true);
-        ret = -EHOSTUNREACH;
-        goto err;
-    }
-
-ready:
-    minip_build_mac_hdr(eth, dst_mac, ETH_TYPE_IPV4);
+    /* the destination mac is filled in once arp knows it */
+    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_IPV4);
     minip_build_ipv4_hdr(ip, dest_addr, proto, data_len);
 
-    minip_tx_handler(p);
-
-err:
-    return ret;
+    return arp_send_to(p, dest_addr);
 }
 
 /* Swap the dst/src ip addresses and send an ICMP ECHO REPLY with the same payload.
@@ -265,7 +317,7 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
 
     len = sizeof(struct icmp_pkt) + reqdatalen;
 
-    minip_build_mac_hdr(eth, arp_cache_lookup(ipaddr), ETH_TYPE_IPV4);
+    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_IPV4);
     minip_build_ipv4_hdr(ip, ipaddr, IP_PROTO_ICMP, len);
 
     icmp->type = ICMP_ECHO_REPLY;
@@ -274,7 +326,7 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
     icmp->chksum = 0;
     icmp->chksum = rfc1701_chksum((uint8_t *) icmp, len);
 
-    minip_tx_handler(p);
+    arp_send_to(p, ipaddr);
 }
 
 static void dump_ipv4_addr(uint32_t addr)
@@ -448,7 +500,7 @@ static void dump_eth_packet(const struct eth_hdr *eth)
     printf(" type 0x%hx\n", htons(eth->type));
 }
 
-void minip_rx_driver_callback(pktbuf_t *p)
+static void minip_rx_packet(pktbuf_t *p)
 {
     struct eth_hdr *eth;
 
@@ -479,6 +531,94 @@ void minip_rx_driver_callback(pktbuf_t *p)
     }
 }
 
+/*
+ * Test shim in front of the receive path that randomly drops packets and
+ * swaps the order of adjacent ones, for exercising loss recovery in the
+ * upper layers. Rates are in packets per thousand, both 0 disables it.
+ */
+static struct {
+    spin_lock_t lock;
+    uint drop_rate;
+    uint reorder_rate;
+    pktbuf_t *held;
+
+    uint32_t seen;
+    uint32_t dropped;
+    uint32_t reordered;
+} rx_shim = {
+    .lock = SPIN_LOCK_INITIAL_VALUE,
+};
+
+void minip_set_rx_shim(uint drop_rate, uint reorder_rate)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&rx_shim.lock, state);
+
+    rx_shim.drop_rate = MIN(drop_rate, 1000);
+    rx_shim.reorder_rate = MIN(reorder_rate, 1000);
+    rx_shim.seen = rx_shim.dropped = rx_shim.reordered = 0;
+
+    pktbuf_t *held = rx_shim.held;
+    rx_shim.held = NULL;
+
+    spin_unlock_irqrestore(&rx_shim.lock, state);
+
+    if (held)
+        pktbuf_free(held, true);
+}
+
+void minip_dump_rx_shim(void)
+{
+    printf("rx shim: drop %u/1000, reorder %u/1000, seen %u, dropped %u, reordered %u\n",
+           rx_shim.drop_rate, rx_shim.reorder_rate, rx_shim.seen, rx_shim.dropped, rx_shim.reordered);
+}
+
+static void minip_rx_shim(pktbuf_t *p)
+{
+    spin_lock_saved_state_t state;
+    uint r = rand() % 1000;
+
+    rx_shim.seen++;
+    if (r < rx_shim.drop_rate) {
+        rx_shim.dropped++;
+        return;
+    }
+
+    spin_lock_irqsave(&rx_shim.lock, state);
+    pktbuf_t *held = rx_shim.held;
+    rx_shim.held = NULL;
+    spin_unlock_irqrestore(&rx_shim.lock, state);
+
+    if (!held && r < rx_shim.drop_rate + rx_shim.reorder_rate) {
+        /* the driver reuses p once we return, so hold on to a copy and
+         * deliver it after the next packet */
+        held = pktbuf_steal(p);
+        if (held) {
+            rx_shim.reordered++;
+            spin_lock_irqsave(&rx_shim.lock, state);
+            rx_shim.held = held;
+            spin_unlock_irqrestore(&rx_shim.lock, state);
+            return;
+        }
+    }
+
+    minip_rx_packet(p);
+    if (held) {
+        minip_rx_packet(held);
+        pktbuf_free(held, true);
+    }
+}
+
+void minip_rx_driver_callback(pktbuf_t *p)
+{
+    if (unlikely(rx_shim.drop_rate || rx_shim.reorder_rate)) {
+        minip_rx_shim(p);
+        return;
+    }
+
+    minip_rx_packet(p);
+}
+
 uint32_t minip_parse_ipaddr(const char *ipaddr_str, size_t len)
 {
     uint8_t ip[4] = { 0, 0, 0, 0 };
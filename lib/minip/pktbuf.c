@@ -28,10 +28,13 @@
 #include <printf.h>
 #include <string.h>
 #include <malloc.h>
+#include <err.h>
 
 #include <kernel/thread.h>
+#include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/spinlock.h>
+#include <arch/ops.h>
 #include <lib/pktbuf.h>
 #include <lib/pool.h>
 #include <lk/init.h>
@@ -42,36 +45,255 @@
 
 #define LOCAL_TRACE 0
 
+/* Objects are handed out from a small cache per cpu, touched only with interrupts
+ * off on that cpu. The cache moves PKTBUF_CACHE_BATCH objects at a time to and from
+ * the global pool, so the global lock is taken once per batch rather than per packet.
+ * When the global pool runs dry it grows a chunk at a time, up to PKTBUF_POOL_MAX.
+ */
+#define PKTBUF_CACHE_SIZE   32
+#define PKTBUF_CACHE_BATCH  16
+#define PKTBUF_GROW_COUNT   64
+
+struct pktbuf_cache {
+    uint count;
+    void *objs[PKTBUF_CACHE_SIZE];
+
+    uint allocs;
+    uint frees;
+    uint refills;
+    uint drains;
+} __ALIGNED(CACHE_LINE);
+
+static struct pktbuf_cache pktbuf_caches[SMP_MAX_CPUS];
+
 static pool_t pktbuf_pool;
-static semaphore_t pktbuf_sem;
 static spin_lock_t lock;
+static uint pktbuf_pool_free;   /* objects sitting in pktbuf_pool */
+static uint pktbuf_pool_total;  /* objects in the pool and out of it */
+
+/* threads blocked in pktbuf_alloc() once the pool can't grow any further */
+static semaphore_t pktbuf_wait_sem;
+static uint pktbuf_waiters;
+
+static mutex_t pktbuf_grow_lock = MUTEX_INITIAL_VALUE(pktbuf_grow_lock);
+
+static struct {
+    uint low_water;     /* fewest objects left in the global pool */
+    uint high_water;    /* most objects out of the global pool at once, cached ones included */
+    uint grows;
+    uint grow_failures;
+    uint waits;
+    uint drops;         /* non blocking allocations that came back empty */
+} pktbuf_stats;
+
+/* Move up to count objects from the global pool to objs, returns how many it moved. */
+static uint pool_take(void **objs, uint count)
+{
+    spin_lock_saved_state_t state;
+    uint i;
+
+    spin_lock_irqsave(&lock, state);
+    for (i = 0; i < count; i++) {
+        objs[i] = pool_alloc(&pktbuf_pool);
+        if (!objs[i])
+            break;
+    }
+    pktbuf_pool_free -= i;
 
+    if (pktbuf_pool_free < pktbuf_stats.low_water)
+        pktbuf_stats.low_water = pktbuf_pool_free;
+    if (pktbuf_pool_total - pktbuf_pool_free > pktbuf_stats.high_water)
+        pktbuf_stats.high_water = pktbuf_pool_total - pktbuf_pool_free;
+    spin_unlock_irqrestore(&lock, state);
 
-/* Take an object from the pool of pktbuf objects to act as a header or buffer.  */
-static void *get_pool_object(void)
+    return i;
+}
+
+/* Put objects back in the global pool. Returns how many waiters need to be woken,
+ * which the caller does once it has interrupts back on. */
+static uint pool_give(void **objs, uint count)
 {
-    pool_t *entry;
     spin_lock_saved_state_t state;
+    uint wake;
 
-    sem_wait(&pktbuf_sem);
     spin_lock_irqsave(&lock, state);
-    entry = pool_alloc(&pktbuf_pool);
+    for (uint i = 0; i < count; i++) {
+        pool_free(&pktbuf_pool, objs[i]);
+    }
+    pktbuf_pool_free += count;
+
+    wake = MIN(pktbuf_waiters, count);
+    pktbuf_waiters -= wake;
     spin_unlock_irqrestore(&lock, state);
 
-    return (pktbuf_pool_object_t *) entry;
+    return wake;
+}
 
+static void pool_wake(uint wake, bool reschedule)
+{
+    while (wake-- > 0) {
+        sem_post(&pktbuf_wait_sem, reschedule);
+    }
 }
 
-/* Return an object to thje pktbuf object pool. */
-static void free_pool_object(pktbuf_pool_object_t *entry, bool reschedule)
+/* Add another chunk of objects to the global pool. Returns false if the pool is at
+ * its limit, memory is short, or we're somewhere we can't allocate pages from. */
+static bool pool_grow(void)
+{
+    if (arch_ints_disabled())
+        return false;
+
+    mutex_acquire(&pktbuf_grow_lock);
+
+    /* someone else may have grown it while we waited for the lock */
+    if (pktbuf_pool_free > 0) {
+        mutex_release(&pktbuf_grow_lock);
+        return true;
+    }
+
+    uint count = MIN(PKTBUF_GROW_COUNT, PKTBUF_POOL_MAX - pktbuf_pool_total);
+    if (count == 0) {
+        mutex_release(&pktbuf_grow_lock);
+        return false;
+    }
+
+#if WITH_KERNEL_VM
+    uint pages = ROUNDUP(count * sizeof(pktbuf_pool_object_t), PAGE_SIZE) / PAGE_SIZE;
+    pktbuf_pool_object_t *chunk = pmm_alloc_kpages(pages, NULL);
+#else
+    pktbuf_pool_object_t *chunk = memalign(CACHE_LINE, count * sizeof(pktbuf_pool_object_t));
+#endif
+    if (!chunk) {
+        pktbuf_stats.grow_failures++;
+        mutex_release(&pktbuf_grow_lock);
+        return false;
+    }
+
+    LTRACEF("adding %u objects at %p, %u total\n", count, chunk, pktbuf_pool_total + count);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&lock, state);
+    for (uint i = 0; i < count; i++) {
+        pool_free(&pktbuf_pool, &chunk[i]);
+    }
+    pktbuf_pool_free += count;
+    pktbuf_pool_total += count;
+    pktbuf_stats.grows++;
+    spin_unlock_irqrestore(&lock, state);
+
+    mutex_release(&pktbuf_grow_lock);
+
+    return true;
+}
+
+/* Block until something is returned to the global pool. */
+static void pool_wait(void)
 {
-    DEBUG_ASSERT(entry);
     spin_lock_saved_state_t state;
 
     spin_lock_irqsave(&lock, state);
-    pool_free(&pktbuf_pool, entry);
+    if (pktbuf_pool_free > 0) {
+        spin_unlock_irqrestore(&lock, state);
+        return;
+    }
+    pktbuf_waiters++;
+    pktbuf_stats.waits++;
     spin_unlock_irqrestore(&lock, state);
-    sem_post(&pktbuf_sem, reschedule);
+
+    sem_wait(&pktbuf_wait_sem);
+}
+
+/* Take count objects from this cpu's cache, refilling it from the global pool as
+ * needed. Returns how many it got, which is less than count only if the global pool
+ * is empty. */
+static uint cache_take(void **objs, uint count)
+{
+    spin_lock_saved_state_t state;
+    uint got = 0;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct pktbuf_cache *c = &pktbuf_caches[arch_curr_cpu_num()];
+
+    while (got < count) {
+        if (c->count == 0) {
+            c->count = pool_take(c->objs, PKTBUF_CACHE_BATCH);
+            if (c->count == 0)
+                break;
+            c->refills++;
+        }
+
+        uint n = MIN(c->count, count - got);
+        c->count -= n;
+        memcpy(&objs[got], &c->objs[c->count], n * sizeof(void *));
+        got += n;
+    }
+    c->allocs += got;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return got;
+}
+
+/* Return count objects to this cpu's cache, spilling to the global pool when it
+ * fills. If anyone is waiting on the global pool everything goes straight there,
+ * otherwise the objects could sit in our cache while they starve on another cpu. */
+static void cache_give(void **objs, uint count, bool reschedule)
+{
+    spin_lock_saved_state_t state;
+    uint wake = 0;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct pktbuf_cache *c = &pktbuf_caches[arch_curr_cpu_num()];
+
+    c->frees += count;
+    if (unlikely(pktbuf_waiters > 0)) {
+        wake = pool_give(objs, count);
+    } else {
+        for (uint i = 0; i < count; i++) {
+            if (c->count == PKTBUF_CACHE_SIZE) {
+                c->count -= PKTBUF_CACHE_BATCH;
+                wake += pool_give(&c->objs[c->count], PKTBUF_CACHE_BATCH);
+                c->drains++;
+            }
+            c->objs[c->count++] = objs[i];
+        }
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    pool_wake(wake, reschedule);
+}
+
+/* Take count objects from the pool of pktbuf objects to act as headers or buffers.
+ * Grows the pool if it can, and if it can't, blocks or returns what it has. */
+static uint get_pool_objects(void **objs, uint count, bool can_block)
+{
+    uint got = 0;
+
+    for (;;) {
+        got += cache_take(&objs[got], count - got);
+        if (got == count)
+            return got;
+
+        if (pool_grow())
+            continue;
+
+        if (!can_block) {
+            pktbuf_stats.drops++;
+            return got;
+        }
+
+        pool_wait();
+    }
+}
+
+/* Return an object to thje pktbuf object pool. */
+static void free_pool_object(pktbuf_pool_object_t *entry, bool reschedule)
+{
+    DEBUG_ASSERT(entry);
+
+    void *obj = entry;
+    cache_give(&obj, 1, reschedule);
 }
 
 /* Callback used internally to place a pktbuf_pool_object back in the pool after
@@ -116,47 +338,176 @@ void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz, uint32
 #endif
 }
 
-pktbuf_t *pktbuf_alloc(void)
+static void pktbuf_init_with_buffer(pktbuf_t *p, void *buf)
 {
-    pktbuf_t *p = NULL;
-    void *buf = NULL;
+    memset(p, 0, sizeof(pktbuf_t));
+    pktbuf_add_buffer(p, buf, PKTBUF_SIZE, PKTBUF_MAX_HDR, 0, free_pktbuf_buf_cb, NULL);
+}
 
-    p = get_pool_object();
-    if (!p) {
+pktbuf_t *pktbuf_alloc_etc(bool can_block)
+{
+    void *objs[2];
+    uint got = get_pool_objects(objs, 2, can_block);
+
+    if (got < 2) {
+        if (got)
+            cache_give(objs, got, false);
         return NULL;
     }
 
-    buf = get_pool_object();
-    if (!buf) {
-        free_pool_object((pktbuf_pool_object_t *)p, false);
-        return NULL;
+    pktbuf_init_with_buffer(objs[0], objs[1]);
+    return objs[0];
+}
+
+pktbuf_t *pktbuf_alloc(void)
+{
+    return pktbuf_alloc_etc(true);
+}
+
+size_t pktbuf_alloc_n(pktbuf_t **pkts, size_t count)
+{
+    void *objs[PKTBUF_CACHE_BATCH * 2];
+    size_t done = 0;
+
+    while (done < count) {
+        uint want = MIN(count - done, (size_t)PKTBUF_CACHE_BATCH) * 2;
+        uint got = get_pool_objects(objs, want, false);
+
+        /* an odd one out can't make a whole pktbuf */
+        if (got & 1) {
+            got--;
+            cache_give(&objs[got], 1, false);
+        }
+
+        for (uint i = 0; i < got; i += 2) {
+            pktbuf_init_with_buffer(objs[i], objs[i + 1]);
+            pkts[done++] = objs[i];
+        }
+
+        if (got < want)
+            break;
     }
 
-    memset(p, 0, sizeof(pktbuf_t));
-    pktbuf_add_buffer(p, buf, PKTBUF_SIZE, PKTBUF_MAX_HDR, 0, free_pktbuf_buf_cb, NULL);
-    return p;
+    return done;
 }
 
-pktbuf_t *pktbuf_alloc_empty(void)
+pktbuf_t *pktbuf_alloc_empty_etc(bool can_block)
 {
-    pktbuf_t *p = (pktbuf_t *) get_pool_object();
+    void *obj;
+
+    if (get_pool_objects(&obj, 1, can_block) == 0)
+        return NULL;
 
+    pktbuf_t *p = obj;
     p->flags = PKTBUF_FLAG_EOF;
     return p;
 }
 
-int pktbuf_free(pktbuf_t *p, bool reschedule)
+pktbuf_t *pktbuf_alloc_empty(void)
+{
+    return pktbuf_alloc_empty_etc(true);
+}
+
+/* Detach the data of a received packet so a protocol layer can hold on to it
+ * after the driver callback returns. If the buffer came from the pool it is
+ * moved to a new pktbuf header and p gets a fresh pool buffer in its place, so
+ * no data is copied. Driver owned buffers are copied into a pool buffer instead.
+ */
+pktbuf_t *pktbuf_steal(pktbuf_t *p)
+{
+    DEBUG_ASSERT(p);
+
+    if (p->dlen > PKTBUF_MAX_DATA)
+        return NULL;
+
+    void *objs[2];
+    uint got = get_pool_objects(objs, 2, false);
+    if (got < 2) {
+        if (got)
+            cache_give(objs, got, false);
+        return NULL;
+    }
+
+    pktbuf_t *np = objs[0];
+    void *buf = objs[1];
+
+    memset(np, 0, sizeof(pktbuf_t));
+    if (p->cb == free_pktbuf_buf_cb) {
+        /* hand the old buffer to the new header, swap in the new buffer */
+        pktbuf_add_buffer(np, p->buffer, p->blen, 0, p->flags, p->cb, p->cb_args);
+        np->data = p->data;
+        np->dlen = p->dlen;
+
+        pktbuf_add_buffer(p, buf, PKTBUF_SIZE, PKTBUF_MAX_HDR, 0, free_pktbuf_buf_cb, NULL);
+    } else {
+        pktbuf_add_buffer(np, buf, PKTBUF_SIZE, PKTBUF_MAX_HDR, p->flags, free_pktbuf_buf_cb, NULL);
+        pktbuf_append_data(np, p->data, p->dlen);
+    }
+
+    return np;
+}
+
+void pktbuf_append_frag(pktbuf_t *p, pktbuf_t *frag)
 {
     DEBUG_ASSERT(p);
+    DEBUG_ASSERT(frag);
+
+    while ((p->flags & PKTBUF_FLAG_EOF) == 0)
+        p = p->next;
+
+    p->next = frag;
+    p->flags &= ~PKTBUF_FLAG_EOF;
+}
 
-    if (p->cb) {
-        p->cb(p->buffer, p->cb_args);
+/* Gather up the pool objects behind a pktbuf chain in objs, flushing them back to
+ * the pool whenever it fills up. Returns how many are left in objs. */
+static uint pktbuf_collect(pktbuf_t *p, void **objs, uint count, uint max)
+{
+    while (p) {
+        pktbuf_t *next = (p->flags & PKTBUF_FLAG_EOF) ? NULL : p->next;
+
+        if (count + 2 > max) {
+            cache_give(objs, count, false);
+            count = 0;
+        }
+
+        if (p->cb == free_pktbuf_buf_cb) {
+            objs[count++] = p->buffer;
+        } else if (p->cb) {
+            p->cb(p->buffer, p->cb_args);
+        }
+        objs[count++] = p;
+
+        p = next;
     }
-    free_pool_object((pktbuf_pool_object_t *)p, false);
+
+    return count;
+}
+
+int pktbuf_free(pktbuf_t *p, bool reschedule)
+{
+    void *objs[PKTBUF_CACHE_BATCH];
+
+    DEBUG_ASSERT(p);
+
+    uint count = pktbuf_collect(p, objs, 0, countof(objs));
+    cache_give(objs, count, reschedule);
 
     return 1;
 }
 
+void pktbuf_free_n(pktbuf_t **pkts, size_t count, bool reschedule)
+{
+    void *objs[PKTBUF_CACHE_BATCH * 2];
+    uint n = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        DEBUG_ASSERT(pkts[i]);
+        n = pktbuf_collect(pkts[i], objs, n, countof(objs));
+    }
+    cache_give(objs, n, reschedule);
+}
+
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz)
 {
     if (pktbuf_avail_tail(p) < sz) {
@@ -222,14 +573,35 @@ void pktbuf_dump(pktbuf_t *p)
            (void *)p->phys_base);
 }
 
+void pktbuf_dump_stats(void)
+{
+    uint cached = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        cached += pktbuf_caches[i].count;
+    }
+
+    printf("pktbuf: %u objects of %zu bytes (max %u), %u free, %u in cpu caches\n",
+           pktbuf_pool_total, sizeof(pktbuf_pool_object_t), PKTBUF_POOL_MAX, pktbuf_pool_free, cached);
+    printf("        low water %u free, high water %u out, %u grows (%u failed), %u waits, %u drops\n",
+           pktbuf_stats.low_water, pktbuf_stats.high_water, pktbuf_stats.grows,
+           pktbuf_stats.grow_failures, pktbuf_stats.waits, pktbuf_stats.drops);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct pktbuf_cache *c = &pktbuf_caches[i];
+        if (c->allocs == 0 && c->frees == 0)
+            continue;
+        printf("        cpu %u: %u cached, %u allocs %u frees, %u refills %u drains\n",
+               i, c->count, c->allocs, c->frees, c->refills, c->drains);
+    }
+}
+
 static void pktbuf_init(uint level)
 {
     void *slab;
 
 #if LK_DEBUGLEVEL > 0
-    printf("pktbuf: creating %u pktbuf entries of size %zu (total %zu)\n",
+    printf("pktbuf: creating %u pktbuf entries of size %zu (total %zu), growing to %u\n",
            PKTBUF_POOL_SIZE, sizeof(struct pktbuf_pool_object),
-           PKTBUF_POOL_SIZE * sizeof(struct pktbuf_pool_object));
+           PKTBUF_POOL_SIZE * sizeof(struct pktbuf_pool_object), PKTBUF_POOL_MAX);
 #endif
 
 #if WITH_KERNEL_VM
@@ -244,7 +616,8 @@ static void pktbuf_init(uint level)
 #endif
 
     pool_init(&pktbuf_pool, sizeof(struct pktbuf_pool_object), CACHE_LINE, PKTBUF_POOL_SIZE, slab);
-    sem_init(&pktbuf_sem, PKTBUF_POOL_SIZE);
+    pktbuf_pool_free = pktbuf_pool_total = pktbuf_stats.low_water = PKTBUF_POOL_SIZE;
+    sem_init(&pktbuf_wait_sem, 0);
 }
 
 LK_INIT_HOOK(pktbuf, pktbuf_init, LK_INIT_LEVEL_THREADING);
@@ -34,8 +34,15 @@
 #include <lib/cbuf.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
 #include <arch/ops.h>
 #include <platform.h>
+#include <lk/init.h>
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -66,6 +73,14 @@ typedef struct tcp_mss_option {
     uint16_t mss;
 } __PACKED tcp_mss_option_t;
 
+enum {
+    TCP_OPTION_EOL = 0,
+    TCP_OPTION_NOP = 1,
+    TCP_OPTION_MSS = 2,
+    TCP_OPTION_SACK_PERMITTED = 4,
+    TCP_OPTION_SACK = 5,
+};
+
 typedef enum tcp_state {
     STATE_CLOSED,
     STATE_LISTEN,
@@ -89,9 +104,27 @@ typedef enum tcp_flags {
     PKT_URG = 32
 } tcp_flags_t;
 
+struct tcp_hash_bucket;
+
+/* a caller owned buffer queued with tcp_write_nocopy() */
+typedef struct tcp_tx_chunk {
+    struct list_node node;
+    const uint8_t *buf;
+    size_t len;
+    size_t acked;         // bytes at the front that have been acked
+    volatile int ref;
+    tcp_write_callback_t cb;
+    void *arg;
+    uint8_t data[];       // inline copy of the data, for tcp_write() behind queued chunks
+} tcp_tx_chunk_t;
+
 typedef struct tcp_socket {
     struct list_node node;
 
+    /* demux hash linkage, protected by the bucket's lock */
+    struct list_node hash_node;
+    struct tcp_hash_bucket *bucket;
+
     mutex_t lock;
     volatile int ref;
 
@@ -113,16 +146,53 @@ typedef struct tcp_socket {
     int      rx_full_mss_count; // number of packets we have received in a row with a full mss
     net_timer_t ack_delay_timer;
 
+    /* out of order segments above rx_win_low, sorted by sequence. pktbuf->priv holds
+     * the sequence number of the first byte of each */
+    struct list_node rx_ooo_queue;
+    uint     rx_ooo_count;
+    uint32_t rx_ooo_recent; // sequence of the most recently queued segment, reported first in SACK
+    bool     sack_permitted;
+
     /* tx */
     uint32_t tx_win_low;  // low side of the acked window
     uint32_t tx_win_high; // tx_win_low + their advertised window size
     uint32_t tx_highest_seq; // highest sequence we have txed them
+    uint32_t tx_next_seq; // next sequence to send, behind tx_highest_seq after a timeout
     uint8_t  *tx_buffer;  // our outgoing buffer
     uint32_t tx_buffer_size; // size of tx_buffer
     uint32_t tx_buffer_offset; // offset into the buffer to append new data to
+    struct list_node tx_chunks; // queued nocopy data, in sequence after tx_buffer
+    uint32_t tx_chunk_bytes;    // unacked bytes in tx_chunks
     event_t  tx_event;
     net_timer_t retransmit_timer;
 
+    /* congestion control, NewReno */
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover;     // tx_highest_seq when we last entered recovery
+    uint     dup_acks;
+    bool     in_recovery;
+
+    /* round trip estimation, in msecs */
+    lk_time_t srtt;       // smoothed rtt, scaled by 8
+    lk_time_t rttvar;     // rtt variance, scaled by 4
+    lk_time_t rto;
+    bool      rtt_timing;
+    uint32_t  rtt_seq;    // sequence being timed
+    lk_time_t rtt_start;
+
+    struct {
+        uint32_t segs_in;
+        uint32_t segs_out;
+        uint32_t gso_segs_out; // of which were bigger than the mss
+        uint32_t retransmits;
+        uint32_t fast_retransmits;
+        uint32_t timeouts;
+        uint32_t dup_acks_in;
+        uint64_t tx_bytes;     // payload bytes handed to the driver
+        uint64_t tx_cycles;    // cycles spent getting them there
+    } stats;
+
     /* listen accept */
     semaphore_t accept_sem;
     struct tcp_socket *accepted;
@@ -134,7 +204,22 @@ typedef struct tcp_socket {
 #define DEFAULT_RX_WINDOW_SIZE (8192)
 #define DEFAULT_TX_BUFFER_SIZE (8192)
 
-#define RETRANSMIT_TIMEOUT (50)
+/* max out of order segments held per socket */
+#ifndef TCP_MAX_OOO_SEGMENTS
+#define TCP_MAX_OOO_SEGMENTS (16)
+#endif
+
+/* 4 blocks plus 2 NOPs and the kind/len fill the 40 byte option space */
+#define TCP_MAX_SACK_BLOCKS (4)
+
+#define TCP_INITIAL_RTO (1000)
+#define TCP_MIN_RTO (200)
+#define TCP_MAX_RTO (60000)
+#define TCP_DUP_ACK_THRESHOLD (3)
+
+/* largest segment handed down the stack in one piece when segmentation offload is on,
+ * leaving room for the ip and tcp headers in the 16 bit ip length */
+#define TCP_GSO_MAX_SIZE (65535 - 20 - 60)
 #define DELAYED_ACK_TIMEOUT (50)
 #define TIME_WAIT_TIMEOUT (60000) // 1 minute
 
@@ -145,10 +230,36 @@ typedef struct tcp_socket {
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
+/* size of the connection and listen demux tables, must be powers of 2 */
+#ifndef TCP_CONN_HASH_BITS
+#define TCP_CONN_HASH_BITS (11)
+#endif
+#ifndef TCP_LISTEN_HASH_BITS
+#define TCP_LISTEN_HASH_BITS (6)
+#endif
+#define TCP_CONN_HASH_SIZE (1U << TCP_CONN_HASH_BITS)
+#define TCP_LISTEN_HASH_SIZE (1U << TCP_LISTEN_HASH_BITS)
+
+/*
+ * Incoming segments are demuxed through two hash tables, one keyed on the full
+ * (remote ip, local ip, remote port, local port) tuple for connected sockets and
+ * one keyed on local port for listening sockets. Each bucket has its own spinlock,
+ * held only long enough to walk the chain and bump the ref on the match.
+ */
+struct tcp_hash_bucket {
+    spin_lock_t lock;
+    struct list_node list;
+};
+
+static struct tcp_hash_bucket tcp_conn_hash[TCP_CONN_HASH_SIZE];
+static struct tcp_hash_bucket tcp_listen_hash[TCP_LISTEN_HASH_SIZE];
+
+/* list of all sockets, only used for enumeration from the debug console */
 static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
 static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
 
 static bool tcp_debug = false;
+static bool tcp_gso = true;
 
 /* local routines */
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port);
@@ -157,10 +268,20 @@ static void remove_socket_from_list(tcp_socket_t *s);
 static tcp_socket_t *create_tcp_socket(bool alloc_buffers);
 static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
                          size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
+static status_t tcp_send_etc(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
+                             size_t len, pktbuf_t *frags, uint16_t gso_size, tcp_flags_t flags, const void *options,
+                             size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
 static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
+static status_t tcp_socket_send_etc(tcp_socket_t *s, const void *data, size_t len, pktbuf_t *frags, tcp_flags_t flags,
+                                    const void *options, size_t options_length, uint32_t sequence);
+static void tcp_tx_chunks_flush(tcp_socket_t *s);
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence);
+static void tcp_ooo_flush(tcp_socket_t *s);
+static bool tcp_syn_sack_permitted(const uint8_t *options, size_t len);
 static void send_ack(tcp_socket_t *s);
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size);
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, size_t data_len);
+static ssize_t tcp_write_pending_data(tcp_socket_t *s);
+static ssize_t tcp_retransmit(tcp_socket_t *s);
 static void handle_retransmit_timeout(void *_s);
 static void handle_time_wait_timeout(void *_s);
 static void handle_delayed_ack_timeout(void *_s);
@@ -223,83 +344,128 @@ static void dump_socket(tcp_socket_t *s)
            s, s->state, tcp_state_to_string(s->state),
            s->local_ip, s->local_port, s->remote_ip, s->remote_port, s->ref);
     if (s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT) {
-        printf("\trx: wsize %u wlo %u whi %u (%u)\n",
+        printf("\trx: wsize %u wlo %u whi %u (%u) ooo segments %u sack %u\n",
                s->rx_win_size, s->rx_win_low, s->rx_win_high,
-               s->rx_win_high - s->rx_win_low);
+               s->rx_win_high - s->rx_win_low, s->rx_ooo_count, s->sack_permitted);
         printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u bufoff %u\n",
                s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low,
                s->tx_highest_seq, s->tx_highest_seq - s->tx_win_low,
                s->tx_buffer_size, s->tx_buffer_offset);
+        printf("\tcc: cwnd %u ssthresh %u%s dupacks %u srtt %u rttvar %u rto %u\n",
+               s->cwnd, s->ssthresh, s->in_recovery ? " (recovery)" : "", s->dup_acks,
+               s->srtt >> 3, s->rttvar >> 2, s->rto);
     }
+    printf("\tstats: segs in %u out %u (gso %u), retransmits %u (fast %u), timeouts %u, dup acks in %u\n",
+           s->stats.segs_in, s->stats.segs_out, s->stats.gso_segs_out, s->stats.retransmits, s->stats.fast_retransmits,
+           s->stats.timeouts, s->stats.dup_acks_in);
+    printf("\ttx: %llu bytes in %llu cycles, nocopy queued %u\n",
+           s->stats.tx_bytes, s->stats.tx_cycles, s->tx_chunk_bytes);
+}
+
+static inline uint32_t tcp_hash_mix(uint32_t h)
+{
+    /* murmur3 finalizer */
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static struct tcp_hash_bucket *tcp_conn_bucket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
+{
+    uint32_t h = remote_ip ^ (local_ip * 0x9e3779b1) ^ (((uint32_t)remote_port << 16) | local_port);
+
+    return &tcp_conn_hash[tcp_hash_mix(h) & (TCP_CONN_HASH_SIZE - 1)];
+}
+
+static struct tcp_hash_bucket *tcp_listen_bucket(uint16_t local_port)
+{
+    return &tcp_listen_hash[tcp_hash_mix(local_port) & (TCP_LISTEN_HASH_SIZE - 1)];
 }
 
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
 {
     LTRACEF("remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    spin_lock_saved_state_t state;
+    tcp_socket_t *s;
 
-    /* XXX replace with something faster, like a hash table */
-    tcp_socket_t *s = NULL;
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_CLOSED || s->state == STATE_LISTEN) {
-            continue;
-        } else {
-            /* full check */
-            if (s->remote_ip == remote_ip &&
-                    s->local_ip == local_ip &&
-                    s->remote_port == remote_port &&
-                    s->local_port == local_port) {
-                goto out;
-            }
+    /* look for a full match first */
+    struct tcp_hash_bucket *b = tcp_conn_bucket(remote_ip, local_ip, remote_port, local_port);
+    spin_lock_irqsave(&b->lock, state);
+    list_for_every_entry(&b->list, s, tcp_socket_t, hash_node) {
+        if (s->remote_ip == remote_ip &&
+                s->local_ip == local_ip &&
+                s->remote_port == remote_port &&
+                s->local_port == local_port &&
+                s->state != STATE_CLOSED) {
+            /* bump the ref before returning it */
+            inc_socket_ref(s);
+            spin_unlock_irqrestore(&b->lock, state);
+            return s;
         }
     }
-
-    /* walk the list again, looking only for listen matches */
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_LISTEN) {
-            /* sockets in listen state only care about local port */
-            if (s->local_port == local_port) {
-                goto out;
-            }
+    spin_unlock_irqrestore(&b->lock, state);
+
+    /* sockets in listen state only care about local port */
+    b = tcp_listen_bucket(local_port);
+    spin_lock_irqsave(&b->lock, state);
+    list_for_every_entry(&b->list, s, tcp_socket_t, hash_node) {
+        if (s->state == STATE_LISTEN && s->local_port == local_port) {
+            inc_socket_ref(s);
+            spin_unlock_irqrestore(&b->lock, state);
+            return s;
         }
     }
+    spin_unlock_irqrestore(&b->lock, state);
 
-    /* fall through case returns null */
-    s = NULL;
-
-out:
-    /* bump the ref before returning it */
-    if (s)
-        inc_socket_ref(s);
-
-    mutex_release(&tcp_socket_list_lock);
-
-    return s;
+    return NULL;
 }
 
 static void add_socket_to_list(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0); // we should have implicitly bumped the ref when creating the socket
+    DEBUG_ASSERT(s->bucket == NULL);
 
     mutex_acquire(&tcp_socket_list_lock);
-
     list_add_head(&tcp_socket_list, &s->node);
-
     mutex_release(&tcp_socket_list_lock);
+
+    /* the state at insertion time decides which table the socket lives in */
+    struct tcp_hash_bucket *b;
+    if (s->state == STATE_LISTEN) {
+        b = tcp_listen_bucket(s->local_port);
+    } else {
+        b = tcp_conn_bucket(s->remote_ip, s->local_ip, s->remote_port, s->local_port);
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&b->lock, state);
+    list_add_head(&b->list, &s->hash_node);
+    s->bucket = b;
+    spin_unlock_irqrestore(&b->lock, state);
 }
 
 static void remove_socket_from_list(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0);
+    DEBUG_ASSERT(s->bucket);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    struct tcp_hash_bucket *b = s->bucket;
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&b->lock, state);
+    DEBUG_ASSERT(list_in_list(&s->hash_node));
+    list_delete(&s->hash_node);
+    s->bucket = NULL;
+    spin_unlock_irqrestore(&b->lock, state);
 
+    mutex_acquire(&tcp_socket_list_lock);
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
-
     mutex_release(&tcp_socket_list_lock);
 }
 
@@ -321,6 +487,8 @@ static bool dec_socket_ref(tcp_socket_t *s)
 
     if (oldval == 1) {
         LTRACEF("destroying socket\n");
+        tcp_ooo_flush(s);
+        tcp_tx_chunks_flush(s);
         event_destroy(&s->tx_event);
         event_destroy(&s->rx_event);
 
@@ -402,6 +570,8 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 
     /* get some data from the packet */
     uint8_t packet_flags = header->length_flags & 0x3f;
+    const uint8_t *options = (const uint8_t *)(header + 1);
+    size_t options_len = header_len - MIN(header_len, sizeof(tcp_header_t));
     size_t data_len = p->dlen - header_len;
     uint32_t highest_sequence = header->seq_num + ((data_len > 0) ? (data_len - 1) : 0);
 
@@ -415,6 +585,8 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
     if (unlikely(tcp_debug))
         TRACEF("got socket %p, state %d (%s), ref %d\n", s, s->state, tcp_state_to_string(s->state), s->ref);
 
+    s->stats.segs_in++;
+
     /* remove the header */
     pktbuf_consume(p, header_len);
 
@@ -456,6 +628,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             accept_socket->remote_ip = src_ip;
             accept_socket->remote_port = header->source_port;
             accept_socket->state = STATE_SYN_RCVD;
+            accept_socket->sack_permitted = tcp_syn_sack_permitted(options, options_len);
 
             mutex_acquire(&accept_socket->lock);
 
@@ -470,13 +643,24 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             sem_post(&s->accept_sem, true);
 
             /* set up a mss option for sending back */
+            uint8_t syn_options[sizeof(tcp_mss_option_t) + 4];
+            size_t syn_options_len = sizeof(tcp_mss_option_t);
             tcp_mss_option_t mss_option;
-            mss_option.kind = 0x2;
+            mss_option.kind = TCP_OPTION_MSS;
             mss_option.len = 0x4;
             mss_option.mss = ntohs(s->mss); // XXX make sure we fit in their mss
+            memcpy(syn_options, &mss_option, sizeof(mss_option));
+
+            /* agree to SACK if they offered it */
+            if (accept_socket->sack_permitted) {
+                syn_options[syn_options_len++] = TCP_OPTION_NOP;
+                syn_options[syn_options_len++] = TCP_OPTION_NOP;
+                syn_options[syn_options_len++] = TCP_OPTION_SACK_PERMITTED;
+                syn_options[syn_options_len++] = 2;
+            }
 
             /* send a response */
-            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option),
+            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, syn_options, syn_options_len,
                             accept_socket->tx_win_low);
 
             /* SYN consumed a sequence */
@@ -500,6 +684,8 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 
                 s->tx_win_high = s->tx_win_low + header->win_size;
                 s->tx_highest_seq = s->tx_win_low;
+                s->tx_next_seq = s->tx_win_low;
+                s->recover = s->tx_win_low - 1;
 
                 s->state = STATE_ESTABLISHED;
             } else {
@@ -511,12 +697,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_ESTABLISHED:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, data_len);
             }
 
             if (data_len > 0) {
                 LTRACEF("new data, len %zu\n", data_len);
-                handle_data(s, p->data, p->dlen, header->seq_num);
+                handle_data(s, p, header->seq_num);
             }
 
             if ((packet_flags & PKT_FIN) && SEQUENCE_GTE(s->rx_win_low, highest_sequence)) {
@@ -537,7 +723,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_CLOSE_WAIT:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, data_len);
             }
             if (packet_flags & PKT_FIN) {
                 /* they must have missed our ack, ack them again */
@@ -614,8 +800,191 @@ send_reset:
     }
 }
 
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence)
+static bool tcp_syn_sack_permitted(const uint8_t *options, size_t len)
+{
+    size_t i = 0;
+    while (i < len) {
+        uint8_t kind = options[i];
+        if (kind == TCP_OPTION_EOL)
+            break;
+        if (kind == TCP_OPTION_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || options[i + 1] < 2)
+            break;
+        if (kind == TCP_OPTION_SACK_PERMITTED)
+            return true;
+        i += options[i + 1];
+    }
+    return false;
+}
+
+/* append the part of a segment starting at rx_win_low to the receive buffer */
+static size_t tcp_rx_append(tcp_socket_t *s, const uint8_t *data, size_t len, uint32_t sequence)
+{
+    size_t offset = s->rx_win_low - sequence;
+    DEBUG_ASSERT(offset < len);
+
+    size_t copy_len = MIN(s->rx_win_high - s->rx_win_low, len - offset);
+
+    LTRACEF("copying from offset %zu, len %zu\n", offset, copy_len);
+
+    copy_len = cbuf_write(&s->rx_buffer, data + offset, copy_len, false);
+    s->rx_win_low += copy_len;
+
+    return copy_len;
+}
+
+/* hold on to a segment above rx_win_low, trimmed against the ones already queued */
+static void tcp_ooo_insert(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    uint32_t start = sequence;
+    uint32_t end = sequence + p->dlen;
+
+    /* clip to the right edge of the window */
+    if (SEQUENCE_GT(end, s->rx_win_high + 1))
+        end = s->rx_win_high + 1;
+
+    /* find the first queued segment that starts above us */
+    pktbuf_t *next = NULL;
+    pktbuf_t *prev = NULL;
+    pktbuf_t *q;
+    list_for_every_entry(&s->rx_ooo_queue, q, pktbuf_t, list) {
+        if (SEQUENCE_GT(q->priv, start)) {
+            next = q;
+            break;
+        }
+        prev = q;
+    }
+
+    if (prev && SEQUENCE_GT(prev->priv + prev->dlen, start))
+        start = prev->priv + prev->dlen;
+    if (next && SEQUENCE_LT(next->priv, end))
+        end = next->priv;
+
+    if (!SEQUENCE_LT(start, end)) {
+        /* nothing new, but remember where they're sending so SACK reports it first */
+        s->rx_ooo_recent = sequence;
+        return;
+    }
+
+    if (s->rx_ooo_count >= TCP_MAX_OOO_SEGMENTS)
+        return;
+
+    q = pktbuf_steal(p);
+    if (!q)
+        return;
+
+    pktbuf_consume(q, start - sequence);
+    pktbuf_consume_tail(q, q->dlen - (end - start));
+    q->priv = start;
+
+    if (next)
+        list_add_tail(&next->list, &q->list);
+    else
+        list_add_tail(&s->rx_ooo_queue, &q->list);
+    s->rx_ooo_count++;
+    s->rx_ooo_recent = start;
+
+    LTRACEF("queued out of order segment %u-%u, %u queued\n", start, end, s->rx_ooo_count);
+}
+
+/* move queued segments that are now in order into the receive buffer */
+static void tcp_ooo_drain(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    pktbuf_t *q;
+    while ((q = list_peek_head_type(&s->rx_ooo_queue, pktbuf_t, list))) {
+        if (SEQUENCE_GT(q->priv, s->rx_win_low)) {
+            /* still a hole in front of it */
+            break;
+        }
+
+        uint32_t end = q->priv + q->dlen;
+        if (SEQUENCE_GT(end, s->rx_win_low)) {
+            tcp_rx_append(s, q->data, q->dlen, q->priv);
+            if (SEQUENCE_LT(s->rx_win_low, end)) {
+                /* receive buffer is full, keep the rest around */
+                break;
+            }
+        }
+
+        list_delete(&q->list);
+        s->rx_ooo_count--;
+        pktbuf_free(q, true);
+    }
+}
+
+static void tcp_ooo_flush(tcp_socket_t *s)
+{
+    pktbuf_t *q;
+    while ((q = list_remove_head_type(&s->rx_ooo_queue, pktbuf_t, list))) {
+        pktbuf_free(q, true);
+    }
+    s->rx_ooo_count = 0;
+}
+
+/* build a SACK option describing the out of order queue, returns its length */
+static size_t tcp_build_sack_option(tcp_socket_t *s, uint8_t *options)
+{
+    if (!s->sack_permitted || s->rx_ooo_count == 0)
+        return 0;
+
+    /* coalesce the queue into contiguous blocks */
+    uint32_t blocks[TCP_MAX_OOO_SEGMENTS][2];
+    uint count = 0;
+    uint recent = 0;
+    pktbuf_t *q;
+    list_for_every_entry(&s->rx_ooo_queue, q, pktbuf_t, list) {
+        if (count > 0 && blocks[count - 1][1] == q->priv) {
+            blocks[count - 1][1] += q->dlen;
+        } else {
+            blocks[count][0] = q->priv;
+            blocks[count][1] = q->priv + q->dlen;
+            count++;
+        }
+        if (SEQUENCE_GTE(s->rx_ooo_recent, blocks[count - 1][0]) &&
+                SEQUENCE_LT(s->rx_ooo_recent, blocks[count - 1][1])) {
+            recent = count - 1;
+        }
+    }
+
+    /* the block holding the most recent segment goes first, then the rest in order */
+    size_t len = 4;
+    uint emitted = 0;
+    for (uint i = 0; i <= count && emitted < TCP_MAX_SACK_BLOCKS; i++) {
+        uint b;
+        if (i == 0) {
+            b = recent;
+        } else {
+            b = i - 1;
+            if (b == recent)
+                continue;
+        }
+
+        uint32_t edges[2] = { htonl(blocks[b][0]), htonl(blocks[b][1]) };
+        memcpy(options + len, edges, sizeof(edges));
+        len += sizeof(edges);
+        emitted++;
+    }
+
+    options[0] = TCP_OPTION_NOP;
+    options[1] = TCP_OPTION_NOP;
+    options[2] = TCP_OPTION_SACK;
+    options[3] = len - 2;
+
+    return len;
+}
+
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence)
 {
+    const uint8_t *data = p->data;
+    size_t len = p->dlen;
+
     if (unlikely(tcp_debug))
         TRACEF("data %p, len %zu, sequence %u\n", data, len, sequence);
 
@@ -628,18 +997,14 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
     uint32_t sequence_top = sequence + len - 1;
     if (SEQUENCE_LTE(sequence, s->rx_win_low) && SEQUENCE_GTE(sequence_top, s->rx_win_low)) {
         /* it intersects the bottom of our window, so it's in order */
+        bool filled_hole = s->rx_ooo_count > 0;
 
-        /* copy the data we need to our cbuf */
-        size_t offset = sequence - s->rx_win_low;
-        size_t copy_len = MIN(s->rx_win_high - s->rx_win_low, len - offset);
+        size_t copy_len = tcp_rx_append(s, data, len, sequence);
 
-        DEBUG_ASSERT(offset < len);
+        /* this may have closed the gap in front of queued segments */
+        if (filled_hole)
+            tcp_ooo_drain(s);
 
-        LTRACEF("copying from offset %zu, len %zu\n", offset, copy_len);
-
-        s->rx_win_low += copy_len;
-
-        cbuf_write(&s->rx_buffer, (uint8_t *)data + offset, copy_len, false);
         event_signal(&s->rx_event, true);
 
         /* keep a counter if they've been sending a full mss */
@@ -649,8 +1014,9 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
             s->rx_full_mss_count = 0;
         }
 
-        /* immediately ack if we're more than halfway into our buffer or they've sent 2 or more full packets */
-        if (s->rx_full_mss_count >= 2 ||
+        /* immediately ack if we're more than halfway into our buffer, they've sent 2 or more
+         * full packets, or we just filled a hole they're waiting to hear about */
+        if (filled_hole || s->rx_full_mss_count >= 2 ||
                 (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
             send_ack(s);
             s->rx_full_mss_count = 0;
@@ -658,18 +1024,24 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
             tcp_timer_set(s, &s->ack_delay_timer, &handle_delayed_ack_timeout, DELAYED_ACK_TIMEOUT);
         }
     } else {
-        // either out of order or completely out of our window, drop
-        // duplicately ack the last thing we really got
+        // out of order segments inside our window are held until the hole fills,
+        // anything else is dropped. either way duplicately ack the last thing we really got
+        if (SEQUENCE_GT(sequence, s->rx_win_low) && SEQUENCE_LTE(sequence, s->rx_win_high)) {
+            tcp_ooo_insert(s, p, sequence);
+        }
         send_ack(s);
     }
 }
 
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags,
-                                const void *options, size_t options_length, uint32_t sequence)
+/* data is copied into the packet unless frags is set, in which case frags carries it.
+ * anything longer than the mss goes down as one segment to be split up on the way out */
+static status_t tcp_socket_send_etc(tcp_socket_t *s, const void *data, size_t len, pktbuf_t *frags, tcp_flags_t flags,
+                                    const void *options, size_t options_length, uint32_t sequence)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(len == 0 || data);
+    DEBUG_ASSERT(len == 0 || data || frags);
+    DEBUG_ASSERT(len <= s->mss || frags);
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
 
@@ -694,12 +1066,23 @@ static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, t
         tcp_timer_cancel(s, &s->ack_delay_timer);
     }
 
-    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, flags,
-                            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
+    uint16_t gso_size = (len > s->mss) ? s->mss : 0;
+
+    status_t err = tcp_send_etc(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, frags, gso_size,
+                                flags, options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
+    s->stats.segs_out++;
+    if (gso_size)
+        s->stats.gso_segs_out++;
 
     return err;
 }
 
+static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags,
+                                const void *options, size_t options_length, uint32_t sequence)
+{
+    return tcp_socket_send_etc(s, data, len, NULL, flags, options, options_length, sequence);
+}
+
 static void send_ack(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
@@ -708,19 +1091,26 @@ static void send_ack(tcp_socket_t *s)
     if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
         return;
 
-    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_win_low);
+    uint8_t options[4 + TCP_MAX_SACK_BLOCKS * 8];
+    size_t options_len = tcp_build_sack_option(s, options);
+
+    tcp_socket_send(s, NULL, 0, PKT_ACK, options_len ? options : NULL, options_len, s->tx_win_low);
 }
 
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
+static status_t tcp_send_etc(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
+                             size_t len, pktbuf_t *frags, uint16_t gso_size, tcp_flags_t flags, const void *options,
+                             size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
 {
-    DEBUG_ASSERT(len == 0 || buf);
+    DEBUG_ASSERT(len == 0 || buf || frags);
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
 
     pktbuf_t *p = pktbuf_alloc();
-    if (!p)
+    if (!p) {
+        if (frags)
+            pktbuf_free(frags, true);
         return ERR_NO_MEMORY;
+    }
 
     tcp_header_t *header = pktbuf_prepend(p, sizeof(tcp_header_t) + options_length);
     DEBUG_ASSERT(header);
@@ -737,21 +1127,38 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     if (options)
         memcpy(header + 1, options, options_length);
 
-    /* append the data */
-    if (len > 0)
+    /* append the data, or chain on the fragments that already point at it */
+    if (frags) {
+        pktbuf_append_frag(p, frags);
+    } else if (len > 0) {
         pktbuf_append_data(p, buf, len);
+    }
 
     /* compute the checksum */
-    /* XXX get the tx ckecksum capability from the nic */
-    if (FORCE_TCP_CHECKSUM || true) {
-        tcp_pseudo_header_t pheader;
-        pheader.source_addr = src_ip;
-        pheader.dest_addr = dest_ip;
-        pheader.zero = 0;
-        pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
+    tcp_pseudo_header_t pheader;
+    pheader.source_addr = src_ip;
+    pheader.dest_addr = dest_ip;
+    pheader.zero = 0;
+    pheader.protocol = IP_PROTO_TCP;
+    pheader.tcp_length = htons(pktbuf_chain_len(p));
+
+    if (gso_size) {
+        /* a segment to be split up further down. whoever splits it finishes the checksum
+         * of each piece, starting from the pseudo header without the length */
+        pheader.tcp_length = 0;
+        p->flags |= PKTBUF_FLAG_GSO_TCPV4;
+        p->gso_size = gso_size;
+    }
 
-        header->checksum = cksum_pheader(&pheader, p->data, p->dlen);
+    uint16_t sum = ones_sum16(0, &pheader, sizeof(pheader));
+    if (gso_size || (!FORCE_TCP_CHECKSUM && (minip_get_tx_features() & MINIP_TX_FEATURE_CSUM))) {
+        /* the nic sums from the tcp header on, starting with what's left in the field */
+        header->checksum = sum;
+        p->flags |= PKTBUF_FLAG_CKSUM_PARTIAL;
+        p->csum_start = p->data - p->buffer;
+        p->csum_offset = offsetof(tcp_header_t, checksum);
+    } else {
+        header->checksum = ~ones_sum16_chain(sum, p, 0);
     }
 
     if (LOCAL_TRACE) {
@@ -764,7 +1171,325 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     return err;
 }
 
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
+static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
+                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
+{
+    return tcp_send_etc(dest_ip, dest_port, src_ip, src_port, buf, len, NULL, 0, flags, options, options_length,
+                        ack, sequence, window_size);
+}
+
+/*
+ * Data queued with tcp_write_nocopy() lives in chunks that reference the caller's
+ * buffer. Each chunk holds a ref for the socket's queue, dropped once the chunk is
+ * acked, and one per pktbuf fragment the driver holds. The last ref may go away in
+ * interrupt context, so finished chunks are handed to a worker thread that runs
+ * the completion callback and frees them.
+ */
+static spin_lock_t tcp_tx_reap_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct list_node tcp_tx_reap_list = LIST_INITIAL_VALUE(tcp_tx_reap_list);
+static event_t tcp_tx_reap_event;
+
+static tcp_tx_chunk_t *tcp_tx_chunk_alloc(const void *buf, size_t len, size_t inline_len,
+                                          tcp_write_callback_t cb, void *arg)
+{
+    tcp_tx_chunk_t *c = malloc(sizeof(tcp_tx_chunk_t) + inline_len);
+    if (!c)
+        return NULL;
+
+    c->buf = inline_len ? c->data : buf;
+    c->len = len;
+    c->acked = 0;
+    c->ref = 1;
+    c->cb = cb;
+    c->arg = arg;
+
+    return c;
+}
+
+static void tcp_tx_chunk_put(tcp_tx_chunk_t *c)
+{
+    if (atomic_add(&c->ref, -1) == 1) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&tcp_tx_reap_lock, state);
+        list_add_tail(&tcp_tx_reap_list, &c->node);
+        spin_unlock_irqrestore(&tcp_tx_reap_lock, state);
+
+        event_signal(&tcp_tx_reap_event, false);
+    }
+}
+
+static void tcp_tx_frag_free(void *buf, void *arg)
+{
+    tcp_tx_chunk_put(arg);
+}
+
+static int tcp_tx_reaper(void *arg)
+{
+    for (;;) {
+        event_wait(&tcp_tx_reap_event);
+
+        for (;;) {
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&tcp_tx_reap_lock, state);
+            tcp_tx_chunk_t *c = list_remove_head_type(&tcp_tx_reap_list, tcp_tx_chunk_t, node);
+            spin_unlock_irqrestore(&tcp_tx_reap_lock, state);
+
+            if (!c)
+                break;
+
+            if (c->cb)
+                c->cb(c->buf, c->len, c->arg);
+            free(c);
+        }
+    }
+
+    return 0;
+}
+
+static void tcp_tx_chunks_flush(tcp_socket_t *s)
+{
+    tcp_tx_chunk_t *c;
+    while ((c = list_remove_head_type(&s->tx_chunks, tcp_tx_chunk_t, node))) {
+        tcp_tx_chunk_put(c);
+    }
+    s->tx_chunk_bytes = 0;
+}
+
+/* total bytes between tx_win_low and the end of everything queued to send */
+static uint32_t tcp_tx_queued(tcp_socket_t *s)
+{
+    return s->tx_buffer_offset + s->tx_chunk_bytes;
+}
+
+/* find the data offset bytes past tx_win_low. everything in tx_buffer comes
+ * before the chunks. returns how much is contiguous from there */
+static size_t tcp_tx_locate(tcp_socket_t *s, uint32_t offset, const uint8_t **ptr, tcp_tx_chunk_t **chunk)
+{
+    if (offset < s->tx_buffer_offset) {
+        *ptr = s->tx_buffer + offset;
+        *chunk = NULL;
+        return s->tx_buffer_offset - offset;
+    }
+    offset -= s->tx_buffer_offset;
+
+    tcp_tx_chunk_t *c;
+    list_for_every_entry(&s->tx_chunks, c, tcp_tx_chunk_t, node) {
+        size_t avail = c->len - c->acked;
+        if (offset < avail) {
+            *ptr = c->buf + c->acked + offset;
+            *chunk = c;
+            return avail - offset;
+        }
+        offset -= avail;
+    }
+
+    return 0;
+}
+
+/* drop acked bytes off the front of the tx buffer and chunk queue */
+static void tcp_tx_consume(tcp_socket_t *s, uint32_t len)
+{
+    DEBUG_ASSERT(len <= tcp_tx_queued(s));
+
+    uint32_t from_buffer = MIN(len, s->tx_buffer_offset);
+    if (from_buffer > 0) {
+        memmove(s->tx_buffer, s->tx_buffer + from_buffer, s->tx_buffer_offset - from_buffer);
+        s->tx_buffer_offset -= from_buffer;
+        len -= from_buffer;
+    }
+
+    while (len > 0) {
+        tcp_tx_chunk_t *c = list_peek_head_type(&s->tx_chunks, tcp_tx_chunk_t, node);
+        DEBUG_ASSERT(c);
+
+        size_t take = MIN(c->len - c->acked, len);
+        c->acked += take;
+        s->tx_chunk_bytes -= take;
+        len -= take;
+
+        if (c->acked == c->len) {
+            list_delete(&c->node);
+            tcp_tx_chunk_put(c);
+        }
+    }
+}
+
+/* build pktbuf fragments pointing straight at a chunk's buffer, one per physically
+ * contiguous run */
+static pktbuf_t *tcp_tx_chunk_frags(tcp_tx_chunk_t *c, const uint8_t *ptr, size_t len)
+{
+    pktbuf_t *head = NULL;
+
+    while (len > 0) {
+        size_t run = len;
+#if WITH_KERNEL_VM
+        run = MIN(run, PAGE_SIZE - ((uintptr_t)ptr % PAGE_SIZE));
+        while (run < len &&
+                vaddr_to_paddr((void *)(ptr + run)) == vaddr_to_paddr((void *)ptr) + run) {
+            run = MIN(len, run + PAGE_SIZE);
+        }
+#endif
+
+        /* the socket lock is held, so don't wait for the pool. the caller copies instead */
+        pktbuf_t *f = pktbuf_alloc_empty_etc(false);
+        if (!f) {
+            if (head)
+                pktbuf_free(head, true);
+            return NULL;
+        }
+
+        atomic_add(&c->ref, 1);
+        pktbuf_add_buffer(f, (u8 *)ptr, run, 0, 0, tcp_tx_frag_free, c);
+        f->dlen = run;
+
+        if (head)
+            pktbuf_append_frag(head, f);
+        else
+            head = f;
+
+        ptr += run;
+        len -= run;
+    }
+
+    return head;
+}
+
+/* how much to send in one segment. with segmentation offload that's as many full mss
+ * worth as fit, and the nic or the bottom of the stack splits them up. a nic doing the
+ * splitting has to take the fragments of the segment as they are */
+static uint32_t tcp_tx_max_segment(tcp_socket_t *s)
+{
+    uint32_t features = minip_get_tx_features();
+
+    if (!tcp_gso || ((features & MINIP_TX_FEATURE_TSO) && !(features & MINIP_TX_FEATURE_SG)))
+        return s->mss;
+
+    return TCP_GSO_MAX_SIZE / s->mss * s->mss;
+}
+
+/* build the fragments of a segment longer than the mss, covering len bytes from offset
+ * bytes past tx_win_low. chunk data is referenced directly where the driver takes
+ * fragments, everything else is packed into pool buffers. returns how many bytes the
+ * fragments hold */
+static uint32_t tcp_tx_gather(tcp_socket_t *s, uint32_t offset, uint32_t len, pktbuf_t **frags)
+{
+    bool sg = minip_get_tx_features() & MINIP_TX_FEATURE_SG;
+    pktbuf_t *head = NULL;
+    pktbuf_t *copy = NULL;
+    uint32_t done = 0;
+
+    while (done < len) {
+        const uint8_t *ptr;
+        tcp_tx_chunk_t *c;
+        size_t run = MIN(len - done, tcp_tx_locate(s, offset + done, &ptr, &c));
+        if (run == 0)
+            break;
+
+        if (c && sg) {
+            pktbuf_t *f = tcp_tx_chunk_frags(c, ptr, run);
+            if (!f)
+                break;
+            if (head)
+                pktbuf_append_frag(head, f);
+            else
+                head = f;
+            copy = NULL;
+            done += run;
+            continue;
+        }
+
+        while (run > 0) {
+            if (!copy || pktbuf_avail_tail(copy) == 0) {
+                /* the socket lock is held, send what was gathered so far instead of waiting */
+                copy = pktbuf_alloc_etc(false);
+                if (!copy)
+                    goto out;
+
+                /* a fragment needs no header room */
+                copy->data = copy->buffer;
+                if (head)
+                    pktbuf_append_frag(head, copy);
+                else
+                    head = copy;
+            }
+
+            size_t n = MIN(run, pktbuf_avail_tail(copy));
+            pktbuf_append_data(copy, ptr, n);
+            ptr += n;
+            run -= n;
+            done += n;
+        }
+    }
+
+out:
+    *frags = head;
+    return done;
+}
+
+/* send len bytes starting offset bytes past tx_win_low. returns how many were sent,
+ * which may be less if the data isn't contiguous */
+static uint32_t tcp_tx_send_data(tcp_socket_t *s, uint32_t offset, uint32_t len, uint32_t sequence)
+{
+    uint32_t start = arch_cycle_count();
+
+    const uint8_t *ptr = NULL;
+    tcp_tx_chunk_t *c;
+    pktbuf_t *frags = NULL;
+
+    if (len > s->mss) {
+        len = tcp_tx_gather(s, offset, len, &frags);
+        if (len == 0)
+            return 0;
+    } else {
+        len = MIN(len, tcp_tx_locate(s, offset, &ptr, &c));
+        if (len == 0)
+            return 0;
+
+        if (c && (minip_get_tx_features() & MINIP_TX_FEATURE_SG))
+            frags = tcp_tx_chunk_frags(c, ptr, len);
+    }
+
+    /* without scatter/gather support the data is copied into the packet */
+    tcp_socket_send_etc(s, ptr, len, frags, PKT_ACK|PKT_PSH, NULL, 0, sequence);
+
+    s->stats.tx_bytes += len;
+    s->stats.tx_cycles += arch_cycle_count() - start;
+
+    return len;
+}
+
+/* fold a new round trip measurement into the smoothed estimate (RFC 6298) */
+static void tcp_rtt_sample(tcp_socket_t *s, lk_time_t rtt)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    /* srtt is kept scaled by 8 and rttvar by 4, as in Jacobson/Karels */
+    if (s->srtt == 0) {
+        s->srtt = rtt << 3;
+        s->rttvar = rtt << 1;
+    } else {
+        int32_t delta = rtt - (s->srtt >> 3);
+        s->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        delta -= (s->rttvar >> 2);
+        s->rttvar += delta;
+    }
+
+    lk_time_t rto = (s->srtt >> 3) + MAX(s->rttvar, 1U);
+    s->rto = MIN(MAX(rto, TCP_MIN_RTO), TCP_MAX_RTO);
+
+    LTRACEF("s %p rtt %u srtt %u rttvar %u rto %u\n", s, rtt, s->srtt >> 3, s->rttvar >> 2, s->rto);
+}
+
+static uint32_t tcp_loss_ssthresh(tcp_socket_t *s)
+{
+    uint32_t flight = s->tx_highest_seq - s->tx_win_low;
+
+    return MAX(flight / 2, 2 * s->mss);
+}
+
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, size_t data_len)
 {
     LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
 
@@ -773,39 +1498,104 @@ static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
 
     LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
             s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
-    if (SEQUENCE_LTE(sequence, s->tx_win_low)) {
+    if (SEQUENCE_LT(sequence, s->tx_win_low)) {
         /* they're acking stuff we've already received an ack for */
         return;
     } else if (SEQUENCE_GT(sequence, s->tx_highest_seq)) {
         /* they're acking stuff we haven't sent */
         return;
-    } else {
-        /* their ack is somewhere in our window */
-        uint32_t acked_len;
+    } else if (sequence == s->tx_win_low) {
+        if (data_len == 0 && s->tx_win_low + win_size == s->tx_win_high &&
+                s->tx_highest_seq != s->tx_win_low) {
+            /* duplicate ack, they're missing the segment at tx_win_low */
+            s->stats.dup_acks_in++;
+            s->dup_acks++;
+
+            if (s->in_recovery) {
+                /* each dup ack means a segment left the network, inflate the window */
+                s->cwnd += s->mss;
+                tcp_write_pending_data(s);
+            } else if (s->dup_acks == TCP_DUP_ACK_THRESHOLD && SEQUENCE_GT(sequence - 1, s->recover)) {
+                /* fast retransmit, then fast recovery (RFC 6582) */
+                s->ssthresh = tcp_loss_ssthresh(s);
+                s->recover = s->tx_highest_seq;
+                s->in_recovery = true;
+                s->rtt_timing = false;
+
+                s->stats.fast_retransmits++;
+                tcp_retransmit(s);
+
+                s->cwnd = s->ssthresh + TCP_DUP_ACK_THRESHOLD * s->mss;
+                tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+            }
+        } else if (s->tx_win_low + win_size != s->tx_win_high) {
+            /* window update */
+            s->tx_win_high = s->tx_win_low + win_size;
+            tcp_write_pending_data(s);
+        }
+        return;
+    }
 
-        acked_len = (sequence - s->tx_win_low);
+    /* their ack is somewhere in our window */
+    uint32_t acked_len;
 
-        LTRACEF("acked len %u\n", acked_len);
+    acked_len = (sequence - s->tx_win_low);
 
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_size);
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_offset);
+    LTRACEF("acked len %u\n", acked_len);
 
-        memmove(s->tx_buffer, s->tx_buffer + acked_len, s->tx_buffer_offset - acked_len);
+    tcp_tx_consume(s, acked_len);
 
-        s->tx_buffer_offset -= acked_len;
-        s->tx_win_low += acked_len;
-        s->tx_win_high = s->tx_win_low + win_size;
+    s->tx_win_low += acked_len;
+    s->tx_win_high = s->tx_win_low + win_size;
+    if (SEQUENCE_LT(s->tx_next_seq, s->tx_win_low))
+        s->tx_next_seq = s->tx_win_low;
 
-        /* cancel or reset our retransmit timer */
-        if (s->tx_win_low == s->tx_highest_seq) {
-            tcp_timer_cancel(s, &s->retransmit_timer);
+    /* Karn: only segments that were never retransmitted are timed */
+    if (s->rtt_timing && SEQUENCE_GT(sequence, s->rtt_seq)) {
+        s->rtt_timing = false;
+        tcp_rtt_sample(s, current_time() - s->rtt_start);
+    }
+
+    if (s->in_recovery) {
+        if (SEQUENCE_GTE(sequence, s->recover)) {
+            /* full ack, everything outstanding at the time of the loss is in, deflate */
+            s->cwnd = s->ssthresh;
+            s->in_recovery = false;
+            s->dup_acks = 0;
+        } else {
+            /* partial ack, the next hole is right at tx_win_low */
+            s->stats.fast_retransmits++;
+            tcp_retransmit(s);
+
+            s->cwnd = (s->cwnd > acked_len) ? s->cwnd - acked_len : 0;
+            if (acked_len >= s->mss)
+                s->cwnd += s->mss;
+            s->cwnd = MAX(s->cwnd, s->mss);
+        }
+    } else {
+        s->dup_acks = 0;
+
+        if (s->cwnd < s->ssthresh) {
+            /* slow start */
+            s->cwnd += MIN(acked_len, s->mss);
         } else {
-            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+            /* congestion avoidance, roughly one mss per round trip */
+            s->cwnd += MAX(s->mss * s->mss / s->cwnd, 1U);
         }
+    }
 
-        /* we have opened the transmit buffer */
-        event_signal(&s->tx_event, true);
+    /* cancel or reset our retransmit timer */
+    if (s->tx_win_low == s->tx_highest_seq) {
+        tcp_timer_cancel(s, &s->retransmit_timer);
+    } else {
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
     }
+
+    /* we have opened the transmit buffer */
+    event_signal(&s->tx_event, true);
+
+    /* the window may have opened up, push out anything that's waiting */
+    tcp_write_pending_data(s);
 }
 
 static ssize_t tcp_write_pending_data(tcp_socket_t *s)
@@ -818,24 +1608,51 @@ static ssize_t tcp_write_pending_data(tcp_socket_t *s)
     DEBUG_ASSERT(s->tx_buffer_size > 0);
     DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
 
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT)
+        return 0;
+
     /* do we have any new data to send? */
-    uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    uint32_t pending = s->tx_buffer_offset - outstanding;
-    LTRACEF("outstanding %u, pending %u\n", outstanding, pending);
+    uint32_t outstanding = (s->tx_next_seq - s->tx_win_low);
+    uint32_t pending = tcp_tx_queued(s) - outstanding;
+    LTRACEF("outstanding %u, pending %u, cwnd %u\n", outstanding, pending, s->cwnd);
+
+    /* we can have the smaller of the congestion window and their window in flight */
+    uint32_t window = MIN(s->cwnd, s->tx_win_high - s->tx_win_low);
+    uint32_t max_segment = tcp_tx_max_segment(s);
 
     /* send packets that cover the pending area of the window */
     uint32_t offset = 0;
     while (offset < pending) {
-        uint32_t tosend = MIN(s->mss, pending - offset);
+        uint32_t flight = s->tx_next_seq - s->tx_win_low;
+        if (flight >= window)
+            break;
 
-        tcp_socket_send(s, s->tx_buffer + outstanding + offset, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
-        s->tx_highest_seq += tosend;
+        uint32_t tosend = MIN(MIN(max_segment, pending - offset), window - flight);
+
+        /* start timing a round trip if this is new data and nothing is being timed */
+        if (s->tx_next_seq == s->tx_highest_seq) {
+            if (!s->rtt_timing) {
+                s->rtt_timing = true;
+                s->rtt_seq = s->tx_next_seq;
+                s->rtt_start = current_time();
+            }
+        } else {
+            s->stats.retransmits++;
+        }
+
+        tosend = tcp_tx_send_data(s, outstanding + offset, tosend, s->tx_next_seq);
+        if (tosend == 0)
+            break;
+
+        s->tx_next_seq += tosend;
+        if (SEQUENCE_GT(s->tx_next_seq, s->tx_highest_seq))
+            s->tx_highest_seq = s->tx_next_seq;
         offset += tosend;
     }
 
     /* reset the retransmit timer if we sent anything */
     if (offset > 0) {
-        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
     }
 
     return offset;
@@ -857,7 +1674,8 @@ static ssize_t tcp_retransmit(tcp_socket_t *s)
     uint32_t tosend = MIN(s->mss, outstanding);
 
     LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
-    tcp_socket_send(s, s->tx_buffer, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_win_low);
+    tosend = tcp_tx_send_data(s, 0, tosend, s->tx_win_low);
+    s->stats.retransmits++;
 
     return tosend;
 }
@@ -872,10 +1690,24 @@ static void handle_retransmit_timeout(void *_s)
 
     mutex_acquire(&s->lock);
 
-    if (tcp_retransmit(s) == 0)
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT)
+        goto done;
+    if (s->tx_highest_seq == s->tx_win_low)
         goto done;
 
-    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    /* the whole flight is presumed lost, back off and go back to slow start from one segment */
+    s->stats.timeouts++;
+    s->ssthresh = tcp_loss_ssthresh(s);
+    s->cwnd = s->mss;
+    s->in_recovery = false;
+    s->recover = s->tx_highest_seq;
+    s->dup_acks = 0;
+    s->rtt_timing = false;
+    s->rto = MIN(s->rto * 2, TCP_MAX_RTO);
+
+    /* resend the first segment regardless of their window, which also probes a closed one */
+    s->tx_next_seq = s->tx_win_low + tcp_retransmit(s);
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
 
 done:
     mutex_release(&s->lock);
@@ -941,6 +1773,7 @@ static void tcp_remote_close(tcp_socket_t *s)
 
     tcp_timer_cancel(s, &s->retransmit_timer);
     tcp_timer_cancel(s, &s->ack_delay_timer);
+    tcp_ooo_flush(s);
 
     tcp_wakeup_waiters(s);
 }
@@ -959,14 +1792,23 @@ static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
     s->state = STATE_CLOSED;
     s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
     event_init(&s->rx_event, false, 0);
+    list_initialize(&s->rx_ooo_queue);
 
     s->mss = DEFAULT_MSS;
 
     s->tx_win_low = rand();
     s->tx_win_high = s->tx_win_low;
     s->tx_highest_seq = s->tx_win_low;
+    s->tx_next_seq = s->tx_win_low;
+    list_initialize(&s->tx_chunks);
     event_init(&s->tx_event, true, 0);
 
+    /* initial window per RFC 3390, slow start until the first loss */
+    s->cwnd = MIN(4 * s->mss, MAX(2 * s->mss, 4380U));
+    s->ssthresh = UINT32_MAX;
+    s->recover = s->tx_win_low - 1;
+    s->rto = TCP_INITIAL_RTO;
+
     if (alloc_buffers) {
         // XXX check for error
         s->rx_buffer_raw = malloc(s->rx_win_size);
@@ -1123,21 +1965,46 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
         DEBUG_ASSERT(s->tx_buffer_size > 0);
         DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
 
-        /* figure out how much data to copy in */
-        size_t to_copy = MIN(s->tx_buffer_size - s->tx_buffer_offset, len - off);
-        if (to_copy == 0) {
-            mutex_release(&s->lock);
-            continue;
-        }
+        uint32_t start = arch_cycle_count();
+        size_t to_copy;
+        if (!list_is_empty(&s->tx_chunks)) {
+            /* nocopy data is queued ahead of us, so this has to go behind it. copy
+             * into a chunk of its own, limited to a tx buffer's worth in flight */
+            if (s->tx_chunk_bytes >= s->tx_buffer_size) {
+                event_unsignal(&s->tx_event);
+                mutex_release(&s->lock);
+                continue;
+            }
 
-        memcpy(s->tx_buffer + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
-        s->tx_buffer_offset += to_copy;
+            to_copy = MIN(s->tx_buffer_size, len - off);
+            tcp_tx_chunk_t *c = tcp_tx_chunk_alloc(NULL, to_copy, to_copy, NULL, NULL);
+            if (!c) {
+                mutex_release(&s->lock);
+                dec_socket_ref(s);
+                return off ? (ssize_t)off : ERR_NO_MEMORY;
+            }
+            memcpy(c->data, (uint8_t *)buf + off, to_copy);
 
-        /* if this has completely filled it, unsignal the event */
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-        if (s->tx_buffer_offset == s->tx_buffer_size) {
-            event_unsignal(&s->tx_event);
+            list_add_tail(&s->tx_chunks, &c->node);
+            s->tx_chunk_bytes += to_copy;
+        } else {
+            /* figure out how much data to copy in */
+            to_copy = MIN(s->tx_buffer_size - s->tx_buffer_offset, len - off);
+            if (to_copy == 0) {
+                mutex_release(&s->lock);
+                continue;
+            }
+
+            memcpy(s->tx_buffer + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
+            s->tx_buffer_offset += to_copy;
+
+            /* if this has completely filled it, unsignal the event */
+            DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
+            if (s->tx_buffer_offset == s->tx_buffer_size) {
+                event_unsignal(&s->tx_event);
+            }
         }
+        s->stats.tx_cycles += arch_cycle_count() - start;
 
         /* send as much data as we can */
         tcp_write_pending_data(s);
@@ -1151,6 +2018,42 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
     return len;
 }
 
+status_t tcp_write_nocopy(tcp_socket_t *socket, const void *buf, size_t len,
+                          tcp_write_callback_t cb, void *arg)
+{
+    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
+    if (!socket || !buf || len == 0 || len > UINT32_MAX / 2)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+
+    tcp_tx_chunk_t *c = tcp_tx_chunk_alloc(buf, len, 0, cb, arg);
+    if (!c)
+        return ERR_NO_MEMORY;
+
+    inc_socket_ref(s);
+    mutex_acquire(&s->lock);
+
+    status_t err = NO_ERROR;
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
+        err = ERR_CHANNEL_CLOSED;
+        free(c);
+        goto out;
+    }
+
+    list_add_tail(&s->tx_chunks, &c->node);
+    s->tx_chunk_bytes += len;
+
+    /* send as much data as we can */
+    tcp_write_pending_data(s);
+
+out:
+    mutex_release(&s->lock);
+    dec_socket_ref(s);
+
+    return err;
+}
+
 status_t tcp_close(tcp_socket_t *socket)
 {
     if (!socket)
@@ -1220,7 +2123,210 @@ out:
     return err;
 }
 
+static void tcp_init(uint level)
+{
+    event_init(&tcp_tx_reap_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    thread_detach_and_resume(thread_create("tcp tx reaper", &tcp_tx_reaper, NULL,
+                                           DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+
+    for (uint i = 0; i < TCP_CONN_HASH_SIZE; i++) {
+        spin_lock_init(&tcp_conn_hash[i].lock);
+        list_initialize(&tcp_conn_hash[i].list);
+    }
+    for (uint i = 0; i < TCP_LISTEN_HASH_SIZE; i++) {
+        spin_lock_init(&tcp_listen_hash[i].lock);
+        list_initialize(&tcp_listen_hash[i].list);
+    }
+}
+
+LK_INIT_HOOK(tcp, tcp_init, LK_INIT_LEVEL_THREADING);
+
 /* debug stuff */
+static void tcp_dump_hash_stats(void)
+{
+    uint used = 0;
+    uint max_chain = 0;
+    uint total = 0;
+
+    for (uint i = 0; i < TCP_CONN_HASH_SIZE; i++) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&tcp_conn_hash[i].lock, state);
+        uint len = list_length(&tcp_conn_hash[i].list);
+        spin_unlock_irqrestore(&tcp_conn_hash[i].lock, state);
+
+        if (len > 0)
+            used++;
+        max_chain = MAX(max_chain, len);
+        total += len;
+    }
+
+    printf("conn hash: %u buckets, %u used, %u sockets, longest chain %u\n",
+           TCP_CONN_HASH_SIZE, used, total, max_chain);
+}
+
+/*
+ * Synthetic receive benchmark: open a large number of fake established
+ * connections and push pure ACK segments for random ones of them through
+ * tcp_input(). The ACKs carry no data and don't advance the window, so
+ * nothing is transmitted and the cost is dominated by header processing
+ * and demux.
+ */
+static void tcp_rx_bench(uint socket_count, uint packet_count)
+{
+    tcp_socket_t **sockets = calloc(socket_count, sizeof(tcp_socket_t *));
+    if (!sockets) {
+        printf("failed to allocate socket array\n");
+        return;
+    }
+
+    const ipv4_addr local_ip = minip_get_ipaddr();
+    const uint16_t local_port = 80;
+
+    uint opened;
+    for (opened = 0; opened < socket_count; opened++) {
+        tcp_socket_t *s = create_tcp_socket(false);
+        if (!s)
+            break;
+
+        /* spread the peers across 198.18.0.0/15, many ports per peer */
+        s->local_ip = local_ip;
+        s->local_port = local_port;
+        s->remote_ip = htonl(0xc6120000 | (opened / 256));
+        s->remote_port = 1024 + (opened % 256);
+        s->tx_win_high = s->tx_win_low + DEFAULT_RX_WINDOW_SIZE;
+        s->state = STATE_ESTABLISHED;
+
+        add_socket_to_list(s);
+        sockets[opened] = s;
+    }
+    printf("opened %u sockets\n", opened);
+    tcp_dump_hash_stats();
+
+    if (opened == 0)
+        goto out;
+
+    /* bare lookup cost */
+    lk_bigtime_t t = current_time_hires();
+    for (uint i = 0; i < packet_count; i++) {
+        tcp_socket_t *s = sockets[rand() % opened];
+        tcp_socket_t *found = lookup_socket(s->remote_ip, s->local_ip, s->remote_port, s->local_port);
+        DEBUG_ASSERT(found == s);
+        dec_socket_ref(found);
+    }
+    t = current_time_hires() - t;
+    printf("%u lookups in %llu usecs, %llu lookups/sec\n", packet_count, t,
+           t ? (uint64_t)packet_count * 1000000ULL / t : 0);
+
+    /* full receive path */
+    uint8_t buf[sizeof(tcp_header_t)];
+    pktbuf_t p;
+    memset(&p, 0, sizeof(p));
+
+    t = current_time_hires();
+    for (uint i = 0; i < packet_count; i++) {
+        tcp_socket_t *s = sockets[rand() % opened];
+        tcp_header_t *header = (tcp_header_t *)buf;
+
+        header->source_port = htons(s->remote_port);
+        header->dest_port = htons(s->local_port);
+        header->seq_num = htonl(s->rx_win_low);
+        header->ack_num = htonl(s->tx_win_low);
+        header->length_flags = htons((sizeof(tcp_header_t) / 4) << 12 | PKT_ACK);
+        header->win_size = htons(DEFAULT_RX_WINDOW_SIZE);
+        header->checksum = 0;
+        header->urg_pointer = 0;
+
+        p.buffer = p.data = buf;
+        p.blen = p.dlen = sizeof(buf);
+        p.flags = PKTBUF_FLAG_CKSUM_TCP_GOOD;
+
+        tcp_input(&p, s->remote_ip, s->local_ip);
+    }
+    t = current_time_hires() - t;
+    printf("%u segments in %llu usecs, %llu segments/sec\n", packet_count, t,
+           t ? (uint64_t)packet_count * 1000000ULL / t : 0);
+
+out:
+    for (uint i = 0; i < opened; i++) {
+        tcp_socket_t *s = sockets[i];
+        mutex_acquire(&s->lock);
+        remove_socket_from_list(s);
+        s->state = STATE_CLOSED;
+        mutex_release(&s->lock);
+        dec_socket_ref(s);
+    }
+    free(sockets);
+}
+
+#define TCP_TX_BENCH_SLOTS 8
+#define TCP_TX_BENCH_SLOT_SIZE (16 * 1024)
+
+static void tcp_tx_bench_done(const void *buf, size_t len, void *arg)
+{
+    event_signal((event_t *)arg, true);
+}
+
+/*
+ * Transmit benchmark: push bytes of data down an accepted connection either with
+ * tcp_write() or by cycling a handful of buffers through tcp_write_nocopy().
+ */
+static void tcp_tx_bench(tcp_socket_t *s, uint64_t bytes, bool nocopy)
+{
+    uint8_t *buf = memalign(PAGE_SIZE, TCP_TX_BENCH_SLOTS * TCP_TX_BENCH_SLOT_SIZE);
+    if (!buf) {
+        printf("failed to allocate buffer\n");
+        return;
+    }
+    memset(buf, 0x99, TCP_TX_BENCH_SLOTS * TCP_TX_BENCH_SLOT_SIZE);
+
+    event_t done[TCP_TX_BENCH_SLOTS];
+    for (uint i = 0; i < TCP_TX_BENCH_SLOTS; i++)
+        event_init(&done[i], true, 0);
+
+    uint64_t sent = 0;
+    lk_bigtime_t t = current_time_hires();
+    for (uint i = 0; sent < bytes; i = (i + 1) % TCP_TX_BENCH_SLOTS) {
+        size_t len = MIN(bytes - sent, TCP_TX_BENCH_SLOT_SIZE);
+        uint8_t *slot = buf + i * TCP_TX_BENCH_SLOT_SIZE;
+
+        if (nocopy) {
+            /* wait for the last send from this slot to be released */
+            event_wait(&done[i]);
+            event_unsignal(&done[i]);
+
+            status_t err = tcp_write_nocopy(s, slot, len, &tcp_tx_bench_done, &done[i]);
+            if (err < 0) {
+                printf("tcp_write_nocopy returns %d\n", err);
+                event_signal(&done[i], false);
+                break;
+            }
+        } else {
+            ssize_t err = tcp_write(s, slot, len);
+            if (err < 0) {
+                printf("tcp_write returns %ld\n", err);
+                break;
+            }
+        }
+        sent += len;
+    }
+
+    /* everything has to come back before the buffer goes away */
+    for (uint i = 0; i < TCP_TX_BENCH_SLOTS; i++) {
+        event_wait(&done[i]);
+        event_destroy(&done[i]);
+    }
+    t = current_time_hires() - t;
+
+    printf("sent %llu bytes in %llu usecs (%llu bytes/sec)\n", sent, t,
+           t ? sent * 1000000ULL / t : 0);
+
+    mutex_acquire(&s->lock);
+    printf("tx path: %llu bytes in %llu cycles\n", s->stats.tx_bytes, s->stats.tx_cycles);
+    mutex_release(&s->lock);
+
+    free(buf);
+}
+
 static int cmd_tcp(int argc, const cmd_args *argv)
 {
     status_t err;
@@ -1232,7 +2338,11 @@ usage:
         printf("usage: %s sockets\n", argv[0].str);
         printf("usage: %s listenclose <port>\n", argv[0].str);
         printf("usage: %s listen <port>\n", argv[0].str);
+        printf("usage: %s sink <port>\n", argv[0].str);
+        printf("usage: %s source <port> <bytes> [nocopy]\n", argv[0].str);
         printf("usage: %s debug\n", argv[0].str);
+        printf("usage: %s gso\n", argv[0].str);
+        printf("usage: %s bench [sockets] [segments]\n", argv[0].str);
         return ERR_INVALID_ARGS;
     }
 
@@ -1244,6 +2354,7 @@ usage:
             dump_socket(s);
         }
         mutex_release(&tcp_socket_list_lock);
+        tcp_dump_hash_stats();
     } else if (!strcmp(argv[1].str, "listenclose")) {
         /* listen for a connection, accept it, then immediately close it */
         if (argc < 3) goto notenoughargs;
@@ -1296,9 +2407,83 @@ usage:
 
         err = tcp_close(handle);
         printf("tcp_close returns %d\n", err);
+    } else if (!strcmp(argv[1].str, "sink")) {
+        /* accept a connection and discard everything read from it, reporting throughput */
+        if (argc < 3) goto notenoughargs;
+
+        tcp_socket_t *handle;
+
+        err = tcp_open_listen(&handle, argv[2].u);
+        if (err < 0) {
+            printf("tcp_open_listen returns %d\n", err);
+            return err;
+        }
+
+        tcp_socket_t *accepted;
+        err = tcp_accept(handle, &accepted);
+        if (err < 0) {
+            printf("tcp_accept returns %d\n", err);
+            tcp_close(handle);
+            return err;
+        }
+
+        uint8_t *buf = malloc(4096);
+        uint64_t total = 0;
+        lk_bigtime_t t = current_time_hires();
+        if (buf) {
+            for (;;) {
+                ssize_t len = tcp_read(accepted, buf, 4096);
+                if (len < 0)
+                    break;
+                total += len;
+            }
+        }
+        t = current_time_hires() - t;
+        free(buf);
+
+        printf("read %llu bytes in %llu usecs (%llu bytes/sec)\n", total, t,
+               t ? total * 1000000ULL / t : 0);
+
+        tcp_close(accepted);
+        tcp_close(handle);
+    } else if (!strcmp(argv[1].str, "source")) {
+        /* accept a connection and send a fixed amount of data down it */
+        if (argc < 4) goto notenoughargs;
+
+        bool nocopy = (argc >= 5) && !strcmp(argv[4].str, "nocopy");
+
+        tcp_socket_t *handle;
+
+        err = tcp_open_listen(&handle, argv[2].u);
+        if (err < 0) {
+            printf("tcp_open_listen returns %d\n", err);
+            return err;
+        }
+
+        tcp_socket_t *accepted;
+        err = tcp_accept(handle, &accepted);
+        if (err < 0) {
+            printf("tcp_accept returns %d\n", err);
+            tcp_close(handle);
+            return err;
+        }
+
+        tcp_tx_bench(accepted, argv[3].u, nocopy);
+
+        tcp_close(accepted);
+        tcp_close(handle);
     } else if (!strcmp(argv[1].str, "debug")) {
         tcp_debug = !tcp_debug;
         printf("tcp debug now %u\n", tcp_debug);
+    } else if (!strcmp(argv[1].str, "gso")) {
+        tcp_gso = !tcp_gso;
+        printf("tcp segmentation offload now %u\n", tcp_gso);
+        minip_dump_tx_stats();
+    } else if (!strcmp(argv[1].str, "bench")) {
+        uint sockets = (argc >= 3) ? argv[2].u : 10000;
+        uint segments = (argc >= 4) ? argv[3].u : 1000000;
+
+        tcp_rx_bench(sockets, segments);
     } else {
         printf("ERROR unknown command\n");
         goto usage;
@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <compiler.h>
 #include <vstream/vsbuf.h>
+#include <kernel/event.h>
 #include <kernel/mutex.h>
 /*
  * This code is inspired by 4.4BSD-Lite by UC Berkeley.
@@ -42,6 +43,8 @@ struct vnode;
 struct vmount;
 struct vnode_ops;
 struct vpath;
+struct vmm_aspace;
+struct evmm_object;
 
 /*
  * VNode types.
@@ -79,8 +82,11 @@ struct vnode {
 	struct vnode_ops *v_op;        /* The operations for this VNode*/
 	void             *v_data;
 	uint              v_type;      /* vnode type. */
-	mutex_t           v_lock;      /* protects the reference count(s). */
+	mutex_t           v_lock;      /* protects the reference count(s) and v_object. */
 	uint              v_usecount;  /* reference count. */
+	
+	struct evmm_object *v_object;  /* pager object, while the file is mapped. */
+	event_t           v_objgone;   /* signalled when a dying v_object is detached. */
 };
 
 struct vnode_ops {
@@ -117,6 +123,25 @@ struct vnode* vn_retain(struct vnode* vn);
  */
 struct vnode* vn_construct(void);
 
+#if WITH_KERNEL_VM
+/*
+ * Memory mapped files.
+ *
+ * All mappings of a vnode share one pager object, and with it the pages of
+ * the file, which are read in with vop_read() on the first fault. Pages
+ * written through a mapping go back with vop_write(), when the page-out
+ * daemon reclaims them, on vn_msync() and once the last mapping is gone.
+ *
+ * vn_mmap() maps the first 'size' bytes of the file, like vmm_alloc_object().
+ */
+int vn_mmap(struct vnode* vn,struct vmm_aspace* aspace,const char* name,size_t size,void** ptr,uint vmm_flags);
+
+/*
+ * Writes back the dirty pages of a mapped file.
+ */
+int vn_msync(struct vnode* vn);
+#endif
+
 
 __END_CDECLS
 
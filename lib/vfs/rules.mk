@@ -7,6 +7,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/vfs_vndef.c \
 	$(LOCAL_DIR)/vfs_vfsdef.c \
 	$(LOCAL_DIR)/vfs_vnops.c \
+	$(LOCAL_DIR)/vfs_vnpager.c \
 	$(LOCAL_DIR)/vfs_alloc.c
 
 EXTRA_LINKER_SCRIPTS += $(LOCAL_DIR)/vfs.ld
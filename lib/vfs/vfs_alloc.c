@@ -30,6 +30,7 @@ struct vnode* vn_construct(void){
 	struct vnode* t = calloc(1,sizeof(struct vnode));
 	if(!t) return 0;
 	mutex_init(&(t->v_lock));
+	event_init(&(t->v_objgone),false,0);
 	t->v_usecount = 1;
 	return t;
 }
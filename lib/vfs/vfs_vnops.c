@@ -72,6 +72,7 @@ void vn_put(struct vnode* vn)
 	if(done) {
 		vn->v_op->vop_put(vn);
 		mutex_destroy(&(vn->v_lock));
+		event_destroy(&(vn->v_objgone));
 		free(vn);
 	}
 }
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2018 Simon Schmidt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <vfs/vnode.h>
+#include <errno.h>
+
+#if WITH_KERNEL_VM
+#include <assert.h>
+#include <err.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <kernel/vm.h>
+#include <kernel/vmi.h>
+#include <kernel/evm.h>
+
+/*
+ * The vnode pager.
+ *
+ * A mapped vnode has an evmm object, whose pager is the vnode itself. The
+ * object holds a reference on the vnode, and is found through ->v_object
+ * for as long as it is referenced, so that all mappings of a file share
+ * one object and its resident pages. When the last mapping goes away, the
+ * dirty pages are written back and the object is freed. The object stays
+ * in ->v_object until then, and whoever wants the vnode's object meanwhile
+ * waits on ->v_objgone, so nothing reads the file before it is written back.
+ *
+ * Pages are read and written by vop_read() and vop_write() straight out of
+ * the physical page, through its kernel mapping, so nothing gets copied on
+ * the way. A page that failed to read keeps its 'error' bit, and faults on
+ * it fail, until the object goes away.
+ */
+#ifndef VN_PAGER_CLUSTER_MAX
+#define VN_PAGER_CLUSTER_MAX 32
+#endif
+
+static inline addr_t vn_pager_kvaddr(evm_page_t* page) {
+	return (addr_t)paddr_to_kvaddr(vm_page_to_paddr(page->phys_page));
+}
+
+/*
+ * Allocate a busy page at offset, waiting for memory if need be, unless
+ * it's resident already, in which case NULL is returned. Called with the
+ * object lock held, which is dropped while waiting.
+ */
+static evm_page_t* vn_pager_grab(evmm_object_t* object, vaddr_t offset)
+{
+	evm_page_t* page;
+	
+	for(;;) {
+		if(evmm_page_lookup(object,offset)) return 0;
+		page = evmm_page_alloc(object,offset);
+		if(page) return page;
+		
+		mutex_release(&object->lock);
+		evmm_page_wait();
+		mutex_acquire(&object->lock);
+	}
+}
+
+/*
+ * Read a run of busy pages with one vop_read(), and hand them out. Called
+ * without the object lock.
+ */
+static void vn_pager_read(evmm_object_t* object, evm_page_t** pages, uint count)
+{
+	struct vnode*   vn = object->pager;
+	struct vsbufmem mem[VN_PAGER_CLUSTER_MAX];
+	struct vsbuf    vsb;
+	
+	for(uint i=0; i<count; i++) {
+		mem[i].m_begin = vn_pager_kvaddr(pages[i]);
+		mem[i].m_len = PAGE_SIZE;
+	}
+	vsb.b_type = VSB_KMEM;
+	vsb.b_count = count;
+	vsb.b_mem = mem;
+	
+	ssize_t ret = vn_read(vn,pages[0]->offset,&vsb);
+	
+	/*
+	 * Whatever lies past the end of the file reads as zeros.
+	 */
+	size_t got = ret > 0 ? (size_t)ret : 0;
+	for(uint i=0; i<count; i++) {
+		size_t off = (size_t)i*PAGE_SIZE;
+		size_t valid = got > off ? MIN(got-off, PAGE_SIZE) : 0;
+		if(valid < PAGE_SIZE) memset((void*)(mem[i].m_begin + valid), 0, PAGE_SIZE - valid);
+	}
+	
+	mutex_acquire(&object->lock);
+	for(uint i=0; i<count; i++) {
+		if(ret < 0) pages[i]->error = 1;
+		pages[i]->busy = 0;
+		if(pages[i]->wanted) {
+			pages[i]->wanted = 0;
+			evmm_signal(object);
+		}
+	}
+	mutex_release(&object->lock);
+}
+
+/*
+ * Write a page back, up to the end of the file. Called without the object
+ * lock, with the page busy. Returns 0 or a negative error number.
+ */
+static int vn_pager_write(evmm_object_t* object, evm_page_t* page)
+{
+	struct vnode*   vn = object->pager;
+	struct vattr    attr;
+	struct vsbufmem mem;
+	struct vsbuf    vsb;
+	
+	int err = vn->v_op->vop_getattr(vn,&attr);
+	if(err) return err;
+	
+	/*
+	 * Truncated away meanwhile.
+	 */
+	if(page->offset >= attr.va_size) return 0;
+	
+	mem.m_begin = vn_pager_kvaddr(page);
+	mem.m_len = MIN((uint64_t)PAGE_SIZE, attr.va_size - page->offset);
+	vsb.b_type = VSB_KMEM;
+	vsb.b_count = 1;
+	vsb.b_mem = &mem;
+	
+	ssize_t ret = vn_write(vn,page->offset,&vsb);
+	if(ret < 0) return ret;
+	if(ret < mem.m_len) return -EIO;
+	return 0;
+}
+
+/*
+ * Write back all dirty pages. Their mappings are torn down first, so that a
+ * later write faults and marks them dirty again. Called with the object
+ * lock held, which is dropped around the writes.
+ */
+static int vn_pager_clean(evmm_object_t* object)
+{
+	evm_page_t* page;
+	
+restart:
+	list_for_every_entry(&object->memq, page, evm_page_t, listq) {
+		if(!page->dirty) continue;
+		
+		if(page->busy) {
+			/*
+			 * The page-out daemon is laundering it. The page may be
+			 * gone after that, so start over.
+			 */
+			page->wanted = 1;
+			mutex_release(&object->lock);
+			evmm_wait(object);
+			mutex_acquire(&object->lock);
+			goto restart;
+		}
+		
+		page->busy = 1;
+		evmm_page_unmap(page);
+		page->prev_uses &= ~EVM_PROT_WRITE;
+		mutex_release(&object->lock);
+		
+		int err = vn_pager_write(object,page);
+		
+		/*
+		 * Busy pages are left alone by everybody else, so we can carry on
+		 * from here.
+		 */
+		mutex_acquire(&object->lock);
+		if(!err) page->dirty = 0;
+		page->busy = 0;
+		if(page->wanted) {
+			page->wanted = 0;
+			evmm_signal(object);
+		}
+		if(err) return err;
+	}
+	
+	return 0;
+}
+
+static void vn_pager_page_req_cluster(evmm_object_t* object, vaddr_t offset, size_t size, evm_prot_t prot, evm_page_t** pagep)
+{
+	evm_page_t* pages[VN_PAGER_CLUSTER_MAX];
+	uint        count = 0;
+	
+	size = MIN(MAX(size, (size_t)PAGE_SIZE), (size_t)VN_PAGER_CLUSTER_MAX*PAGE_SIZE);
+	
+	mutex_acquire(&object->lock);
+	
+	pages[0] = vn_pager_grab(object,offset);
+	if(!pages[0]) {
+		/*
+		 * Somebody else brought it in meanwhile.
+		 */
+		*pagep = evmm_page_lookup(object,offset);
+		mutex_release(&object->lock);
+		return;
+	}
+	count++;
+	
+	/*
+	 * Read ahead up to the next resident page, but don't wait for memory
+	 * for it.
+	 */
+	for(vaddr_t off = offset+PAGE_SIZE; off < offset+size; off += PAGE_SIZE) {
+		if(evmm_page_lookup(object,off)) break;
+		evm_page_t* page = evmm_page_alloc(object,off);
+		if(!page) break;
+		pages[count++] = page;
+	}
+	
+	mutex_release(&object->lock);
+	
+	vn_pager_read(object,pages,count);
+	
+	*pagep = pages[0];
+}
+
+static void vn_pager_page_req(evmm_object_t* object, vaddr_t offset, evm_prot_t prot, evm_page_t** pagep)
+{
+	vn_pager_page_req_cluster(object,offset,PAGE_SIZE,prot,pagep);
+}
+
+static void vn_pager_pgunlock(evmm_object_t* object, evm_prot_t prot, evm_page_t* page)
+{
+	/* We never lock pages. */
+}
+
+static void vn_pager_page_out(evmm_object_t* object, evm_page_t* page)
+{
+	int err = vn_pager_write(object,page);
+	
+	mutex_acquire(&object->lock);
+	if(!err) page->dirty = 0;
+	mutex_release(&object->lock);
+}
+
+static void vn_pager_free(evmm_object_t* object)
+{
+	struct vnode* vn = object->pager;
+	evm_page_t*   page;
+	
+	DEBUG_ASSERT(vn->v_object == object);
+	
+	mutex_acquire(&object->lock);
+	{
+		int err = vn_pager_clean(object);
+		if(err) printf("vn pager: failed to write back dirty pages, err %d\n", err);
+		
+		while((page = list_peek_head_type(&object->memq, evm_page_t, listq))) {
+			DEBUG_ASSERT(!page->busy);
+			evmm_page_free(page);
+		}
+	}
+	mutex_release(&object->lock);
+	
+	mutex_acquire(&vn->v_lock);
+	vn->v_object = 0;
+	event_signal(&vn->v_objgone,false);
+	mutex_release(&vn->v_lock);
+	
+	evmm_pre_destroy(object);
+	free(object);
+	vn_put(vn);
+}
+
+static struct evmm_object_ops vn_pager_ops = {
+	.evm_page_req = vn_pager_page_req,
+	.evm_pgunlock = vn_pager_pgunlock,
+	.evm_free = vn_pager_free,
+	.evm_page_out = vn_pager_page_out,
+	.evm_page_req_cluster = vn_pager_page_req_cluster,
+};
+
+/*
+ * Returns the vnode's pager object with a reference, creating it if asked to.
+ */
+static evmm_object_t* vn_pager_get(struct vnode* vn, bool create)
+{
+	evmm_object_t* object;
+	
+retry:
+	mutex_acquire(&vn->v_lock);
+	
+	object = vn->v_object;
+	if(object) {
+		bool dying;
+		
+		mutex_acquire(vmi_vmm_lock());
+		dying = !object->refcount;
+		if(!dying) object->refcount++;
+		mutex_release(vmi_vmm_lock());
+		
+		/*
+		 * If its last reference is gone already, it is on its way out.
+		 * Wait for vn_pager_free() to let go of it. Whatever was left
+		 * signalled by an earlier one is cleared under the vnode lock,
+		 * which this one needs before it can signal.
+		 */
+		if(dying) {
+			event_unsignal(&vn->v_objgone);
+			mutex_release(&vn->v_lock);
+			event_wait(&vn->v_objgone);
+			goto retry;
+		}
+	}
+	
+	if(!object && create) {
+		object = malloc(sizeof(evmm_object_t));
+		if(object) {
+			evmm_init(object,&vn_pager_ops,vn);
+			vn->v_usecount++; /* The object's reference. */
+			vn->v_object = object;
+		}
+	}
+	
+	mutex_release(&vn->v_lock);
+	
+	return object;
+}
+
+int vn_mmap(struct vnode* vn,struct vmm_aspace* aspace,const char* name,size_t size,void** ptr,uint vmm_flags)
+{
+	if(vn->v_type != VREG) return -ENODEV;
+	
+	evmm_object_t* object = vn_pager_get(vn,true);
+	if(!object) return -ENOMEM;
+	
+	status_t err = vmm_alloc_object(aspace,name,size,ptr,0,vmm_flags,object);
+	
+	/*
+	 * The region holds its own reference, if we got one.
+	 */
+	evmm_release(object);
+	
+	if(err == ERR_NO_MEMORY) return -ENOMEM;
+	if(err < 0) return -EINVAL;
+	return 0;
+}
+
+int vn_msync(struct vnode* vn)
+{
+	evmm_object_t* object = vn_pager_get(vn,false);
+	if(!object) return 0;
+	
+	mutex_acquire(&object->lock);
+	int err = vn_pager_clean(object);
+	mutex_release(&object->lock);
+	
+	evmm_release(object);
+	
+	return err;
+}
+
+#endif
@@ -39,7 +39,7 @@ struct vsbufmem {
 
 struct vsbuf {
 	uint  b_type;
-	off_t b_count;
+	off_t b_count;   /* number of segments in b_mem. */
 	union {
 		struct vsbufmem *b_mem;
 	};
@@ -22,47 +22,62 @@
  */
 #include <sys/zalloc.h>
 #include <list.h>
+#include <assert.h>
 #include <kernel/mutex.h>
 #include <malloc.h>
 
 /*
- * Shamelessly ripped from list.h and changed.
+ * Every crammed chunk of memory starts with a zone_block_t, followed by an
+ * occupancy bitmap (1 = free slot) and then the object slots. Each slot is
+ * prefixed by a pointer back to its block, so zfree() finds the owner in O(1).
+ *
+ * Blocks live on one of three lists, depending on how many slots are in use:
+ * partial, full or empty. Allocation takes the first partial block (or an
+ * empty one) and finds a free slot with a ctz over the bitmap, starting at
+ * the lowest word that may hold a free bit.
  */
-#define list_for_every_entry_rev(list, entry, type, member) \
-  for((entry) = containerof((list)->prev, type, member);\
-    &(entry)->member != (list);\
-    (entry) = containerof((entry)->member.prev, type, member))
 
+typedef struct zone_block zone_block_t;
 
 typedef struct zone_object {
-	uintptr_t refc;
+	zone_block_t     *block;
 } zone_object_t;
 
-typedef struct zone_block {
+#define ZBITS ((off_t)(sizeof(unsigned long)*8))
+
+struct zone_block {
 	struct list_node  node;
 	uintptr_t         begin;
 	off_t             size,count,used;
-} zone_block_t;
+	off_t             hint;   /* lowest bitmap word that may have a free bit */
+	unsigned long     bitmap[];
+};
 
 struct zone{
 	mutex_t           mutex;
 	off_t             allocsz;
 	zone_event_t      alloc, free;
 	void             *userdata;
-	struct list_node  blocks;
+	struct list_node  partial, full, empty;
 };
 
 static inline off_t alignment(off_t allocsz){
 	allocsz += 15;
-	allocsz -= allocsz&16;
+	allocsz -= allocsz&15;
 	return allocsz;
 }
 
+static inline off_t bitmap_words(off_t count){
+	return (count+ZBITS-1)/ZBITS;
+}
+
 zone_t zinit(off_t allocsz,zone_event_t alloc,zone_event_t free,void* userdata){
 	zone_t t = calloc(1,sizeof(struct zone));
 	if(!t) return 0;
 	mutex_init(&t->mutex);
-	list_initialize(&t->blocks);
+	list_initialize(&t->partial);
+	list_initialize(&t->full);
+	list_initialize(&t->empty);
 	t->allocsz = alignment(sizeof(zone_object_t)+allocsz);
 	t->alloc = alloc;
 	t->free = free;
@@ -77,53 +92,67 @@ void *zone_userdata(zone_t zone){
 static vaddr_t izalloc(zone_t zone){
 	zone_object_t* obj;
 	zone_block_t* block;
-	vaddr_t chunk = (vaddr_t)(zone->allocsz),newmem;
-	off_t i,n;
+	off_t i,slot;
 	
 	mutex_acquire(&zone->mutex);
-	list_for_every_entry(&zone->blocks,block,zone_block_t,node) {
-		newmem = block->begin;
-		n = block->count;
-		for(i=0;i<n;++i,newmem+=chunk) {
-			obj = (zone_object_t*)newmem;
-			if(obj->refc) continue;
-			block->used++;
-			obj->refc++;
-			obj++;
-			return (vaddr_t)obj;
+	block = list_peek_head_type(&zone->partial,zone_block_t,node);
+	if(!block) {
+		block = list_peek_head_type(&zone->empty,zone_block_t,node);
+		if(!block) {
+			mutex_release(&zone->mutex);
+			return 0;
 		}
+		list_delete(&block->node);
+		list_add_head(&zone->partial,&block->node);
+	}
+	
+	/* a block on the partial list always has a free bit at or after the hint */
+	for(i=block->hint;!block->bitmap[i];++i)
+		DEBUG_ASSERT(i<bitmap_words(block->count));
+	block->hint = i;
+	slot = i*ZBITS + __builtin_ctzl(block->bitmap[i]);
+	block->bitmap[i] &= ~(1UL<<(slot%ZBITS));
+	
+	if(++block->used == block->count) {
+		list_delete(&block->node);
+		list_add_tail(&zone->full,&block->node);
 	}
 	mutex_release(&zone->mutex);
 	
-	return 0;
+	obj = (zone_object_t*)(block->begin + slot*zone->allocsz);
+	obj->block = block;
+	obj++;
+	return (vaddr_t)obj;
 }
 static int izfree(zone_t zone,zone_object_t* obj) {
 	zone_block_t* block;
-	vaddr_t chunk = (vaddr_t)(zone->allocsz),newmem;
-	off_t n;
+	off_t slot;
+	int empty = 0;
 	
 	obj--;
-	vaddr_t buf = (vaddr_t)obj;
+	block = obj->block;
+	slot = ((vaddr_t)obj - block->begin)/zone->allocsz;
+	DEBUG_ASSERT(slot < block->count);
 	
 	mutex_acquire(&zone->mutex);
-	list_for_every_entry(&zone->blocks,block,zone_block_t,node) {
-		newmem = block->begin;
-		n = block->count*chunk;
-		n += newmem-1;
-		if(buf<newmem||n<buf) continue;
-		
-		obj->refc--;
-		if(obj->refc) return 0;
-		
-		block->used--;
-		if(block->used) return 0;
-		
+	DEBUG_ASSERT(!(block->bitmap[slot/ZBITS] & (1UL<<(slot%ZBITS)))); /* double free */
+	
+	block->bitmap[slot/ZBITS] |= 1UL<<(slot%ZBITS);
+	if(slot/ZBITS < block->hint) block->hint = slot/ZBITS;
+	
+	if(block->used-- == block->count) {
+		/* was full */
+		list_delete(&block->node);
+		list_add_head(&zone->partial,&block->node);
+	}
+	if(!block->used) {
+		/* the most recently emptied block is handed back first by zuncram() */
 		list_delete(&block->node);
-		list_add_tail(&zone->blocks,&block->node);
-		return 1;
+		list_add_tail(&zone->empty,&block->node);
+		empty = 1;
 	}
 	mutex_release(&zone->mutex);
-	return 0;
+	return empty;
 }
 
 
@@ -157,26 +186,34 @@ void zput(zone_t zone,vaddr_t buf){
 }
 
 void zcram(zone_t zone,vaddr_t newmem,off_t size){
-	off_t prefix = alignment(sizeof(zone_block_t));
-	off_t i;
-	vaddr_t chunk = (vaddr_t)(zone->allocsz);
+	off_t prefix,count,i;
+	off_t chunk = zone->allocsz;
 	
 	if(!newmem) return;
 	
+	/* size the bitmap and the slots against each other */
+	prefix = alignment(sizeof(zone_block_t));
 	if(prefix>size) return; /* Ignore it. XXX leak! */
+	count = (size-prefix)/chunk;
+	while(count>0 && alignment(sizeof(zone_block_t)+bitmap_words(count)*sizeof(unsigned long))+count*chunk > size)
+		count--;
+	if(!count) return; /* Ignore it. XXX leak! */
+	prefix = alignment(sizeof(zone_block_t)+bitmap_words(count)*sizeof(unsigned long));
+	
 	zone_block_t *blk = (zone_block_t*)newmem;
 	blk->size = size;
-	size -= prefix;
-	size /= chunk;
-	blk->count = size;
+	blk->count = count;
 	blk->used = 0;
+	blk->hint = 0;
 	blk->begin = newmem + prefix;
 	
-	for(i=0;i<size;++i,newmem+=chunk)
-		((zone_object_t*)newmem)->refc=0;
+	for(i=0;i<bitmap_words(count);++i)
+		blk->bitmap[i] = ~0UL;
+	if(count%ZBITS)
+		blk->bitmap[count/ZBITS] = (1UL<<(count%ZBITS))-1;
 	
 	mutex_acquire(&zone->mutex);
-	list_add_tail(&zone->blocks,&blk->node);
+	list_add_tail(&zone->empty,&blk->node);
 	mutex_release(&zone->mutex);
 }
 
@@ -184,17 +221,12 @@ int zuncram(zone_t zone,vaddr_t *oldmem,off_t *size){
 	zone_block_t* block;
 	
 	mutex_acquire(&zone->mutex);
-	list_for_every_entry_rev(&zone->blocks,block,zone_block_t,node) {
-		if(!(block->used)) {
-			list_delete(&block->node);
-			*oldmem = (vaddr_t)block;
-			*size = block->size;
-			
-			mutex_release(&zone->mutex);
-			return 1;
-		}
-	}
+	block = list_remove_tail_type(&zone->empty,zone_block_t,node);
 	mutex_release(&zone->mutex);
-	return 0;
+	
+	if(!block) return 0;
+	*oldmem = (vaddr_t)block;
+	*size = block->size;
+	return 1;
 }
 
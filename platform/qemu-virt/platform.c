@@ -174,6 +174,7 @@ void platform_init(void)
 
         //minip_init(virtio_net_send_minip_pkt, NULL, ip_addr, ip_mask, ip_gateway);
         minip_init_dhcp(virtio_net_send_minip_pkt, NULL);
+        minip_set_tx_features(virtio_net_minip_tx_features());
 
         virtio_net_start();
     }